@@ -85,7 +85,9 @@ static inline void __flush_tlb_one(unsigned long addr)
  *  - flush_tlb_page(vma, vmaddr) flushes one page
  *  - flush_tlb_range(vma, start, end) flushes a range of pages
  *  - flush_tlb_kernel_range(start, end) flushes a range of kernel pages
- *  - flush_tlb_others(cpumask, mm, va) flushes TLBs on other cpus
+ *  - flush_tlb_others(cpumask, mm, va) flushes TLBs on other cpus,
+ *    all of them for any mm if mm is NULL
+ *  - flush_tlb_batched(cpumask) flushes all TLBs of the cpus in cpumask
  *
  * ..but the i386 has somewhat limited tlb flushing capabilities,
  * and page-granular flushes are available only on i486 and up.
@@ -153,6 +155,8 @@ static inline void flush_tlb_range(struct vm_area_struct *vma,
 void native_flush_tlb_others(const struct cpumask *cpumask,
 			     struct mm_struct *mm, unsigned long va);
 
+extern void flush_tlb_batched(const struct cpumask *cpumask);
+
 #define TLBSTATE_OK	1
 #define TLBSTATE_LAZY	2
 
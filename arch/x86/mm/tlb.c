@@ -152,7 +152,8 @@ void smp_invalidate_interrupt(struct pt_regs *regs)
 		 * BUG();
 		 */
 
-	if (f->flush_mm == percpu_read(cpu_tlbstate.active_mm)) {
+	/* A NULL mm flushes whatever mm the cpu is using */
+	if (!f->flush_mm || f->flush_mm == percpu_read(cpu_tlbstate.active_mm)) {
 		if (percpu_read(cpu_tlbstate.state) == TLBSTATE_OK) {
 			if (f->flush_va == TLB_FLUSH_ALL)
 				local_flush_tlb();
@@ -319,6 +320,23 @@ void flush_tlb_page(struct vm_area_struct *vma, unsigned long va)
 	preempt_enable();
 }
 
+/*
+ * Flush the TLBs of the cpus in @cpumask, whatever mm they are running.
+ * Page reclaim uses this to flush the TLB entries of pages unmapped from
+ * many mms at once, with one IPI per cpu.
+ */
+void flush_tlb_batched(const struct cpumask *cpumask)
+{
+	int cpu = get_cpu();
+
+	if (cpumask_test_cpu(cpu, cpumask))
+		local_flush_tlb();
+	if (cpumask_any_but(cpumask, cpu) < nr_cpu_ids)
+		flush_tlb_others(cpumask, NULL, TLB_FLUSH_ALL);
+
+	put_cpu();
+}
+
 static void do_flush_tlb_all(void *info)
 {
 	__flush_tlb_all();
@@ -63,6 +63,7 @@ struct driver_private {
  * list soon.
  * @device - pointer back to the struct class that this structure is
  * associated with.
+ * @async_driver - pointer to device driver awaiting probe via async_probe
  *
  * Nothing outside of the driver core should ever touch these fields.
  */
@@ -73,6 +74,7 @@ struct device_private {
 	struct klist_node knode_bus;
 	void *driver_data;
 	struct device *device;
+	struct device_driver *async_driver;
 };
 #define to_device_private_parent(obj)	\
 	container_of(obj, struct device_private, knode_parent)
@@ -106,6 +108,8 @@ extern void bus_remove_driver(struct device_driver *drv);
 
 extern void driver_detach(struct device_driver *drv);
 extern int driver_probe_device(struct device_driver *drv, struct device *dev);
+extern void device_initial_probe(struct device *dev);
+extern bool driver_allows_async_probing(struct device_driver *drv);
 static inline int driver_match_device(struct device_driver *drv,
 				      struct device *dev)
 {
@@ -487,12 +487,9 @@ out_put:
 void bus_probe_device(struct device *dev)
 {
 	struct bus_type *bus = dev->bus;
-	int ret;
 
-	if (bus && bus->p->drivers_autoprobe) {
-		ret = device_attach(dev);
-		WARN_ON(ret < 0);
-	}
+	if (bus && bus->p->drivers_autoprobe)
+		device_initial_probe(dev);
 }
 
 /**
@@ -5313,7 +5313,7 @@ static inline u32 tg3_tx_avail(struct tg3_napi *tnapi)
  * need special logic to handle SKBs that have not had all
  * of their frags sent yet, like SunGEM does.
  */
-static void tg3_tx(struct tg3_napi *tnapi)
+static void tg3_tx(struct tg3_napi *tnapi, int budget)
 {
 	struct tg3 *tp = tnapi->tp;
 	u32 hw_idx = tnapi->hw_status->idx[0].tx_consumer;
@@ -5370,7 +5370,7 @@ static void tg3_tx(struct tg3_napi *tnapi)
 			sw_idx = NEXT_TX(sw_idx);
 		}
 
-		dev_kfree_skb(skb);
+		napi_consume_skb(skb, budget);
 
 		if (unlikely(tx_bug)) {
 			tg3_tx_recover(tp);
@@ -5888,7 +5888,7 @@ static int tg3_poll_work(struct tg3_napi *tnapi, int work_done, int budget)
 
 	/* run TX completion thread */
 	if (tnapi->hw_status->idx[0].tx_consumer != tnapi->tx_cons) {
-		tg3_tx(tnapi);
+		tg3_tx(tnapi, budget);
 		if (unlikely(tg3_flag(tp, TX_RECOVERY_PENDING)))
 			return work_done;
 	}
@@ -40,6 +40,9 @@ module_param(gso, bool, 0444);
 
 #define VIRTNET_SEND_COMMAND_SG_MAX    2
 
+/* Pages allocated at once when the page chain runs empty on rx refill */
+#define VIRTNET_PREFILL_PAGES	(MAX_SKB_FRAGS + 2)
+
 struct virtnet_stats {
 	struct u64_stats_sync syncp;
 	u64 tx_bytes;
@@ -129,6 +132,21 @@ static struct page *get_a_page(struct virtnet_info *vi, gfp_t gfp_mask)
 	return p;
 }
 
+/*
+ * Top up the vi->pages chain in one call into the page allocator, so
+ * that refilling the receive ring does not go through alloc_page() for
+ * every single buffer page.
+ */
+static void prefill_pages(struct virtnet_info *vi, gfp_t gfp_mask)
+{
+	struct page *pages[VIRTNET_PREFILL_PAGES] = { NULL };
+	unsigned long i, nr;
+
+	nr = alloc_pages_bulk_array(gfp_mask, VIRTNET_PREFILL_PAGES, pages);
+	for (i = 0; i < nr; i++)
+		give_pages(vi, pages[i]);
+}
+
 static void skb_xmit_done(struct virtqueue *svq)
 {
 	struct virtnet_info *vi = svq->vdev->priv;
@@ -446,6 +464,9 @@ static bool try_fill_recv(struct virtnet_info *vi, gfp_t gfp)
 	bool oom;
 
 	do {
+		if (!vi->pages && (vi->mergeable_rx_bufs || vi->big_packets))
+			prefill_pages(vi, gfp);
+
 		if (vi->mergeable_rx_bufs)
 			err = add_recvbuf_mergeable(vi, gfp);
 		else if (vi->big_packets)
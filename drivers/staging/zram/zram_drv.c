@@ -23,8 +23,10 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/cpu.h>
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
@@ -42,51 +44,149 @@ struct zram *zram_devices;
 /* Module params (documentation at end) */
 unsigned int zram_num_devices;
 
-static void zram_stat_inc(u32 *v)
+/*
+ * Per-cpu compression streams.  A writer compresses into the stream of
+ * the cpu it runs on, with preemption disabled, so writes to zram
+ * devices scale with the number of cpus instead of serializing on a
+ * single per-device buffer.
+ */
+static DEFINE_PER_CPU(struct zram_strm, zram_strm);
+
+static struct zram_strm *zram_get_strm(void)
+{
+	return &get_cpu_var(zram_strm);
+}
+
+static void zram_put_strm(struct zram_strm *strm)
+{
+	put_cpu_var(zram_strm);
+}
+
+static void zram_strm_free(int cpu)
+{
+	struct zram_strm *strm = &per_cpu(zram_strm, cpu);
+
+	kfree(strm->workmem);
+	free_pages((unsigned long)strm->buffer, 1);
+	strm->workmem = NULL;
+	strm->buffer = NULL;
+}
+
+static int zram_strm_alloc(int cpu)
 {
-	*v = *v + 1;
+	struct zram_strm *strm = &per_cpu(zram_strm, cpu);
+
+	if (strm->workmem)
+		return 0;
+
+	strm->workmem = kzalloc_node(LZO1X_MEM_COMPRESS, GFP_KERNEL,
+				     cpu_to_node(cpu));
+	/*
+	 * allocate 2 pages. 1 for compressed data, plus 1 extra for the
+	 * case when compressed size is larger than the original one
+	 */
+	strm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (!strm->workmem || !strm->buffer) {
+		zram_strm_free(cpu);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static int zram_cpu_notifier(struct notifier_block *nb,
+			     unsigned long action, void *pcpu)
+{
+	int cpu = (long)pcpu;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_UP_PREPARE:
+		if (zram_strm_alloc(cpu)) {
+			pr_err("Error allocating compression stream for "
+				"cpu %d\n", cpu);
+			return notifier_from_errno(-ENOMEM);
+		}
+		break;
+	case CPU_DEAD:
+	case CPU_UP_CANCELED:
+		zram_strm_free(cpu);
+		break;
+	}
+
+	return NOTIFY_OK;
 }
 
-static void zram_stat_dec(u32 *v)
+static struct notifier_block zram_cpu_nb = {
+	.notifier_call = zram_cpu_notifier
+};
+
+static void zram_strm_destroy(void)
 {
-	*v = *v - 1;
+	int cpu;
+
+	get_online_cpus();
+	unregister_cpu_notifier(&zram_cpu_nb);
+	for_each_possible_cpu(cpu)
+		zram_strm_free(cpu);
+	put_online_cpus();
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+static int zram_strm_init(void)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v + inc;
-	spin_unlock(&zram->stat64_lock);
+	int cpu, ret = 0;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		ret = zram_strm_alloc(cpu);
+		if (ret)
+			break;
+	}
+	register_cpu_notifier(&zram_cpu_nb);
+	put_online_cpus();
+
+	if (ret)
+		zram_strm_destroy();
+	return ret;
 }
 
-static void zram_stat64_sub(struct zram *zram, u64 *v, u64 dec)
+static void zram_lock_table(struct zram *zram, u32 index)
 {
-	spin_lock(&zram->stat64_lock);
-	*v = *v - dec;
-	spin_unlock(&zram->stat64_lock);
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
-static void zram_stat64_inc(struct zram *zram, u64 *v)
+static void zram_unlock_table(struct zram *zram, u32 index)
 {
-	zram_stat64_add(zram, v, 1);
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
 }
 
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return zram->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	zram->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	zram->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
+{
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
+}
+
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
+{
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
 static int page_zero_filled(void *ptr)
@@ -133,48 +233,43 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/*
+ * To protect concurrent access to the same index entry,
+ * caller should hold this table index entry's bit_spinlock to
+ * indicate this index entry is accessing.
+ */
 static void zram_free_page(struct zram *zram, size_t index)
 {
-	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
+	size_t clen = zram_get_obj_size(zram, index);
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
-
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
 		 */
 		if (zram_test_flag(zram, index, ZRAM_ZERO)) {
 			zram_clear_flag(zram, index, ZRAM_ZERO);
-			zram_stat_dec(&zram->stats.pages_zero);
+			atomic64_dec(&zram->stats.pages_zero);
 		}
 		return;
 	}
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_dec(&zram->stats.pages_expand);
-		goto out;
+		atomic64_dec(&zram->stats.pages_expand);
+	} else {
+		zs_free(zram->mem_pool, handle);
+		if (clen <= PAGE_SIZE / 2)
+			atomic64_dec(&zram->stats.good_compress);
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_dec(&zram->stats.good_compress);
-
-out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
-	zram_stat_dec(&zram->stats.pages_stored);
+	atomic64_sub(clen, &zram->stats.compr_size);
+	atomic64_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -189,60 +284,77 @@ static void handle_zero_page(struct bio_vec *bvec)
 	flush_dcache_page(page);
 }
 
-static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
-				     u32 index, int offset)
+static inline int is_partial_io(struct bio_vec *bvec)
 {
-	struct page *page = bvec->bv_page;
-	unsigned char *user_mem, *cmem;
+	return bvec->bv_len != PAGE_SIZE;
+}
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+/*
+ * Fill mem with the full contents of page index.  Decompression needs
+ * no working memory, so readers only take the table entry lock.
+ */
+static int zram_decompress_page(struct zram *zram, unsigned char *mem,
+				u32 index)
+{
+	int ret = LZO_E_OK;
+	size_t clen = PAGE_SIZE;
+	unsigned char *cmem;
+	unsigned long handle;
 
-	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
-	kunmap_atomic(cmem, KM_USER1);
-	kunmap_atomic(user_mem, KM_USER0);
+	zram_lock_table(zram, index);
+	handle = zram->table[index].handle;
 
-	flush_dcache_page(page);
-}
+	if (zram_test_flag(zram, index, ZRAM_ZERO) || !handle) {
+		zram_unlock_table(zram, index);
+		memset(mem, 0, PAGE_SIZE);
+		return 0;
+	}
 
-static inline int is_partial_io(struct bio_vec *bvec)
-{
-	return bvec->bv_len != PAGE_SIZE;
+	/* Page is stored uncompressed since it's incompressible */
+	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic((struct page *)handle, KM_USER1);
+		memcpy(mem, cmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+	} else {
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+		ret = lzo1x_decompress_safe(cmem,
+					    zram_get_obj_size(zram, index),
+					    mem, &clen);
+		zs_unmap_object(zram->mem_pool, handle);
+	}
+	zram_unlock_table(zram, index);
+
+	/* Should NEVER happen. Return bio error if it does. */
+	if (unlikely(ret != LZO_E_OK)) {
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		atomic64_inc(&zram->stats.failed_reads);
+		return ret;
+	}
+
+	return 0;
 }
 
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
 	int ret;
-	size_t clen;
 	struct page *page;
-	struct zobj_header *zheader;
-	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	unsigned char *user_mem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+	zram_lock_table(zram, index);
+	if (unlikely(!zram->table[index].handle) ||
+	    zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_unlock_table(zram, index);
 		handle_zero_page(bvec);
 		return 0;
 	}
-
-	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
-		pr_debug("Read before write: sector=%lu, size=%u",
-			 (ulong)(bio->bi_sector), bio->bi_size);
-		handle_zero_page(bvec);
-		return 0;
-	}
-
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
-	}
+	zram_unlock_table(zram, index);
 
 	if (is_partial_io(bvec)) {
 		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			return -ENOMEM;
@@ -252,139 +364,88 @@ static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
+	ret = zram_decompress_page(zram, uncmem, index);
 
 	if (is_partial_io(bvec)) {
-		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
-		       bvec->bv_len);
+		if (!ret)
+			memcpy(user_mem + bvec->bv_offset, uncmem + offset,
+			       bvec->bv_len);
 		kfree(uncmem);
 	}
 
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
 
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
+	if (ret)
 		return ret;
-	}
 
 	flush_dcache_page(page);
 
 	return 0;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
-{
-	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
-	unsigned char *cmem;
-
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
-		memset(mem, 0, PAGE_SIZE);
-		return 0;
-	}
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
-
-	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		memcpy(mem, cmem, PAGE_SIZE);
-		kunmap_atomic(cmem, KM_USER0);
-		return 0;
-	}
-
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
-
-	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
-		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
-		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
-	}
-
-	return 0;
-}
-
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
-	int ret;
-	u32 store_offset;
-	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
-	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
+	int ret = 0;
+	size_t clen, alloced = 0;
+	unsigned long handle = 0;
+	struct page *page;
+	struct zram_strm *strm = NULL;
+	unsigned char *user_mem, *cmem, *uncmem = NULL;
+	bool uncompressed = false;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
-		if (ret) {
-			kfree(uncmem);
+		ret = zram_decompress_page(zram, uncmem, index);
+		if (ret)
 			goto out;
-		}
-	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
-	user_mem = kmap_atomic(page, KM_USER0);
-
-	if (is_partial_io(bvec))
+		user_mem = kmap_atomic(page, KM_USER0);
 		memcpy(uncmem + offset, user_mem + bvec->bv_offset,
 		       bvec->bv_len);
-	else
+		kunmap_atomic(user_mem, KM_USER0);
+	}
+
+compress_again:
+	user_mem = kmap_atomic(page, KM_USER0);
+	if (!is_partial_io(bvec))
 		uncmem = user_mem;
 
 	if (page_zero_filled(uncmem)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
+		if (handle)
+			zs_free(zram->mem_pool, handle);
+		/* Free memory associated with this sector now. */
+		zram_lock_table(zram, index);
+		zram_free_page(zram, index);
 		zram_set_flag(zram, index, ZRAM_ZERO);
+		zram_unlock_table(zram, index);
+
+		atomic64_inc(&zram->stats.pages_zero);
 		ret = 0;
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
-
-	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
+	strm = zram_get_strm();
+	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, strm->buffer, &clen,
+			       strm->workmem);
 
 	if (unlikely(ret != LZO_E_OK)) {
+		kunmap_atomic(user_mem, KM_USER0);
+		if (handle)
+			zs_free(zram->mem_pool, handle);
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -395,83 +456,112 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
-		clen = PAGE_SIZE;
-		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
-		if (unlikely(!page_store)) {
+		kunmap_atomic(user_mem, KM_USER0);
+		zram_put_strm(strm);
+		strm = NULL;
+		if (handle)
+			zs_free(zram->mem_pool, handle);
+
+		handle = (unsigned long)alloc_page(GFP_NOIO | __GFP_HIGHMEM);
+		if (unlikely(!handle)) {
 			pr_info("Error allocating memory for "
 				"incompressible page: %u\n", index);
 			ret = -ENOMEM;
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
-		goto memstore;
+		clen = PAGE_SIZE;
+		uncompressed = true;
+		user_mem = kmap_atomic(page, KM_USER0);
+		if (!is_partial_io(bvec))
+			uncmem = user_mem;
+		cmem = kmap_atomic((struct page *)handle, KM_USER1);
+		memcpy(cmem, uncmem, PAGE_SIZE);
+		kunmap_atomic(cmem, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+		goto store;
+	}
+	kunmap_atomic(user_mem, KM_USER0);
+
+	/* The object allocated on an earlier pass may be too small now */
+	if (handle && clen > alloced) {
+		zs_free(zram->mem_pool, handle);
+		handle = 0;
 	}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
+	/*
+	 * Try to allocate without reclaim first: the compression stream
+	 * pins us to this cpu.  If that fails, drop the stream, allocate
+	 * with reclaim and compress again, since the stream buffer may
+	 * have been reused meanwhile.
+	 */
+	if (!handle) {
+		handle = zs_malloc(zram->mem_pool, clen,
+				   GFP_NOWAIT | __GFP_HIGHMEM | __GFP_NOWARN);
+		alloced = clen;
+	}
+	if (!handle) {
+		zram_put_strm(strm);
+		strm = NULL;
+
+		handle = zs_malloc(zram->mem_pool, clen,
+				   GFP_NOIO | __GFP_HIGHMEM);
+		alloced = clen;
+		if (handle)
+			goto compress_again;
+
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		ret = -ENOMEM;
 		goto out;
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, strm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, handle);
 
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
-	}
-#endif
+	zram_put_strm(strm);
+	strm = NULL;
 
-	memcpy(cmem, src, clen);
+store:
+	/*
+	 * Free memory associated with this sector
+	 * before overwriting unused sectors.
+	 */
+	zram_lock_table(zram, index);
+	zram_free_page(zram, index);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+	zram->table[index].handle = handle;
+	zram_set_obj_size(zram, index, clen);
+	if (uncompressed)
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_table(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
-	zram_stat_inc(&zram->stats.pages_stored);
-	if (clen <= PAGE_SIZE / 2)
-		zram_stat_inc(&zram->stats.good_compress);
-
-	return 0;
+	atomic64_add(clen, &zram->stats.compr_size);
+	atomic64_inc(&zram->stats.pages_stored);
+	if (uncompressed)
+		atomic64_inc(&zram->stats.pages_expand);
+	else if (clen <= PAGE_SIZE / 2)
+		atomic64_inc(&zram->stats.good_compress);
 
 out:
+	if (strm)
+		zram_put_strm(strm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
-		zram_stat64_inc(zram, &zram->stats.failed_writes);
+		atomic64_inc(&zram->stats.failed_writes);
 	return ret;
 }
 
 static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 			int offset, struct bio *bio, int rw)
 {
-	int ret;
-
-	if (rw == READ) {
-		down_read(&zram->lock);
-		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
-		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
+	if (rw == READ)
+		return zram_bvec_read(zram, bvec, index, offset, bio);
 
-	return ret;
+	return zram_bvec_write(zram, bvec, index, offset);
 }
 
 static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
@@ -489,10 +579,10 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 
 	switch (rw) {
 	case READ:
-		zram_stat64_inc(zram, &zram->stats.num_reads);
+		atomic64_inc(&zram->stats.num_reads);
 		break;
 	case WRITE:
-		zram_stat64_inc(zram, &zram->stats.num_writes);
+		atomic64_inc(&zram->stats.num_writes);
 		break;
 	}
 
@@ -568,7 +658,7 @@ static void zram_make_request(struct request_queue *queue, struct bio *bio)
 		goto error_unlock;
 
 	if (!valid_io_request(zram, bio)) {
-		zram_stat64_inc(zram, &zram->stats.invalid_io);
+		atomic64_inc(&zram->stats.invalid_io);
 		goto error_unlock;
 	}
 
@@ -589,34 +679,24 @@ void __zram_reset_device(struct zram *zram)
 
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
-
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		unsigned long handle = zram->table[index].handle;
 
-		if (!page)
+		if (!handle)
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page((struct page *)handle);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -646,20 +726,6 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail_no_table;
-	}
-
 	num_pages = zram->disksize >> PAGE_SHIFT;
 	zram->table = vzalloc(num_pages * sizeof(*zram->table));
 	if (!zram->table) {
@@ -673,7 +739,7 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -702,8 +768,10 @@ static void zram_slot_free_notify(struct block_device *bdev,
 	struct zram *zram;
 
 	zram = bdev->bd_disk->private_data;
+	zram_lock_table(zram, index);
 	zram_free_page(zram, index);
-	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_unlock_table(zram, index);
+	atomic64_inc(&zram->stats.notify_free);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -715,9 +783,7 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	init_rwsem(&zram->init_lock);
-	spin_lock_init(&zram->stat64_lock);
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -807,6 +873,12 @@ static int __init zram_init(void)
 		goto out;
 	}
 
+	ret = zram_strm_init();
+	if (ret) {
+		pr_warning("Unable to allocate compression streams\n");
+		goto unregister;
+	}
+
 	if (!zram_num_devices) {
 		pr_info("num_devices not specified. Using default: 1\n");
 		zram_num_devices = 1;
@@ -817,7 +889,7 @@ static int __init zram_init(void)
 	zram_devices = kzalloc(zram_num_devices * sizeof(struct zram), GFP_KERNEL);
 	if (!zram_devices) {
 		ret = -ENOMEM;
-		goto unregister;
+		goto free_strm;
 	}
 
 	for (dev_id = 0; dev_id < zram_num_devices; dev_id++) {
@@ -832,6 +904,8 @@ free_devices:
 	while (dev_id)
 		destroy_device(&zram_devices[--dev_id]);
 	kfree(zram_devices);
+free_strm:
+	zram_strm_destroy();
 unregister:
 	unregister_blkdev(zram_major, "zram");
 out:
@@ -854,6 +928,7 @@ static void __exit zram_exit(void)
 	unregister_blkdev(zram_major, "zram");
 
 	kfree(zram_devices);
+	zram_strm_destroy();
 	pr_debug("Cleanup done!\n");
 }
 
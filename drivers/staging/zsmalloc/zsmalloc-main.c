@@ -0,0 +1,898 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the license that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc stores objects of a given size in 'zspages': groups of up to
+ * ZS_MAX_PAGES_PER_ZSPAGE 0-order pages that are not physically
+ * contiguous.  Objects are packed back to back across the whole zspage,
+ * so an object may start in one page and end in the next one.  That is
+ * what keeps internal fragmentation low for sizes that do not divide
+ * PAGE_SIZE, which compressed pages never do, and it means no higher
+ * order allocation is ever needed.
+ *
+ * Each size class keeps its partially used zspages on fullness lists.
+ * Allocation takes the fullest zspage first.  zs_compact() moves objects
+ * out of sparsely used zspages into fuller ones of the same class and
+ * frees the emptied zspages; it is run on demand and from a shrinker.
+ *
+ * Because objects move, zs_malloc() returns a handle, not a pointer:
+ * the handle points to a slot holding the current object location and
+ * must be mapped with zs_map_object() to access the object.  A mapped
+ * object is pinned and compaction leaves it alone.  Objects that span
+ * two pages are copied through a per-cpu buffer on map and unmap.
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/sched.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/*
+ * per-cpu area used to map objects that span two pages
+ */
+struct mapping_area {
+	char *vm_buf; /* copy buffer for objects that span pages */
+	char *vm_addr; /* address of kmap_atomic()'ed page */
+	enum zs_mapmode vm_mm; /* mapping mode */
+};
+
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+
+static struct kmem_cache *zs_handle_cache;
+static struct kmem_cache *zs_zspage_cache;
+
+static int is_first_page(struct page *page)
+{
+	return page == ((struct zspage *)page_private(page))->pages[0];
+}
+
+static struct zspage *get_zspage(struct page *page)
+{
+	return (struct zspage *)page_private(page);
+}
+
+/*
+ * Encode <page, obj_idx> as a single value, page being the first page
+ * of the zspage.
+ */
+static unsigned long location_to_obj(struct page *page, unsigned int obj_idx)
+{
+	unsigned long obj;
+
+	obj = page_to_pfn(page) << OBJ_INDEX_BITS;
+	obj |= obj_idx & OBJ_INDEX_MASK;
+	obj <<= OBJ_TAG_BITS;
+
+	return obj;
+}
+
+/*
+ * Decode <page, obj_idx> pair from the given object location value
+ */
+static void obj_to_location(unsigned long obj, struct page **page,
+				unsigned int *obj_idx)
+{
+	obj >>= OBJ_TAG_BITS;
+	*page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+	*obj_idx = (obj & OBJ_INDEX_MASK);
+}
+
+static unsigned long handle_to_obj(unsigned long handle)
+{
+	return *(unsigned long *)handle & ~BIT(HANDLE_PIN_BIT);
+}
+
+static void record_obj(unsigned long handle, unsigned long obj)
+{
+	*(unsigned long *)handle = obj;
+}
+
+static void pin_tag(unsigned long handle)
+{
+	bit_spin_lock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static int trypin_tag(unsigned long handle)
+{
+	return bit_spin_trylock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+static void unpin_tag(unsigned long handle)
+{
+	bit_spin_unlock(HANDLE_PIN_BIT, (unsigned long *)handle);
+}
+
+/* zspage and offset within it of the object */
+static struct zspage *obj_to_zspage(struct zs_pool *pool, unsigned long obj,
+				struct size_class **class, unsigned long *off)
+{
+	struct page *first_page;
+	struct zspage *zspage;
+	unsigned int obj_idx;
+
+	obj_to_location(obj, &first_page, &obj_idx);
+	zspage = get_zspage(first_page);
+	BUG_ON(!is_first_page(first_page));
+	*class = &pool->size_class[zspage->class_idx];
+	*off = (unsigned long)obj_idx * (*class)->size;
+
+	return zspage;
+}
+
+/*
+ * The first word of an object, either its tagged handle or the free list
+ * link.  It never spans two pages.
+ */
+static unsigned long get_obj_head(struct zspage *zspage, unsigned long off)
+{
+	unsigned long *addr, head;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+	head = *(unsigned long *)((char *)addr + (off & ~PAGE_MASK));
+	kunmap_atomic(addr);
+
+	return head;
+}
+
+static void set_obj_head(struct zspage *zspage, unsigned long off,
+				unsigned long head)
+{
+	unsigned long *addr;
+
+	addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+	*(unsigned long *)((char *)addr + (off & ~PAGE_MASK)) = head;
+	kunmap_atomic(addr);
+}
+
+/* Copy len bytes at offset off of a zspage to or from buf */
+static void zs_copy_object(struct zspage *zspage, unsigned long off,
+				char *buf, int len, bool to_zspage)
+{
+	char *addr;
+	int chunk;
+
+	while (len) {
+		chunk = min_t(int, len, PAGE_SIZE - (off & ~PAGE_MASK));
+		addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+		if (to_zspage)
+			memcpy(addr + (off & ~PAGE_MASK), buf, chunk);
+		else
+			memcpy(buf, addr + (off & ~PAGE_MASK), chunk);
+		kunmap_atomic(addr);
+		off += chunk;
+		buf += chunk;
+		len -= chunk;
+	}
+}
+
+/* Copy an object of the given size between two zspages */
+static void zs_object_copy(struct zspage *d_zspage, unsigned long d_off,
+				struct zspage *s_zspage, unsigned long s_off,
+				int size)
+{
+	char *s_addr, *d_addr;
+	int chunk;
+
+	while (size) {
+		chunk = min_t(int, size, PAGE_SIZE - (s_off & ~PAGE_MASK));
+		chunk = min_t(int, chunk, PAGE_SIZE - (d_off & ~PAGE_MASK));
+
+		s_addr = kmap_atomic(s_zspage->pages[s_off >> PAGE_SHIFT]);
+		d_addr = kmap_atomic(d_zspage->pages[d_off >> PAGE_SHIFT]);
+		memcpy(d_addr + (d_off & ~PAGE_MASK),
+		       s_addr + (s_off & ~PAGE_MASK), chunk);
+		kunmap_atomic(d_addr);
+		kunmap_atomic(s_addr);
+
+		s_off += chunk;
+		d_off += chunk;
+		size -= chunk;
+	}
+}
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+						struct zspage *zspage)
+{
+	int inuse, max_objects;
+	enum fullness_group fg;
+
+	inuse = zspage->inuse;
+	max_objects = class->objs_per_zspage;
+
+	if (inuse == 0)
+		fg = ZS_EMPTY;
+	else if (inuse == max_objects)
+		fg = ZS_FULL;
+	else if (inuse <= 3 * max_objects / fullness_threshold_frac)
+		fg = ZS_ALMOST_EMPTY;
+	else
+		fg = ZS_ALMOST_FULL;
+
+	return fg;
+}
+
+static void insert_zspage(struct size_class *class, struct zspage *zspage,
+				enum fullness_group fullness)
+{
+	zspage->fullness = fullness;
+	if (fullness >= _ZS_NR_FULLNESS_GROUPS)
+		return;
+
+	list_add(&zspage->list, &class->fullness_list[fullness]);
+}
+
+static void remove_zspage(struct zspage *zspage)
+{
+	list_del_init(&zspage->list);
+}
+
+/*
+ * Each size class maintains zspages in different fullness groups depending
+ * on the number of live objects they contain. When allocating or freeing
+ * objects, the fullness status of the page can change, say, from ALMOST_FULL
+ * to ALMOST_EMPTY when freeing an object. This function checks if such
+ * a status change has occurred for the given page and accordingly moves the
+ * page from the freelist of the old fullness group to that of the new
+ * fullness group.
+ */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+						struct zspage *zspage)
+{
+	enum fullness_group newfg;
+
+	newfg = get_fullness_group(class, zspage);
+	if (newfg == zspage->fullness && !list_empty(&zspage->list))
+		goto out;
+
+	remove_zspage(zspage);
+	insert_zspage(class, zspage, newfg);
+out:
+	return newfg;
+}
+
+/*
+ * We have to decide on how many pages to link together
+ * to form a zspage for each size class. This is important
+ * to reduce wastage due to unusable space left at end of
+ * each zspage which is given as:
+ *	wastage = Zp - Zp % size_class
+ * where Zp = zspage size = k * PAGE_SIZE where k = 1, 2, ...
+ *
+ * For example, for size class of 3/8 * PAGE_SIZE, we should
+ * link together 3 PAGE_SIZE sized pages to form a zspage
+ * since then we can perfectly fit in 8 such objects.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	/* zspage order which gives maximum used size per KB */
+	int max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size;
+		int waste, usedpc;
+
+		zspage_size = i * PAGE_SIZE;
+		waste = zspage_size % class_size;
+		usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+static void free_zspage(struct zs_pool *pool, struct size_class *class,
+				struct zspage *zspage)
+{
+	int i;
+
+	BUG_ON(zspage->inuse);
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		set_page_private(zspage->pages[i], 0);
+		__free_page(zspage->pages[i]);
+	}
+	kmem_cache_free(zs_zspage_cache, zspage);
+	atomic_long_sub(class->pages_per_zspage, &pool->pages_allocated);
+}
+
+/*
+ * Allocate a zspage for the given size class and link all its objects
+ * into the free list.
+ */
+static struct zspage *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	struct zspage *zspage;
+	unsigned int i;
+
+	zspage = kmem_cache_alloc(zs_zspage_cache,
+				  flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+	if (!zspage)
+		return NULL;
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class_idx = class->index;
+	zspage->fullness = ZS_EMPTY;
+	zspage->inuse = 0;
+	zspage->freeobj = 0;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page;
+
+		page = alloc_page(flags);
+		if (!page)
+			goto cleanup;
+		set_page_private(page, (unsigned long)zspage);
+		zspage->pages[i] = page;
+	}
+
+	for (i = 0; i < class->objs_per_zspage; i++)
+		set_obj_head(zspage, (unsigned long)i * class->size,
+			     (unsigned long)(i + 1) << OBJ_TAG_BITS);
+
+	return zspage;
+
+cleanup:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kmem_cache_free(zs_zspage_cache, zspage);
+	return NULL;
+}
+
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	int i;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		if (!list_empty(&class->fullness_list[i]))
+			return list_first_entry(&class->fullness_list[i],
+						struct zspage, list);
+	}
+
+	return NULL;
+}
+
+/* Take a free object of a zspage for handle, class lock held */
+static unsigned long obj_malloc(struct size_class *class,
+				struct zspage *zspage, unsigned long handle)
+{
+	unsigned int obj_idx = zspage->freeobj;
+	unsigned long off = (unsigned long)obj_idx * class->size;
+
+	BUG_ON(zspage->inuse >= class->objs_per_zspage);
+
+	zspage->freeobj = get_obj_head(zspage, off) >> OBJ_TAG_BITS;
+	set_obj_head(zspage, off, handle | OBJ_ALLOCATED_TAG);
+	zspage->inuse++;
+	class->obj_used++;
+
+	return location_to_obj(zspage->pages[0], obj_idx);
+}
+
+/* Put an object back on the free list of its zspage, class lock held */
+static void obj_free(struct size_class *class, struct zspage *zspage,
+			unsigned long off)
+{
+	set_obj_head(zspage, off,
+		     (unsigned long)zspage->freeobj << OBJ_TAG_BITS);
+	zspage->freeobj = off / class->size;
+	zspage->inuse--;
+	class->obj_used--;
+}
+
+/**
+ * zs_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @flags: gfp flags used if the pool has to grow
+ *
+ * On success, handle to the allocated object is returned,
+ * otherwise 0.
+ * Allocation requests with size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * will fail.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size, gfp_t flags)
+{
+	unsigned long handle, obj;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cache,
+				flags & ~(__GFP_HIGHMEM | __GFP_MOVABLE));
+	if (!handle)
+		return 0;
+
+	/* extra space in the object to store the handle */
+	size += ZS_HANDLE_SIZE;
+	class = &pool->size_class[get_size_class_index(size)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(class, flags);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cache, (void *)handle);
+			return 0;
+		}
+
+		atomic_long_add(class->pages_per_zspage,
+				&pool->pages_allocated);
+		spin_lock(&class->lock);
+		class->obj_allocated += class->objs_per_zspage;
+	}
+
+	obj = obj_malloc(class, zspage, handle);
+	record_obj(handle, obj);
+	fix_fullness_group(class, zspage);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	enum fullness_group fullness;
+	unsigned long off;
+
+	if (unlikely(!handle))
+		return;
+
+	/* the pin keeps compaction from moving the object under us */
+	pin_tag(handle);
+	zspage = obj_to_zspage(pool, handle_to_obj(handle), &class, &off);
+
+	spin_lock(&class->lock);
+	obj_free(class, zspage, off);
+	fullness = fix_fullness_group(class, zspage);
+	if (fullness == ZS_EMPTY)
+		class->obj_allocated -= class->objs_per_zspage;
+	spin_unlock(&class->lock);
+	unpin_tag(handle);
+
+	if (fullness == ZS_EMPTY)
+		free_zspage(pool, class, zspage);
+
+	kmem_cache_free(zs_handle_cache, (void *)handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - get address of allocated object from handle.
+ * @pool: pool from which the object was allocated
+ * @handle: handle returned from zs_malloc
+ * @mm: mapping mode to use
+ *
+ * Before using an object allocated from zs_malloc, it must be mapped using
+ * this function. When done with the object, it must be unmapped using
+ * zs_unmap_object.
+ *
+ * Only one object can be mapped per cpu at a time. There is no protection
+ * against nested mappings.
+ *
+ * This function returns with preemption and page faults disabled.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	struct mapping_area *area;
+	unsigned long off;
+	char *ret;
+
+	BUG_ON(!handle);
+
+	/* pinned objects are not moved by compaction */
+	pin_tag(handle);
+	zspage = obj_to_zspage(pool, handle_to_obj(handle), &class, &off);
+
+	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
+	if ((off & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		/* this object is contained entirely within a page */
+		area->vm_addr = kmap_atomic(zspage->pages[off >> PAGE_SHIFT]);
+		ret = area->vm_addr + (off & ~PAGE_MASK);
+	} else {
+		/* this object spans two pages */
+		ret = area->vm_buf;
+		pagefault_disable();
+		if (mm != ZS_MM_WO)
+			zs_copy_object(zspage, off, ret, class->size, false);
+	}
+
+	return ret + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct size_class *class;
+	struct zspage *zspage;
+	struct mapping_area *area;
+	unsigned long off;
+
+	BUG_ON(!handle);
+
+	zspage = obj_to_zspage(pool, handle_to_obj(handle), &class, &off);
+
+	area = &__get_cpu_var(zs_map_area);
+	if ((off & ~PAGE_MASK) + class->size <= PAGE_SIZE) {
+		kunmap_atomic(area->vm_addr);
+	} else {
+		/* the handle at the start of the object is left alone */
+		if (area->vm_mm != ZS_MM_RO)
+			zs_copy_object(zspage, off + ZS_HANDLE_SIZE,
+				       area->vm_buf + ZS_HANDLE_SIZE,
+				       class->size - ZS_HANDLE_SIZE, true);
+		pagefault_enable();
+	}
+	put_cpu_var(zs_map_area);
+
+	unpin_tag(handle);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+unsigned long zs_get_total_pages(struct zs_pool *pool)
+{
+	return atomic_long_read(&pool->pages_allocated);
+}
+EXPORT_SYMBOL_GPL(zs_get_total_pages);
+
+/*
+ * Number of pages compaction could free in a class, assuming all the
+ * unused object slots could be gathered into whole zspages.
+ */
+static unsigned long zs_can_compact(struct size_class *class)
+{
+	unsigned long obj_wasted;
+
+	obj_wasted = class->obj_allocated - class->obj_used;
+	obj_wasted /= class->objs_per_zspage;
+
+	return obj_wasted * class->pages_per_zspage;
+}
+
+/*
+ * Take a zspage off its fullness list: sparsely used ones are sources
+ * for compaction, densely used ones destinations.
+ */
+static struct zspage *isolate_zspage(struct size_class *class, bool source)
+{
+	static const enum fullness_group source_fg[] = {
+		ZS_ALMOST_EMPTY, ZS_ALMOST_FULL
+	};
+	static const enum fullness_group dest_fg[] = {
+		ZS_ALMOST_FULL, ZS_ALMOST_EMPTY
+	};
+	const enum fullness_group *fg = source ? source_fg : dest_fg;
+	struct zspage *zspage;
+	int i;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		struct list_head *list = &class->fullness_list[fg[i]];
+
+		if (list_empty(list))
+			continue;
+		zspage = list_first_entry(list, struct zspage, list);
+		remove_zspage(zspage);
+		return zspage;
+	}
+
+	return NULL;
+}
+
+/*
+ * Move the objects of src at index *obj_idx and up to dst, skipping
+ * pinned ones.  Returns -ENOMEM when dst filled up before the end of
+ * src was reached.
+ */
+static int migrate_zspage(struct size_class *class, struct zspage *src,
+				struct zspage *dst, unsigned int *obj_idx)
+{
+	unsigned long handle, head, free_obj, off, dst_off;
+
+	for (; *obj_idx < class->objs_per_zspage; (*obj_idx)++) {
+		off = (unsigned long)*obj_idx * class->size;
+		head = get_obj_head(src, off);
+		if (!(head & OBJ_ALLOCATED_TAG))
+			continue;
+
+		handle = head & ~OBJ_ALLOCATED_TAG;
+		/* the object is mapped or being freed */
+		if (!trypin_tag(handle))
+			continue;
+
+		if (dst->inuse == class->objs_per_zspage) {
+			unpin_tag(handle);
+			return -ENOMEM;
+		}
+
+		dst_off = (unsigned long)dst->freeobj * class->size;
+		free_obj = obj_malloc(class, dst, handle);
+		zs_object_copy(dst, dst_off, src, off, class->size);
+
+		/* keep the pin while the handle is switched over */
+		record_obj(handle, free_obj | BIT(HANDLE_PIN_BIT));
+		unpin_tag(handle);
+		obj_free(class, src, off);
+	}
+
+	return 0;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	struct zspage *src, *dst;
+	unsigned long pages_freed = 0;
+	unsigned int obj_idx;
+	int ret;
+
+	spin_lock(&class->lock);
+	while (zs_can_compact(class) && (src = isolate_zspage(class, true))) {
+		obj_idx = 0;
+		ret = 0;
+		while ((dst = isolate_zspage(class, false))) {
+			ret = migrate_zspage(class, src, dst, &obj_idx);
+			fix_fullness_group(class, dst);
+			if (ret != -ENOMEM)
+				break;
+		}
+
+		if (!src->inuse) {
+			class->obj_allocated -= class->objs_per_zspage;
+			free_zspage(pool, class, src);
+			pages_freed += class->pages_per_zspage;
+		} else {
+			/* out of room or pinned objects left, give up */
+			fix_fullness_group(class, src);
+			break;
+		}
+
+		spin_unlock(&class->lock);
+		cond_resched();
+		spin_lock(&class->lock);
+	}
+	spin_unlock(&class->lock);
+
+	return pages_freed;
+}
+
+/**
+ * zs_compact - move objects to free sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages freed.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	unsigned long pages_freed = 0;
+	int i;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--)
+		pages_freed += __zs_compact(pool, &pool->size_class[i]);
+
+	pool->pages_compacted += pages_freed;
+	return pages_freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+void zs_pool_stats(struct zs_pool *pool, struct zs_pool_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->pages_compacted = pool->pages_compacted;
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		spin_lock(&class->lock);
+		stats->obj_allocated += class->obj_allocated;
+		stats->obj_used += class->obj_used;
+		spin_unlock(&class->lock);
+	}
+}
+EXPORT_SYMBOL_GPL(zs_pool_stats);
+
+static int zs_shrinker_shrink(struct shrinker *shrinker,
+				struct shrink_control *sc)
+{
+	struct zs_pool *pool = container_of(shrinker, struct zs_pool,
+					    shrinker);
+	unsigned long pages_to_free = 0;
+	int i;
+
+	if (sc->nr_to_scan)
+		zs_compact(pool);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		pages_to_free += zs_can_compact(&pool->size_class[i]);
+
+	return min_t(unsigned long, pages_to_free, INT_MAX);
+}
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @name: name of the pool to be created
+ *
+ * This function must be called before anything when using
+ * the zsmalloc allocator.
+ *
+ * On success, a pointer to the newly created pool is returned,
+ * otherwise NULL.
+ */
+struct zs_pool *zs_create_pool(const char *name)
+{
+	int i;
+	struct zs_pool *pool;
+
+	pool = vzalloc(sizeof(*pool));
+	if (!pool)
+		return NULL;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int size;
+		struct size_class *class;
+
+		size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		if (size > ZS_MAX_ALLOC_SIZE)
+			size = ZS_MAX_ALLOC_SIZE;
+
+		class = &pool->size_class[i];
+		class->size = size;
+		class->index = i;
+		spin_lock_init(&class->lock);
+		class->pages_per_zspage = get_pages_per_zspage(size);
+		class->objs_per_zspage = class->pages_per_zspage *
+						PAGE_SIZE / size;
+		INIT_LIST_HEAD(&class->fullness_list[ZS_ALMOST_FULL]);
+		INIT_LIST_HEAD(&class->fullness_list[ZS_ALMOST_EMPTY]);
+	}
+
+	pool->name = name;
+	atomic_long_set(&pool->pages_allocated, 0);
+
+	pool->shrinker.shrink = zs_shrinker_shrink;
+	pool->shrinker.seeks = DEFAULT_SEEKS;
+	register_shrinker(&pool->shrinker);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	unregister_shrinker(&pool->shrinker);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class = &pool->size_class[i];
+
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
+			if (!list_empty(&class->fullness_list[fg])) {
+				pr_info("Freeing non-empty class with size "
+					"%db, fullness group %d\n",
+					class->size, fg);
+			}
+		}
+	}
+	vfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+static int zs_cpu_notifier(struct notifier_block *nb, unsigned long action,
+				void *pcpu)
+{
+	int cpu = (long)pcpu;
+	struct mapping_area *area;
+
+	switch (action & ~CPU_TASKS_FROZEN) {
+	case CPU_UP_PREPARE:
+		area = &per_cpu(zs_map_area, cpu);
+		if (area->vm_buf)
+			break;
+		area->vm_buf = kmalloc_node(ZS_MAX_ALLOC_SIZE, GFP_KERNEL,
+					    cpu_to_node(cpu));
+		if (!area->vm_buf)
+			return notifier_from_errno(-ENOMEM);
+		break;
+	case CPU_DEAD:
+	case CPU_UP_CANCELED:
+		area = &per_cpu(zs_map_area, cpu);
+		kfree(area->vm_buf);
+		area->vm_buf = NULL;
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block zs_cpu_nb = {
+	.notifier_call = zs_cpu_notifier
+};
+
+static void zs_exit(void)
+{
+	int cpu;
+
+	for_each_online_cpu(cpu)
+		zs_cpu_notifier(NULL, CPU_DEAD, (void *)(long)cpu);
+	unregister_cpu_notifier(&zs_cpu_nb);
+
+	if (zs_zspage_cache)
+		kmem_cache_destroy(zs_zspage_cache);
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
+}
+
+static int zs_init(void)
+{
+	int cpu, ret;
+
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+					    0, 0, NULL);
+	zs_zspage_cache = KMEM_CACHE(zspage, 0);
+	if (!zs_handle_cache || !zs_zspage_cache) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	register_cpu_notifier(&zs_cpu_nb);
+	for_each_online_cpu(cpu) {
+		ret = zs_cpu_notifier(NULL, CPU_UP_PREPARE, (void *)(long)cpu);
+		if (notifier_to_errno(ret))
+			goto fail;
+	}
+	return 0;
+fail:
+	zs_exit();
+	return notifier_to_errno(ret);
+}
+
+module_init(zs_init);
+module_exit(zs_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
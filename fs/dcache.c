@@ -37,6 +37,7 @@
 #include <linux/rculist_bl.h>
 #include <linux/prefetch.h>
 #include <linux/ratelimit.h>
+#include <linux/memcontrol.h>
 #include "internal.h"
 
 /*
@@ -235,6 +236,7 @@ static void dentry_lru_add(struct dentry *dentry)
 		list_add(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
 		dentry->d_sb->s_nr_dentry_unused++;
 		dentry_stat.nr_unused++;
+		mem_cgroup_kmem_lru_mod(dentry, MEMCG_KMEM_LRU_DENTRY, 1);
 		spin_unlock(&dcache_lru_lock);
 	}
 }
@@ -244,6 +246,7 @@ static void __dentry_lru_del(struct dentry *dentry)
 	list_del_init(&dentry->d_lru);
 	dentry->d_sb->s_nr_dentry_unused--;
 	dentry_stat.nr_unused--;
+	mem_cgroup_kmem_lru_mod(dentry, MEMCG_KMEM_LRU_DENTRY, -1);
 }
 
 /*
@@ -282,6 +285,7 @@ static void dentry_lru_move_tail(struct dentry *dentry)
 		list_add_tail(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
 		dentry->d_sb->s_nr_dentry_unused++;
 		dentry_stat.nr_unused++;
+		mem_cgroup_kmem_lru_mod(dentry, MEMCG_KMEM_LRU_DENTRY, 1);
 	} else {
 		list_move_tail(&dentry->d_lru, &dentry->d_sb->s_dentry_lru);
 	}
@@ -773,10 +777,12 @@ static void shrink_dentry_list(struct list_head *list)
  * @sb:		superblock to shrink dentry LRU.
  * @count:	number of entries to prune
  * @flags:	flags to control the dentry processing
+ * @memcg:	only prune the dentries charged to this memcg, if not NULL
  *
  * If flags contains DCACHE_REFERENCED reference dentries will not be pruned.
  */
-static void __shrink_dcache_sb(struct super_block *sb, int count, int flags)
+static void __shrink_dcache_sb(struct super_block *sb, int count, int flags,
+			       struct mem_cgroup *memcg)
 {
 	struct dentry *dentry;
 	LIST_HEAD(referenced);
@@ -796,11 +802,15 @@ relock:
 		}
 
 		/*
-		 * If we are honouring the DCACHE_REFERENCED flag and the
-		 * dentry has this flag set, don't free it.  Clear the flag
-		 * and put it back on the LRU.
+		 * Dentries of other memcgs are skipped, but count against
+		 * the scan so that a sparse LRU is not walked forever.
 		 */
-		if (flags & DCACHE_REFERENCED &&
+		if (memcg && mem_cgroup_from_kmem(dentry) != memcg) {
+			list_move(&dentry->d_lru, &referenced);
+			spin_unlock(&dentry->d_lock);
+			if (!--count)
+				break;
+		} else if (flags & DCACHE_REFERENCED &&
 				dentry->d_flags & DCACHE_REFERENCED) {
 			dentry->d_flags &= ~DCACHE_REFERENCED;
 			list_move(&dentry->d_lru, &referenced);
@@ -824,6 +834,7 @@ relock:
  * prune_dcache_sb - shrink the dcache
  * @sb: superblock
  * @nr_to_scan: number of entries to try to free
+ * @memcg: memcg to free the dentries of, NULL for all dentries
  *
  * Attempt to shrink the superblock dcache LRU by @nr_to_scan entries. This is
  * done when we need more memory an called from the superblock shrinker
@@ -832,9 +843,10 @@ relock:
  * This function may fail to free any resources if all the dentries are in
  * use.
  */
-void prune_dcache_sb(struct super_block *sb, int nr_to_scan)
+void prune_dcache_sb(struct super_block *sb, int nr_to_scan,
+		     struct mem_cgroup *memcg)
 {
-	__shrink_dcache_sb(sb, nr_to_scan, DCACHE_REFERENCED);
+	__shrink_dcache_sb(sb, nr_to_scan, DCACHE_REFERENCED, memcg);
 }
 
 /**
@@ -1187,7 +1199,7 @@ void shrink_dcache_parent(struct dentry * parent)
 	int found;
 
 	while ((found = select_parent(parent)) != 0)
-		__shrink_dcache_sb(sb, found, 0);
+		__shrink_dcache_sb(sb, found, 0, NULL);
 }
 EXPORT_SYMBOL(shrink_dcache_parent);
 
@@ -3013,7 +3025,7 @@ static void __init dcache_init(void)
 	 * of the dcache. 
 	 */
 	dentry_cache = KMEM_CACHE(dentry,
-		SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|SLAB_MEM_SPREAD);
+		SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|SLAB_MEM_SPREAD|SLAB_ACCOUNT);
 
 	/* Hash may have been set up in dcache_init_early */
 	if (!hashdist)
@@ -261,6 +261,7 @@ static int __bprm_mm_init(struct linux_binprm *bprm)
 	if (!vma)
 		return -ENOMEM;
 
+	vma_spf_init(vma);
 	down_write(&mm->mmap_sem);
 	vma->vm_mm = mm;
 
@@ -539,7 +539,7 @@ void __init files_init(unsigned long mempages)
 	unsigned long n;
 
 	filp_cachep = kmem_cache_create("filp", sizeof(struct file), 0,
-			SLAB_HWCACHE_ALIGN | SLAB_PANIC, NULL);
+			SLAB_HWCACHE_ALIGN | SLAB_PANIC | SLAB_ACCOUNT, NULL);
 
 	/*
 	 * One file with associated inode and dcache is very roughly 1K.
@@ -27,6 +27,7 @@
 #include <linux/backing-dev.h>
 #include <linux/buffer_head.h>
 #include <linux/tracepoint.h>
+#include <linux/memcontrol.h>
 #include "internal.h"
 
 /*
@@ -41,6 +42,8 @@ struct wb_writeback_work {
 	unsigned int for_kupdate:1;
 	unsigned int range_cyclic:1;
 	unsigned int for_background:1;
+	unsigned int for_memcg:1;
+	unsigned short memcg_id;	/* memcg to write back for */
 	enum wb_reason reason;		/* why was writeback initiated? */
 
 	struct list_head list;		/* pending work list */
@@ -181,6 +184,70 @@ void bdi_start_background_writeback(struct backing_dev_info *bdi)
 	spin_unlock_bh(&bdi->wb_lock);
 }
 
+/**
+ * bdi_start_memcg_writeback - start writeback on behalf of a memory cgroup
+ * @bdi: the backing device to write from
+ * @id: css id of the memory cgroup
+ *
+ * Description:
+ *   Like background writeback, but only inodes with pages dirtied by the
+ *   memory cgroup are written, and writeback stops once the memory cgroup
+ *   is below its own background dirty threshold.  Returns -ENOMEM if the
+ *   work could not be queued.
+ */
+int bdi_start_memcg_writeback(struct backing_dev_info *bdi, unsigned short id)
+{
+	struct wb_writeback_work *work;
+
+	work = kzalloc(sizeof(*work), GFP_ATOMIC);
+	if (!work)
+		return -ENOMEM;
+
+	work->sync_mode	= WB_SYNC_NONE;
+	work->nr_pages	= LONG_MAX;
+	work->range_cyclic = 1;
+	work->for_memcg	= 1;
+	work->memcg_id	= id;
+	work->reason	= WB_REASON_MEMCG;
+
+	bdi_queue_work(bdi, work);
+	return 0;
+}
+
+static bool list_has_memcg_inode(struct list_head *head, unsigned short id)
+{
+	struct inode *inode;
+
+	list_for_each_entry(inode, head, i_wb_list)
+		if (mem_cgroup_mapping_dirtied_by(inode->i_mapping, id))
+			return true;
+	return false;
+}
+
+/**
+ * bdi_has_memcg_dirty_io - check for dirty inodes of a memory cgroup
+ * @bdi: the backing device to look at
+ * @id: css id of the memory cgroup
+ *
+ * Returns true if any inode queued for writeback on @bdi has pages dirtied
+ * by the memory cgroup.
+ */
+bool bdi_has_memcg_dirty_io(struct backing_dev_info *bdi, unsigned short id)
+{
+	struct bdi_writeback *wb = &bdi->wb;
+	bool ret;
+
+	if (!wb_has_dirty_io(wb))
+		return false;
+
+	spin_lock(&wb->list_lock);
+	ret = list_has_memcg_inode(&wb->b_dirty, id) ||
+	      list_has_memcg_inode(&wb->b_io, id) ||
+	      list_has_memcg_inode(&wb->b_more_io, id);
+	spin_unlock(&wb->list_lock);
+	return ret;
+}
+
 /*
  * Remove the inode from the writeback list it is on.
  */
@@ -250,8 +317,22 @@ static bool inode_dirtied_after(struct inode *inode, unsigned long t)
 	return ret;
 }
 
+/*
+ * Writeback for a memcg only wants the inodes it dirtied, the others are
+ * left for the regular writeback.
+ */
+static bool inode_skip_for_work(struct inode *inode,
+				struct wb_writeback_work *work)
+{
+	return work->for_memcg &&
+	       !mem_cgroup_mapping_dirtied_by(inode->i_mapping,
+					      work->memcg_id);
+}
+
 /*
  * Move expired dirty inodes from @delaying_queue to @dispatch_queue.
+ * Inodes the work is not interested in stay where they are, with their
+ * dirtied_when untouched.
  */
 static int move_expired_inodes(struct list_head *delaying_queue,
 			       struct list_head *dispatch_queue,
@@ -264,11 +345,13 @@ static int move_expired_inodes(struct list_head *delaying_queue,
 	int do_sb_sort = 0;
 	int moved = 0;
 
-	while (!list_empty(delaying_queue)) {
-		inode = wb_inode(delaying_queue->prev);
+	list_for_each_prev_safe(pos, node, delaying_queue) {
+		inode = wb_inode(pos);
 		if (work->older_than_this &&
 		    inode_dirtied_after(inode, *work->older_than_this))
 			break;
+		if (inode_skip_for_work(inode, work))
+			continue;
 		if (sb && sb != inode->i_sb)
 			do_sb_sort = 1;
 		sb = inode->i_sb;
@@ -310,7 +393,15 @@ static void queue_io(struct bdi_writeback *wb, struct wb_writeback_work *work)
 {
 	int moved;
 	assert_spin_locked(&wb->list_lock);
-	list_splice_init(&wb->b_more_io, &wb->b_io);
+	if (work->for_memcg) {
+		struct inode *inode, *next;
+
+		list_for_each_entry_safe(inode, next, &wb->b_more_io,
+					 i_wb_list)
+			if (!inode_skip_for_work(inode, work))
+				list_move_tail(&inode->i_wb_list, &wb->b_io);
+	} else
+		list_splice_init(&wb->b_more_io, &wb->b_io);
 	moved = move_expired_inodes(&wb->b_dirty, &wb->b_io, work);
 	trace_writeback_queue_io(wb, work, moved);
 }
@@ -477,6 +568,7 @@ writeback_single_inode(struct inode *inode, struct bdi_writeback *wb,
 			 * No need to add it back to the LRU.
 			 */
 			list_del_init(&inode->i_wb_list);
+			mem_cgroup_mapping_clean(mapping);
 		}
 	}
 	inode_sync_complete(inode);
@@ -563,6 +655,18 @@ static long writeback_sb_inodes(struct super_block *sb,
 			break;
 		}
 
+		/*
+		 * queue_io() leaves out the inodes a memcg writeback does
+		 * not want, but an inode on b_io may have been queued by
+		 * another work.  Park it on b_more_io rather than
+		 * redirty_tail(), which would make it look freshly dirtied
+		 * and delay its expiry-based writeback.
+		 */
+		if (inode_skip_for_work(inode, work)) {
+			requeue_io(inode, wb);
+			continue;
+		}
+
 		/*
 		 * Don't bother with new inodes or inodes beeing freed, first
 		 * kind does not need peridic writeout yet, and for the latter
@@ -732,7 +836,8 @@ static long wb_writeback(struct bdi_writeback *wb,
 		 * so that e.g. sync can proceed. They'll be restarted
 		 * after the other works are all done.
 		 */
-		if ((work->for_background || work->for_kupdate) &&
+		if ((work->for_background || work->for_kupdate ||
+		     work->for_memcg) &&
 		    !list_empty(&wb->bdi->work_list))
 			break;
 
@@ -743,6 +848,14 @@ static long wb_writeback(struct bdi_writeback *wb,
 		if (work->for_background && !over_bground_thresh(wb->bdi))
 			break;
 
+		/*
+		 * Likewise for writeout on behalf of a memcg, against the
+		 * memcg's own background threshold
+		 */
+		if (work->for_memcg &&
+		    !mem_cgroup_over_bground_thresh(work->memcg_id))
+			break;
+
 		if (work->for_kupdate) {
 			oldest_jif = jiffies -
 				msecs_to_jiffies(dirty_expire_interval * 10);
@@ -775,6 +888,12 @@ static long wb_writeback(struct bdi_writeback *wb,
 		 */
 		if (list_empty(&wb->b_more_io))
 			break;
+		/*
+		 * Writeback for a memcg leaves the inodes of others on
+		 * b_more_io alone, don't wait or spin on them.
+		 */
+		if (work->for_memcg)
+			break;
 		/*
 		 * Nothing written. Wait for some inode to
 		 * become available for writeback. Otherwise
@@ -896,6 +1015,9 @@ long wb_do_writeback(struct bdi_writeback *wb, int force_wait)
 
 		wrote += wb_writeback(wb, work);
 
+		if (work->for_memcg)
+			mem_cgroup_writeback_done(work->memcg_id);
+
 		/*
 		 * Notify the caller of completion if this is a synchronous
 		 * work item, otherwise just free it.
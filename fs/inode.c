@@ -26,6 +26,7 @@
 #include <linux/ima.h>
 #include <linux/cred.h>
 #include <linux/buffer_head.h> /* for inode_has_buffers */
+#include <linux/memcontrol.h>
 #include "internal.h"
 
 /*
@@ -177,6 +178,9 @@ int inode_init_always(struct super_block *sb, struct inode *inode)
 	mapping->assoc_mapping = NULL;
 	mapping->backing_dev_info = &default_backing_dev_info;
 	mapping->writeback_index = 0;
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR
+	mapping->i_memcg = 0;
+#endif
 
 	/*
 	 * If the block_device provides a backing_dev_info for client
@@ -333,6 +337,7 @@ static void inode_lru_list_add(struct inode *inode)
 		list_add(&inode->i_lru, &inode->i_sb->s_inode_lru);
 		inode->i_sb->s_nr_inodes_unused++;
 		this_cpu_inc(nr_unused);
+		mem_cgroup_kmem_lru_mod(inode, MEMCG_KMEM_LRU_INODE, 1);
 	}
 	spin_unlock(&inode->i_sb->s_inode_lru_lock);
 }
@@ -344,6 +349,7 @@ static void inode_lru_list_del(struct inode *inode)
 		list_del_init(&inode->i_lru);
 		inode->i_sb->s_nr_inodes_unused--;
 		this_cpu_dec(nr_unused);
+		mem_cgroup_kmem_lru_mod(inode, MEMCG_KMEM_LRU_INODE, -1);
 	}
 	spin_unlock(&inode->i_sb->s_inode_lru_lock);
 }
@@ -425,6 +431,7 @@ void end_writeback(struct inode *inode)
 	 */
 	spin_lock_irq(&inode->i_data.tree_lock);
 	BUG_ON(inode->i_data.nrpages);
+	BUG_ON(inode->i_data.nrshadows);
 	spin_unlock_irq(&inode->i_data.tree_lock);
 	BUG_ON(!list_empty(&inode->i_data.private_list));
 	BUG_ON(!(inode->i_state & I_FREEING));
@@ -460,10 +467,16 @@ static void evict(struct inode *inode)
 
 	inode_sb_list_del(inode);
 
+	/*
+	 * Keep reclaim from leaving shadow entries behind the final
+	 * truncation of the page cache.
+	 */
+	mapping_set_exiting(&inode->i_data);
+
 	if (op->evict_inode) {
 		op->evict_inode(inode);
 	} else {
-		if (inode->i_data.nrpages)
+		if (inode->i_data.nrpages || inode->i_data.nrshadows)
 			truncate_inode_pages(&inode->i_data, 0);
 		end_writeback(inode);
 	}
@@ -612,8 +625,11 @@ static int can_unuse(struct inode *inode)
  * the fact we are doing lazy LRU updates to minimise lock contention so the
  * LRU does not have strict ordering. Hence we don't want to reclaim inodes
  * with this flag set because they are the inodes that are out of order.
+ *
+ * If @memcg is not NULL, only the inodes charged to it are freed.
  */
-void prune_icache_sb(struct super_block *sb, int nr_to_scan)
+void prune_icache_sb(struct super_block *sb, int nr_to_scan,
+		     struct mem_cgroup *memcg)
 {
 	LIST_HEAD(freeable);
 	int nr_scanned;
@@ -648,6 +664,14 @@ void prune_icache_sb(struct super_block *sb, int nr_to_scan)
 			spin_unlock(&inode->i_lock);
 			sb->s_nr_inodes_unused--;
 			this_cpu_dec(nr_unused);
+			mem_cgroup_kmem_lru_mod(inode, MEMCG_KMEM_LRU_INODE, -1);
+			continue;
+		}
+
+		/* Inodes of other memcgs get another pass */
+		if (memcg && mem_cgroup_from_kmem(inode) != memcg) {
+			list_move(&inode->i_lru, &sb->s_inode_lru);
+			spin_unlock(&inode->i_lock);
 			continue;
 		}
 
@@ -686,6 +710,7 @@ void prune_icache_sb(struct super_block *sb, int nr_to_scan)
 		list_move(&inode->i_lru, &freeable);
 		sb->s_nr_inodes_unused--;
 		this_cpu_dec(nr_unused);
+		mem_cgroup_kmem_lru_mod(inode, MEMCG_KMEM_LRU_INODE, -1);
 	}
 	if (current_is_kswapd())
 		__count_vm_events(KSWAPD_INODESTEAL, reap);
@@ -1599,7 +1624,7 @@ void __init inode_init(void)
 					 sizeof(struct inode),
 					 0,
 					 (SLAB_RECLAIM_ACCOUNT|SLAB_PANIC|
-					 SLAB_MEM_SPREAD),
+					 SLAB_MEM_SPREAD|SLAB_ACCOUNT),
 					 init_once);
 
 	/* Hash may have been set up in inode_init_early */
@@ -0,0 +1,1498 @@
+/*
+ *	Shared application/kernel submission and completion ring pair, for
+ *	supporting fast/efficient asynchronous IO.
+ *
+ *	A ring is created with io_ring_setup(2) and the application mmaps
+ *	the submission queue (SQ) ring, the array of submission entries
+ *	(SQEs) and the completion queue (CQ) ring. The application adds
+ *	requests at the tail of the SQ ring and reaps completions from the
+ *	head of the CQ ring, the kernel does the reverse. Neither side needs
+ *	a system call for that; io_ring_enter(2) only tells the kernel to
+ *	consume the SQ ring and/or waits for completions. With
+ *	IORING_SETUP_SQPOLL a kernel thread polls the SQ ring instead and
+ *	even that call goes away as long as the thread is busy.
+ *
+ *	Requests that are known not to block (reads fully served from the
+ *	page cache, nops) are executed inline. Everything else is handed to
+ *	a pool of kernel workers that run with the credentials and the mm
+ *	of the ring creator. Buffers and files can be registered up front,
+ *	which saves pinning/mapping user memory and the fd table lookup on
+ *	every request.
+ *
+ *	See ../COPYING for licensing terms.
+ */
+#include <linux/kernel.h>
+#include <linux/init.h>
+#include <linux/errno.h>
+#include <linux/syscalls.h>
+#include <linux/module.h>
+#include <linux/sched.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/mmu_context.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/uio.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/anon_inodes.h>
+#include <linux/cred.h>
+#include <linux/log2.h>
+#include <linux/io_ring.h>
+
+#include <asm/uaccess.h>
+
+#define IORING_MAX_ENTRIES	4096
+#define IORING_MAX_FIXED_FILES	1024
+#define IORING_MAX_FIXED_BUFS	1024
+#define IORING_MAX_BUF_SIZE	(1UL << 30)
+
+/* Largest cached read that is still executed by the submitter */
+#define IORING_INLINE_PAGES	16
+
+struct io_ring_idx {
+	u32 head ____cacheline_aligned_in_smp;
+	u32 tail ____cacheline_aligned_in_smp;
+};
+
+/*
+ * The SQ and CQ rings as seen by the application. Only head, tail and
+ * the entries themselves are ever written by both sides.
+ */
+struct io_sq_ring {
+	struct io_ring_idx	r;
+	u32			ring_mask;
+	u32			ring_entries;
+	u32			dropped;
+	u32			flags;
+	u32			array[];
+};
+
+struct io_cq_ring {
+	struct io_ring_idx	r;
+	u32			ring_mask;
+	u32			ring_entries;
+	u32			overflow;
+	struct io_ring_cqe	cqes[] ____cacheline_aligned_in_smp;
+};
+
+struct io_mapped_ubuf {
+	u64			ubuf;
+	size_t			len;
+	struct page		**pages;
+	unsigned int		nr_pages;
+	void			*kaddr;
+};
+
+struct io_ring_ctx {
+	/*
+	 * One reference for the ring file, one for every request in
+	 * flight. ->done fires when the last one goes away, with
+	 * completion_lock held. If the closing task was killed while
+	 * waiting for that, the ring is orphaned and the last request
+	 * frees it instead.
+	 */
+	atomic_t		refs;
+	struct completion	done;
+	bool			closing;
+	bool			orphaned;
+	unsigned int		flags;
+
+	/* submission side, serialized by uring_lock */
+	struct mutex		uring_lock;
+	struct io_sq_ring	*sq_ring;
+	struct io_ring_sqe	*sq_sqes;
+	size_t			sq_ring_size;
+	size_t			sqes_size;
+	unsigned		sq_entries;
+	unsigned		sq_mask;
+	unsigned		cached_sq_head;
+
+	/* completion side, serialized by completion_lock */
+	spinlock_t		completion_lock;
+	struct io_cq_ring	*cq_ring;
+	size_t			cq_ring_size;
+	unsigned		cq_entries;
+	unsigned		cq_mask;
+	unsigned		cached_cq_tail;
+	wait_queue_head_t	cq_wait;
+	struct list_head	poll_list;
+
+	/* context of the creator, used by the workers and the sq thread */
+	struct mm_struct	*sqo_mm;
+	const struct cred	*creds;
+	struct task_struct	*sqo_thread;
+	wait_queue_head_t	sqo_wait;
+	unsigned long		sq_thread_idle;
+
+	struct file		**user_files;
+	unsigned		nr_user_files;
+	struct io_mapped_ubuf	*user_bufs;
+	unsigned		nr_user_bufs;
+};
+
+struct io_poll_iocb {
+	wait_queue_head_t	*head;
+	unsigned long		events;
+	bool			canceled;
+	wait_queue_t		wait;
+};
+
+struct io_kiocb {
+	struct io_ring_ctx	*ctx;
+	struct file		*file;
+	atomic_t		refs;
+	struct io_ring_sqe	sqe;	/* stable copy of the application's sqe */
+	void			*kbuf;	/* kernel address of a fixed buffer */
+	struct work_struct	work;
+	struct list_head	list;	/* ctx->poll_list */
+	struct io_poll_iocb	poll;
+};
+
+static struct kmem_cache *req_cachep;
+static struct workqueue_struct *io_ring_wq;
+
+static const struct file_operations io_ring_fops;
+
+static void *io_mem_alloc(size_t size)
+{
+	gfp_t gfp = GFP_KERNEL | __GFP_ZERO | __GFP_NOWARN;
+
+	return (void *)__get_free_pages(gfp, get_order(size));
+}
+
+static void io_mem_free(void *ptr, size_t size)
+{
+	if (ptr)
+		free_pages((unsigned long)ptr, get_order(size));
+}
+
+static void io_ring_ctx_free(struct io_ring_ctx *ctx);
+
+static void io_ring_ctx_put(struct io_ring_ctx *ctx)
+{
+	unsigned long flags;
+	bool orphaned;
+
+	/* not the last reference, nobody to tell */
+	if (atomic_add_unless(&ctx->refs, -1, 1))
+		return;
+
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	if (!atomic_dec_and_test(&ctx->refs)) {
+		spin_unlock_irqrestore(&ctx->completion_lock, flags);
+		return;
+	}
+	orphaned = ctx->orphaned;
+	if (!orphaned)
+		complete(&ctx->done);
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
+
+	if (orphaned)
+		io_ring_ctx_free(ctx);
+}
+
+/*
+ * Grab a reference to the creator's address space, unless the creator
+ * has already exited.
+ */
+static struct mm_struct *io_get_mm(struct io_ring_ctx *ctx)
+{
+	struct mm_struct *mm = ctx->sqo_mm;
+
+	if (!atomic_inc_not_zero(&mm->mm_users))
+		return NULL;
+	return mm;
+}
+
+static unsigned io_cqring_events(struct io_ring_ctx *ctx)
+{
+	return ctx->cached_cq_tail - ACCESS_ONCE(ctx->cq_ring->r.head);
+}
+
+static void io_cqring_fill_event(struct io_ring_ctx *ctx, u64 user_data,
+				 long res)
+{
+	struct io_cq_ring *ring = ctx->cq_ring;
+	struct io_ring_cqe *cqe;
+
+	/*
+	 * If the application doesn't reap completions fast enough we have
+	 * to drop them on the floor, but at least tell it so.
+	 */
+	if (io_cqring_events(ctx) == ctx->cq_entries) {
+		ring->overflow++;
+		return;
+	}
+
+	cqe = &ring->cqes[ctx->cached_cq_tail & ctx->cq_mask];
+	cqe->user_data = user_data;
+	cqe->res = res;
+	cqe->flags = 0;
+
+	/* order the cqe contents before the tail update */
+	smp_wmb();
+	ring->r.tail = ++ctx->cached_cq_tail;
+}
+
+static void io_cqring_add_event(struct io_ring_ctx *ctx, u64 user_data,
+				long res)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&ctx->completion_lock, flags);
+	io_cqring_fill_event(ctx, user_data, res);
+	spin_unlock_irqrestore(&ctx->completion_lock, flags);
+
+	wake_up_interruptible(&ctx->cq_wait);
+}
+
+static struct io_kiocb *io_get_req(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req;
+
+	req = kmem_cache_alloc(req_cachep, GFP_KERNEL);
+	if (!req)
+		return NULL;
+
+	atomic_inc(&ctx->refs);
+	req->ctx = ctx;
+	req->file = NULL;
+	req->kbuf = NULL;
+	atomic_set(&req->refs, 1);
+	INIT_LIST_HEAD(&req->list);
+	return req;
+}
+
+static void io_put_req(struct io_kiocb *req)
+{
+	struct io_ring_ctx *ctx = req->ctx;
+
+	if (!atomic_dec_and_test(&req->refs))
+		return;
+
+	if (req->file)
+		fput(req->file);
+	kmem_cache_free(req_cachep, req);
+	io_ring_ctx_put(ctx);
+}
+
+static void io_complete_req(struct io_kiocb *req, long res)
+{
+	io_cqring_add_event(req->ctx, req->sqe.user_data, res);
+	io_put_req(req);
+}
+
+static int io_req_set_file(struct io_ring_ctx *ctx, struct io_kiocb *req)
+{
+	const struct io_ring_sqe *sqe = &req->sqe;
+
+	if (sqe->flags & IOSQE_FIXED_FILE) {
+		if (!ctx->user_files || (unsigned)sqe->fd >= ctx->nr_user_files)
+			return -EBADF;
+		req->file = ctx->user_files[sqe->fd];
+		get_file(req->file);
+		return 0;
+	}
+
+	/*
+	 * The sq thread has no file table of its own, so it can only work
+	 * on registered files.
+	 */
+	if (ctx->flags & IORING_SETUP_SQPOLL)
+		return -EBADF;
+
+	req->file = fget(sqe->fd);
+	if (!req->file)
+		return -EBADF;
+	return 0;
+}
+
+static int io_prep_rw(struct io_ring_ctx *ctx, struct io_kiocb *req)
+{
+	const struct io_ring_sqe *sqe = &req->sqe;
+	u8 op = sqe->opcode;
+	int ret;
+
+	ret = io_req_set_file(ctx, req);
+	if (ret)
+		return ret;
+
+	if (op == IORING_OP_READV || op == IORING_OP_READ_FIXED) {
+		if (!(req->file->f_mode & FMODE_READ))
+			return -EBADF;
+	} else if (!(req->file->f_mode & FMODE_WRITE))
+		return -EBADF;
+
+	if (op == IORING_OP_READ_FIXED || op == IORING_OP_WRITE_FIXED) {
+		struct io_mapped_ubuf *imu;
+		u64 buf_addr = sqe->addr;
+
+		if (unlikely(!ctx->user_bufs || sqe->buf_index >= ctx->nr_user_bufs))
+			return -EFAULT;
+
+		imu = &ctx->user_bufs[sqe->buf_index];
+		if (buf_addr < imu->ubuf || buf_addr + sqe->len < buf_addr ||
+		    buf_addr + sqe->len > imu->ubuf + imu->len)
+			return -EFAULT;
+
+		req->kbuf = imu->kaddr + offset_in_page(imu->ubuf) +
+			    (buf_addr - imu->ubuf);
+	}
+	return 0;
+}
+
+static long io_do_rw(struct io_kiocb *req)
+{
+	const struct io_ring_sqe *sqe = &req->sqe;
+	void __user *buf = (void __user *)(unsigned long)sqe->addr;
+	loff_t pos = sqe->off;
+	mm_segment_t old_fs;
+	long ret;
+
+	switch (sqe->opcode) {
+	case IORING_OP_READV:
+		return vfs_readv(req->file, buf, sqe->len, &pos);
+	case IORING_OP_WRITEV:
+		return vfs_writev(req->file, buf, sqe->len, &pos);
+	case IORING_OP_READ_FIXED:
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = vfs_read(req->file, (char __user *)req->kbuf, sqe->len,
+			       &pos);
+		set_fs(old_fs);
+		return ret;
+	case IORING_OP_WRITE_FIXED:
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		ret = vfs_write(req->file, (const char __user *)req->kbuf,
+				sqe->len, &pos);
+		set_fs(old_fs);
+		return ret;
+	}
+	return -EINVAL;
+}
+
+/*
+ * A buffered read can be done by the submitter if every page it touches
+ * is in the page cache and uptodate already. Anything else might block
+ * and goes to the workers.
+ */
+static bool io_rw_cached(struct io_kiocb *req)
+{
+	const struct io_ring_sqe *sqe = &req->sqe;
+	struct file *file = req->file;
+	struct address_space *mapping = file->f_mapping;
+	pgoff_t index, end;
+	size_t len;
+
+	if (!S_ISREG(file->f_path.dentry->d_inode->i_mode) ||
+	    (file->f_flags & O_DIRECT))
+		return false;
+
+	if (sqe->opcode == IORING_OP_READ_FIXED) {
+		len = sqe->len;
+	} else if (sqe->opcode == IORING_OP_READV && sqe->len == 1) {
+		struct iovec iov;
+
+		if (copy_from_user(&iov, (void __user *)(unsigned long)sqe->addr,
+				   sizeof(iov)))
+			return false;
+		len = iov.iov_len;
+	} else
+		return false;
+
+	if (!len)
+		return false;
+
+	index = sqe->off >> PAGE_CACHE_SHIFT;
+	end = (sqe->off + len - 1) >> PAGE_CACHE_SHIFT;
+	if (end - index >= IORING_INLINE_PAGES)
+		return false;
+
+	for (; index <= end; index++) {
+		struct page *page = find_get_page(mapping, index);
+		bool uptodate;
+
+		if (!page)
+			return false;
+		uptodate = PageUptodate(page);
+		page_cache_release(page);
+		if (!uptodate)
+			return false;
+	}
+	return true;
+}
+
+static long io_do_fsync(struct io_kiocb *req)
+{
+	const struct io_ring_sqe *sqe = &req->sqe;
+	loff_t start = sqe->off;
+	loff_t end = LLONG_MAX;
+
+	if (unlikely(sqe->fsync_flags & ~IORING_FSYNC_DATASYNC))
+		return -EINVAL;
+	if (unlikely(start < 0))
+		return -EINVAL;
+
+	/* a zero length syncs everything from the offset on */
+	if (sqe->len) {
+		if (unlikely(start > LLONG_MAX - sqe->len))
+			return -EINVAL;
+		end = start + sqe->len - 1;
+	}
+
+	return vfs_fsync_range(req->file, start, end,
+			       sqe->fsync_flags & IORING_FSYNC_DATASYNC);
+}
+
+/*
+ * Worker side of read/write/fsync. Runs with the creds of the ring
+ * creator and, for requests pointing at user memory, with its mm.
+ */
+static void io_sq_wq_submit_work(struct work_struct *work)
+{
+	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
+	struct io_ring_ctx *ctx = req->ctx;
+	u8 op = req->sqe.opcode;
+	struct mm_struct *mm = NULL;
+	const struct cred *old_cred;
+	mm_segment_t old_fs;
+	long ret;
+
+	/* the ring is going away, don't start anything that may block */
+	if (ACCESS_ONCE(ctx->closing)) {
+		io_complete_req(req, -ECANCELED);
+		return;
+	}
+
+	old_cred = override_creds(ctx->creds);
+
+	if (op == IORING_OP_READV || op == IORING_OP_WRITEV) {
+		mm = io_get_mm(ctx);
+		if (!mm) {
+			ret = -EFAULT;
+			goto out;
+		}
+		old_fs = get_fs();
+		set_fs(USER_DS);
+		use_mm(mm);
+	}
+
+	if (op == IORING_OP_FSYNC)
+		ret = io_do_fsync(req);
+	else
+		ret = io_do_rw(req);
+
+	if (mm) {
+		unuse_mm(mm);
+		set_fs(old_fs);
+		mmput(mm);
+	}
+out:
+	revert_creds(old_cred);
+	io_complete_req(req, ret);
+}
+
+struct io_poll_table {
+	poll_table		pt;
+	struct io_kiocb		*req;
+	int			error;
+};
+
+static void io_poll_queue_proc(struct file *file, wait_queue_head_t *head,
+			       poll_table *p)
+{
+	struct io_poll_table *pt = container_of(p, struct io_poll_table, pt);
+
+	/* only one wait queue per request, like aio and epoll one-shot */
+	if (unlikely(pt->req->poll.head)) {
+		pt->error = -EINVAL;
+		return;
+	}
+
+	pt->req->poll.head = head;
+	add_wait_queue(head, &pt->req->poll.wait);
+}
+
+/*
+ * Called from the wakeup with the wait queue lock held. Whoever removes
+ * the entry from the wait queue owns the completion, here that means
+ * the work item.
+ */
+static int io_poll_wake(wait_queue_t *wait, unsigned mode, int sync,
+			void *key)
+{
+	struct io_kiocb *req = container_of(wait, struct io_kiocb, poll.wait);
+	unsigned long mask = (unsigned long)key;
+
+	if (mask && !(mask & req->poll.events))
+		return 0;
+
+	list_del_init(&wait->task_list);
+	queue_work(io_ring_wq, &req->work);
+	return 1;
+}
+
+static void io_poll_complete_work(struct work_struct *work)
+{
+	struct io_kiocb *req = container_of(work, struct io_kiocb, work);
+	struct io_poll_iocb *poll = &req->poll;
+	struct io_ring_ctx *ctx = req->ctx;
+	struct file *file = req->file;
+	unsigned long mask = 0;
+
+	if (!ACCESS_ONCE(poll->canceled))
+		mask = file->f_op->poll(file, NULL) & poll->events;
+
+	spin_lock_irq(&ctx->completion_lock);
+	if (!mask && !poll->canceled) {
+		/*
+		 * Spurious wakeup, rearm. Since the event may have fired
+		 * between the ->poll() above and adding ourselves back to
+		 * the queue, check once more and take the entry off again
+		 * unless the wakeup got to it first.
+		 */
+		add_wait_queue(poll->head, &poll->wait);
+		if (list_empty(&req->list))
+			list_add_tail(&req->list, &ctx->poll_list);
+		spin_unlock_irq(&ctx->completion_lock);
+
+		mask = file->f_op->poll(file, NULL) & poll->events;
+		if (!mask)
+			return;
+
+		spin_lock_irq(&ctx->completion_lock);
+		spin_lock(&poll->head->lock);
+		if (list_empty(&poll->wait.task_list)) {
+			spin_unlock(&poll->head->lock);
+			spin_unlock_irq(&ctx->completion_lock);
+			return;
+		}
+		list_del_init(&poll->wait.task_list);
+		spin_unlock(&poll->head->lock);
+	}
+	list_del_init(&req->list);
+	io_cqring_fill_event(ctx, req->sqe.user_data,
+			     mask ? (long)mask : -ECANCELED);
+	spin_unlock_irq(&ctx->completion_lock);
+
+	wake_up_interruptible(&ctx->cq_wait);
+	io_put_req(req);
+}
+
+static void io_poll_add(struct io_ring_ctx *ctx, struct io_kiocb *req)
+{
+	struct io_poll_iocb *poll = &req->poll;
+	struct io_poll_table ipt;
+	unsigned long mask;
+	bool completed = false;
+	int ret;
+
+	ret = io_req_set_file(ctx, req);
+	if (ret) {
+		io_complete_req(req, ret);
+		return;
+	}
+
+	poll->events = req->sqe.poll_events | POLLERR | POLLHUP;
+	if (!req->file->f_op->poll) {
+		io_complete_req(req, DEFAULT_POLLMASK & poll->events);
+		return;
+	}
+
+	poll->head = NULL;
+	poll->canceled = false;
+	init_waitqueue_func_entry(&poll->wait, io_poll_wake);
+	INIT_LIST_HEAD(&poll->wait.task_list);
+	INIT_WORK(&req->work, io_poll_complete_work);
+
+	/* the wakeup may complete the request before we are done here */
+	atomic_inc(&req->refs);
+
+	ipt.pt.qproc = io_poll_queue_proc;
+	ipt.pt.key = poll->events;
+	ipt.req = req;
+	ipt.error = 0;
+
+	mask = req->file->f_op->poll(req->file, &ipt.pt) & poll->events;
+
+	spin_lock_irq(&ctx->completion_lock);
+	if (poll->head) {
+		spin_lock(&poll->head->lock);
+		if (list_empty(&poll->wait.task_list)) {
+			/* woken already, the work item completes it */
+			mask = 0;
+			ipt.error = 0;
+		} else if (mask || ipt.error) {
+			list_del_init(&poll->wait.task_list);
+			completed = true;
+		} else
+			list_add_tail(&req->list, &ctx->poll_list);
+		spin_unlock(&poll->head->lock);
+	} else
+		completed = true;
+
+	if (completed)
+		io_cqring_fill_event(ctx, req->sqe.user_data,
+				     ipt.error ? ipt.error : (long)mask);
+	spin_unlock_irq(&ctx->completion_lock);
+
+	if (completed) {
+		wake_up_interruptible(&ctx->cq_wait);
+		io_put_req(req);
+	}
+	io_put_req(req);
+}
+
+static void io_poll_remove_all(struct io_ring_ctx *ctx)
+{
+	struct io_kiocb *req;
+
+	spin_lock_irq(&ctx->completion_lock);
+	list_for_each_entry(req, &ctx->poll_list, list) {
+		struct io_poll_iocb *poll = &req->poll;
+
+		spin_lock(&poll->head->lock);
+		poll->canceled = true;
+		if (!list_empty(&poll->wait.task_list)) {
+			list_del_init(&poll->wait.task_list);
+			queue_work(io_ring_wq, &req->work);
+		}
+		spin_unlock(&poll->head->lock);
+	}
+	spin_unlock_irq(&ctx->completion_lock);
+}
+
+static void io_submit_sqe(struct io_ring_ctx *ctx, const struct io_ring_sqe *s)
+{
+	struct io_kiocb *req;
+	int ret;
+
+	req = io_get_req(ctx);
+	if (unlikely(!req)) {
+		io_cqring_add_event(ctx, s->user_data, -ENOMEM);
+		return;
+	}
+
+	/* the application may change the shared sqe under us */
+	memcpy(&req->sqe, s, sizeof(req->sqe));
+
+	if (unlikely(req->sqe.flags & ~IOSQE_FIXED_FILE)) {
+		io_complete_req(req, -EINVAL);
+		return;
+	}
+
+	switch (req->sqe.opcode) {
+	case IORING_OP_NOP:
+		io_complete_req(req, 0);
+		return;
+	case IORING_OP_READV:
+	case IORING_OP_WRITEV:
+	case IORING_OP_READ_FIXED:
+	case IORING_OP_WRITE_FIXED:
+		ret = io_prep_rw(ctx, req);
+		if (ret)
+			break;
+		if (io_rw_cached(req)) {
+			io_complete_req(req, io_do_rw(req));
+			return;
+		}
+		INIT_WORK(&req->work, io_sq_wq_submit_work);
+		queue_work(io_ring_wq, &req->work);
+		return;
+	case IORING_OP_FSYNC:
+		ret = io_req_set_file(ctx, req);
+		if (ret)
+			break;
+		INIT_WORK(&req->work, io_sq_wq_submit_work);
+		queue_work(io_ring_wq, &req->work);
+		return;
+	case IORING_OP_POLL_ADD:
+		io_poll_add(ctx, req);
+		return;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	io_complete_req(req, ret);
+}
+
+static bool io_sqring_pending(struct io_ring_ctx *ctx)
+{
+	return ctx->cached_sq_head != ACCESS_ONCE(ctx->sq_ring->r.tail);
+}
+
+/*
+ * Consume up to @to_submit entries from the SQ ring. Called with
+ * uring_lock held, in the context of the ring creator's mm.
+ */
+static int io_submit_sqes(struct io_ring_ctx *ctx, unsigned int to_submit)
+{
+	struct io_sq_ring *ring = ctx->sq_ring;
+	unsigned int head = ctx->cached_sq_head;
+	unsigned int tail, submitted = 0;
+
+	tail = ACCESS_ONCE(ring->r.tail);
+	/* read the entries only after seeing the new tail */
+	smp_rmb();
+
+	while (submitted < to_submit && head != tail) {
+		unsigned int idx = ACCESS_ONCE(ring->array[head & ctx->sq_mask]);
+
+		head++;
+		if (unlikely(idx >= ctx->sq_entries)) {
+			ring->dropped++;
+			continue;
+		}
+		io_submit_sqe(ctx, &ctx->sq_sqes[idx]);
+		submitted++;
+	}
+
+	ctx->cached_sq_head = head;
+	/* we're done reading the entries, hand them back to the application */
+	smp_mb();
+	ring->r.head = head;
+
+	return submitted;
+}
+
+static int io_sq_thread(void *data)
+{
+	struct io_ring_ctx *ctx = data;
+	struct mm_struct *cur_mm = NULL;
+	const struct cred *old_cred;
+	mm_segment_t old_fs;
+	unsigned long timeout;
+	DEFINE_WAIT(wait);
+
+	old_fs = get_fs();
+	set_fs(USER_DS);
+	old_cred = override_creds(ctx->creds);
+
+	timeout = jiffies + ctx->sq_thread_idle;
+	while (!kthread_should_stop()) {
+		if (!io_sqring_pending(ctx)) {
+			if (time_before(jiffies, timeout)) {
+				cond_resched();
+				continue;
+			}
+
+			/*
+			 * Idle for a while, go to sleep and let the
+			 * application know it has to wake us up.
+			 */
+			if (cur_mm) {
+				unuse_mm(cur_mm);
+				mmput(cur_mm);
+				cur_mm = NULL;
+			}
+
+			prepare_to_wait(&ctx->sqo_wait, &wait, TASK_INTERRUPTIBLE);
+			ctx->sq_ring->flags |= IORING_SQ_NEED_WAKEUP;
+			smp_mb();
+			if (!io_sqring_pending(ctx) && !kthread_should_stop())
+				schedule();
+			finish_wait(&ctx->sqo_wait, &wait);
+			ctx->sq_ring->flags &= ~IORING_SQ_NEED_WAKEUP;
+
+			timeout = jiffies + ctx->sq_thread_idle;
+			continue;
+		}
+
+		if (!cur_mm) {
+			cur_mm = io_get_mm(ctx);
+			if (!cur_mm) {
+				/* the owner is gone, wait to be stopped */
+				set_current_state(TASK_INTERRUPTIBLE);
+				if (!kthread_should_stop())
+					schedule();
+				__set_current_state(TASK_RUNNING);
+				continue;
+			}
+			use_mm(cur_mm);
+		}
+
+		mutex_lock(&ctx->uring_lock);
+		io_submit_sqes(ctx, ctx->sq_entries);
+		mutex_unlock(&ctx->uring_lock);
+
+		timeout = jiffies + ctx->sq_thread_idle;
+	}
+
+	if (cur_mm) {
+		unuse_mm(cur_mm);
+		mmput(cur_mm);
+	}
+	revert_creds(old_cred);
+	set_fs(old_fs);
+
+	return 0;
+}
+
+static int io_sq_thread_start(struct io_ring_ctx *ctx, struct io_ring_params *p)
+{
+	int node = -1;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	ctx->sq_thread_idle = msecs_to_jiffies(p->sq_thread_idle);
+	if (!ctx->sq_thread_idle)
+		ctx->sq_thread_idle = HZ;
+
+	if (p->flags & IORING_SETUP_SQ_AFF) {
+		if (p->sq_thread_cpu >= nr_cpu_ids ||
+		    !cpu_online(p->sq_thread_cpu))
+			return -EINVAL;
+		node = cpu_to_node(p->sq_thread_cpu);
+	}
+
+	ctx->sqo_thread = kthread_create_on_node(io_sq_thread, ctx, node,
+						 "io_ring-sq");
+	if (IS_ERR(ctx->sqo_thread)) {
+		int ret = PTR_ERR(ctx->sqo_thread);
+
+		ctx->sqo_thread = NULL;
+		return ret;
+	}
+
+	if (p->flags & IORING_SETUP_SQ_AFF)
+		kthread_bind(ctx->sqo_thread, p->sq_thread_cpu);
+	wake_up_process(ctx->sqo_thread);
+	return 0;
+}
+
+static void io_sqe_files_unregister(struct io_ring_ctx *ctx)
+{
+	unsigned i;
+
+	if (!ctx->user_files)
+		return;
+
+	for (i = 0; i < ctx->nr_user_files; i++)
+		fput(ctx->user_files[i]);
+	kfree(ctx->user_files);
+	ctx->user_files = NULL;
+	ctx->nr_user_files = 0;
+}
+
+static int io_sqe_files_register(struct io_ring_ctx *ctx, void __user *arg,
+				 unsigned nr_args)
+{
+	__s32 __user *fds = (__s32 __user *)arg;
+	int ret = 0;
+	unsigned i;
+
+	if (ctx->user_files)
+		return -EBUSY;
+	if (!nr_args || nr_args > IORING_MAX_FIXED_FILES)
+		return -EINVAL;
+
+	ctx->user_files = kcalloc(nr_args, sizeof(struct file *), GFP_KERNEL);
+	if (!ctx->user_files)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_args; i++) {
+		struct file *file;
+		__s32 fd;
+
+		if (get_user(fd, &fds[i])) {
+			ret = -EFAULT;
+			break;
+		}
+		file = fget(fd);
+		if (!file) {
+			ret = -EBADF;
+			break;
+		}
+		/* a ring holding a reference to a ring could never be freed */
+		if (file->f_op == &io_ring_fops) {
+			fput(file);
+			ret = -EBADF;
+			break;
+		}
+		ctx->user_files[i] = file;
+		ctx->nr_user_files++;
+	}
+
+	if (ret)
+		io_sqe_files_unregister(ctx);
+	return ret;
+}
+
+static int io_account_pinned(struct mm_struct *mm, long nr_pages)
+{
+	unsigned long lock_limit;
+	int ret = 0;
+
+	lock_limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+	down_write(&mm->mmap_sem);
+	if (nr_pages > 0 && mm->pinned_vm + nr_pages > lock_limit &&
+	    !capable(CAP_IPC_LOCK))
+		ret = -ENOMEM;
+	else
+		mm->pinned_vm += nr_pages;
+	up_write(&mm->mmap_sem);
+
+	return ret;
+}
+
+static void *io_alloc_array(size_t nr, size_t size)
+{
+	if (nr * size <= PAGE_SIZE)
+		return kcalloc(nr, size, GFP_KERNEL);
+	return vzalloc(nr * size);
+}
+
+static void io_free_array(void *ptr)
+{
+	if (is_vmalloc_addr(ptr))
+		vfree(ptr);
+	else
+		kfree(ptr);
+}
+
+static void io_unmap_ubuf(struct io_ring_ctx *ctx, struct io_mapped_ubuf *imu)
+{
+	unsigned i;
+
+	if (imu->kaddr)
+		vunmap(imu->kaddr);
+	for (i = 0; i < imu->nr_pages; i++) {
+		/* we may have written to the pages behind the vmap */
+		set_page_dirty_lock(imu->pages[i]);
+		put_page(imu->pages[i]);
+	}
+	io_account_pinned(ctx->sqo_mm, -(long)imu->nr_pages);
+	io_free_array(imu->pages);
+}
+
+static void io_sqe_buffer_unregister(struct io_ring_ctx *ctx)
+{
+	unsigned i;
+
+	if (!ctx->user_bufs)
+		return;
+
+	for (i = 0; i < ctx->nr_user_bufs; i++)
+		io_unmap_ubuf(ctx, &ctx->user_bufs[i]);
+	kfree(ctx->user_bufs);
+	ctx->user_bufs = NULL;
+	ctx->nr_user_bufs = 0;
+}
+
+static int io_map_ubuf(struct io_ring_ctx *ctx, struct io_mapped_ubuf *imu,
+		       const struct iovec *iov)
+{
+	unsigned long ubuf = (unsigned long)iov->iov_base;
+	unsigned long start, end;
+	struct vm_area_struct **vmas;
+	struct page **pages;
+	int i, nr_pages, pret;
+	int ret;
+
+	if (!iov->iov_len || iov->iov_len > IORING_MAX_BUF_SIZE)
+		return -EINVAL;
+	if (ubuf + iov->iov_len < ubuf)
+		return -EFAULT;
+
+	start = ubuf >> PAGE_SHIFT;
+	end = (ubuf + iov->iov_len + PAGE_SIZE - 1) >> PAGE_SHIFT;
+	nr_pages = end - start;
+
+	ret = io_account_pinned(current->mm, nr_pages);
+	if (ret)
+		return ret;
+
+	ret = -ENOMEM;
+	pages = io_alloc_array(nr_pages, sizeof(struct page *));
+	vmas = io_alloc_array(nr_pages, sizeof(struct vm_area_struct *));
+	if (!pages || !vmas)
+		goto err;
+
+	down_read(&current->mm->mmap_sem);
+	pret = get_user_pages(current, current->mm, ubuf & PAGE_MASK, nr_pages,
+			      1, 0, pages, vmas);
+	ret = 0;
+	if (pret == nr_pages) {
+		/*
+		 * Page cache pages written behind the back of the file
+		 * system are asking for trouble, only anonymous memory
+		 * can be registered.
+		 */
+		for (i = 0; i < nr_pages; i++) {
+			if (vmas[i]->vm_file) {
+				ret = -EOPNOTSUPP;
+				break;
+			}
+		}
+	} else
+		ret = pret < 0 ? pret : -EFAULT;
+	up_read(&current->mm->mmap_sem);
+
+	if (ret) {
+		for (i = 0; i < pret; i++)
+			put_page(pages[i]);
+		goto err;
+	}
+
+	imu->kaddr = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (!imu->kaddr) {
+		for (i = 0; i < nr_pages; i++)
+			put_page(pages[i]);
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	io_free_array(vmas);
+	imu->ubuf = ubuf;
+	imu->len = iov->iov_len;
+	imu->pages = pages;
+	imu->nr_pages = nr_pages;
+	return 0;
+
+err:
+	io_free_array(vmas);
+	io_free_array(pages);
+	io_account_pinned(current->mm, -(long)nr_pages);
+	return ret;
+}
+
+static int io_sqe_buffer_register(struct io_ring_ctx *ctx, void __user *arg,
+				  unsigned nr_args)
+{
+	struct iovec __user *uiov = arg;
+	int ret = 0;
+	unsigned i;
+
+	if (ctx->user_bufs)
+		return -EBUSY;
+	/* the pages are pinned in, and accounted to, the creator's mm */
+	if (current->mm != ctx->sqo_mm)
+		return -EPERM;
+	if (!nr_args || nr_args > IORING_MAX_FIXED_BUFS)
+		return -EINVAL;
+
+	ctx->user_bufs = kcalloc(nr_args, sizeof(struct io_mapped_ubuf),
+				 GFP_KERNEL);
+	if (!ctx->user_bufs)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_args; i++) {
+		struct iovec iov;
+
+		if (copy_from_user(&iov, &uiov[i], sizeof(iov))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = io_map_ubuf(ctx, &ctx->user_bufs[i], &iov);
+		if (ret)
+			break;
+		ctx->nr_user_bufs++;
+	}
+
+	if (ret)
+		io_sqe_buffer_unregister(ctx);
+	return ret;
+}
+
+static void io_ring_ctx_free(struct io_ring_ctx *ctx)
+{
+	io_sqe_files_unregister(ctx);
+	io_sqe_buffer_unregister(ctx);
+
+	io_mem_free(ctx->sq_ring, ctx->sq_ring_size);
+	io_mem_free(ctx->sq_sqes, ctx->sqes_size);
+	io_mem_free(ctx->cq_ring, ctx->cq_ring_size);
+
+	mmdrop(ctx->sqo_mm);
+	put_cred(ctx->creds);
+	kfree(ctx);
+}
+
+static int io_ring_release(struct inode *inode, struct file *file)
+{
+	struct io_ring_ctx *ctx = file->private_data;
+
+	bool orphaned;
+
+	file->private_data = NULL;
+
+	if (ctx->sqo_thread)
+		kthread_stop(ctx->sqo_thread);
+
+	/*
+	 * Nothing can submit anymore, flush out what is still in flight:
+	 * polls and requests the workers have not started yet are
+	 * canceled.
+	 */
+	ctx->closing = true;
+	smp_mb();
+	io_poll_remove_all(ctx);
+	io_ring_ctx_put(ctx);
+
+	/*
+	 * A request a worker already runs may block forever, e.g. reading
+	 * from a pipe nobody writes to. Don't keep the closing task in D
+	 * state for it: if the task is killed, leave the ring to the last
+	 * request.
+	 */
+	wait_for_completion_killable(&ctx->done);
+
+	spin_lock_irq(&ctx->completion_lock);
+	orphaned = atomic_read(&ctx->refs) != 0;
+	ctx->orphaned = orphaned;
+	spin_unlock_irq(&ctx->completion_lock);
+
+	if (!orphaned)
+		io_ring_ctx_free(ctx);
+	return 0;
+}
+
+/*
+ * Wait for all requests in flight to finish, so the registered files
+ * and buffers can be changed. Called with uring_lock held, which keeps
+ * new submissions out.
+ */
+static int io_ring_quiesce(struct io_ring_ctx *ctx)
+{
+	bool drained;
+	int ret;
+
+	if (!atomic_dec_and_test(&ctx->refs)) {
+		ret = wait_for_completion_interruptible(&ctx->done);
+		if (ret) {
+			/*
+			 * Interrupted: take the file's reference back. If
+			 * the last request went away meanwhile, ->done has
+			 * already fired under completion_lock and we are
+			 * drained after all.
+			 */
+			spin_lock_irq(&ctx->completion_lock);
+			drained = atomic_inc_return(&ctx->refs) == 1;
+			spin_unlock_irq(&ctx->completion_lock);
+			if (!drained)
+				return ret;
+		}
+	}
+
+	INIT_COMPLETION(ctx->done);
+	atomic_set(&ctx->refs, 1);
+	return 0;
+}
+
+static unsigned int io_ring_poll(struct file *file, poll_table *wait)
+{
+	struct io_ring_ctx *ctx = file->private_data;
+	unsigned int mask = 0;
+
+	poll_wait(file, &ctx->cq_wait, wait);
+	smp_rmb();
+	if (ACCESS_ONCE(ctx->sq_ring->r.tail) - ctx->cached_sq_head !=
+	    ctx->sq_entries)
+		mask |= POLLOUT | POLLWRNORM;
+	if (io_cqring_events(ctx))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+static int io_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	loff_t offset = (loff_t) vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long sz = vma->vm_end - vma->vm_start;
+	struct io_ring_ctx *ctx = file->private_data;
+	void *ptr;
+	size_t size;
+
+	switch (offset) {
+	case IORING_OFF_SQ_RING:
+		ptr = ctx->sq_ring;
+		size = ctx->sq_ring_size;
+		break;
+	case IORING_OFF_SQES:
+		ptr = ctx->sq_sqes;
+		size = ctx->sqes_size;
+		break;
+	case IORING_OFF_CQ_RING:
+		ptr = ctx->cq_ring;
+		size = ctx->cq_ring_size;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (sz > PAGE_ALIGN(size))
+		return -EINVAL;
+
+	return remap_pfn_range(vma, vma->vm_start, virt_to_phys(ptr) >> PAGE_SHIFT,
+			       sz, vma->vm_page_prot);
+}
+
+static const struct file_operations io_ring_fops = {
+	.release	= io_ring_release,
+	.mmap		= io_ring_mmap,
+	.poll		= io_ring_poll,
+	.llseek		= noop_llseek,
+};
+
+static int io_allocate_rings(struct io_ring_ctx *ctx, struct io_ring_params *p)
+{
+	ctx->sq_ring_size = sizeof(struct io_sq_ring) +
+			    p->sq_entries * sizeof(u32);
+	ctx->sqes_size = p->sq_entries * sizeof(struct io_ring_sqe);
+	ctx->cq_ring_size = sizeof(struct io_cq_ring) +
+			    p->cq_entries * sizeof(struct io_ring_cqe);
+
+	ctx->sq_ring = io_mem_alloc(ctx->sq_ring_size);
+	ctx->sq_sqes = io_mem_alloc(ctx->sqes_size);
+	ctx->cq_ring = io_mem_alloc(ctx->cq_ring_size);
+	if (!ctx->sq_ring || !ctx->sq_sqes || !ctx->cq_ring)
+		return -ENOMEM;
+
+	ctx->sq_entries = ctx->sq_ring->ring_entries = p->sq_entries;
+	ctx->sq_mask = ctx->sq_ring->ring_mask = p->sq_entries - 1;
+	ctx->cq_entries = ctx->cq_ring->ring_entries = p->cq_entries;
+	ctx->cq_mask = ctx->cq_ring->ring_mask = p->cq_entries - 1;
+
+	memset(&p->sq_off, 0, sizeof(p->sq_off));
+	p->sq_off.head = offsetof(struct io_sq_ring, r.head);
+	p->sq_off.tail = offsetof(struct io_sq_ring, r.tail);
+	p->sq_off.ring_mask = offsetof(struct io_sq_ring, ring_mask);
+	p->sq_off.ring_entries = offsetof(struct io_sq_ring, ring_entries);
+	p->sq_off.flags = offsetof(struct io_sq_ring, flags);
+	p->sq_off.dropped = offsetof(struct io_sq_ring, dropped);
+	p->sq_off.array = offsetof(struct io_sq_ring, array);
+
+	memset(&p->cq_off, 0, sizeof(p->cq_off));
+	p->cq_off.head = offsetof(struct io_cq_ring, r.head);
+	p->cq_off.tail = offsetof(struct io_cq_ring, r.tail);
+	p->cq_off.ring_mask = offsetof(struct io_cq_ring, ring_mask);
+	p->cq_off.ring_entries = offsetof(struct io_cq_ring, ring_entries);
+	p->cq_off.overflow = offsetof(struct io_cq_ring, overflow);
+	p->cq_off.cqes = offsetof(struct io_cq_ring, cqes);
+	return 0;
+}
+
+static int io_ring_create(unsigned entries, struct io_ring_params *p)
+{
+	struct io_ring_ctx *ctx;
+	int ret;
+
+	if (!entries || entries > IORING_MAX_ENTRIES)
+		return -EINVAL;
+	if (!current->mm)
+		return -EINVAL;
+
+	/*
+	 * The CQ ring is twice the size of the SQ ring, so that requests
+	 * still in flight don't overflow it while the SQ ring refills.
+	 */
+	p->sq_entries = roundup_pow_of_two(entries);
+	p->cq_entries = 2 * p->sq_entries;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->flags = p->flags;
+	atomic_set(&ctx->refs, 1);
+	init_completion(&ctx->done);
+	mutex_init(&ctx->uring_lock);
+	spin_lock_init(&ctx->completion_lock);
+	init_waitqueue_head(&ctx->cq_wait);
+	init_waitqueue_head(&ctx->sqo_wait);
+	INIT_LIST_HEAD(&ctx->poll_list);
+
+	ctx->sqo_mm = current->mm;
+	atomic_inc(&ctx->sqo_mm->mm_count);
+	ctx->creds = get_current_cred();
+
+	ret = io_allocate_rings(ctx, p);
+	if (ret)
+		goto err;
+
+	if (p->flags & IORING_SETUP_SQPOLL) {
+		ret = io_sq_thread_start(ctx, p);
+		if (ret)
+			goto err;
+	}
+
+	ret = anon_inode_getfd("[io_ring]", &io_ring_fops, ctx,
+			       O_RDWR | O_CLOEXEC);
+	if (ret < 0)
+		goto err_thread;
+	return ret;
+
+err_thread:
+	if (ctx->sqo_thread)
+		kthread_stop(ctx->sqo_thread);
+err:
+	io_ring_ctx_free(ctx);
+	return ret;
+}
+
+/*
+ * Sets up an io_ring context and returns the fd. The application asks
+ * for a ring size, and the kernel fills in the offsets of the ring
+ * fields for the subsequent mmap(2) calls.
+ */
+SYSCALL_DEFINE2(io_ring_setup, u32, entries,
+		struct io_ring_params __user *, params)
+{
+	struct io_ring_params p;
+	long ret;
+	int i;
+
+	if (copy_from_user(&p, params, sizeof(p)))
+		return -EFAULT;
+	for (i = 0; i < ARRAY_SIZE(p.resv); i++) {
+		if (p.resv[i])
+			return -EINVAL;
+	}
+	if (p.flags & ~(IORING_SETUP_SQPOLL | IORING_SETUP_SQ_AFF))
+		return -EINVAL;
+
+	ret = io_ring_create(entries, &p);
+	if (ret < 0)
+		return ret;
+
+	if (copy_to_user(params, &p, sizeof(p))) {
+		/* the fd is installed, closing it tears the ring down */
+		sys_close(ret);
+		return -EFAULT;
+	}
+	return ret;
+}
+
+SYSCALL_DEFINE4(io_ring_enter, unsigned int, fd, u32, to_submit,
+		u32, min_complete, u32, flags)
+{
+	struct io_ring_ctx *ctx;
+	struct file *f;
+	long ret = 0;
+	int submitted = 0;
+
+	if (flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_SQ_WAKEUP))
+		return -EINVAL;
+
+	f = fget(fd);
+	if (!f)
+		return -EBADF;
+
+	ret = -EOPNOTSUPP;
+	if (f->f_op != &io_ring_fops)
+		goto out_fput;
+	ctx = f->private_data;
+	ret = 0;
+
+	/*
+	 * For SQ polling, the thread will do all submissions and
+	 * completions. Just return the requested submit count, and wake
+	 * the thread if we were asked to.
+	 */
+	if (ctx->flags & IORING_SETUP_SQPOLL) {
+		if (flags & IORING_ENTER_SQ_WAKEUP)
+			wake_up(&ctx->sqo_wait);
+		submitted = to_submit;
+	} else if (to_submit) {
+		/* the workers would look at the wrong address space */
+		ret = -EPERM;
+		if (current->mm != ctx->sqo_mm)
+			goto out_fput;
+		ret = 0;
+
+		mutex_lock(&ctx->uring_lock);
+		submitted = io_submit_sqes(ctx, to_submit);
+		mutex_unlock(&ctx->uring_lock);
+	}
+
+	if (flags & IORING_ENTER_GETEVENTS) {
+		min_complete = min(min_complete, ctx->cq_entries);
+		ret = wait_event_interruptible(ctx->cq_wait,
+				io_cqring_events(ctx) >= min_complete);
+	}
+
+out_fput:
+	fput(f);
+	return submitted ? submitted : ret;
+}
+
+SYSCALL_DEFINE4(io_ring_register, unsigned int, fd, unsigned int, opcode,
+		void __user *, arg, unsigned int, nr_args)
+{
+	struct io_ring_ctx *ctx;
+	struct file *f;
+	long ret;
+
+	f = fget(fd);
+	if (!f)
+		return -EBADF;
+
+	ret = -EOPNOTSUPP;
+	if (f->f_op != &io_ring_fops)
+		goto out_fput;
+	ctx = f->private_data;
+
+	mutex_lock(&ctx->uring_lock);
+	ret = io_ring_quiesce(ctx);
+	if (ret)
+		goto out_unlock;
+
+	switch (opcode) {
+	case IORING_REGISTER_BUFFERS:
+		ret = io_sqe_buffer_register(ctx, arg, nr_args);
+		break;
+	case IORING_UNREGISTER_BUFFERS:
+		ret = -EINVAL;
+		if (arg || nr_args)
+			break;
+		ret = -ENXIO;
+		if (!ctx->user_bufs)
+			break;
+		io_sqe_buffer_unregister(ctx);
+		ret = 0;
+		break;
+	case IORING_REGISTER_FILES:
+		ret = io_sqe_files_register(ctx, arg, nr_args);
+		break;
+	case IORING_UNREGISTER_FILES:
+		ret = -EINVAL;
+		if (arg || nr_args)
+			break;
+		ret = -ENXIO;
+		if (!ctx->user_files)
+			break;
+		io_sqe_files_unregister(ctx);
+		ret = 0;
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+out_unlock:
+	mutex_unlock(&ctx->uring_lock);
+out_fput:
+	fput(f);
+	return ret;
+}
+
+static int __init io_ring_init(void)
+{
+	req_cachep = KMEM_CACHE(io_kiocb, SLAB_HWCACHE_ALIGN | SLAB_PANIC);
+
+	/* the worker pool for everything that may block */
+	io_ring_wq = alloc_workqueue("io_ring", WQ_UNBOUND | WQ_NON_REENTRANT,
+				     0);
+	BUG_ON(!io_ring_wq);
+	return 0;
+}
+__initcall(io_ring_init);
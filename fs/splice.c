@@ -25,6 +25,7 @@
 #include <linux/mm_inline.h>
 #include <linux/swap.h>
 #include <linux/writeback.h>
+#include <linux/backing-dev.h>
 #include <linux/buffer_head.h>
 #include <linux/module.h>
 #include <linux/syscalls.h>
@@ -712,10 +713,72 @@ static int pipe_to_sendpage(struct pipe_inode_info *pipe,
  * If asked to move pages to the output file (SPLICE_F_MOVE is set in
  * sd->flags), we attempt to migrate pages from the pipe to the output
  * file address space page cache. This is possible if no one else has
- * the pipe page referenced outside of the pipe and page cache. If
- * SPLICE_F_MOVE isn't set, or we cannot move the page, we simply create
- * a new page in the output file page cache and fill/dirty that.
+ * the pipe page referenced outside of the pipe, the page is not on an
+ * LRU list yet (socket payload pages, mostly) and it is appended past
+ * the current end of file. ->write_begin() then finds the moved page in
+ * the page cache and no copy is needed. If SPLICE_F_MOVE isn't set, or
+ * we cannot move the page, we simply create a new page in the output
+ * file page cache and fill/dirty that.
  */
+static int pipe_to_file_move(struct pipe_inode_info *pipe,
+			     struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct address_space *mapping = sd->u.file->f_mapping;
+	struct page *page = buf->page;
+	gfp_t gfp_mask = mapping_gfp_mask(mapping) & GFP_KERNEL;
+	int ret;
+
+	/*
+	 * Only a full, page aligned page can become a page cache page. We
+	 * also insist on it landing beyond the current end of file: until
+	 * ->write_end() has moved i_size over it, nobody can read or fault
+	 * in the new data, so a failing ->write_begin() can simply drop the
+	 * page again.
+	 */
+	if (buf->offset || sd->len != PAGE_CACHE_SIZE ||
+	    (sd->pos & ~PAGE_CACHE_MASK))
+		return 1;
+	if (sd->pos < i_size_read(mapping->host))
+		return 1;
+	if (mapping_cap_swap_backed(mapping))
+		return 1;
+	if (PageHighMem(page) && !(gfp_mask & __GFP_HIGHMEM))
+		return 1;
+
+	/*
+	 * Pages already on an LRU list belong to some page cache or to user
+	 * space, and stealing them would have side effects on their owner
+	 * even if we end up copying. Leave those alone.
+	 */
+	if (PageLRU(page))
+		return 1;
+
+	if (buf->ops->steal(pipe, buf))
+		return 1;
+
+	/*
+	 * The page is now locked and ours. Make sure it really is an
+	 * anonymous kernel page before handing it to the file system.
+	 */
+	if ((buf->flags & PIPE_BUF_FLAG_LRU) || page->mapping ||
+	    PageSwapBacked(page) || PageLRU(page))
+		goto out_unlock;
+
+	ret = add_to_page_cache_locked(page, mapping,
+				       sd->pos >> PAGE_CACHE_SHIFT, gfp_mask);
+	if (ret)
+		goto out_unlock;
+
+	lru_cache_add_file(page);
+	SetPageUptodate(page);
+	unlock_page(page);
+	return 0;
+
+out_unlock:
+	unlock_page(page);
+	return 1;
+}
+
 int pipe_to_file(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
 		 struct splice_desc *sd)
 {
@@ -724,6 +787,7 @@ int pipe_to_file(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
 	unsigned int offset, this_len;
 	struct page *page;
 	void *fsdata;
+	bool moved = false;
 	int ret;
 
 	offset = sd->pos & ~PAGE_CACHE_MASK;
@@ -732,10 +796,24 @@ int pipe_to_file(struct pipe_inode_info *pipe, struct pipe_buffer *buf,
 	if (this_len + offset > PAGE_CACHE_SIZE)
 		this_len = PAGE_CACHE_SIZE - offset;
 
+	if ((sd->flags & SPLICE_F_MOVE) && !pipe_to_file_move(pipe, buf, sd))
+		moved = true;
+
 	ret = pagecache_write_begin(file, mapping, sd->pos, this_len,
 				AOP_FLAG_UNINTERRUPTIBLE, &page, &fsdata);
-	if (unlikely(ret))
+	if (unlikely(ret)) {
+		/*
+		 * The moved page sits beyond i_size and nobody has seen
+		 * it yet, get it out of the page cache again.
+		 */
+		if (moved) {
+			lock_page(buf->page);
+			if (buf->page->mapping == mapping)
+				truncate_inode_page(mapping, buf->page);
+			unlock_page(buf->page);
+		}
 		goto out;
+	}
 
 	if (buf->page != page) {
 		/*
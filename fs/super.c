@@ -32,6 +32,7 @@
 #include <linux/backing-dev.h>
 #include <linux/rculist_bl.h>
 #include <linux/cleancache.h>
+#include <linux/memcontrol.h>
 #include "internal.h"
 
 
@@ -45,11 +46,26 @@ DEFINE_SPINLOCK(sb_lock);
  * shrinker path and that leads to deadlock on the shrinker_rwsem. Hence we
  * take a passive reference to the superblock to avoid this from occurring.
  */
+/*
+ * For memcg reclaim, only the unused dentries and inodes charged to the
+ * memcg count.  They are not tracked per superblock, so their number is
+ * bounded by the number of unused objects of the superblock.
+ */
+static int sb_nr_unused(int nr, struct mem_cgroup *memcg,
+			enum mem_cgroup_kmem_lru lru)
+{
+	if (memcg)
+		nr = min_t(unsigned long, nr,
+			   mem_cgroup_kmem_lru_size(memcg, lru));
+	return nr;
+}
+
 static int prune_super(struct shrinker *shrink, struct shrink_control *sc)
 {
 	struct super_block *sb;
 	int	fs_objects = 0;
 	int	total_objects;
+	int	nr_dentry, nr_inode;
 
 	sb = container_of(shrink, struct super_block, s_shrink);
 
@@ -63,21 +79,23 @@ static int prune_super(struct shrinker *shrink, struct shrink_control *sc)
 	if (!grab_super_passive(sb))
 		return !sc->nr_to_scan ? 0 : -1;
 
-	if (sb->s_op && sb->s_op->nr_cached_objects)
+	/* The filesystem specific caches are not accounted to memcgs */
+	if (sb->s_op && sb->s_op->nr_cached_objects && !sc->memcg)
 		fs_objects = sb->s_op->nr_cached_objects(sb);
 
-	total_objects = sb->s_nr_dentry_unused +
-			sb->s_nr_inodes_unused + fs_objects + 1;
+	nr_dentry = sb_nr_unused(sb->s_nr_dentry_unused, sc->memcg,
+				 MEMCG_KMEM_LRU_DENTRY);
+	nr_inode = sb_nr_unused(sb->s_nr_inodes_unused, sc->memcg,
+				MEMCG_KMEM_LRU_INODE);
+	total_objects = nr_dentry + nr_inode + fs_objects + 1;
 
 	if (sc->nr_to_scan) {
 		int	dentries;
 		int	inodes;
 
 		/* proportion the scan between the caches */
-		dentries = (sc->nr_to_scan * sb->s_nr_dentry_unused) /
-							total_objects;
-		inodes = (sc->nr_to_scan * sb->s_nr_inodes_unused) /
-							total_objects;
+		dentries = (sc->nr_to_scan * nr_dentry) / total_objects;
+		inodes = (sc->nr_to_scan * nr_inode) / total_objects;
 		if (fs_objects)
 			fs_objects = (sc->nr_to_scan * fs_objects) /
 							total_objects;
@@ -85,15 +103,18 @@ static int prune_super(struct shrinker *shrink, struct shrink_control *sc)
 		 * prune the dcache first as the icache is pinned by it, then
 		 * prune the icache, followed by the filesystem specific caches
 		 */
-		prune_dcache_sb(sb, dentries);
-		prune_icache_sb(sb, inodes);
+		prune_dcache_sb(sb, dentries, sc->memcg);
+		prune_icache_sb(sb, inodes, sc->memcg);
 
 		if (fs_objects && sb->s_op->free_cached_objects) {
 			sb->s_op->free_cached_objects(sb, fs_objects);
 			fs_objects = sb->s_op->nr_cached_objects(sb);
 		}
-		total_objects = sb->s_nr_dentry_unused +
-				sb->s_nr_inodes_unused + fs_objects;
+		nr_dentry = sb_nr_unused(sb->s_nr_dentry_unused, sc->memcg,
+					 MEMCG_KMEM_LRU_DENTRY);
+		nr_inode = sb_nr_unused(sb->s_nr_inodes_unused, sc->memcg,
+					MEMCG_KMEM_LRU_INODE);
+		total_objects = nr_dentry + nr_inode + fs_objects;
 	}
 
 	total_objects = (total_objects / 100) * sysctl_vfs_cache_pressure;
@@ -183,6 +204,7 @@ static struct super_block *alloc_super(struct file_system_type *type)
 		s->s_shrink.seeks = DEFAULT_SEEKS;
 		s->s_shrink.shrink = prune_super;
 		s->s_shrink.batch = 1024;
+		s->s_shrink.flags = SHRINKER_MEMCG_AWARE;
 	}
 out:
 	return s;
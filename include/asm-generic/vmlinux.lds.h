@@ -615,31 +615,31 @@
 		*(.init.setup)						\
 		VMLINUX_SYMBOL(__setup_end) = .;
 
+#define INIT_CALLS_LEVEL(level)						\
+		VMLINUX_SYMBOL(__initcall##level##_start) = .;		\
+		*(.initcall##level##.init)				\
+		*(.initcall##level##s.init)
+
 #define INITCALLS							\
 	*(.initcallearly.init)						\
-	VMLINUX_SYMBOL(__early_initcall_end) = .;			\
-  	*(.initcall0.init)						\
-  	*(.initcall0s.init)						\
-  	*(.initcall1.init)						\
-  	*(.initcall1s.init)						\
-  	*(.initcall2.init)						\
-  	*(.initcall2s.init)						\
-  	*(.initcall3.init)						\
-  	*(.initcall3s.init)						\
-  	*(.initcall4.init)						\
-  	*(.initcall4s.init)						\
-  	*(.initcall5.init)						\
-  	*(.initcall5s.init)						\
+	INIT_CALLS_LEVEL(0)						\
+	INIT_CALLS_LEVEL(1)						\
+	INIT_CALLS_LEVEL(2)						\
+	INIT_CALLS_LEVEL(3)						\
+	INIT_CALLS_LEVEL(4)						\
+	INIT_CALLS_LEVEL(5)						\
 	*(.initcallrootfs.init)						\
-  	*(.initcall6.init)						\
-  	*(.initcall6s.init)						\
-  	*(.initcall7.init)						\
-  	*(.initcall7s.init)
+	INIT_CALLS_LEVEL(6)						\
+	INIT_CALLS_LEVEL(7)
 
 #define INIT_CALLS							\
 		VMLINUX_SYMBOL(__initcall_start) = .;			\
 		INITCALLS						\
-		VMLINUX_SYMBOL(__initcall_end) = .;
+		VMLINUX_SYMBOL(__initcall_end) = .;			\
+		. = ALIGN(8);						\
+		VMLINUX_SYMBOL(__parallel_initcall_start) = .;		\
+		*(.initcall.parallel.init)				\
+		VMLINUX_SYMBOL(__parallel_initcall_end) = .;
 
 #define CON_INITCALL							\
 		VMLINUX_SYMBOL(__con_initcall_start) = .;		\
@@ -121,6 +121,8 @@ int bdi_setup_and_register(struct backing_dev_info *, char *, unsigned int);
 void bdi_start_writeback(struct backing_dev_info *bdi, long nr_pages,
 			enum wb_reason reason);
 void bdi_start_background_writeback(struct backing_dev_info *bdi);
+int bdi_start_memcg_writeback(struct backing_dev_info *bdi, unsigned short id);
+bool bdi_has_memcg_dirty_io(struct backing_dev_info *bdi, unsigned short id);
 int bdi_writeback_thread(void *data);
 int bdi_has_dirty_io(struct backing_dev_info *bdi);
 void bdi_arm_supers_timer(void);
@@ -2,6 +2,7 @@
 #define _LINUX_INIT_H
 
 #include <linux/compiler.h>
+#include <linux/types.h>
 
 /* These macros are used to mark some functions or 
  * initialized data (doesn't apply to uninitialized data)
@@ -213,6 +214,57 @@ extern int initcall_debug;
 
 #define __initcall(fn) device_initcall(fn)
 
+/*
+ * A parallel initcall is not run in link order.  Instead it is started
+ * on a worker thread as soon as the listed initcalls of its own level
+ * have returned, and runs concurrently with the rest of that level on
+ * all online CPUs.  The level as a whole still completes before the
+ * next level starts, so dependencies on earlier levels are implicit.
+ *
+ * The dependencies must themselves be parallel initcalls, and the
+ * initcall must not be relied upon by anything else in its level.
+ */
+struct parallel_initcall {
+	initcall_t		fn;
+	const initcall_t	*deps;
+	unsigned int		nr_deps;
+	int			level;
+
+	/* state of the current run, private to init/main.c */
+	struct list_head	list;
+	atomic_t		pending;
+	bool			serial;
+	u64			queued;
+};
+
+#define __define_parallel_initcall(lvl, func, depfns...)		\
+	static const initcall_t __parallel_deps_##func[] __initconst =	\
+		{ depfns };						\
+	static struct parallel_initcall __parallel_initcall_##func	\
+		__used __section(.initcall.parallel.init)		\
+		__attribute__((aligned((sizeof(long))))) = {		\
+		.fn = func,						\
+		.deps = __parallel_deps_##func,				\
+		.nr_deps = sizeof(__parallel_deps_##func) /		\
+			   sizeof(initcall_t),				\
+		.level = lvl,						\
+	}
+
+#define core_initcall_parallel(fn, deps...)			\
+	__define_parallel_initcall(1, fn, deps)
+#define postcore_initcall_parallel(fn, deps...)			\
+	__define_parallel_initcall(2, fn, deps)
+#define arch_initcall_parallel(fn, deps...)			\
+	__define_parallel_initcall(3, fn, deps)
+#define subsys_initcall_parallel(fn, deps...)			\
+	__define_parallel_initcall(4, fn, deps)
+#define fs_initcall_parallel(fn, deps...)			\
+	__define_parallel_initcall(5, fn, deps)
+#define device_initcall_parallel(fn, deps...)			\
+	__define_parallel_initcall(6, fn, deps)
+#define late_initcall_parallel(fn, deps...)			\
+	__define_parallel_initcall(7, fn, deps)
+
 #define __exitcall(fn) \
 	static exitcall_t __exitcall_##fn __exit_call = fn
 
@@ -297,6 +349,14 @@ void __init parse_early_options(char *cmdline);
 #define device_initcall(fn)		module_init(fn)
 #define late_initcall(fn)		module_init(fn)
 
+#define core_initcall_parallel(fn, deps...)	module_init(fn)
+#define postcore_initcall_parallel(fn, deps...)	module_init(fn)
+#define arch_initcall_parallel(fn, deps...)	module_init(fn)
+#define subsys_initcall_parallel(fn, deps...)	module_init(fn)
+#define fs_initcall_parallel(fn, deps...)	module_init(fn)
+#define device_initcall_parallel(fn, deps...)	module_init(fn)
+#define late_initcall_parallel(fn, deps...)	module_init(fn)
+
 #define security_initcall(fn)		module_init(fn)
 
 /* Each module must use one module_init(). */
@@ -21,15 +21,32 @@
 #define _LINUX_MEMCONTROL_H
 #include <linux/cgroup.h>
 #include <linux/vm_event_item.h>
+#include <linux/jump_label.h>
+#include <linux/workqueue.h>
 
 struct mem_cgroup;
 struct page_cgroup;
 struct page;
 struct mm_struct;
+struct address_space;
+struct backing_dev_info;
 
 /* Stats that can be updated by kernel. */
 enum mem_cgroup_page_stat_item {
 	MEMCG_NR_FILE_MAPPED, /* # of pages charged as file rss */
+	MEMCG_NR_FILE_DIRTY, /* # of dirty pages in page cache */
+	MEMCG_NR_FILE_WRITEBACK, /* # of pages under writeback */
+};
+
+/*
+ * Dirty page state and dirty thresholds of a memory cgroup, in pages,
+ * as used by balance_dirty_pages().
+ */
+struct mem_cgroup_dirty_info {
+	unsigned long background_thresh;
+	unsigned long dirty_thresh;
+	unsigned long nr_reclaimable;	/* = file_dirty */
+	unsigned long nr_dirty;		/* = file_dirty + writeback */
 };
 
 extern unsigned long mem_cgroup_isolate_pages(unsigned long nr_to_scan,
@@ -147,6 +164,14 @@ static inline void mem_cgroup_dec_page_stat(struct page *page,
 	mem_cgroup_update_page_stat(page, idx, -1);
 }
 
+bool mem_cgroup_dirty_info(struct mem_cgroup_dirty_info *info);
+void mem_cgroup_start_writeback(struct backing_dev_info *bdi);
+bool mem_cgroup_over_bground_thresh(unsigned short id);
+void mem_cgroup_writeback_done(unsigned short id);
+bool mem_cgroup_mapping_dirtied_by(struct address_space *mapping,
+				   unsigned short id);
+void mem_cgroup_mapping_clean(struct address_space *mapping);
+
 unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 						gfp_t gfp_mask,
 						unsigned long *total_scanned);
@@ -343,6 +368,34 @@ static inline void mem_cgroup_dec_page_stat(struct page *page,
 {
 }
 
+static inline bool mem_cgroup_dirty_info(struct mem_cgroup_dirty_info *info)
+{
+	return false;
+}
+
+static inline void mem_cgroup_start_writeback(struct backing_dev_info *bdi)
+{
+}
+
+static inline bool mem_cgroup_over_bground_thresh(unsigned short id)
+{
+	return false;
+}
+
+static inline void mem_cgroup_writeback_done(unsigned short id)
+{
+}
+
+static inline bool mem_cgroup_mapping_dirtied_by(struct address_space *mapping,
+						 unsigned short id)
+{
+	return true;
+}
+
+static inline void mem_cgroup_mapping_clean(struct address_space *mapping)
+{
+}
+
 static inline
 unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 					    gfp_t gfp_mask,
@@ -381,5 +434,122 @@ mem_cgroup_print_bad_page(struct page *page)
 }
 #endif
 
+/* Unused dentries and inodes, which the memcg aware sb shrinker frees */
+enum mem_cgroup_kmem_lru {
+	MEMCG_KMEM_LRU_DENTRY,
+	MEMCG_KMEM_LRU_INODE,
+	NR_MEMCG_KMEM_LRU,
+};
+
+struct kmem_cache;
+
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+/*
+ * Upper bound for the number of memcgs that account kernel memory at
+ * the same time: it sizes the per memcg cache tables of the slab caches.
+ */
+#define MEMCG_CACHES_MAX_SIZE	512
+
+/**
+ * struct memcg_cache_params - memcg data of a slab cache
+ * @is_root_cache: true for a cache created with kmem_cache_create()
+ * @memcg_caches: per memcg copies of a root cache, indexed by kmemcg_id
+ * @memcg: the memcg a copy is charged to
+ * @root_cache: the cache a copy was made from
+ * @cachep: the copy itself
+ * @list: entry in the memcg's list of caches
+ * @dead: the memcg is gone and the copy is being destroyed
+ * @released: the copy no longer holds its @nr_pages bias
+ * @nr_pages: slab pages of the copy, biased by one while the memcg lives
+ *	and by one for each free path that still uses the copy
+ * @destroy: work that destroys the copy once the memcg is gone
+ */
+struct memcg_cache_params {
+	bool is_root_cache;
+	union {
+		struct kmem_cache **memcg_caches;
+		struct {
+			struct mem_cgroup *memcg;
+			struct kmem_cache *root_cache;
+			struct kmem_cache *cachep;
+			struct list_head list;
+			bool dead;
+			bool released;
+			atomic_t nr_pages;
+			struct work_struct destroy;
+		};
+	};
+};
+
+extern struct jump_label_key memcg_kmem_enabled_key;
+
+static inline bool memcg_kmem_enabled(void)
+{
+	return static_branch(&memcg_kmem_enabled_key);
+}
+
+struct kmem_cache *__memcg_kmem_get_cache(struct kmem_cache *cachep,
+					  gfp_t gfp);
+int __memcg_charge_slab(struct kmem_cache *s, gfp_t gfp, int order);
+void __memcg_uncharge_slab(struct kmem_cache *s, int order);
+bool __memcg_cache_tryget(struct kmem_cache *s);
+void __memcg_cache_put(struct kmem_cache *s);
+void memcg_destroy_cache_copies(struct kmem_cache *s);
+void memcg_release_cache(struct kmem_cache *s);
+
+bool memcg_kmem_is_active(struct mem_cgroup *memcg);
+struct mem_cgroup *mem_cgroup_from_kmem(void *ptr);
+void __mem_cgroup_kmem_lru_mod(void *ptr, enum mem_cgroup_kmem_lru lru,
+			       int nr);
+unsigned long mem_cgroup_kmem_lru_size(struct mem_cgroup *memcg,
+				       enum mem_cgroup_kmem_lru lru);
+unsigned long mem_cgroup_reclaimable_pages(struct mem_cgroup *memcg);
+
+/*
+ * Account @nr objects that are added to (or, if negative, removed from)
+ * one of the unused object lists of a superblock to the memcg owning
+ * the object at @ptr.
+ */
+static inline void mem_cgroup_kmem_lru_mod(void *ptr,
+					   enum mem_cgroup_kmem_lru lru, int nr)
+{
+	if (memcg_kmem_enabled())
+		__mem_cgroup_kmem_lru_mod(ptr, lru, nr);
+}
+#else
+static inline bool memcg_kmem_enabled(void)
+{
+	return false;
+}
+
+static inline bool memcg_kmem_is_active(struct mem_cgroup *memcg)
+{
+	return false;
+}
+
+static inline struct mem_cgroup *mem_cgroup_from_kmem(void *ptr)
+{
+	return NULL;
+}
+
+static inline void mem_cgroup_kmem_lru_mod(void *ptr,
+					   enum mem_cgroup_kmem_lru lru, int nr)
+{
+}
+
+static inline unsigned long
+mem_cgroup_kmem_lru_size(struct mem_cgroup *memcg,
+			 enum mem_cgroup_kmem_lru lru)
+{
+	return 0;
+}
+
+static inline unsigned long
+mem_cgroup_reclaimable_pages(struct mem_cgroup *memcg)
+{
+	return 0;
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR_KMEM */
+
 #endif /* _LINUX_MEMCONTROL_H */
 
@@ -10,6 +10,7 @@
 #include <linux/rbtree.h>
 #include <linux/rwsem.h>
 #include <linux/completion.h>
+#include <linux/seqlock.h>
 #include <linux/cpumask.h>
 #include <linux/page-debug-flags.h>
 #include <asm/page.h>
@@ -253,6 +254,14 @@ struct vm_area_struct {
 #ifdef CONFIG_NUMA
 	struct mempolicy *vm_policy;	/* NUMA policy for the VMA */
 #endif
+#ifdef CONFIG_SWAP
+	atomic_long_t swap_readahead_info; /* see mm/swap_state.c */
+#endif
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	seqcount_t vm_sequence;		/* Bumped around changes that matter
+					   to speculative faults */
+	atomic_t vm_ref_count;		/* Pins the VMA for speculative faults */
+#endif
 };
 
 struct core_thread {
@@ -307,6 +316,13 @@ struct mm_struct {
 
 	spinlock_t page_table_lock;		/* Protects page tables and some counters */
 	struct rw_semaphore mmap_sem;
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	rwlock_t mm_rb_lock;			/* Protects mm_rb against speculative lookups */
+#endif
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+	bool tlb_flush_batched;			/* Reclaim left a TLB flush pending,
+						 * see flush_tlb_batched_pending() */
+#endif
 
 	struct list_head mmlist;		/* List of maybe swapped mm's.	These are globally strung
 						 * together off init_mm.mmlist, and are protected
@@ -386,6 +402,16 @@ struct mm_struct {
 #ifdef CONFIG_TRANSPARENT_HUGEPAGE
 	pgtable_t pmd_huge_pte; /* protected by page_table_lock */
 #endif
+#ifdef CONFIG_NUMA_BALANCING
+	/* jiffies after which the next NUMA scan pass may start */
+	unsigned long numa_next_scan;
+	/* jiffies after which the scan period is reset to its minimum */
+	unsigned long numa_next_reset;
+	/* address the next NUMA scan pass starts at */
+	unsigned long numa_scan_offset;
+	/* incremented each time the whole address space was scanned */
+	int numa_scan_seq;
+#endif
 #ifdef CONFIG_CPUMASK_OFFSTACK
 	struct cpumask cpumask_allocation;
 #endif
@@ -62,6 +62,7 @@ struct robust_list_head;
 struct getcpu_cache;
 struct old_linux_dirent;
 struct perf_event_attr;
+struct io_ring_params;
 struct file_handle;
 
 #include <linux/types.h>
@@ -856,5 +857,11 @@ asmlinkage long sys_process_vm_writev(pid_t pid,
 				      const struct iovec __user *rvec,
 				      unsigned long riovcnt,
 				      unsigned long flags);
+asmlinkage long sys_io_ring_setup(u32 entries,
+				  struct io_ring_params __user *p);
+asmlinkage long sys_io_ring_enter(unsigned int fd, u32 to_submit,
+				  u32 min_complete, u32 flags);
+asmlinkage long sys_io_ring_register(unsigned int fd, unsigned int op,
+				     void __user *arg, unsigned int nr_args);
 
 #endif
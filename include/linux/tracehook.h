@@ -183,6 +183,10 @@ static inline void set_notify_resume(struct task_struct *task)
  */
 static inline void tracehook_notify_resume(struct pt_regs *regs)
 {
+#ifdef CONFIG_NUMA_BALANCING
+	if (unlikely(current->numa_work_pending))
+		task_numa_work();
+#endif
 }
 #endif	/* TIF_NOTIFY_RESUME */
 
@@ -470,7 +470,6 @@ static void __init mm_init(void)
 	page_cgroup_init_flatmem();
 	mem_init();
 	kmem_cache_init();
-	percpu_init_late();
 	pgtable_cache_init();
 	vmalloc_init();
 }
@@ -690,8 +689,6 @@ static void __init do_ctors(void)
 int initcall_debug;
 core_param(initcall_debug, initcall_debug, bool, 0644);
 
-static char msgbuf[64];
-
 static int __init_or_module do_one_initcall_debug(initcall_t fn)
 {
 	ktime_t calltime, delta, rettime;
@@ -713,6 +710,7 @@ static int __init_or_module do_one_initcall_debug(initcall_t fn)
 int __init_or_module do_one_initcall(initcall_t fn)
 {
 	int count = preempt_count();
+	char msgbuf[64];
 	int ret;
 
 	if (initcall_debug)
@@ -741,14 +739,300 @@ int __init_or_module do_one_initcall(initcall_t fn)
 }
 
 
-extern initcall_t __initcall_start[], __initcall_end[], __early_initcall_end[];
+extern initcall_t __initcall_start[];
+extern initcall_t __initcall0_start[];
+extern initcall_t __initcall1_start[];
+extern initcall_t __initcall2_start[];
+extern initcall_t __initcall3_start[];
+extern initcall_t __initcall4_start[];
+extern initcall_t __initcall5_start[];
+extern initcall_t __initcall6_start[];
+extern initcall_t __initcall7_start[];
+extern initcall_t __initcall_end[];
+
+static initcall_t *initcall_levels[] __initdata = {
+	__initcall0_start,
+	__initcall1_start,
+	__initcall2_start,
+	__initcall3_start,
+	__initcall4_start,
+	__initcall5_start,
+	__initcall6_start,
+	__initcall7_start,
+	__initcall_end,
+};
+
+static char *initcall_level_names[] __initdata = {
+	"pure",
+	"core",
+	"postcore",
+	"arch",
+	"subsys",
+	"fs",
+	"device",
+	"late",
+};
+
+extern struct parallel_initcall __parallel_initcall_start[];
+extern struct parallel_initcall __parallel_initcall_end[];
+
+#define for_each_parallel_initcall(pc, lvl)				\
+	for (pc = __parallel_initcall_start;				\
+	     pc < __parallel_initcall_end; pc++)			\
+		if (pc->level != (lvl)) {} else
+
+static LIST_HEAD(parallel_initcall_ready);
+static DEFINE_SPINLOCK(parallel_initcall_lock);
+static DECLARE_WAIT_QUEUE_HEAD(parallel_initcall_wq);
+static atomic_t parallel_initcall_pending;
+
+static struct task_struct **parallel_initcall_workers __initdata;
+static int nr_parallel_initcall_workers __initdata;
+
+static struct parallel_initcall * __init find_parallel_initcall(initcall_t fn)
+{
+	struct parallel_initcall *pc;
 
-static void __init do_initcalls(void)
+	for (pc = __parallel_initcall_start; pc < __parallel_initcall_end; pc++)
+		if (pc->fn == fn)
+			return pc;
+	return NULL;
+}
+
+/*
+ * Count, for every parallel initcall of @level, the dependencies that
+ * belong to the same level and so have not run yet.
+ */
+static int __init count_parallel_initcall_deps(int level, bool warn)
+{
+	struct parallel_initcall *pc, *dep;
+	unsigned int i;
+	int nr = 0;
+
+	for_each_parallel_initcall(pc, level) {
+		int count = 0;
+
+		for (i = 0; i < pc->nr_deps; i++) {
+			dep = find_parallel_initcall(pc->deps[i]);
+			if (!dep || dep->level > level) {
+				if (warn)
+					printk(KERN_WARNING "initcall %pF: "
+					       "ignoring dependency on %pF\n",
+					       pc->fn, pc->deps[i]);
+				continue;
+			}
+			if (dep->level == level)
+				count++;
+		}
+		atomic_set(&pc->pending, count);
+		nr++;
+	}
+	return nr;
+}
+
+static void __init queue_parallel_initcall(struct parallel_initcall *pc)
+{
+	pc->queued = ktime_to_ns(ktime_get());
+
+	spin_lock(&parallel_initcall_lock);
+	list_add_tail(&pc->list, &parallel_initcall_ready);
+	spin_unlock(&parallel_initcall_lock);
+
+	wake_up(&parallel_initcall_wq);
+}
+
+static struct parallel_initcall * __init next_parallel_initcall(void)
+{
+	struct parallel_initcall *pc = NULL;
+
+	spin_lock(&parallel_initcall_lock);
+	if (!list_empty(&parallel_initcall_ready)) {
+		pc = list_first_entry(&parallel_initcall_ready,
+				      struct parallel_initcall, list);
+		list_del(&pc->list);
+	}
+	spin_unlock(&parallel_initcall_lock);
+
+	return pc;
+}
+
+/*
+ * Release the initcalls of the level that were waiting on @done.
+ * When @queue is false this only simulates the run, for the cycle
+ * check in start_parallel_initcalls().
+ */
+static void __init release_parallel_initcall_deps(struct parallel_initcall *done,
+						  bool queue)
+{
+	struct parallel_initcall *pc;
+	unsigned int i;
+
+	for_each_parallel_initcall(pc, done->level) {
+		for (i = 0; i < pc->nr_deps; i++) {
+			if (pc->deps[i] != done->fn)
+				continue;
+			if (atomic_dec_and_test(&pc->pending) && queue)
+				queue_parallel_initcall(pc);
+		}
+	}
+}
+
+static void __init run_parallel_initcall(struct parallel_initcall *pc)
 {
+	if (initcall_debug) {
+		unsigned long long delay;
+
+		delay = (ktime_to_ns(ktime_get()) - pc->queued) >> 10;
+		printk(KERN_DEBUG "initcall %pF started on cpu %d after "
+		       "%lld usecs in queue\n", pc->fn,
+		       raw_smp_processor_id(), delay);
+	}
+
+	do_one_initcall(pc->fn);
+	release_parallel_initcall_deps(pc, true);
+
+	if (atomic_dec_and_test(&parallel_initcall_pending))
+		wake_up_all(&parallel_initcall_wq);
+}
+
+static int __init parallel_initcall_worker(void *unused)
+{
+	struct parallel_initcall *pc;
+
+	while (!kthread_should_stop()) {
+		pc = next_parallel_initcall();
+		if (pc) {
+			run_parallel_initcall(pc);
+			continue;
+		}
+		wait_event(parallel_initcall_wq, kthread_should_stop() ||
+			   !list_empty(&parallel_initcall_ready));
+	}
+	return 0;
+}
+
+/*
+ * Queue the parallel initcalls of @level that have no dependency left
+ * and start one worker per online CPU for them.  Initcalls caught in a
+ * dependency cycle are flagged to be run serially afterwards.
+ */
+static int __init start_parallel_initcalls(int level)
+{
+	struct parallel_initcall *pc;
+	int nr, nr_serial = 0;
+	bool progress;
+	int cpu;
+
+	nr = count_parallel_initcall_deps(level, true);
+	if (!nr)
+		return 0;
+
+	for_each_parallel_initcall(pc, level)
+		pc->serial = true;
+	do {
+		progress = false;
+		for_each_parallel_initcall(pc, level) {
+			if (!pc->serial || atomic_read(&pc->pending))
+				continue;
+			pc->serial = false;
+			release_parallel_initcall_deps(pc, false);
+			progress = true;
+		}
+	} while (progress);
+
+	count_parallel_initcall_deps(level, false);
+	for_each_parallel_initcall(pc, level) {
+		if (pc->serial) {
+			printk(KERN_ERR "initcall %pF: circular dependency, "
+			       "running it serially\n", pc->fn);
+			nr_serial++;
+		}
+	}
+	atomic_set(&parallel_initcall_pending, nr - nr_serial);
+
+	for_each_parallel_initcall(pc, level)
+		if (!pc->serial && !atomic_read(&pc->pending))
+			queue_parallel_initcall(pc);
+
+	parallel_initcall_workers = kcalloc(num_online_cpus(),
+					    sizeof(struct task_struct *),
+					    GFP_KERNEL);
+	if (!parallel_initcall_workers)
+		return nr;
+
+	for_each_online_cpu(cpu) {
+		struct task_struct *tsk;
+
+		if (nr_parallel_initcall_workers == nr - nr_serial)
+			break;
+		tsk = kthread_create(parallel_initcall_worker, NULL,
+				     "initcall/%d", cpu);
+		if (IS_ERR(tsk))
+			break;
+		get_task_struct(tsk);
+		parallel_initcall_workers[nr_parallel_initcall_workers++] = tsk;
+		wake_up_process(tsk);
+	}
+	return nr;
+}
+
+/*
+ * Help the workers drain the parallel initcalls of @level once the
+ * serial ones are done, wait for all of them and stop the workers.
+ */
+static void __init finish_parallel_initcalls(int level)
+{
+	struct parallel_initcall *pc;
+	int i;
+
+	while ((pc = next_parallel_initcall()))
+		run_parallel_initcall(pc);
+	wait_event(parallel_initcall_wq,
+		   !atomic_read(&parallel_initcall_pending));
+
+	for (i = 0; i < nr_parallel_initcall_workers; i++) {
+		kthread_stop(parallel_initcall_workers[i]);
+		put_task_struct(parallel_initcall_workers[i]);
+	}
+	kfree(parallel_initcall_workers);
+	parallel_initcall_workers = NULL;
+	nr_parallel_initcall_workers = 0;
+
+	for_each_parallel_initcall(pc, level)
+		if (pc->serial)
+			do_one_initcall(pc->fn);
+}
+
+static void __init do_initcall_level(int level)
+{
+	ktime_t uninitialized_var(calltime), delta, rettime;
 	initcall_t *fn;
+	int nr;
 
-	for (fn = __early_initcall_end; fn < __initcall_end; fn++)
+	if (initcall_debug)
+		calltime = ktime_get();
+
+	nr = start_parallel_initcalls(level);
+	for (fn = initcall_levels[level]; fn < initcall_levels[level + 1]; fn++)
 		do_one_initcall(*fn);
+	if (nr)
+		finish_parallel_initcalls(level);
+
+	if (initcall_debug) {
+		rettime = ktime_get();
+		delta = ktime_sub(rettime, calltime);
+		printk(KERN_DEBUG "initcall level %s (%d parallel) done after "
+		       "%lld usecs\n", initcall_level_names[level], nr,
+		       (unsigned long long) ktime_to_ns(delta) >> 10);
+	}
+}
+
+static void __init do_initcalls(void)
+{
+	int level;
+
+	for (level = 0; level < ARRAY_SIZE(initcall_levels) - 1; level++)
+		do_initcall_level(level);
 }
 
 /*
@@ -774,7 +1058,7 @@ static void __init do_pre_smp_initcalls(void)
 {
 	initcall_t *fn;
 
-	for (fn = __initcall_start; fn < __early_initcall_end; fn++)
+	for (fn = __initcall_start; fn < __initcall0_start; fn++)
 		do_one_initcall(*fn);
 }
 
@@ -850,6 +1134,8 @@ static int __init kernel_init(void * unused)
 	smp_init();
 	sched_init_smp();
 
+	page_alloc_init_late();
+
 	do_basic_setup();
 
 	/* Open the /dev/console on the rootfs, this should never fail */
@@ -23,6 +23,7 @@
 #include <linux/latencytop.h>
 #include <linux/sched.h>
 #include <linux/cpumask.h>
+#include <linux/mempolicy.h>
 
 /*
  * Targeted preemption latency for CPU-bound tasks:
@@ -662,6 +663,255 @@ update_stats_curr_start(struct cfs_rq *cfs_rq, struct sched_entity *se)
 	se->exec_start = rq_of(cfs_rq)->clock_task;
 }
 
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * NUMA balancing: the address space of each task is periodically made
+ * inaccessible, scan_size MB at a time. The resulting hinting faults
+ * migrate misplaced pages towards the node the task runs on, and are
+ * counted per node so the load balancer can prefer keeping the task
+ * on the node holding most of its memory.
+ */
+unsigned int sysctl_numa_balancing = 1;
+
+/* delay before the first scan of a new address space, in msecs */
+unsigned int sysctl_numa_balancing_scan_delay = 1000;
+
+/*
+ * A task whose pages stay where they are scans less often, between
+ * scan_period_min and scan_period_max msecs; the period is reset to
+ * its minimum every scan_period_reset msecs to catch phase changes.
+ */
+unsigned int sysctl_numa_balancing_scan_period_min = 1000;
+unsigned int sysctl_numa_balancing_scan_period_max = 60000;
+unsigned int sysctl_numa_balancing_scan_period_reset = 60000;
+
+/* portion of the address space to scan per pass, in MB */
+unsigned int sysctl_numa_balancing_scan_size = 256;
+
+static void task_numa_placement(struct task_struct *p)
+{
+	unsigned long max_faults = 0;
+	int seq, nid, max_nid = -1;
+
+	seq = ACCESS_ONCE(p->mm->numa_scan_seq);
+	if (p->numa_scan_seq == seq)
+		return;
+	p->numa_scan_seq = seq;
+
+	/* pick the node with most faults, then decay the history */
+	for_each_online_node(nid) {
+		unsigned long faults = p->numa_faults[nid];
+
+		p->numa_faults[nid] = faults >> 1;
+		if (faults > max_faults) {
+			max_faults = faults;
+			max_nid = nid;
+		}
+	}
+	p->numa_preferred_nid = max_nid;
+}
+
+/*
+ * Called from the NUMA hinting fault path with the node the accessed
+ * pages are on after any migration.
+ */
+void task_numa_fault(int node, int pages, bool migrated)
+{
+	struct task_struct *p = current;
+
+	if (!sysctl_numa_balancing || !p->mm)
+		return;
+
+	if (unlikely(!p->numa_faults)) {
+		p->numa_faults = kzalloc(sizeof(*p->numa_faults) * nr_node_ids,
+					 GFP_KERNEL | __GFP_NOWARN);
+		if (!p->numa_faults)
+			return;
+	}
+
+	/* properly placed pages make the next scans less frequent */
+	if (!migrated)
+		p->numa_scan_period = min(sysctl_numa_balancing_scan_period_max,
+					  p->numa_scan_period +
+					  jiffies_to_msecs(10));
+
+	task_numa_placement(p);
+	p->numa_faults[node] += pages;
+}
+
+void task_numa_free(struct task_struct *p)
+{
+	kfree(p->numa_faults);
+	p->numa_faults = NULL;
+}
+
+static void reset_ptenuma_scan(struct mm_struct *mm)
+{
+	ACCESS_ONCE(mm->numa_scan_seq)++;
+	mm->numa_scan_offset = 0;
+}
+
+/*
+ * The expensive part of NUMA balancing, run from
+ * tracehook_notify_resume() when the task returns to user mode.
+ * Only one thread of an mm scans per period.
+ */
+void task_numa_work(void)
+{
+	unsigned long migrate, next_scan, now = jiffies;
+	struct task_struct *p = current;
+	struct mm_struct *mm = p->mm;
+	struct vm_area_struct *vma;
+	unsigned long start, end;
+	long pages;
+
+	p->numa_work_pending = 0;
+
+	if (!mm || (p->flags & PF_EXITING))
+		return;
+
+	/*
+	 * Tasks settle into phases where their pages are well placed,
+	 * but phases change: periodically go back to scanning fast.
+	 */
+	migrate = mm->numa_next_reset;
+	if (time_after(now, migrate)) {
+		p->numa_scan_period = sysctl_numa_balancing_scan_period_min;
+		next_scan = now +
+			msecs_to_jiffies(sysctl_numa_balancing_scan_period_reset);
+		xchg(&mm->numa_next_reset, next_scan);
+	}
+
+	migrate = mm->numa_next_scan;
+	if (time_before(now, migrate))
+		return;
+
+	if (p->numa_scan_period == 0)
+		p->numa_scan_period = sysctl_numa_balancing_scan_period_min;
+
+	next_scan = now + msecs_to_jiffies(p->numa_scan_period);
+	if (cmpxchg(&mm->numa_next_scan, migrate, next_scan) != migrate)
+		return;
+
+	pages = sysctl_numa_balancing_scan_size;
+	pages <<= 20 - PAGE_SHIFT; /* MB in pages */
+	if (!pages)
+		return;
+
+	down_read(&mm->mmap_sem);
+	start = mm->numa_scan_offset;
+	vma = find_vma(mm, start);
+	if (!vma) {
+		reset_ptenuma_scan(mm);
+		start = 0;
+		vma = mm->mmap;
+	}
+	for (; vma; vma = vma->vm_next) {
+		if (!vma_migratable(vma) || !vma_is_accessible(vma))
+			continue;
+
+		do {
+			start = max(start, vma->vm_start);
+			end = ALIGN(start + (pages << PAGE_SHIFT), PMD_SIZE);
+			end = min(end, vma->vm_end);
+			pages -= change_prot_numa(vma, start, end);
+
+			start = end;
+			if (pages <= 0)
+				goto out;
+		} while (end != vma->vm_end);
+	}
+
+out:
+	/*
+	 * The whole address space was scanned when we ran out of vmas:
+	 * start over from the beginning on the next pass.
+	 */
+	if (vma)
+		mm->numa_scan_offset = start;
+	else
+		reset_ptenuma_scan(mm);
+	up_read(&mm->mmap_sem);
+}
+
+/*
+ * Request a scan pass from the tick once the task has run for its
+ * scan period. The scan itself runs in task_numa_work().
+ */
+static void task_tick_numa(struct rq *rq, struct task_struct *curr)
+{
+	u64 period, now;
+
+	if (!sysctl_numa_balancing || nr_node_ids == 1)
+		return;
+
+	if (!curr->mm || (curr->flags & (PF_EXITING | PF_KTHREAD)) ||
+	    curr->numa_work_pending)
+		return;
+
+	now = curr->se.sum_exec_runtime;
+	period = (u64)curr->numa_scan_period * NSEC_PER_MSEC;
+
+	if (now - curr->node_stamp > period) {
+		if (!curr->node_stamp)
+			curr->numa_scan_period =
+				sysctl_numa_balancing_scan_period_min;
+		curr->node_stamp = now;
+
+		if (!time_before(jiffies, curr->mm->numa_next_scan)) {
+			curr->numa_work_pending = 1;
+			set_tsk_thread_flag(curr, TIF_NOTIFY_RESUME);
+		}
+	}
+}
+
+/* Would moving p from src_cpu to dst_cpu bring it to its memory? */
+static bool migrate_improves_locality(struct task_struct *p,
+				      int src_cpu, int dst_cpu)
+{
+	int src_nid, dst_nid;
+
+	if (!sched_feat(NUMA_FAVOUR) || p->numa_preferred_nid == -1)
+		return false;
+
+	src_nid = cpu_to_node(src_cpu);
+	dst_nid = cpu_to_node(dst_cpu);
+
+	return src_nid != dst_nid && dst_nid == p->numa_preferred_nid;
+}
+
+/* Would moving p from src_cpu to dst_cpu take it away from its memory? */
+static bool migrate_degrades_locality(struct task_struct *p,
+				      int src_cpu, int dst_cpu)
+{
+	int src_nid, dst_nid;
+
+	if (!sched_feat(NUMA_FAVOUR) || p->numa_preferred_nid == -1)
+		return false;
+
+	src_nid = cpu_to_node(src_cpu);
+	dst_nid = cpu_to_node(dst_cpu);
+
+	return src_nid != dst_nid && src_nid == p->numa_preferred_nid;
+}
+#else
+static inline void task_tick_numa(struct rq *rq, struct task_struct *curr)
+{
+}
+
+static inline bool migrate_improves_locality(struct task_struct *p,
+					     int src_cpu, int dst_cpu)
+{
+	return false;
+}
+
+static inline bool migrate_degrades_locality(struct task_struct *p,
+					     int src_cpu, int dst_cpu)
+{
+	return false;
+}
+#endif /* CONFIG_NUMA_BALANCING */
+
 /**************************************************
  * Scheduling class queueing methods:
  */
@@ -2801,13 +3051,26 @@ int can_migrate_task(struct task_struct *p, struct rq *rq, int this_cpu,
 		return 0;
 	}
 
+	/*
+	 * Always pull a task towards the node holding most of its
+	 * memory, whatever its cache footprint.
+	 */
+	if (migrate_improves_locality(p, cpu_of(rq), this_cpu)) {
+		schedstat_inc(p, se.statistics.nr_forced_migrations);
+		return 1;
+	}
+
 	/*
 	 * Aggressive migration if:
 	 * 1) task is cache cold, or
 	 * 2) too many balance attempts have failed.
+	 *
+	 * Moving a task away from its memory is treated like moving a
+	 * cache hot task.
 	 */
 
-	tsk_cache_hot = task_hot(p, rq->clock_task, sd);
+	tsk_cache_hot = task_hot(p, rq->clock_task, sd) ||
+			migrate_degrades_locality(p, cpu_of(rq), this_cpu);
 	if (!tsk_cache_hot ||
 		sd->nr_balance_failed > sd->cache_nice_tries) {
 #ifdef CONFIG_SCHEDSTATS
@@ -4871,6 +5134,8 @@ static void task_tick_fair(struct rq *rq, struct task_struct *curr, int queued)
 		cfs_rq = cfs_rq_of(se);
 		entity_tick(cfs_rq, se, queued);
 	}
+
+	task_tick_numa(rq, curr);
 }
 
 /*
@@ -68,3 +68,11 @@ SCHED_FEAT(TTWU_QUEUE, 1)
 
 SCHED_FEAT(FORCE_SD_OVERLAP, 0)
 SCHED_FEAT(RT_RUNTIME_SHARE, 1)
+
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Prefer running tasks on the node holding most of their memory, as
+ * measured by NUMA hinting faults.
+ */
+SCHED_FEAT(NUMA_FAVOUR, 1)
+#endif
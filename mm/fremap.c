@@ -59,6 +59,9 @@ static int install_file_pte(struct mm_struct *mm, struct vm_area_struct *vma,
 	pte_t *pte;
 	spinlock_t *ptl;
 
+	/* the linear mapping may have used a huge pmd */
+	split_huge_file_pmd_address(vma, addr);
+
 	pte = get_locked_pte(mm, addr, &ptl);
 	if (!pte)
 		goto out;
@@ -212,7 +215,9 @@ SYSCALL_DEFINE5(remap_file_pages, unsigned long, start, unsigned long, size,
 		}
 		mutex_lock(&mapping->i_mmap_mutex);
 		flush_dcache_mmap_lock(mapping);
+		vm_write_begin(vma);
 		vma->vm_flags |= VM_NONLINEAR;
+		vm_write_end(vma);
 		vma_prio_tree_remove(vma, &mapping->i_mmap);
 		vma_nonlinear_insert(vma, &mapping->i_mmap_nonlinear);
 		flush_dcache_mmap_unlock(mapping);
@@ -17,6 +17,9 @@
 #include <linux/khugepaged.h>
 #include <linux/freezer.h>
 #include <linux/mman.h>
+#include <linux/shmem_fs.h>
+#include <linux/file.h>
+#include <linux/mempolicy.h>
 #include <asm/tlb.h>
 #include <asm/pgalloc.h>
 #include "internal.h"
@@ -36,7 +39,8 @@ unsigned long transparent_hugepage_flags __read_mostly =
 	(1<<TRANSPARENT_HUGEPAGE_REQ_MADV_FLAG)|
 #endif
 	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_FLAG)|
-	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG);
+	(1<<TRANSPARENT_HUGEPAGE_DEFRAG_KHUGEPAGED_FLAG)|
+	(1<<TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
 
 /* default scan 8*512 pte (or vmas) every 30 second */
 static unsigned int khugepaged_pages_to_scan __read_mostly = HPAGE_PMD_NR*8;
@@ -46,6 +50,73 @@ static unsigned int khugepaged_scan_sleep_millisecs __read_mostly = 10000;
 /* during fragmentation poll the hugepage allocator once every minute */
 static unsigned int khugepaged_alloc_sleep_millisecs __read_mostly = 60000;
 static struct task_struct *khugepaged_thread __read_mostly;
+
+/*
+ * Read faults on anonymous memory map a single zero filled huge page
+ * read-only instead of allocating and clearing a new one. The page is
+ * allocated on first use and freed by the shrinker once no pmd maps
+ * it any more: huge_zero_refcount holds one reference for the pointer
+ * itself plus one per mapping pmd.
+ */
+struct page *huge_zero_page __read_mostly;
+static atomic_t huge_zero_refcount;
+
+static struct page *get_huge_zero_page(void)
+{
+	struct page *zero_page;
+retry:
+	if (likely(atomic_inc_not_zero(&huge_zero_refcount)))
+		return ACCESS_ONCE(huge_zero_page);
+
+	zero_page = alloc_pages((GFP_TRANSHUGE | __GFP_ZERO) & ~__GFP_MOVABLE,
+				HPAGE_PMD_ORDER);
+	if (!zero_page) {
+		count_vm_event(THP_ZERO_PAGE_ALLOC_FAILED);
+		return NULL;
+	}
+	count_vm_event(THP_ZERO_PAGE_ALLOC);
+	preempt_disable();
+	if (cmpxchg(&huge_zero_page, NULL, zero_page)) {
+		preempt_enable();
+		put_page(zero_page);
+		goto retry;
+	}
+
+	/* one reference for the pointer, one for the caller */
+	atomic_set(&huge_zero_refcount, 2);
+	preempt_enable();
+	return ACCESS_ONCE(huge_zero_page);
+}
+
+static void put_huge_zero_page(void)
+{
+	/*
+	 * The reference held by huge_zero_page itself is only dropped
+	 * by the shrinker, so this can never be the last one.
+	 */
+	BUG_ON(atomic_dec_and_test(&huge_zero_refcount));
+}
+
+static int shrink_huge_zero_page(struct shrinker *shrink,
+				 struct shrink_control *sc)
+{
+	if (!sc->nr_to_scan)
+		/* we can free the zero page only if the last ref remains */
+		return atomic_read(&huge_zero_refcount) == 1 ? HPAGE_PMD_NR : 0;
+
+	if (atomic_cmpxchg(&huge_zero_refcount, 1, 0) == 1) {
+		struct page *zero_page = xchg(&huge_zero_page, NULL);
+		BUG_ON(zero_page == NULL);
+		put_page(zero_page);
+	}
+
+	return 0;
+}
+
+static struct shrinker huge_zero_page_shrinker = {
+	.shrink = shrink_huge_zero_page,
+	.seeks = DEFAULT_SEEKS,
+};
 static DEFINE_MUTEX(khugepaged_mutex);
 static DEFINE_SPINLOCK(khugepaged_mm_lock);
 static DECLARE_WAIT_QUEUE_HEAD(khugepaged_wait);
@@ -312,11 +383,31 @@ static struct kobj_attribute debug_cow_attr =
 	__ATTR(debug_cow, 0644, debug_cow_show, debug_cow_store);
 #endif /* CONFIG_DEBUG_VM */
 
+static ssize_t use_zero_page_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	return single_flag_show(kobj, attr, buf,
+				TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
+}
+static ssize_t use_zero_page_store(struct kobject *kobj,
+				   struct kobj_attribute *attr,
+				   const char *buf, size_t count)
+{
+	return single_flag_store(kobj, attr, buf, count,
+				 TRANSPARENT_HUGEPAGE_USE_ZERO_PAGE_FLAG);
+}
+static struct kobj_attribute use_zero_page_attr =
+	__ATTR(use_zero_page, 0644, use_zero_page_show, use_zero_page_store);
+
 static struct attribute *hugepage_attr[] = {
 	&enabled_attr.attr,
 	&defrag_attr.attr,
+	&use_zero_page_attr.attr,
 #ifdef CONFIG_DEBUG_VM
 	&debug_cow_attr.attr,
+#endif
+#ifdef CONFIG_SHMEM
+	&shmem_enabled_attr.attr,
 #endif
 	NULL,
 };
@@ -541,6 +632,8 @@ static int __init hugepage_init(void)
 	if (totalram_pages < (512 << (20 - PAGE_SHIFT)))
 		transparent_hugepage_flags = 0;
 
+	register_shrinker(&huge_zero_page_shrinker);
+
 	start_khugepaged();
 
 	set_recommended_min_free_kbytes();
@@ -602,6 +695,28 @@ static inline pmd_t maybe_pmd_mkwrite(pmd_t pmd, struct vm_area_struct *vma)
 	return pmd;
 }
 
+/*
+ * Map the huge zero page read-only at haddr. The pmd is not accounted
+ * in the rss counters nor in the rmap, exactly like the zero page
+ * mapped by a pte. Returns false if somebody else populated the pmd.
+ */
+static bool set_huge_zero_page(pgtable_t pgtable, struct mm_struct *mm,
+			       struct vm_area_struct *vma, unsigned long haddr,
+			       pmd_t *pmd, struct page *zero_page)
+{
+	pmd_t entry;
+
+	assert_spin_locked(&mm->page_table_lock);
+	if (!pmd_none(*pmd))
+		return false;
+	entry = mk_pmd(zero_page, vma->vm_page_prot);
+	entry = pmd_wrprotect(entry);
+	entry = pmd_mkhuge(entry);
+	set_pmd_at(mm, haddr, pmd, entry);
+	prepare_pmd_huge_pte(pgtable, mm);
+	return true;
+}
+
 static int __do_huge_pmd_anonymous_page(struct mm_struct *mm,
 					struct vm_area_struct *vma,
 					unsigned long haddr, pmd_t *pmd,
@@ -683,6 +798,31 @@ int do_huge_pmd_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			return VM_FAULT_OOM;
 		if (unlikely(khugepaged_enter(vma)))
 			return VM_FAULT_OOM;
+		if (!(flags & FAULT_FLAG_WRITE) &&
+		    transparent_hugepage_use_zero_page()) {
+			pgtable_t pgtable;
+			struct page *zero_page;
+			bool set;
+
+			pgtable = pte_alloc_one(mm, haddr);
+			if (unlikely(!pgtable))
+				return VM_FAULT_OOM;
+			zero_page = get_huge_zero_page();
+			if (unlikely(!zero_page)) {
+				pte_free(mm, pgtable);
+				count_vm_event(THP_FAULT_FALLBACK);
+				goto out;
+			}
+			spin_lock(&mm->page_table_lock);
+			set = set_huge_zero_page(pgtable, mm, vma, haddr, pmd,
+						 zero_page);
+			spin_unlock(&mm->page_table_lock);
+			if (!set) {
+				pte_free(mm, pgtable);
+				put_huge_zero_page();
+			}
+			return 0;
+		}
 		page = alloc_hugepage_vma(transparent_hugepage_defrag(vma),
 					  vma, haddr, numa_node_id(), 0);
 		if (unlikely(!page)) {
@@ -718,6 +858,51 @@ out:
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+/*
+ * Map HPAGE_PMD_NR physically contiguous and naturally aligned page
+ * cache pages with a single huge pmd. The pages are not compound:
+ * each of them keeps its own refcount, mapcount and page cache slot,
+ * so the huge pmd can always be split back to ptes without touching
+ * the pages. The caller holds the pages locked and passes one
+ * reference per page, which the mapping takes over on success.
+ */
+int do_huge_pmd_file_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			  unsigned long address, pmd_t *pmd,
+			  struct page *page, unsigned int flags)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	pgtable_t pgtable;
+	pmd_t entry;
+	int i;
+
+	VM_BUG_ON(PageAnon(page) || PageCompound(page));
+	VM_BUG_ON(page_to_pfn(page) & (HPAGE_PMD_NR - 1));
+
+	pgtable = pte_alloc_one(mm, haddr);
+	if (unlikely(!pgtable))
+		return VM_FAULT_OOM;
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_none(*pmd))) {
+		spin_unlock(&mm->page_table_lock);
+		pte_free(mm, pgtable);
+		return VM_FAULT_FALLBACK;
+	}
+	entry = mk_pmd(page, vma->vm_page_prot);
+	if (flags & FAULT_FLAG_WRITE)
+		entry = maybe_pmd_mkwrite(pmd_mkdirty(entry), vma);
+	entry = pmd_mkhuge(entry);
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		page_add_file_rmap(page + i);
+	set_pmd_at(mm, haddr, pmd, entry);
+	prepare_pmd_huge_pte(pgtable, mm);
+	add_mm_counter(mm, MM_FILEPAGES, HPAGE_PMD_NR);
+	spin_unlock(&mm->page_table_lock);
+	count_vm_event(THP_FILE_MAPPED);
+
+	return VM_FAULT_NOPAGE;
+}
+
 int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		  pmd_t *dst_pmd, pmd_t *src_pmd, unsigned long addr,
 		  struct vm_area_struct *vma)
@@ -751,6 +936,28 @@ int copy_huge_pmd(struct mm_struct *dst_mm, struct mm_struct *src_mm,
 		goto out;
 	}
 	src_page = pmd_page(pmd);
+	/*
+	 * The huge zero page is not PageAnon: test for it before
+	 * treating the pmd as a file mapping.
+	 */
+	if (is_huge_zero_page(src_page)) {
+		struct page *zero_page;
+		bool set;
+
+		/* we already hold a reference through src_pmd */
+		zero_page = get_huge_zero_page();
+		set = set_huge_zero_page(pgtable, dst_mm, vma, addr, dst_pmd,
+					 zero_page);
+		BUG_ON(!set);
+		ret = 0;
+		goto out_unlock;
+	}
+	if (!PageAnon(src_page)) {
+		/* leave it to the child to fault in file pages */
+		pte_free(dst_mm, pgtable);
+		ret = 0;
+		goto out_unlock;
+	}
 	VM_BUG_ON(!PageHead(src_page));
 	get_page(src_page);
 	page_dup_rmap(src_page);
@@ -882,6 +1089,66 @@ out_free_pages:
 	goto out;
 }
 
+/*
+ * Write fault on the huge zero page: replace it with a freshly cleared
+ * huge page, or split the pmd and let the pte fault path copy the
+ * small zero page if no huge page is available.
+ */
+static int do_huge_pmd_wp_zero_page(struct mm_struct *mm,
+				    struct vm_area_struct *vma,
+				    unsigned long address,
+				    pmd_t *pmd, pmd_t orig_pmd)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct page *new_page;
+	pmd_t entry;
+
+	if (transparent_hugepage_enabled(vma) &&
+	    !transparent_hugepage_debug_cow())
+		new_page = alloc_hugepage_vma(transparent_hugepage_defrag(vma),
+					      vma, haddr, numa_node_id(), 0);
+	else
+		new_page = NULL;
+
+	if (unlikely(!new_page)) {
+		count_vm_event(THP_FAULT_FALLBACK);
+		goto fallback;
+	}
+	count_vm_event(THP_FAULT_ALLOC);
+
+	if (unlikely(mem_cgroup_newpage_charge(new_page, mm, GFP_KERNEL))) {
+		put_page(new_page);
+		goto fallback;
+	}
+
+	clear_huge_page(new_page, haddr, HPAGE_PMD_NR);
+	__SetPageUptodate(new_page);
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_same(*pmd, orig_pmd))) {
+		spin_unlock(&mm->page_table_lock);
+		mem_cgroup_uncharge_page(new_page);
+		put_page(new_page);
+		return 0;
+	}
+	entry = mk_pmd(new_page, vma->vm_page_prot);
+	entry = maybe_pmd_mkwrite(pmd_mkdirty(entry), vma);
+	entry = pmd_mkhuge(entry);
+	pmdp_clear_flush_notify(vma, haddr, pmd);
+	page_add_new_anon_rmap(new_page, vma, haddr);
+	set_pmd_at(mm, haddr, pmd, entry);
+	update_mmu_cache(vma, address, entry);
+	add_mm_counter(mm, MM_ANONPAGES, HPAGE_PMD_NR);
+	spin_unlock(&mm->page_table_lock);
+	put_huge_zero_page();
+
+	return VM_FAULT_WRITE;
+
+fallback:
+	__split_huge_page_pmd(mm, address, pmd);
+	return VM_FAULT_FALLBACK;
+}
+
 int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 			unsigned long address, pmd_t *pmd, pmd_t orig_pmd)
 {
@@ -889,12 +1156,23 @@ int do_huge_pmd_wp_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	struct page *page, *new_page;
 	unsigned long haddr;
 
-	VM_BUG_ON(!vma->anon_vma);
 	spin_lock(&mm->page_table_lock);
 	if (unlikely(!pmd_same(*pmd, orig_pmd)))
 		goto out_unlock;
 
 	page = pmd_page(orig_pmd);
+	if (is_huge_zero_page(page)) {
+		spin_unlock(&mm->page_table_lock);
+		return do_huge_pmd_wp_zero_page(mm, vma, address,
+						pmd, orig_pmd);
+	}
+	if (!PageAnon(page)) {
+		/* let the pte fault path handle the write */
+		spin_unlock(&mm->page_table_lock);
+		__split_huge_page_pmd(mm, address, pmd);
+		return VM_FAULT_FALLBACK;
+	}
+	VM_BUG_ON(!vma->anon_vma);
 	VM_BUG_ON(!PageCompound(page) || !PageHead(page));
 	haddr = address & HPAGE_PMD_MASK;
 	if (page_mapcount(page) == 1) {
@@ -960,11 +1238,58 @@ out:
 	return ret;
 }
 
-struct page *follow_trans_huge_pmd(struct mm_struct *mm,
+/*
+ * NUMA hinting fault on an anonymous huge pmd: restore the protection
+ * and account the fault. Hugepages are not migrated as a whole: a
+ * misplaced one that is not shared is split, so that its subpages
+ * migrate on the following hinting faults and khugepaged can collapse
+ * them again on the node they moved to.
+ */
+int do_huge_pmd_numa_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			  unsigned long address, pmd_t *pmd, pmd_t orig_pmd)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct page *page;
+	pmd_t entry;
+	int current_nid, target_nid;
+
+	spin_lock(&mm->page_table_lock);
+	if (unlikely(!pmd_same(*pmd, orig_pmd))) {
+		spin_unlock(&mm->page_table_lock);
+		return 0;
+	}
+
+	entry = pmd_mkyoung(pmd_modify(orig_pmd, vma->vm_page_prot));
+	set_pmd_at(mm, haddr, pmd, entry);
+	update_mmu_cache(vma, address, entry);
+
+	page = pmd_page(entry);
+	VM_BUG_ON(!PageHead(page));
+	current_nid = page_to_nid(page);
+	count_vm_numa_event(NUMA_HINT_FAULTS);
+	if (current_nid == numa_node_id())
+		count_vm_numa_event(NUMA_HINT_FAULTS_LOCAL);
+	target_nid = mpol_misplaced(page, vma, haddr);
+	if (target_nid == -1 || page_mapcount(page) != 1) {
+		spin_unlock(&mm->page_table_lock);
+		goto out;
+	}
+	get_page(page);
+	spin_unlock(&mm->page_table_lock);
+
+	split_huge_page(page);
+	put_page(page);
+out:
+	task_numa_fault(current_nid, HPAGE_PMD_NR, false);
+	return 0;
+}
+
+struct page *follow_trans_huge_pmd(struct vm_area_struct *vma,
 				   unsigned long addr,
 				   pmd_t *pmd,
 				   unsigned int flags)
 {
+	struct mm_struct *mm = vma->vm_mm;
 	struct page *page = NULL;
 
 	assert_spin_locked(&mm->page_table_lock);
@@ -973,6 +1298,37 @@ struct page *follow_trans_huge_pmd(struct mm_struct *mm,
 		goto out;
 
 	page = pmd_page(*pmd);
+	if (is_huge_zero_page(page)) {
+		/* core dumps skip the zero page, like follow_page() */
+		if (flags & FOLL_DUMP) {
+			page = ERR_PTR(-EFAULT);
+			goto out;
+		}
+		page += (addr & ~HPAGE_PMD_MASK) >> PAGE_SHIFT;
+		if (flags & FOLL_GET)
+			get_page_foll(page);
+		goto out;
+	}
+	if (!PageAnon(page)) {
+		/* same as follow_page() does for a file pte */
+		page += (addr & ~HPAGE_PMD_MASK) >> PAGE_SHIFT;
+		if (flags & FOLL_GET)
+			get_page(page);
+		if (flags & FOLL_TOUCH) {
+			if ((flags & FOLL_WRITE) && !PageDirty(page))
+				set_page_dirty(page);
+			mark_page_accessed(page);
+		}
+		if ((flags & FOLL_MLOCK) && (vma->vm_flags & VM_LOCKED)) {
+			if (page->mapping && trylock_page(page)) {
+				lru_add_drain();
+				if (page->mapping)
+					mlock_vma_page(page);
+				unlock_page(page);
+			}
+		}
+		goto out;
+	}
 	VM_BUG_ON(!PageHead(page));
 	if (flags & FOLL_TOUCH) {
 		pmd_t _pmd;
@@ -996,6 +1352,37 @@ out:
 	return page;
 }
 
+/*
+ * Called with page_table_lock held, returns with it released.
+ */
+static void zap_huge_file_pmd(struct mmu_gather *tlb,
+			      struct vm_area_struct *vma, pmd_t *pmd)
+	__releases(&tlb->mm->page_table_lock)
+{
+	struct page *page;
+	pgtable_t pgtable;
+	pmd_t orig_pmd;
+	int i;
+
+	pgtable = get_pmd_huge_pte(tlb->mm);
+	orig_pmd = *pmd;
+	page = pmd_page(orig_pmd);
+	pmd_clear(pmd);
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		if (pmd_dirty(orig_pmd))
+			set_page_dirty(page + i);
+		if (pmd_young(orig_pmd) && likely(!VM_SequentialReadHint(vma)))
+			mark_page_accessed(page + i);
+		page_remove_rmap(page + i);
+		VM_BUG_ON(page_mapcount(page + i) < 0);
+	}
+	add_mm_counter(tlb->mm, MM_FILEPAGES, -HPAGE_PMD_NR);
+	spin_unlock(&tlb->mm->page_table_lock);
+	for (i = 0; i < HPAGE_PMD_NR; i++)
+		tlb_remove_page(tlb, page + i);
+	pte_free(tlb->mm, pgtable);
+}
+
 int zap_huge_pmd(struct mmu_gather *tlb, struct vm_area_struct *vma,
 		 pmd_t *pmd)
 {
@@ -1007,6 +1394,17 @@ int zap_huge_pmd(struct mmu_gather *tlb, struct vm_area_struct *vma,
 			spin_unlock(&tlb->mm->page_table_lock);
 			wait_split_huge_page(vma->anon_vma,
 					     pmd);
+		} else if (is_huge_zero_pmd(*pmd)) {
+			pgtable_t pgtable;
+			pgtable = get_pmd_huge_pte(tlb->mm);
+			pmd_clear(pmd);
+			spin_unlock(&tlb->mm->page_table_lock);
+			put_huge_zero_page();
+			pte_free(tlb->mm, pgtable);
+			ret = 1;
+		} else if (!PageAnon(pmd_page(*pmd))) {
+			zap_huge_file_pmd(tlb, vma, pmd);
+			ret = 1;
 		} else {
 			struct page *page;
 			pgtable_t pgtable;
@@ -1098,8 +1496,12 @@ out:
 	return ret;
 }
 
+/*
+ * Returns HPAGE_PMD_NR if the huge pmd was handled, 0 if the caller
+ * has to fall back to the ptes.
+ */
 int change_huge_pmd(struct vm_area_struct *vma, pmd_t *pmd,
-		unsigned long addr, pgprot_t newprot)
+		unsigned long addr, pgprot_t newprot, int prot_numa)
 {
 	struct mm_struct *mm = vma->vm_mm;
 	int ret = 0;
@@ -1112,12 +1514,24 @@ int change_huge_pmd(struct vm_area_struct *vma, pmd_t *pmd,
 		} else {
 			pmd_t entry;
 
+			/*
+			 * NUMA sampling only covers anonymous hugepages:
+			 * leave the zero page, file pages and pmds already
+			 * sampled alone.
+			 */
+			if (prot_numa && (pmd_protnone(*pmd) ||
+					  !PageAnon(pmd_page(*pmd)))) {
+				spin_unlock(&mm->page_table_lock);
+				return HPAGE_PMD_NR;
+			}
 			entry = pmdp_get_and_clear(mm, addr, pmd);
 			entry = pmd_modify(entry, newprot);
+			if (is_huge_zero_pmd(entry))
+				entry = pmd_wrprotect(entry);
 			set_pmd_at(mm, addr, pmd, entry);
 			spin_unlock(&vma->vm_mm->page_table_lock);
 			flush_tlb_range(vma, addr, addr + HPAGE_PMD_SIZE);
-			ret = 1;
+			ret = HPAGE_PMD_NR;
 		}
 	} else
 		spin_unlock(&vma->vm_mm->page_table_lock);
@@ -1475,12 +1889,18 @@ out:
 int hugepage_madvise(struct vm_area_struct *vma,
 		     unsigned long *vm_flags, int advice)
 {
+	unsigned long no_thp = VM_NO_THP;
+
+	/* Shared mappings are only a problem if they cannot map a pmd */
+	if (vma->vm_ops && vma->vm_ops->pmd_fault)
+		no_thp &= ~(VM_SHARED | VM_MAYSHARE);
+
 	switch (advice) {
 	case MADV_HUGEPAGE:
 		/*
 		 * Be somewhat over-protective like KSM for now!
 		 */
-		if (*vm_flags & (VM_HUGEPAGE | VM_NO_THP))
+		if (*vm_flags & (VM_HUGEPAGE | no_thp))
 			return -EINVAL;
 		*vm_flags &= ~VM_NOHUGEPAGE;
 		*vm_flags |= VM_HUGEPAGE;
@@ -1496,7 +1916,7 @@ int hugepage_madvise(struct vm_area_struct *vma,
 		/*
 		 * Be somewhat over-protective like KSM for now!
 		 */
-		if (*vm_flags & (VM_NOHUGEPAGE | VM_NO_THP))
+		if (*vm_flags & (VM_NOHUGEPAGE | no_thp))
 			return -EINVAL;
 		*vm_flags &= ~VM_HUGEPAGE;
 		*vm_flags |= VM_NOHUGEPAGE;
@@ -1624,15 +2044,28 @@ int __khugepaged_enter(struct mm_struct *mm)
 int khugepaged_enter_vma_merge(struct vm_area_struct *vma)
 {
 	unsigned long hstart, hend;
+	if (vma->vm_ops) {
+		/*
+		 * khugepaged only works on file mappings which can be
+		 * mapped by a pmd: the mm is registered whenever such a
+		 * vma spans a hugepage extent, and khugepaged_scan_mm_slot
+		 * checks the per-vma policy as it goes.
+		 */
+		if (!vma->vm_ops->pmd_fault)
+			return 0;
+		hstart = (vma->vm_start + ~HPAGE_PMD_MASK) & HPAGE_PMD_MASK;
+		hend = vma->vm_end & HPAGE_PMD_MASK;
+		if (hstart < hend &&
+		    !test_bit(MMF_VM_HUGEPAGE, &vma->vm_mm->flags))
+			return __khugepaged_enter(vma->vm_mm);
+		return 0;
+	}
 	if (!vma->anon_vma)
 		/*
 		 * Not yet faulted in so we will register later in the
 		 * page fault if needed.
 		 */
 		return 0;
-	if (vma->vm_ops)
-		/* khugepaged not yet working on file or special mappings */
-		return 0;
 	/*
 	 * If is_pfn_mapping() is true is_learn_pfn_mapping() must be
 	 * true too, verify it here.
@@ -1910,6 +2343,8 @@ static void collapse_huge_page(struct mm_struct *mm,
 	if (!pmd_present(*pmd) || pmd_trans_huge(*pmd))
 		goto out;
 
+	/* speculative faults must not populate the ptes being collapsed */
+	vm_write_begin(vma);
 	anon_vma_lock(vma->anon_vma);
 
 	pte = pte_offset_map(pmd, address);
@@ -1936,6 +2371,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 		set_pmd_at(mm, address, pmd, _pmd);
 		spin_unlock(&mm->page_table_lock);
 		anon_vma_unlock(vma->anon_vma);
+		vm_write_end(vma);
 		goto out;
 	}
 
@@ -1971,6 +2407,7 @@ static void collapse_huge_page(struct mm_struct *mm,
 	prepare_pmd_huge_pte(pgtable, mm);
 	mm->nr_ptes--;
 	spin_unlock(&mm->page_table_lock);
+	vm_write_end(vma);
 
 #ifndef CONFIG_NUMA
 	*hpage = NULL;
@@ -2083,6 +2520,114 @@ static void collect_mm_slot(struct mm_slot *mm_slot)
 	}
 }
 
+static pmd_t *mm_find_pmd(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		return NULL;
+
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		return NULL;
+
+	pmd = pmd_offset(pud, address);
+	if (!pmd_present(*pmd))
+		return NULL;
+	return pmd;
+}
+
+/*
+ * Free the now empty page tables of every shared mapping of the hugepage
+ * extent at @pgoff, so that the next fault there can map it with a pmd.
+ * Mappings whose mmap_sem is contended are left for a later pass.
+ */
+static void retract_page_tables(struct address_space *mapping, pgoff_t pgoff)
+{
+	struct vm_area_struct *vma;
+	struct prio_tree_iter iter;
+
+	mutex_lock(&mapping->i_mmap_mutex);
+	vma_prio_tree_foreach(vma, &iter, &mapping->i_mmap, pgoff, pgoff) {
+		struct mm_struct *mm = vma->vm_mm;
+		unsigned long addr;
+		pmd_t *pmd, _pmd;
+		pte_t *pte;
+		int i;
+
+		if (vma->anon_vma || !(vma->vm_flags & VM_SHARED))
+			continue;
+		addr = vma->vm_start + ((pgoff - vma->vm_pgoff) << PAGE_SHIFT);
+		if ((addr & ~HPAGE_PMD_MASK) ||
+		    addr + HPAGE_PMD_SIZE > vma->vm_end)
+			continue;
+		if (!down_write_trylock(&mm->mmap_sem))
+			continue;
+		if (khugepaged_test_exit(mm))
+			goto next;
+		pmd = mm_find_pmd(mm, addr);
+		if (!pmd || pmd_trans_huge(*pmd))
+			goto next;
+
+		spin_lock(&mm->page_table_lock);
+		pte = pte_offset_map(pmd, addr);
+		for (i = 0; i < HPAGE_PMD_NR; i++)
+			if (!pte_none(pte[i]))
+				break;
+		pte_unmap(pte);
+		if (i < HPAGE_PMD_NR) {
+			spin_unlock(&mm->page_table_lock);
+			goto next;
+		}
+		_pmd = pmdp_clear_flush(vma, addr, pmd);
+		mm->nr_ptes--;
+		spin_unlock(&mm->page_table_lock);
+		pte_free(mm, pmd_pgtable(_pmd));
+next:
+		up_write(&mm->mmap_sem);
+	}
+	mutex_unlock(&mapping->i_mmap_mutex);
+}
+
+/*
+ * Collapse the shmem pages behind a hugepage aligned range of a shared
+ * mapping into one hugepage. Returns 1 if mmap_sem has been released.
+ */
+static int khugepaged_scan_file(struct mm_struct *mm,
+				struct vm_area_struct *vma,
+				unsigned long address)
+{
+	struct file *file = vma->vm_file;
+	pgoff_t pgoff;
+	pmd_t *pmd;
+	int ret;
+
+	pgoff = ((address - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	if (pgoff & (HPAGE_PMD_NR - 1))
+		return 0;
+	pmd = mm_find_pmd(mm, address);
+	if (pmd && pmd_trans_huge(*pmd))
+		return 0;
+
+	ret = shmem_collapse_huge(file->f_mapping, pgoff);
+	if (ret < 0)
+		return 0;
+	if (ret > 0)
+		khugepaged_pages_collapsed++;
+	if (!pmd)
+		return 0;
+
+	/* The page tables must go before the extent can be mapped huge */
+	get_file(file);
+	up_read(&mm->mmap_sem);
+	retract_page_tables(file->f_mapping, pgoff);
+	fput(file);
+	return 1;
+}
+
 static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 					    struct page **hpage)
 	__releases(&khugepaged_mm_lock)
@@ -2123,14 +2668,15 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 			break;
 		}
 
-		if ((!(vma->vm_flags & VM_HUGEPAGE) &&
+		if (vma->vm_ops ? !shmem_huge_enabled(vma) :
+		    (!(vma->vm_flags & VM_HUGEPAGE) &&
 		     !khugepaged_always()) ||
 		    (vma->vm_flags & VM_NOHUGEPAGE)) {
 		skip:
 			progress++;
 			continue;
 		}
-		if (!vma->anon_vma || vma->vm_ops)
+		if (!vma->vm_ops && !vma->anon_vma)
 			goto skip;
 		if (is_vma_temporary_stack(vma))
 			goto skip;
@@ -2138,8 +2684,8 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 		 * If is_pfn_mapping() is true is_learn_pfn_mapping()
 		 * must be true too, verify it here.
 		 */
-		VM_BUG_ON(is_linear_pfn_mapping(vma) ||
-			  vma->vm_flags & VM_NO_THP);
+		VM_BUG_ON(!vma->vm_ops && (is_linear_pfn_mapping(vma) ||
+					   vma->vm_flags & VM_NO_THP));
 
 		hstart = (vma->vm_start + ~HPAGE_PMD_MASK) & HPAGE_PMD_MASK;
 		hend = vma->vm_end & HPAGE_PMD_MASK;
@@ -2160,9 +2706,13 @@ static unsigned int khugepaged_scan_mm_slot(unsigned int pages,
 			VM_BUG_ON(khugepaged_scan.address < hstart ||
 				  khugepaged_scan.address + HPAGE_PMD_SIZE >
 				  hend);
-			ret = khugepaged_scan_pmd(mm, vma,
-						  khugepaged_scan.address,
-						  hpage);
+			if (vma->vm_ops)
+				ret = khugepaged_scan_file(mm, vma,
+						khugepaged_scan.address);
+			else
+				ret = khugepaged_scan_pmd(mm, vma,
+						khugepaged_scan.address,
+						hpage);
 			/* move to next address */
 			khugepaged_scan.address += HPAGE_PMD_SIZE;
 			progress += HPAGE_PMD_NR;
@@ -2355,7 +2905,87 @@ static int khugepaged(void *none)
 	return 0;
 }
 
-void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
+/*
+ * A huge pmd mapping file pages is split in place: the deposited page
+ * table is filled with ptes carrying the same protection, dirty and
+ * young bits, and no page refcount or mapcount needs to change. The
+ * pmd is made not present and flushed before the page table replaces
+ * it, like __split_huge_page_map() does.
+ */
+static void __split_huge_file_pmd(struct mm_struct *mm,
+				  unsigned long address, pmd_t *pmd)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	unsigned long pfn;
+	pgtable_t pgtable;
+	pgprot_t prot;
+	pmd_t _pmd;
+	int i;
+
+	assert_spin_locked(&mm->page_table_lock);
+
+	pfn = pmd_pfn(*pmd);
+	prot = pmd_pgprot(*pmd);
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		unsigned long addr = haddr + i * PAGE_SIZE;
+		pte_t *pte;
+
+		pte = pte_offset_map(&_pmd, addr);
+		BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, addr, pte, pfn_pte(pfn + i, prot));
+		pte_unmap(pte);
+	}
+
+	mm->nr_ptes++;
+	smp_wmb(); /* make ptes visible before pmd */
+	set_pmd_at(mm, haddr, pmd, pmd_mknotpresent(*pmd));
+	flush_tlb_mm(mm);
+	pmd_populate(mm, pmd, pgtable);
+}
+
+/*
+ * The huge zero page is replaced by HPAGE_PMD_NR ptes mapping the
+ * small zero page, so that a later write fault copies only 4k.
+ */
+static void __split_huge_zero_page_pmd(struct mm_struct *mm,
+				       unsigned long address, pmd_t *pmd)
+{
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	pgtable_t pgtable;
+	pgprot_t prot;
+	pmd_t _pmd;
+	int i;
+
+	assert_spin_locked(&mm->page_table_lock);
+
+	prot = pmd_pgprot(*pmd);
+	pgtable = get_pmd_huge_pte(mm);
+	pmd_populate(mm, &_pmd, pgtable);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		unsigned long addr = haddr + i * PAGE_SIZE;
+		pte_t *pte, entry;
+
+		entry = pfn_pte(my_zero_pfn(addr), prot);
+		entry = pte_mkspecial(entry);
+		pte = pte_offset_map(&_pmd, addr);
+		BUG_ON(!pte_none(*pte));
+		set_pte_at(mm, addr, pte, entry);
+		pte_unmap(pte);
+	}
+
+	mm->nr_ptes++;
+	smp_wmb(); /* make ptes visible before pmd */
+	set_pmd_at(mm, haddr, pmd, pmd_mknotpresent(*pmd));
+	flush_tlb_mm(mm);
+	pmd_populate(mm, pmd, pgtable);
+}
+
+void __split_huge_page_pmd(struct mm_struct *mm, unsigned long address,
+			   pmd_t *pmd)
 {
 	struct page *page;
 
@@ -2366,6 +2996,17 @@ void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 	}
 	page = pmd_page(*pmd);
 	VM_BUG_ON(!page_count(page));
+	if (is_huge_zero_page(page)) {
+		__split_huge_zero_page_pmd(mm, address, pmd);
+		spin_unlock(&mm->page_table_lock);
+		put_huge_zero_page();
+		return;
+	}
+	if (!PageAnon(page)) {
+		__split_huge_file_pmd(mm, address, pmd);
+		spin_unlock(&mm->page_table_lock);
+		return;
+	}
 	get_page(page);
 	spin_unlock(&mm->page_table_lock);
 
@@ -2378,28 +3019,37 @@ void __split_huge_page_pmd(struct mm_struct *mm, pmd_t *pmd)
 static void split_huge_page_address(struct mm_struct *mm,
 				    unsigned long address)
 {
-	pgd_t *pgd;
-	pud_t *pud;
 	pmd_t *pmd;
 
 	VM_BUG_ON(!(address & ~HPAGE_PMD_MASK));
 
-	pgd = pgd_offset(mm, address);
-	if (!pgd_present(*pgd))
-		return;
-
-	pud = pud_offset(pgd, address);
-	if (!pud_present(*pud))
-		return;
-
-	pmd = pmd_offset(pud, address);
-	if (!pmd_present(*pmd))
+	pmd = mm_find_pmd(mm, address);
+	if (!pmd)
 		return;
 	/*
 	 * Caller holds the mmap_sem write mode, so a huge pmd cannot
 	 * materialize from under us.
 	 */
-	split_huge_page_pmd(mm, pmd);
+	split_huge_page_pmd(mm, address, pmd);
+}
+
+/*
+ * The rmap walk of a file page looks for its pte: if the page is
+ * mapped by a huge pmd at @address, split it first. The caller holds
+ * the i_mmap_mutex or the mmap_sem, which keeps the page tables of
+ * @vma around.
+ */
+void split_huge_file_pmd_address(struct vm_area_struct *vma,
+				 unsigned long address)
+{
+	pmd_t *pmd;
+
+	if (!vma->vm_ops || !vma->vm_ops->pmd_fault)
+		return;
+
+	pmd = mm_find_pmd(vma->vm_mm, address);
+	if (pmd)
+		split_huge_page_pmd(vma->vm_mm, address, pmd);
 }
 
 void __vma_adjust_trans_huge(struct vm_area_struct *vma,
@@ -49,6 +49,7 @@
 #include <linux/page_cgroup.h>
 #include <linux/cpu.h>
 #include <linux/oom.h>
+#include <linux/writeback.h>
 #include "internal.h"
 
 #include <asm/uaccess.h>
@@ -85,6 +86,8 @@ enum mem_cgroup_stat_index {
 	MEM_CGROUP_STAT_CACHE, 	   /* # of pages charged as cache */
 	MEM_CGROUP_STAT_RSS,	   /* # of pages charged as anon rss */
 	MEM_CGROUP_STAT_FILE_MAPPED,  /* # of pages charged as file rss */
+	MEM_CGROUP_STAT_FILE_DIRTY,   /* # of dirty pages in page cache */
+	MEM_CGROUP_STAT_FILE_WRITEBACK, /* # of pages under writeback */
 	MEM_CGROUP_STAT_SWAPOUT, /* # of pages, swapped out */
 	MEM_CGROUP_STAT_DATA, /* end of data requires synchronization */
 	MEM_CGROUP_ON_MOVE,	/* someone is moving account between groups */
@@ -216,6 +219,18 @@ static void mem_cgroup_oom_notify(struct mem_cgroup *memcg);
  * no reclaim occurs from a cgroup at it's low water mark, this is
  * a feature that will be implemented much later in the future.
  */
+/*
+ * Per memcg counterparts of the vm.dirty_* sysctls.  As with the
+ * sysctls, only one value of each ratio/bytes pair is in effect and
+ * the other one is zero.
+ */
+struct vm_dirty_param {
+	int dirty_ratio;
+	int dirty_background_ratio;
+	unsigned long dirty_bytes;
+	unsigned long dirty_background_bytes;
+};
+
 struct mem_cgroup {
 	struct cgroup_subsys_state css;
 	/*
@@ -226,6 +241,21 @@ struct mem_cgroup {
 	 * the counter to account for mem+swap usage.
 	 */
 	struct res_counter memsw;
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+	/*
+	 * the counter to account for kernel memory usage.
+	 */
+	struct res_counter kmem;
+	/*
+	 * index of the memcg in the tables of per memcg slab caches, -1
+	 * while kernel memory is not accounted.
+	 */
+	int kmemcg_id;
+	/* the memcg's copies of the slab caches */
+	struct list_head memcg_slab_caches;
+	/* unused dentries and inodes charged to the memcg */
+	atomic_long_t kmem_lru[NR_MEMCG_KMEM_LRU];
+#endif
 	/*
 	 * Per cgroup active and inactive list, similar to the
 	 * per zone LRU lists.
@@ -253,6 +283,10 @@ struct mem_cgroup {
 	atomic_t	refcnt;
 
 	int	swappiness;
+	/* dirty page limits, see mem_cgroup_dirty_info() */
+	struct vm_dirty_param dirty_param;
+	/* number of writeback works queued for this memcg */
+	atomic_t	dirty_writeback_works;
 	/* OOM-Killer disable */
 	int		oom_kill_disable;
 
@@ -347,6 +381,7 @@ enum charge_type {
 #define _MEM			(0)
 #define _MEMSWAP		(1)
 #define _OOM_TYPE		(2)
+#define _KMEM			(3)
 #define MEMFILE_PRIVATE(x, val)	(((x) << 16) | (val))
 #define MEMFILE_TYPE(val)	(((val) >> 16) & 0xffff)
 #define MEMFILE_ATTR(val)	((val) & 0xffff)
@@ -1910,8 +1945,30 @@ bool mem_cgroup_handle_oom(struct mem_cgroup *memcg, gfp_t mask)
 }
 
 /*
- * Currently used to update mapped file statistics, but the routine can be
- * generalized to update other statistics as well.
+ * address_space->i_memcg records the memcg whose pages were dirtied in the
+ * mapping, so that writeback on behalf of a memcg can pick its inodes.  A
+ * mapping with dirty pages of several memcgs is written for any of them.
+ */
+#define MEMCG_MAPPING_SHARED	(~0U)
+
+static void mem_cgroup_mark_mapping(struct address_space *mapping,
+				    struct mem_cgroup *memcg)
+{
+	unsigned int id = css_id(&memcg->css);
+	unsigned int owner;
+
+	if (!mapping)
+		return;
+	owner = ACCESS_ONCE(mapping->i_memcg);
+	if (owner == id || owner == MEMCG_MAPPING_SHARED)
+		return;
+	mapping->i_memcg = owner ? MEMCG_MAPPING_SHARED : id;
+}
+
+/*
+ * Used to update mapped file, dirty and writeback statistics.  The dirty
+ * and writeback counts are updated under mapping->tree_lock and, at the
+ * end of writeback, from IRQ context.
  *
  * Notes: Race condition
  *
@@ -1966,6 +2023,23 @@ void mem_cgroup_update_page_stat(struct page *page,
 			ClearPageCgroupFileMapped(pc);
 		idx = MEM_CGROUP_STAT_FILE_MAPPED;
 		break;
+	case MEMCG_NR_FILE_DIRTY:
+		if (val > 0) {
+			if (TestSetPageCgroupFileDirty(pc))
+				goto out;
+			mem_cgroup_mark_mapping(page->mapping, memcg);
+		} else if (!TestClearPageCgroupFileDirty(pc))
+			goto out;
+		idx = MEM_CGROUP_STAT_FILE_DIRTY;
+		break;
+	case MEMCG_NR_FILE_WRITEBACK:
+		if (val > 0) {
+			if (TestSetPageCgroupFileWriteback(pc))
+				goto out;
+		} else if (!TestClearPageCgroupFileWriteback(pc))
+			goto out;
+		idx = MEM_CGROUP_STAT_FILE_WRITEBACK;
+		break;
 	default:
 		BUG();
 	}
@@ -2613,6 +2687,18 @@ static int mem_cgroup_move_account(struct page *page,
 		__this_cpu_inc(to->stat->count[MEM_CGROUP_STAT_FILE_MAPPED]);
 		preempt_enable();
 	}
+	if (PageCgroupFileDirty(pc)) {
+		preempt_disable();
+		__this_cpu_dec(from->stat->count[MEM_CGROUP_STAT_FILE_DIRTY]);
+		__this_cpu_inc(to->stat->count[MEM_CGROUP_STAT_FILE_DIRTY]);
+		preempt_enable();
+	}
+	if (PageCgroupFileWriteback(pc)) {
+		preempt_disable();
+		__this_cpu_dec(from->stat->count[MEM_CGROUP_STAT_FILE_WRITEBACK]);
+		__this_cpu_inc(to->stat->count[MEM_CGROUP_STAT_FILE_WRITEBACK]);
+		preempt_enable();
+	}
 	mem_cgroup_charge_statistics(from, PageCgroupCache(pc), -nr_pages);
 	if (uncharge)
 		/* This is not "cancel", but cancel_charge does all we need. */
@@ -3018,6 +3104,15 @@ __mem_cgroup_uncharge_common(struct page *page, enum charge_type ctype)
 
 	mem_cgroup_charge_statistics(memcg, PageCgroupCache(pc), -nr_pages);
 
+	/*
+	 * Page cache is clean and not under writeback by the time it is
+	 * uncharged, but don't let a stale flag confuse the next user.
+	 */
+	if (unlikely(TestClearPageCgroupFileDirty(pc)))
+		this_cpu_dec(memcg->stat->count[MEM_CGROUP_STAT_FILE_DIRTY]);
+	if (unlikely(TestClearPageCgroupFileWriteback(pc)))
+		this_cpu_dec(memcg->stat->count[MEM_CGROUP_STAT_FILE_WRITEBACK]);
+
 	ClearPageCgroupUsed(pc);
 	/*
 	 * pc->mem_cgroup is not cleared here. It will be accessed when it's
@@ -3638,6 +3733,550 @@ unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 	return nr_reclaimed;
 }
 
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+/*
+ * Kernel memory accounting
+ *
+ * Slab caches created with SLAB_ACCOUNT are duplicated for every memcg
+ * that accounts kernel memory.  Allocations made by the tasks of such a
+ * memcg are served from its copies of the caches, whose slab pages are
+ * charged to the kmem counter of the memcg as well as to its regular
+ * counters.  Accounting is enabled by the first write of a kmem limit,
+ * and inherited by the children created in a hierarchy afterwards.
+ *
+ * The copies are created on first use, from a work item, while the
+ * allocation that found the copy missing is served from the root cache
+ * and is not accounted.  When the memcg goes away, its copies are
+ * destroyed as soon as all their objects have been freed.
+ */
+struct jump_label_key memcg_kmem_enabled_key;
+EXPORT_SYMBOL(memcg_kmem_enabled_key);
+
+/* Allocates the kmemcg_id of the memcgs that account kernel memory */
+static DEFINE_IDA(kmem_limited_groups);
+
+/* Protects the per memcg cache tables and lists */
+static DEFINE_MUTEX(memcg_cache_mutex);
+
+bool memcg_kmem_is_active(struct mem_cgroup *memcg)
+{
+	return memcg->kmemcg_id >= 0;
+}
+
+static int memcg_activate_kmem(struct mem_cgroup *memcg)
+{
+	int id;
+
+	id = ida_simple_get(&kmem_limited_groups, 0, MEMCG_CACHES_MAX_SIZE,
+			    GFP_KERNEL);
+	if (id < 0)
+		return id;
+	memcg->kmemcg_id = id;
+
+	/*
+	 * The hooks in the slab allocator stay enabled for good once a
+	 * memcg has accounted kernel memory: objects of the per memcg
+	 * caches may be around long after the memcg is gone.
+	 */
+	mutex_lock(&memcg_cache_mutex);
+	if (!jump_label_enabled(&memcg_kmem_enabled_key))
+		jump_label_inc(&memcg_kmem_enabled_key);
+	mutex_unlock(&memcg_cache_mutex);
+	return 0;
+}
+
+static int memcg_update_kmem_limit(struct mem_cgroup *memcg, u64 val)
+{
+	struct cgroup *cont = memcg->css.cgroup;
+	int ret = 0;
+
+	/*
+	 * Objects allocated before accounting is enabled are never
+	 * charged, so it can only be enabled while the group is empty.
+	 */
+	cgroup_lock();
+	if (!memcg_kmem_is_active(memcg) && val != RESOURCE_MAX) {
+		if (cgroup_task_count(cont) || !list_empty(&cont->children)) {
+			ret = -EBUSY;
+			goto out;
+		}
+		ret = memcg_activate_kmem(memcg);
+		if (ret)
+			goto out;
+	}
+	ret = res_counter_set_limit(&memcg->kmem, val);
+out:
+	cgroup_unlock();
+	return ret;
+}
+
+static void memcg_reset_kmem(struct mem_cgroup *memcg, int name)
+{
+	if (name == RES_MAX_USAGE)
+		res_counter_reset_max(&memcg->kmem);
+	else
+		res_counter_reset_failcnt(&memcg->kmem);
+}
+
+static u64 mem_cgroup_user_usage(struct mem_cgroup *memcg)
+{
+	u64 usage = res_counter_read_u64(&memcg->res, RES_USAGE);
+	u64 kmem = res_counter_read_u64(&memcg->kmem, RES_USAGE);
+
+	return usage > kmem ? usage - kmem : 0;
+}
+
+static int memcg_charge_kmem(struct mem_cgroup *memcg, gfp_t gfp, u64 size)
+{
+	struct res_counter *fail_res;
+	struct mem_cgroup *_memcg;
+	int ret;
+
+	ret = res_counter_charge(&memcg->kmem, size, &fail_res);
+	if (ret)
+		return ret;
+
+	/*
+	 * The OOM killer is only invoked when the allocation could have
+	 * invoked it globally as well.
+	 */
+	_memcg = memcg;
+	if (!css_is_removed(&memcg->css))
+		ret = __mem_cgroup_try_charge(NULL, gfp, size >> PAGE_SHIFT,
+				&_memcg, (gfp & __GFP_FS) &&
+					 !(gfp & __GFP_NORETRY));
+	else
+		_memcg = NULL;
+
+	if (!ret && !_memcg) {
+		/*
+		 * The charge was bypassed, either because the memcg is
+		 * being removed or because the task is dying: let the
+		 * allocation go through, but keep the counters in sync
+		 * with the uncharge that will follow.
+		 */
+		res_counter_charge_nofail(&memcg->res, size, &fail_res);
+		if (do_swap_account)
+			res_counter_charge_nofail(&memcg->memsw, size,
+						  &fail_res);
+	} else if (ret)
+		res_counter_uncharge(&memcg->kmem, size);
+
+	return ret;
+}
+
+static void memcg_uncharge_kmem(struct mem_cgroup *memcg, u64 size)
+{
+	res_counter_uncharge(&memcg->res, size);
+	if (do_swap_account)
+		res_counter_uncharge(&memcg->memsw, size);
+	res_counter_uncharge(&memcg->kmem, size);
+}
+
+int __memcg_charge_slab(struct kmem_cache *s, gfp_t gfp, int order)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+	int ret;
+
+	ret = memcg_charge_kmem(params->memcg, gfp, PAGE_SIZE << order);
+	if (!ret)
+		atomic_add(1 << order, &params->nr_pages);
+	return ret;
+}
+
+void __memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+
+	memcg_uncharge_kmem(params->memcg, PAGE_SIZE << order);
+	/* The last page of a dead cache lets it be destroyed */
+	if (atomic_sub_and_test(1 << order, &params->nr_pages))
+		schedule_work(&params->destroy);
+}
+
+/*
+ * Pins a copy for a free path that still uses it after discarding slabs,
+ * so that freeing the last slab does not destroy it under our feet.
+ * Fails only if the copy has no pages left and is already going away.
+ */
+bool __memcg_cache_tryget(struct kmem_cache *s)
+{
+	return atomic_inc_not_zero(&s->memcg_params->nr_pages);
+}
+
+void __memcg_cache_put(struct kmem_cache *s)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+
+	if (atomic_dec_and_test(&params->nr_pages))
+		schedule_work(&params->destroy);
+}
+
+static void memcg_cache_destroy_work(struct work_struct *work)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *s;
+
+	params = container_of(work, struct memcg_cache_params, destroy);
+	s = params->cachep;
+
+	if (!params->released) {
+		params->released = true;
+		/*
+		 * Nothing is allocated from the cache anymore: release the
+		 * slabs that are empty now, and drop the bias on the page
+		 * count so that the last slab to be freed brings us back.
+		 */
+		kmem_cache_shrink_dead(s);
+		if (!atomic_dec_and_test(&params->nr_pages))
+			return;
+	}
+	kmem_cache_destroy(s);
+}
+
+static char *memcg_cache_name(struct mem_cgroup *memcg,
+			      struct kmem_cache *root)
+{
+	struct dentry *dentry = memcg->css.cgroup->dentry;
+
+	return kasprintf(GFP_KERNEL, "%s(%d:%s)", root->name,
+			 css_id(&memcg->css), dentry->d_name.name);
+}
+
+static int memcg_init_root_cache(struct kmem_cache *root)
+{
+	struct memcg_cache_params *params;
+
+	if (root->memcg_params)
+		return 0;
+
+	params = kzalloc(sizeof(*params), GFP_KERNEL);
+	if (!params)
+		return -ENOMEM;
+	params->memcg_caches = kcalloc(MEMCG_CACHES_MAX_SIZE,
+				       sizeof(struct kmem_cache *), GFP_KERNEL);
+	if (!params->memcg_caches) {
+		kfree(params);
+		return -ENOMEM;
+	}
+	params->is_root_cache = true;
+
+	/* Lockless readers must see an initialized table */
+	smp_wmb();
+	root->memcg_params = params;
+	return 0;
+}
+
+static void memcg_create_kmem_cache(struct mem_cgroup *memcg,
+				    struct kmem_cache *root)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *s;
+	int id = memcg->kmemcg_id;
+	char *name;
+
+	mutex_lock(&memcg_cache_mutex);
+	/*
+	 * Another allocation may have queued the same request, and no
+	 * copy must be created once the memcg caches have been killed.
+	 */
+	if (css_is_removed(&memcg->css))
+		goto out;
+	if (memcg_init_root_cache(root))
+		goto out;
+	if (root->memcg_params->memcg_caches[id])
+		goto out;
+
+	params = kzalloc(sizeof(*params), GFP_KERNEL);
+	if (!params)
+		goto out;
+	params->memcg = memcg;
+	params->root_cache = root;
+	atomic_set(&params->nr_pages, 1);
+	INIT_WORK(&params->destroy, memcg_cache_destroy_work);
+
+	name = memcg_cache_name(memcg, root);
+	s = name ? kmem_cache_create_memcg(root, name, params) : NULL;
+	kfree(name);
+	if (!s) {
+		kfree(params);
+		goto out;
+	}
+	params->cachep = s;
+	mem_cgroup_get(memcg);
+	list_add(&params->list, &memcg->memcg_slab_caches);
+
+	/* The copy must be fully set up before allocations can use it */
+	smp_wmb();
+	root->memcg_params->memcg_caches[id] = s;
+out:
+	mutex_unlock(&memcg_cache_mutex);
+}
+
+struct create_work {
+	struct mem_cgroup *memcg;
+	struct kmem_cache *cachep;
+	struct work_struct work;
+};
+
+static void memcg_create_cache_work_func(struct work_struct *w)
+{
+	struct create_work *cw = container_of(w, struct create_work, work);
+
+	memcg_create_kmem_cache(cw->memcg, cw->cachep);
+	css_put(&cw->memcg->css);
+	kfree(cw);
+}
+
+/*
+ * Creating a cache may sleep and take locks the allocating context
+ * holds already, so it is done from a work item.  Called with a css
+ * reference on @memcg, which the work item takes over.
+ */
+static void memcg_create_cache_enqueue(struct mem_cgroup *memcg,
+				       struct kmem_cache *cachep)
+{
+	struct create_work *cw;
+
+	cw = kmalloc(sizeof(*cw), GFP_NOWAIT | __GFP_NOWARN);
+	if (!cw) {
+		css_put(&memcg->css);
+		return;
+	}
+
+	cw->memcg = memcg;
+	cw->cachep = cachep;
+	INIT_WORK(&cw->work, memcg_create_cache_work_func);
+	schedule_work(&cw->work);
+}
+
+/**
+ * __memcg_kmem_get_cache - select the cache an allocation is made from
+ * @cachep: the root cache the caller allocates from
+ * @gfp: allocation flags
+ *
+ * Returns the copy of @cachep of the memcg of the current task, or
+ * @cachep itself if the memcg does not account kernel memory or its
+ * copy does not exist yet; creation of the copy is started then.
+ */
+struct kmem_cache *__memcg_kmem_get_cache(struct kmem_cache *cachep,
+					  gfp_t gfp)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *s = cachep;
+	struct mem_cgroup *memcg;
+
+	rcu_read_lock();
+	memcg = mem_cgroup_from_task(rcu_dereference(current->mm->owner));
+	if (!memcg || !memcg_kmem_is_active(memcg))
+		goto out;
+
+	params = ACCESS_ONCE(cachep->memcg_params);
+	if (params) {
+		smp_read_barrier_depends();
+		s = ACCESS_ONCE(params->memcg_caches[memcg->kmemcg_id]);
+		if (s) {
+			smp_read_barrier_depends();
+			goto out;
+		}
+		s = cachep;
+	}
+
+	if (css_tryget(&memcg->css)) {
+		rcu_read_unlock();
+		memcg_create_cache_enqueue(memcg, cachep);
+		return cachep;
+	}
+out:
+	rcu_read_unlock();
+	return s;
+}
+
+/*
+ * Called on removal of a memcg: no more objects are allocated from its
+ * copies of the caches, which are destroyed once they are empty.
+ */
+static void memcg_kill_caches(struct mem_cgroup *memcg)
+{
+	struct memcg_cache_params *params;
+	struct kmem_cache *root;
+
+	mutex_lock(&memcg_cache_mutex);
+	list_for_each_entry(params, &memcg->memcg_slab_caches, list) {
+		if (params->dead)
+			continue;
+		params->dead = true;
+		root = params->root_cache;
+		root->memcg_params->memcg_caches[memcg->kmemcg_id] = NULL;
+		params->root_cache = NULL;
+		schedule_work(&params->destroy);
+	}
+	mutex_unlock(&memcg_cache_mutex);
+}
+
+/**
+ * memcg_destroy_cache_copies - destroy the per memcg copies of a cache
+ * @s: the root cache that is being destroyed
+ *
+ * The copies that are already dead are left to their destroy work.
+ */
+void memcg_destroy_cache_copies(struct kmem_cache *s)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+	struct kmem_cache *c;
+	int i;
+
+	if (!params || !params->is_root_cache)
+		return;
+
+	for (i = 0; i < MEMCG_CACHES_MAX_SIZE; i++) {
+		mutex_lock(&memcg_cache_mutex);
+		c = params->memcg_caches[i];
+		if (c) {
+			params->memcg_caches[i] = NULL;
+			c->memcg_params->root_cache = NULL;
+			c->memcg_params->dead = true;
+		}
+		mutex_unlock(&memcg_cache_mutex);
+		if (c)
+			kmem_cache_destroy(c);
+	}
+}
+
+/**
+ * memcg_release_cache - release the memcg data of a destroyed cache
+ * @s: the cache
+ */
+void memcg_release_cache(struct kmem_cache *s)
+{
+	struct memcg_cache_params *params = s->memcg_params;
+	struct mem_cgroup *memcg;
+
+	if (!params)
+		return;
+
+	if (params->is_root_cache) {
+		kfree(params->memcg_caches);
+		kfree(params);
+		return;
+	}
+
+	memcg = params->memcg;
+	mutex_lock(&memcg_cache_mutex);
+	list_del(&params->list);
+	mutex_unlock(&memcg_cache_mutex);
+	kfree(params);
+	mem_cgroup_put(memcg);
+}
+
+/*
+ * Returns the memcg the slab object at @ptr is charged to, if any.
+ */
+struct mem_cgroup *mem_cgroup_from_kmem(void *ptr)
+{
+	struct page *page = virt_to_head_page(ptr);
+	struct kmem_cache *s;
+
+	if (!PageSlab(page))
+		return NULL;
+	s = page->slab;
+	if (!s->memcg_params || s->memcg_params->is_root_cache)
+		return NULL;
+	return s->memcg_params->memcg;
+}
+
+void __mem_cgroup_kmem_lru_mod(void *ptr, enum mem_cgroup_kmem_lru lru,
+			       int nr)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_kmem(ptr);
+
+	if (memcg)
+		atomic_long_add(nr, &memcg->kmem_lru[lru]);
+}
+
+/*
+ * Number of unused dentries or inodes charged to @memcg, which bounds
+ * what the memcg aware sb shrinker can free on its behalf.
+ */
+unsigned long mem_cgroup_kmem_lru_size(struct mem_cgroup *memcg,
+				       enum mem_cgroup_kmem_lru lru)
+{
+	long val = atomic_long_read(&memcg->kmem_lru[lru]);
+
+	return val < 0 ? 0 : val;
+}
+
+/*
+ * Number of LRU pages of @memcg, against which slab shrinking is
+ * balanced when the memcg reclaims.
+ */
+unsigned long mem_cgroup_reclaimable_pages(struct mem_cgroup *memcg)
+{
+	return mem_cgroup_nr_lru_pages(memcg, LRU_ALL_EVICTABLE);
+}
+
+static void memcg_kmem_init(struct mem_cgroup *memcg)
+{
+	res_counter_init(&memcg->kmem, NULL);
+	memcg->kmemcg_id = -1;
+	INIT_LIST_HEAD(&memcg->memcg_slab_caches);
+}
+
+/*
+ * In a hierarchy, kernel memory is charged to the parents as well, and
+ * the children of a memcg accounting kernel memory account it too.
+ */
+static int memcg_propagate_kmem(struct mem_cgroup *memcg,
+				struct mem_cgroup *parent)
+{
+	if (!parent || !parent->use_hierarchy)
+		return 0;
+
+	res_counter_init(&memcg->kmem, &parent->kmem);
+	if (!memcg_kmem_is_active(parent))
+		return 0;
+	return memcg_activate_kmem(memcg);
+}
+
+static void memcg_kmem_free(struct mem_cgroup *memcg)
+{
+	if (memcg_kmem_is_active(memcg))
+		ida_simple_remove(&kmem_limited_groups, memcg->kmemcg_id);
+}
+#else
+static int memcg_update_kmem_limit(struct mem_cgroup *memcg, u64 val)
+{
+	return -EINVAL;
+}
+
+static void memcg_reset_kmem(struct mem_cgroup *memcg, int name)
+{
+}
+
+static u64 mem_cgroup_user_usage(struct mem_cgroup *memcg)
+{
+	return res_counter_read_u64(&memcg->res, RES_USAGE);
+}
+
+static void memcg_kill_caches(struct mem_cgroup *memcg)
+{
+}
+
+static void memcg_kmem_init(struct mem_cgroup *memcg)
+{
+}
+
+static int memcg_propagate_kmem(struct mem_cgroup *memcg,
+				struct mem_cgroup *parent)
+{
+	return 0;
+}
+
+static void memcg_kmem_free(struct mem_cgroup *memcg)
+{
+}
+#endif /* CONFIG_CGROUP_MEM_RES_CTLR_KMEM */
+
 /*
  * This routine traverse page_cgroup in given list and drop them all.
  * *And* this routine doesn't reclaim page itself, just removes page_cgroup.
@@ -3747,7 +4386,7 @@ move_account:
 			goto try_to_free;
 		cond_resched();
 	/* "ret" should also be checked to ensure all lists are empty. */
-	} while (memcg->res.usage > 0 || ret);
+	} while (mem_cgroup_user_usage(memcg) > 0 || ret);
 out:
 	css_put(&memcg->css);
 	return ret;
@@ -3762,7 +4401,7 @@ try_to_free:
 	lru_add_drain_all();
 	/* try to free all pages in this cgroup */
 	shrink = 1;
-	while (nr_retries && memcg->res.usage > 0) {
+	while (nr_retries && mem_cgroup_user_usage(memcg) > 0) {
 		int progress;
 
 		if (signal_pending(current)) {
@@ -3884,6 +4523,11 @@ static u64 mem_cgroup_read(struct cgroup *cont, struct cftype *cft)
 		else
 			val = res_counter_read_u64(&memcg->memsw, name);
 		break;
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+	case _KMEM:
+		val = res_counter_read_u64(&memcg->kmem, name);
+		break;
+#endif
 	default:
 		BUG();
 		break;
@@ -3916,8 +4560,10 @@ static int mem_cgroup_write(struct cgroup *cont, struct cftype *cft,
 			break;
 		if (type == _MEM)
 			ret = mem_cgroup_resize_limit(memcg, val);
-		else
+		else if (type == _MEMSWAP)
 			ret = mem_cgroup_resize_memsw_limit(memcg, val);
+		else
+			ret = memcg_update_kmem_limit(memcg, val);
 		break;
 	case RES_SOFT_LIMIT:
 		ret = res_counter_memparse_write_strategy(buffer, &val);
@@ -3980,14 +4626,18 @@ static int mem_cgroup_reset(struct cgroup *cont, unsigned int event)
 	case RES_MAX_USAGE:
 		if (type == _MEM)
 			res_counter_reset_max(&memcg->res);
-		else
+		else if (type == _MEMSWAP)
 			res_counter_reset_max(&memcg->memsw);
+		else
+			memcg_reset_kmem(memcg, RES_MAX_USAGE);
 		break;
 	case RES_FAILCNT:
 		if (type == _MEM)
 			res_counter_reset_failcnt(&memcg->res);
-		else
+		else if (type == _MEMSWAP)
 			res_counter_reset_failcnt(&memcg->memsw);
+		else
+			memcg_reset_kmem(memcg, RES_FAILCNT);
 		break;
 	}
 
@@ -4033,6 +4683,8 @@ enum {
 	MCS_CACHE,
 	MCS_RSS,
 	MCS_FILE_MAPPED,
+	MCS_FILE_DIRTY,
+	MCS_WRITEBACK,
 	MCS_PGPGIN,
 	MCS_PGPGOUT,
 	MCS_SWAP,
@@ -4057,6 +4709,8 @@ struct {
 	{"cache", "total_cache"},
 	{"rss", "total_rss"},
 	{"mapped_file", "total_mapped_file"},
+	{"dirty", "total_dirty"},
+	{"writeback", "total_writeback"},
 	{"pgpgin", "total_pgpgin"},
 	{"pgpgout", "total_pgpgout"},
 	{"swap", "total_swap"},
@@ -4082,6 +4736,10 @@ mem_cgroup_get_local_stat(struct mem_cgroup *memcg, struct mcs_total_stat *s)
 	s->stat[MCS_RSS] += val * PAGE_SIZE;
 	val = mem_cgroup_read_stat(memcg, MEM_CGROUP_STAT_FILE_MAPPED);
 	s->stat[MCS_FILE_MAPPED] += val * PAGE_SIZE;
+	val = mem_cgroup_read_stat(memcg, MEM_CGROUP_STAT_FILE_DIRTY);
+	s->stat[MCS_FILE_DIRTY] += val * PAGE_SIZE;
+	val = mem_cgroup_read_stat(memcg, MEM_CGROUP_STAT_FILE_WRITEBACK);
+	s->stat[MCS_WRITEBACK] += val * PAGE_SIZE;
 	val = mem_cgroup_read_events(memcg, MEM_CGROUP_EVENTS_PGPGIN);
 	s->stat[MCS_PGPGIN] += val;
 	val = mem_cgroup_read_events(memcg, MEM_CGROUP_EVENTS_PGPGOUT);
@@ -4265,6 +4923,317 @@ static int mem_cgroup_swappiness_write(struct cgroup *cgrp, struct cftype *cft,
 	return 0;
 }
 
+/*
+ * The root cgroup follows the vm.dirty_* sysctls, other memcgs start out
+ * with the values of their parent.
+ */
+static void mem_cgroup_dirty_param(struct vm_dirty_param *param,
+				   struct mem_cgroup *memcg)
+{
+	if (mem_cgroup_is_root(memcg)) {
+		param->dirty_ratio = vm_dirty_ratio;
+		param->dirty_bytes = vm_dirty_bytes;
+		param->dirty_background_ratio = dirty_background_ratio;
+		param->dirty_background_bytes = dirty_background_bytes;
+	} else
+		*param = memcg->dirty_param;
+}
+
+/*
+ * The page cache the memcg could hold: its file pages plus the room left
+ * below its limit (and the limits of its hierarchical parents), but no
+ * more than is dirtyable in the whole system.
+ */
+static unsigned long mem_cgroup_dirtyable_pages(struct mem_cgroup *memcg)
+{
+	unsigned long available = determine_dirtyable_memory();
+	unsigned long margin = available;
+	unsigned long nr = 0;
+	struct mem_cgroup *iter;
+
+	for (iter = memcg; iter; iter = parent_mem_cgroup(iter))
+		margin = min(margin, mem_cgroup_margin(iter));
+	for_each_mem_cgroup_tree(iter, memcg)
+		nr += mem_cgroup_nr_lru_pages(iter, LRU_ALL_FILE);
+
+	return min(nr + margin, available);
+}
+
+static void __mem_cgroup_dirty_info(struct mem_cgroup *memcg,
+				    struct mem_cgroup_dirty_info *info)
+{
+	struct vm_dirty_param param;
+	unsigned long uninitialized_var(available);
+	unsigned long background;
+	unsigned long dirty;
+
+	mem_cgroup_dirty_param(&param, memcg);
+
+	if (!param.dirty_bytes || !param.dirty_background_bytes)
+		available = mem_cgroup_dirtyable_pages(memcg);
+
+	if (param.dirty_bytes)
+		dirty = DIV_ROUND_UP(param.dirty_bytes, PAGE_SIZE);
+	else
+		dirty = (param.dirty_ratio * available) / 100;
+
+	if (param.dirty_background_bytes)
+		background = DIV_ROUND_UP(param.dirty_background_bytes,
+					  PAGE_SIZE);
+	else
+		background = (param.dirty_background_ratio * available) / 100;
+
+	if (background >= dirty)
+		background = dirty / 2;
+
+	info->background_thresh = background;
+	info->dirty_thresh = dirty;
+	info->nr_reclaimable = mem_cgroup_recursive_stat(memcg,
+						MEM_CGROUP_STAT_FILE_DIRTY);
+	info->nr_dirty = info->nr_reclaimable +
+		mem_cgroup_recursive_stat(memcg, MEM_CGROUP_STAT_FILE_WRITEBACK);
+}
+
+/**
+ * mem_cgroup_dirty_info - dirty state of the current task's memcg
+ * @info: filled in with the memcg's dirty thresholds and dirty pages
+ *
+ * Returns false if the current task is not subject to memcg dirty limits,
+ * i.e. it belongs to the root cgroup.  The thresholds are lifted by 1/4
+ * for PF_LESS_THROTTLE and real-time tasks, as in global_dirty_limits().
+ */
+bool mem_cgroup_dirty_info(struct mem_cgroup_dirty_info *info)
+{
+	struct task_struct *tsk = current;
+	struct mem_cgroup *memcg;
+
+	if (mem_cgroup_disabled())
+		return false;
+
+	memcg = try_get_mem_cgroup_from_mm(tsk->mm);
+	if (!memcg)
+		return false;
+	if (mem_cgroup_is_root(memcg)) {
+		css_put(&memcg->css);
+		return false;
+	}
+	__mem_cgroup_dirty_info(memcg, info);
+	css_put(&memcg->css);
+
+	if (tsk->flags & PF_LESS_THROTTLE || rt_task(tsk)) {
+		info->background_thresh += info->background_thresh / 4;
+		info->dirty_thresh += info->dirty_thresh / 4;
+	}
+	return true;
+}
+
+static struct mem_cgroup *mem_cgroup_get_by_id(unsigned short id)
+{
+	struct mem_cgroup *memcg;
+
+	rcu_read_lock();
+	memcg = mem_cgroup_lookup(id);
+	if (memcg && !css_tryget(&memcg->css))
+		memcg = NULL;
+	rcu_read_unlock();
+	return memcg;
+}
+
+static void mem_cgroup_queue_writeback(struct mem_cgroup *memcg,
+				       struct backing_dev_info *bdi)
+{
+	atomic_inc(&memcg->dirty_writeback_works);
+	if (bdi_start_memcg_writeback(bdi, css_id(&memcg->css)))
+		atomic_dec(&memcg->dirty_writeback_works);
+}
+
+/**
+ * mem_cgroup_start_writeback - write back the current task's memcg
+ * @bdi: the backing device the task is dirtying pages on
+ *
+ * Queues writeback of the inodes that hold dirty pages of the current
+ * task's memcg, until the memcg is back below its background threshold.
+ * The memcg's dirty pages need not be on @bdi: if @bdi has none of them,
+ * every other bdi that does gets a work, and if none is found at all the
+ * flusher threads are woken up globally.  No new works are queued while
+ * earlier ones for the memcg are still in flight.
+ */
+void mem_cgroup_start_writeback(struct backing_dev_info *bdi)
+{
+	struct backing_dev_info *tmp;
+	struct mem_cgroup *memcg;
+	unsigned short id;
+	bool queued = false;
+
+	memcg = try_get_mem_cgroup_from_mm(current->mm);
+	if (!memcg)
+		return;
+	if (mem_cgroup_is_root(memcg))
+		goto out;
+	/* the extra count keeps others out while we look for bdis */
+	if (atomic_cmpxchg(&memcg->dirty_writeback_works, 0, 1))
+		goto out;
+
+	id = css_id(&memcg->css);
+	if (bdi_has_memcg_dirty_io(bdi, id)) {
+		mem_cgroup_queue_writeback(memcg, bdi);
+		queued = true;
+	} else {
+		rcu_read_lock();
+		list_for_each_entry_rcu(tmp, &bdi_list, bdi_list) {
+			if (tmp == bdi || !bdi_has_memcg_dirty_io(tmp, id))
+				continue;
+			mem_cgroup_queue_writeback(memcg, tmp);
+			queued = true;
+		}
+		rcu_read_unlock();
+	}
+	atomic_dec(&memcg->dirty_writeback_works);
+
+	if (!queued)
+		wakeup_flusher_threads(0, WB_REASON_MEMCG);
+out:
+	css_put(&memcg->css);
+}
+
+/*
+ * Called by the flusher threads to decide whether writeback on behalf of
+ * memcg @id should continue.
+ */
+bool mem_cgroup_over_bground_thresh(unsigned short id)
+{
+	struct mem_cgroup_dirty_info info;
+	struct mem_cgroup *memcg;
+
+	memcg = mem_cgroup_get_by_id(id);
+	if (!memcg)
+		return false;
+	__mem_cgroup_dirty_info(memcg, &info);
+	css_put(&memcg->css);
+
+	return info.nr_reclaimable > info.background_thresh;
+}
+
+void mem_cgroup_writeback_done(unsigned short id)
+{
+	struct mem_cgroup *memcg;
+
+	memcg = mem_cgroup_get_by_id(id);
+	if (!memcg)
+		return;
+	atomic_dec(&memcg->dirty_writeback_works);
+	css_put(&memcg->css);
+}
+
+/*
+ * Returns true if @mapping has dirty pages charged to memcg @id, or to one
+ * of its children under hierarchical accounting.
+ */
+bool mem_cgroup_mapping_dirtied_by(struct address_space *mapping,
+				   unsigned short id)
+{
+	unsigned int owner = ACCESS_ONCE(mapping->i_memcg);
+	struct mem_cgroup *memcg, *child;
+	bool ret = false;
+
+	if (owner == id || owner == MEMCG_MAPPING_SHARED)
+		return true;
+	if (!owner)
+		return false;
+
+	rcu_read_lock();
+	memcg = mem_cgroup_lookup(id);
+	child = mem_cgroup_lookup(owner);
+	if (memcg && child && memcg->use_hierarchy)
+		ret = css_is_ancestor(&child->css, &memcg->css);
+	rcu_read_unlock();
+	return ret;
+}
+
+/*
+ * Called when writeback found @mapping clean.  A page dirtied concurrently
+ * may lose its owner here; such a mapping is still written back by the
+ * global and per-bdi writeback, and gets an owner again the next time one
+ * of its pages is dirtied.
+ */
+void mem_cgroup_mapping_clean(struct address_space *mapping)
+{
+	mapping->i_memcg = 0;
+}
+
+enum {
+	MEM_CGROUP_DIRTY_RATIO,
+	MEM_CGROUP_DIRTY_BYTES,
+	MEM_CGROUP_DIRTY_BACKGROUND_RATIO,
+	MEM_CGROUP_DIRTY_BACKGROUND_BYTES,
+};
+
+static u64 mem_cgroup_dirty_read(struct cgroup *cgrp, struct cftype *cft)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+	struct vm_dirty_param param;
+
+	mem_cgroup_dirty_param(&param, memcg);
+
+	switch (cft->private) {
+	case MEM_CGROUP_DIRTY_RATIO:
+		return param.dirty_ratio;
+	case MEM_CGROUP_DIRTY_BYTES:
+		return param.dirty_bytes;
+	case MEM_CGROUP_DIRTY_BACKGROUND_RATIO:
+		return param.dirty_background_ratio;
+	case MEM_CGROUP_DIRTY_BACKGROUND_BYTES:
+		return param.dirty_background_bytes;
+	default:
+		BUG();
+	}
+}
+
+/*
+ * Same ranges as the vm.dirty_* sysctls.  Setting a ratio clears the
+ * corresponding bytes value and vice versa.
+ */
+static int mem_cgroup_dirty_write(struct cgroup *cgrp, struct cftype *cft,
+				  u64 val)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cgrp);
+	struct vm_dirty_param *param = &memcg->dirty_param;
+
+	/* the root cgroup is controlled by the sysctls */
+	if (cgrp->parent == NULL)
+		return -EINVAL;
+
+	switch (cft->private) {
+	case MEM_CGROUP_DIRTY_RATIO:
+		if (val > 100)
+			return -EINVAL;
+		param->dirty_ratio = val;
+		param->dirty_bytes = 0;
+		break;
+	case MEM_CGROUP_DIRTY_BYTES:
+		if (val < 2 * PAGE_SIZE || val > ULONG_MAX)
+			return -EINVAL;
+		param->dirty_bytes = val;
+		param->dirty_ratio = 0;
+		break;
+	case MEM_CGROUP_DIRTY_BACKGROUND_RATIO:
+		if (val > 100)
+			return -EINVAL;
+		param->dirty_background_ratio = val;
+		param->dirty_background_bytes = 0;
+		break;
+	case MEM_CGROUP_DIRTY_BACKGROUND_BYTES:
+		if (!val || val > ULONG_MAX)
+			return -EINVAL;
+		param->dirty_background_bytes = val;
+		param->dirty_background_ratio = 0;
+		break;
+	default:
+		BUG();
+	}
+	return 0;
+}
+
 static void __mem_cgroup_threshold(struct mem_cgroup *memcg, bool swap)
 {
 	struct mem_cgroup_threshold_ary *t;
@@ -4662,6 +5631,30 @@ static struct cftype mem_cgroup_files[] = {
 		.read_u64 = mem_cgroup_swappiness_read,
 		.write_u64 = mem_cgroup_swappiness_write,
 	},
+	{
+		.name = "dirty_ratio",
+		.read_u64 = mem_cgroup_dirty_read,
+		.write_u64 = mem_cgroup_dirty_write,
+		.private = MEM_CGROUP_DIRTY_RATIO,
+	},
+	{
+		.name = "dirty_bytes",
+		.read_u64 = mem_cgroup_dirty_read,
+		.write_u64 = mem_cgroup_dirty_write,
+		.private = MEM_CGROUP_DIRTY_BYTES,
+	},
+	{
+		.name = "dirty_background_ratio",
+		.read_u64 = mem_cgroup_dirty_read,
+		.write_u64 = mem_cgroup_dirty_write,
+		.private = MEM_CGROUP_DIRTY_BACKGROUND_RATIO,
+	},
+	{
+		.name = "dirty_background_bytes",
+		.read_u64 = mem_cgroup_dirty_read,
+		.write_u64 = mem_cgroup_dirty_write,
+		.private = MEM_CGROUP_DIRTY_BACKGROUND_BYTES,
+	},
 	{
 		.name = "move_charge_at_immigrate",
 		.read_u64 = mem_cgroup_move_charge_read,
@@ -4727,6 +5720,45 @@ static int register_memsw_files(struct cgroup *cont, struct cgroup_subsys *ss)
 }
 #endif
 
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+static struct cftype kmem_cgroup_files[] = {
+	{
+		.name = "kmem.usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_USAGE),
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.max_usage_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_MAX_USAGE),
+		.trigger = mem_cgroup_reset,
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.limit_in_bytes",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_LIMIT),
+		.write_string = mem_cgroup_write,
+		.read_u64 = mem_cgroup_read,
+	},
+	{
+		.name = "kmem.failcnt",
+		.private = MEMFILE_PRIVATE(_KMEM, RES_FAILCNT),
+		.trigger = mem_cgroup_reset,
+		.read_u64 = mem_cgroup_read,
+	},
+};
+
+static int register_kmem_files(struct cgroup *cont, struct cgroup_subsys *ss)
+{
+	return cgroup_add_files(cont, ss, kmem_cgroup_files,
+				ARRAY_SIZE(kmem_cgroup_files));
+}
+#else
+static int register_kmem_files(struct cgroup *cont, struct cgroup_subsys *ss)
+{
+	return 0;
+}
+#endif
+
 static int alloc_mem_cgroup_per_zone_info(struct mem_cgroup *memcg, int node)
 {
 	struct mem_cgroup_per_node *pn;
@@ -4809,6 +5841,7 @@ static void __mem_cgroup_free(struct mem_cgroup *memcg)
 
 	mem_cgroup_remove_from_trees(memcg);
 	free_css_id(&mem_cgroup_subsys, &memcg->css);
+	memcg_kmem_free(memcg);
 
 	for_each_node_state(node, N_POSSIBLE)
 		free_mem_cgroup_per_zone_info(memcg, node);
@@ -4897,6 +5930,7 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 	memcg = mem_cgroup_alloc();
 	if (!memcg)
 		return ERR_PTR(error);
+	memcg_kmem_init(memcg);
 
 	for_each_node_state(node, N_POSSIBLE)
 		if (alloc_mem_cgroup_per_zone_info(memcg, node))
@@ -4922,6 +5956,10 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 		memcg->oom_kill_disable = parent->oom_kill_disable;
 	}
 
+	error = memcg_propagate_kmem(memcg, parent);
+	if (error)
+		goto free_out;
+
 	if (parent && parent->use_hierarchy) {
 		res_counter_init(&memcg->res, &parent->res);
 		res_counter_init(&memcg->memsw, &parent->memsw);
@@ -4940,8 +5978,10 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 	memcg->last_scanned_node = MAX_NUMNODES;
 	INIT_LIST_HEAD(&memcg->oom_notify);
 
-	if (parent)
+	if (parent) {
 		memcg->swappiness = mem_cgroup_swappiness(parent);
+		mem_cgroup_dirty_param(&memcg->dirty_param, parent);
+	}
 	atomic_set(&memcg->refcnt, 1);
 	memcg->move_charge_at_immigrate = 0;
 	mutex_init(&memcg->thresholds_lock);
@@ -4964,6 +6004,7 @@ static void mem_cgroup_destroy(struct cgroup_subsys *ss,
 {
 	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
 
+	memcg_kill_caches(memcg);
 	mem_cgroup_put(memcg);
 }
 
@@ -4977,6 +6018,8 @@ static int mem_cgroup_populate(struct cgroup_subsys *ss,
 
 	if (!ret)
 		ret = register_memsw_files(cont, ss);
+	if (!ret)
+		ret = register_kmem_files(cont, ss);
 	return ret;
 }
 
@@ -5125,17 +6168,21 @@ static struct page *mc_handle_file_pte(struct vm_area_struct *vma,
 		pgoff = pte_to_pgoff(ptent);
 
 	/* page is moved even if it's not RSS of this task(page-faulted). */
-	page = find_get_page(mapping, pgoff);
+	page = find_get_entry(mapping, pgoff);
 
 #ifdef CONFIG_SWAP
 	/* shmem/tmpfs may report page out on swap: account for that too. */
-	if (radix_tree_exceptional_entry(page)) {
+	if (radix_tree_exceptional_entry(page) &&
+	    mapping_cap_swap_backed(mapping)) {
 		swp_entry_t swap = radix_to_swp_entry(page);
 		if (do_swap_account)
 			*entry = swap;
 		page = find_get_page(&swapper_space, swap.val);
 	}
 #endif
+	/* Otherwise it is the shadow entry of an evicted page */
+	if (radix_tree_exceptional_entry(page))
+		page = NULL;
 	return page;
 }
 
@@ -5189,7 +6236,7 @@ static int mem_cgroup_count_precharge_pte_range(pmd_t *pmd,
 	pte_t *pte;
 	spinlock_t *ptl;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(walk->mm, addr, pmd);
 
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; pte++, addr += PAGE_SIZE)
@@ -5350,7 +6397,7 @@ static int mem_cgroup_move_charge_pte_range(pmd_t *pmd,
 	pte_t *pte;
 	spinlock_t *ptl;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(walk->mm, addr, pmd);
 retry:
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; addr += PAGE_SIZE) {
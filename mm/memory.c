@@ -57,6 +57,8 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/gfp.h>
+#include <linux/mempolicy.h>
+#include <linux/migrate.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -736,20 +738,6 @@ static inline int is_cow_mapping(vm_flags_t flags)
 	return (flags & (VM_SHARED | VM_MAYWRITE)) == VM_MAYWRITE;
 }
 
-#ifndef is_zero_pfn
-static inline int is_zero_pfn(unsigned long pfn)
-{
-	return pfn == zero_pfn;
-}
-#endif
-
-#ifndef my_zero_pfn
-static inline unsigned long my_zero_pfn(unsigned long addr)
-{
-	return zero_pfn;
-}
-#endif
-
 /*
  * vm_normal_page -- This function gets the "struct page" associated with a pte.
  *
@@ -1120,6 +1108,7 @@ again:
 	init_rss_vec(rss);
 	start_pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
 	pte = start_pte;
+	flush_tlb_batched_pending(mm);
 	arch_enter_lazy_mmu_mode();
 	do {
 		pte_t ptent = *pte;
@@ -1229,8 +1218,13 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 		next = pmd_addr_end(addr, end);
 		if (pmd_trans_huge(*pmd)) {
 			if (next-addr != HPAGE_PMD_SIZE) {
-				VM_BUG_ON(!rwsem_is_locked(&tlb->mm->mmap_sem));
-				split_huge_page_pmd(vma->vm_mm, pmd);
+				/*
+				 * Truncation zaps file mappings without
+				 * holding the mmap_sem.
+				 */
+				VM_BUG_ON(!vma->vm_ops &&
+					  !rwsem_is_locked(&tlb->mm->mmap_sem));
+				split_huge_page_pmd(vma->vm_mm, addr, pmd);
 			} else if (zap_huge_pmd(tlb, vma, pmd))
 				continue;
 			/* fall through */
@@ -1464,7 +1458,7 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 	}
 	if (pmd_trans_huge(*pmd)) {
 		if (flags & FOLL_SPLIT) {
-			split_huge_page_pmd(mm, pmd);
+			split_huge_page_pmd(mm, address, pmd);
 			goto split_fallthrough;
 		}
 		spin_lock(&mm->page_table_lock);
@@ -1473,7 +1467,7 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 				spin_unlock(&mm->page_table_lock);
 				wait_split_huge_page(vma->anon_vma, pmd);
 			} else {
-				page = follow_trans_huge_pmd(mm, address,
+				page = follow_trans_huge_pmd(vma, address,
 							     pmd, flags);
 				spin_unlock(&mm->page_table_lock);
 				goto out;
@@ -2878,11 +2872,15 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		goto out;
 	}
 	delayacct_set_flag(DELAYACCT_PF_SWAPIN);
-	page = lookup_swap_cache(entry);
+	page = lookup_swap_cache(entry, vma, address);
 	if (!page) {
 		grab_swap_token(mm); /* Contend for token _before_ read-in */
-		page = swapin_readahead(entry,
-					GFP_HIGHUSER_MOVABLE, vma, address);
+		if (swap_use_vma_readahead())
+			page = swap_vma_readahead(entry, GFP_HIGHUSER_MOVABLE,
+						  vma, address, pmd);
+		else
+			page = swapin_readahead(entry, GFP_HIGHUSER_MOVABLE,
+						vma, address);
 		if (!page) {
 			/*
 			 * Back out if somebody else faulted in this pte
@@ -3370,6 +3368,60 @@ static int do_nonlinear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte);
 }
 
+/*
+ * NUMA hinting fault: the pte was made inaccessible by the NUMA
+ * scanner. Restore the vma protection, account the access to the
+ * node holding the page and migrate the page if the memory policy
+ * says it belongs elsewhere.
+ */
+static int do_numa_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			unsigned long address, pte_t *page_table, pmd_t *pmd,
+			pte_t orig_pte)
+{
+	struct page *page;
+	spinlock_t *ptl;
+	pte_t entry;
+	int current_nid, target_nid;
+	bool migrated = false;
+
+	ptl = pte_lockptr(mm, pmd);
+	spin_lock(ptl);
+	if (unlikely(!pte_same(*page_table, orig_pte))) {
+		pte_unmap_unlock(page_table, ptl);
+		return 0;
+	}
+
+	entry = pte_mkyoung(pte_modify(orig_pte, vma->vm_page_prot));
+	set_pte_at(mm, address, page_table, entry);
+	update_mmu_cache(vma, address, page_table);
+
+	page = vm_normal_page(vma, address, entry);
+	if (!page) {
+		pte_unmap_unlock(page_table, ptl);
+		return 0;
+	}
+
+	current_nid = page_to_nid(page);
+	count_vm_numa_event(NUMA_HINT_FAULTS);
+	if (current_nid == numa_node_id())
+		count_vm_numa_event(NUMA_HINT_FAULTS_LOCAL);
+	target_nid = mpol_misplaced(page, vma, address);
+	if (target_nid == -1) {
+		pte_unmap_unlock(page_table, ptl);
+		goto out;
+	}
+	get_page(page);
+	pte_unmap_unlock(page_table, ptl);
+
+	/* drops the reference */
+	migrated = migrate_misplaced_page(page, target_nid);
+	if (migrated)
+		current_nid = target_nid;
+out:
+	task_numa_fault(current_nid, 1, migrated);
+	return 0;
+}
+
 /*
  * These routines also need to handle stuff like marking pages dirty
  * and/or accessed for architectures that don't do it in hardware (most
@@ -3408,6 +3460,9 @@ int handle_pte_fault(struct mm_struct *mm,
 					pte, pmd, flags, entry);
 	}
 
+	if (pte_protnone(entry) && vma_is_accessible(vma))
+		return do_numa_page(mm, vma, address, pte, pmd, entry);
+
 	ptl = pte_lockptr(mm, pmd);
 	spin_lock(ptl);
 	if (unlikely(!pte_same(*pte, entry)))
@@ -3465,20 +3520,34 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	pmd = pmd_alloc(mm, pud, address);
 	if (!pmd)
 		return VM_FAULT_OOM;
-	if (pmd_none(*pmd) && transparent_hugepage_enabled(vma)) {
-		if (!vma->vm_ops)
-			return do_huge_pmd_anonymous_page(mm, vma, address,
-							  pmd, flags);
+	if (pmd_none(*pmd)) {
+		if (!vma->vm_ops) {
+			if (transparent_hugepage_enabled(vma))
+				return do_huge_pmd_anonymous_page(mm, vma,
+							address, pmd, flags);
+		} else if (vma->vm_ops->pmd_fault) {
+			int ret = vma->vm_ops->pmd_fault(vma, address,
+							 pmd, flags);
+			if (!(ret & VM_FAULT_FALLBACK))
+				return ret;
+		}
 	} else {
 		pmd_t orig_pmd = *pmd;
 		barrier();
 		if (pmd_trans_huge(orig_pmd)) {
+			if (pmd_protnone(orig_pmd) && vma_is_accessible(vma) &&
+			    !pmd_trans_splitting(orig_pmd))
+				return do_huge_pmd_numa_page(mm, vma, address,
+							     pmd, orig_pmd);
 			if (flags & FAULT_FLAG_WRITE &&
 			    !pmd_write(orig_pmd) &&
-			    !pmd_trans_splitting(orig_pmd))
-				return do_huge_pmd_wp_page(mm, vma, address,
-							   pmd, orig_pmd);
-			return 0;
+			    !pmd_trans_splitting(orig_pmd)) {
+				int ret = do_huge_pmd_wp_page(mm, vma, address,
+							      pmd, orig_pmd);
+				if (!(ret & VM_FAULT_FALLBACK))
+					return ret;
+			} else
+				return 0;
 		}
 	}
 
@@ -3503,6 +3572,346 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Speculative page faults
+ *
+ * A fault on a not yet populated pte of an anonymous or page cache
+ * backed vma is first tried without mmap_sem.  The vma is looked up
+ * under mm->mm_rb_lock and pinned by a reference, and the fault works
+ * on a private copy of it.  Everything that changes a vma in a way that
+ * matters here does so inside a vm_sequence write section, so the copy
+ * is known to be current if vm_sequence did not move.
+ *
+ * Page tables are walked with interrupts disabled, like in
+ * get_user_pages_fast(): a pte page is freed only after a TLB flush
+ * that needs this cpu to respond.  Page tables are never allocated
+ * here.  The new pte is installed under the pte lock, after checking
+ * that neither the pmd nor vm_sequence changed; the unmap, mremap and
+ * collapse paths bump vm_sequence before they touch the ptes, and those
+ * changes need the pte lock, so they cannot slip in after the check.
+ *
+ * Whenever anything does not match, VM_FAULT_RETRY is returned and the
+ * caller handles the fault the regular way, under mmap_sem.
+ */
+
+/* Called with interrupts disabled */
+static pte_t *spf_pte_map(struct mm_struct *mm, unsigned long address,
+			  pmd_t **pmdp, pmd_t *pmdvalp)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd, pmdval;
+
+	pgd = pgd_offset(mm, address);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		return NULL;
+	pud = pud_offset(pgd, address);
+	if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+		return NULL;
+	pmd = pmd_offset(pud, address);
+	pmdval = *pmd;
+	barrier();
+	if (pmd_none(pmdval) || pmd_trans_huge(pmdval) ||
+	    unlikely(pmd_bad(pmdval)))
+		return NULL;
+
+	*pmdp = pmd;
+	*pmdvalp = pmdval;
+	return pte_offset_map(&pmdval, address);
+}
+
+static bool spf_pte_none(struct mm_struct *mm, unsigned long address)
+{
+	pmd_t *pmd, pmdval;
+	pte_t *pte;
+	bool ret = false;
+
+	local_irq_disable();
+	pte = spf_pte_map(mm, address, &pmd, &pmdval);
+	if (pte) {
+		ret = pte_none(*pte);
+		pte_unmap(pte);
+	}
+	local_irq_enable();
+
+	return ret;
+}
+
+static bool spf_pte_map_lock(struct mm_struct *mm, struct vm_area_struct *vma,
+			     unsigned int seq, unsigned long address,
+			     pte_t **ptep, spinlock_t **ptlp)
+{
+	pmd_t *pmd, pmdval;
+	spinlock_t *ptl;
+	pte_t *pte;
+
+	local_irq_disable();
+	pte = spf_pte_map(mm, address, &pmd, &pmdval);
+	if (!pte)
+		goto fail;
+	ptl = pte_lockptr(mm, &pmdval);
+	/*
+	 * The lock holder may be waiting for this cpu to acknowledge a
+	 * TLB flush, so don't spin on it with interrupts disabled.
+	 */
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		goto fail;
+	}
+	if (!pmd_same(*pmd, pmdval) ||
+	    read_seqcount_retry(&vma->vm_sequence, seq)) {
+		pte_unmap_unlock(pte, ptl);
+		goto fail;
+	}
+	local_irq_enable();
+
+	*ptep = pte;
+	*ptlp = ptl;
+	return true;
+fail:
+	local_irq_enable();
+	return false;
+}
+
+static int spf_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
+			      struct vm_area_struct *copy, unsigned int seq,
+			      unsigned long address, unsigned int flags)
+{
+	struct page *page = NULL;
+	spinlock_t *ptl;
+	pte_t *page_table;
+	pte_t entry;
+
+	/* Use the zero-page for reads */
+	if (!(flags & FAULT_FLAG_WRITE)) {
+		entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
+						copy->vm_page_prot));
+	} else {
+		/* anon_vma_prepare() needs mmap_sem */
+		if (!copy->anon_vma)
+			return VM_FAULT_RETRY;
+		page = alloc_zeroed_user_highpage_movable(copy, address);
+		if (!page)
+			return VM_FAULT_RETRY;
+		__SetPageUptodate(page);
+
+		if (mem_cgroup_newpage_charge(page, mm, GFP_KERNEL)) {
+			page_cache_release(page);
+			return VM_FAULT_RETRY;
+		}
+
+		entry = mk_pte(page, copy->vm_page_prot);
+		if (copy->vm_flags & VM_WRITE)
+			entry = pte_mkwrite(pte_mkdirty(entry));
+	}
+
+	if (!spf_pte_map_lock(mm, vma, seq, address, &page_table, &ptl))
+		goto release;
+	if (!pte_none(*page_table)) {
+		pte_unmap_unlock(page_table, ptl);
+		goto release;
+	}
+
+	if (page) {
+		inc_mm_counter_fast(mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, copy, address);
+	}
+	set_pte_at(mm, address, page_table, entry);
+
+	/* No need to invalidate - it was non-present before */
+	update_mmu_cache(copy, address, page_table);
+	pte_unmap_unlock(page_table, ptl);
+	return 0;
+release:
+	if (page) {
+		mem_cgroup_uncharge_page(page);
+		page_cache_release(page);
+	}
+	return VM_FAULT_RETRY;
+}
+
+static int spf_linear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
+			    struct vm_area_struct *copy, unsigned int seq,
+			    unsigned long address, unsigned int flags)
+{
+	pgoff_t pgoff = (((address & PAGE_MASK)
+			- copy->vm_start) >> PAGE_SHIFT) + copy->vm_pgoff;
+	struct page *cow_page = NULL;
+	struct page *page;
+	struct vm_fault vmf;
+	spinlock_t *ptl;
+	pte_t *page_table;
+	pte_t entry;
+	int ret;
+
+	/* Only private mappings get here for writes: break COW now */
+	if (flags & FAULT_FLAG_WRITE) {
+		if (!copy->anon_vma)
+			return VM_FAULT_RETRY;
+		cow_page = alloc_page_vma(GFP_HIGHUSER_MOVABLE, copy, address);
+		if (!cow_page)
+			return VM_FAULT_RETRY;
+		if (mem_cgroup_newpage_charge(cow_page, mm, GFP_KERNEL)) {
+			page_cache_release(cow_page);
+			return VM_FAULT_RETRY;
+		}
+	}
+
+	vmf.virtual_address = (void __user *)(address & PAGE_MASK);
+	vmf.pgoff = pgoff;
+	vmf.flags = flags;
+	vmf.page = NULL;
+
+	/* Errors are reported by the regular fault path */
+	ret = copy->vm_ops->fault(copy, &vmf);
+	if (unlikely(ret & (VM_FAULT_ERROR | VM_FAULT_NOPAGE |
+			    VM_FAULT_RETRY)))
+		goto uncharge_out;
+
+	if (!(ret & VM_FAULT_LOCKED))
+		lock_page(vmf.page);
+	else
+		VM_BUG_ON(!PageLocked(vmf.page));
+
+	page = vmf.page;
+	if (cow_page) {
+		copy_user_highpage(cow_page, vmf.page, address, copy);
+		__SetPageUptodate(cow_page);
+		page = cow_page;
+	}
+
+	if (!spf_pte_map_lock(mm, vma, seq, address, &page_table, &ptl))
+		goto release;
+	if (!pte_none(*page_table)) {
+		pte_unmap_unlock(page_table, ptl);
+		goto release;
+	}
+
+	flush_icache_page(copy, page);
+	entry = mk_pte(page, copy->vm_page_prot);
+	if (cow_page) {
+		entry = maybe_mkwrite(pte_mkdirty(entry), copy);
+		inc_mm_counter_fast(mm, MM_ANONPAGES);
+		page_add_new_anon_rmap(page, copy, address);
+	} else {
+		inc_mm_counter_fast(mm, MM_FILEPAGES);
+		page_add_file_rmap(page);
+	}
+	set_pte_at(mm, address, page_table, entry);
+
+	/* no need to invalidate: a not-present page won't be cached */
+	update_mmu_cache(copy, address, page_table);
+	pte_unmap_unlock(page_table, ptl);
+
+	unlock_page(vmf.page);
+	if (cow_page)
+		page_cache_release(vmf.page);
+	return ret & ~VM_FAULT_LOCKED;
+
+release:
+	unlock_page(vmf.page);
+	page_cache_release(vmf.page);
+uncharge_out:
+	if (cow_page) {
+		mem_cgroup_uncharge_page(cow_page);
+		page_cache_release(cow_page);
+	}
+	return VM_FAULT_RETRY;
+}
+
+/**
+ * handle_speculative_fault - try to handle a user fault without mmap_sem
+ * @mm: the faulting mm
+ * @address: the faulting address
+ * @flags: FAULT_FLAG_xxx
+ *
+ * Returns VM_FAULT_RETRY if the fault was not handled, in which case the
+ * caller has to take mmap_sem and go through handle_mm_fault().  Errors
+ * are never reported from here.
+ */
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+			     unsigned int flags)
+{
+	struct vm_area_struct *vma, copy;
+	unsigned int seq;
+	int ret = VM_FAULT_RETRY;
+
+	/* Nothing here may drop mmap_sem, we do not even hold it */
+	flags &= ~FAULT_FLAG_ALLOW_RETRY;
+
+	vma = get_vma(mm, address);
+	if (!vma)
+		return VM_FAULT_RETRY;
+
+	/*
+	 * read_seqcount_begin() would spin on a vma in a write section,
+	 * which a dead one never leaves.
+	 */
+	seq = ACCESS_ONCE(vma->vm_sequence.sequence);
+	smp_rmb();
+	if (seq & 1)
+		goto out_put;
+
+	copy = *vma;
+	if (read_seqcount_retry(&vma->vm_sequence, seq))
+		goto out_put;
+
+	if (address < copy.vm_start || address >= copy.vm_end)
+		goto out_put;
+	if (copy.vm_flags & (VM_HUGETLB | VM_PFNMAP | VM_MIXEDMAP |
+			     VM_NONLINEAR))
+		goto out_put;
+	/* Stack guard pages and stack expansion need mmap_sem */
+	if ((copy.vm_flags & VM_GROWSDOWN) &&
+	    (address & PAGE_MASK) == copy.vm_start)
+		goto out_put;
+	if ((copy.vm_flags & VM_GROWSUP) &&
+	    (address & PAGE_MASK) + PAGE_SIZE == copy.vm_end)
+		goto out_put;
+
+	if (flags & FAULT_FLAG_WRITE) {
+		if (!(copy.vm_flags & VM_WRITE))
+			goto out_put;
+	} else if (!(copy.vm_flags & (VM_READ | VM_EXEC | VM_WRITE)))
+		goto out_put;
+
+	/* A mempolicy may be freed under us */
+	if (vma_policy(&copy))
+		goto out_put;
+
+	if (copy.vm_ops) {
+		/* Other fault handlers may rely on mmap_sem */
+		if (copy.vm_ops->fault != filemap_fault)
+			goto out_put;
+		/* Shared writes need ->page_mkwrite and dirty throttling */
+		if ((flags & FAULT_FLAG_WRITE) && (copy.vm_flags & VM_SHARED))
+			goto out_put;
+	}
+
+	/* Swap, COW and protection faults are left to the regular path */
+	if (!spf_pte_none(mm, address))
+		goto out_put;
+
+	__set_current_state(TASK_RUNNING);
+	check_sync_rss_stat(current);
+
+	if (copy.vm_ops)
+		ret = spf_linear_fault(mm, vma, &copy, seq, address, flags);
+	else
+		ret = spf_anonymous_page(mm, vma, &copy, seq, address, flags);
+
+	if (!(ret & VM_FAULT_RETRY)) {
+		count_vm_event(PGFAULT);
+		count_vm_event(SPECULATIVE_PGFAULT);
+		mem_cgroup_count_vm_event(mm, PGFAULT);
+	}
+out_put:
+	put_vma(vma);
+	return ret;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
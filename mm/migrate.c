@@ -1367,3 +1367,88 @@ int migrate_vmas(struct mm_struct *mm, const nodemask_t *to,
  	return err;
 }
 #endif
+
+#ifdef CONFIG_NUMA_BALANCING
+/*
+ * Returns true if the node has enough free memory above its high
+ * watermarks to take nr_migrate_pages without waking up kswapd:
+ * misplaced pages are not worth pushing a node into reclaim.
+ */
+static bool migrate_balanced_pgdat(struct pglist_data *pgdat,
+				   int nr_migrate_pages)
+{
+	int z;
+
+	for (z = pgdat->nr_zones - 1; z >= 0; z--) {
+		struct zone *zone = pgdat->node_zones + z;
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (zone->all_unreclaimable)
+			continue;
+
+		if (!zone_watermark_ok(zone, 0,
+				       high_wmark_pages(zone) +
+				       nr_migrate_pages,
+				       0, 0))
+			continue;
+		return true;
+	}
+	return false;
+}
+
+static struct page *alloc_misplaced_dst_page(struct page *page,
+					     unsigned long data,
+					     int **result)
+{
+	int nid = (int) data;
+
+	return alloc_pages_exact_node(nid,
+				      (GFP_HIGHUSER_MOVABLE | __GFP_THISNODE |
+				       __GFP_NOMEMALLOC | __GFP_NORETRY |
+				       __GFP_NOWARN) & ~GFP_IOFS, 0);
+}
+
+/*
+ * Attempt to migrate a misplaced page to the specified destination
+ * node. The caller holds a reference on the page, which is dropped
+ * before returning. Returns true if the page was migrated.
+ */
+bool migrate_misplaced_page(struct page *page, int node)
+{
+	LIST_HEAD(migratepages);
+	int nr_remaining;
+
+	/*
+	 * Pages mapped by several processes are likely to be accessed
+	 * from several nodes: leave them alone rather than bounce them.
+	 */
+	if (page_mapcount(page) != 1)
+		goto out;
+
+	if (!migrate_balanced_pgdat(NODE_DATA(node), 1))
+		goto out;
+
+	if (isolate_lru_page(page))
+		goto out;
+
+	inc_zone_page_state(page, NR_ISOLATED_ANON + page_is_file_cache(page));
+	list_add(&page->lru, &migratepages);
+	/* isolate_lru_page() took its own reference */
+	put_page(page);
+
+	nr_remaining = migrate_pages(&migratepages, alloc_misplaced_dst_page,
+				     node, false, false);
+	if (nr_remaining) {
+		putback_lru_pages(&migratepages);
+		return false;
+	}
+	count_vm_event(NUMA_PAGE_MIGRATE);
+	return true;
+
+out:
+	put_page(page);
+	return false;
+}
+#endif /* CONFIG_NUMA_BALANCING */
@@ -124,11 +124,36 @@ unsigned long __init free_all_memory_core_early(int nodeid)
 	struct range *range = NULL;
 	int nr_range;
 
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	struct memblock_region *r;
+
+	/*
+	 * Struct pages past each node's first_deferred_pfn aren't
+	 * initialised yet.  Go node by node so that the free ranges can
+	 * be cut there, the deferred init threads free the rest.  Only
+	 * the reserved pages in there are initialised right away.
+	 */
+	if (nodeid == MAX_NUMNODES) {
+		for_each_online_node(i)
+			count += free_all_memory_core_early(i);
+		return count;
+	}
+
+	for_each_memblock(reserved, r)
+		deferred_init_reserved(nodeid, PFN_DOWN(r->base),
+				       PFN_UP(r->base + r->size));
+#endif
+
 	nr_range = get_free_all_memory_range(&range, nodeid);
 
 	for (i = 0; i < nr_range; i++) {
 		start = range[i].start;
 		end = range[i].end;
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+		end = min_t(u64, end, NODE_DATA(nodeid)->first_deferred_pfn);
+		if (start >= end)
+			continue;
+#endif
 		count += end - start;
 		__free_pages_memory(start, end);
 	}
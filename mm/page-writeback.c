@@ -34,6 +34,7 @@
 #include <linux/syscalls.h>
 #include <linux/buffer_head.h>
 #include <linux/pagevec.h>
+#include <linux/memcontrol.h>
 #include <trace/events/writeback.h>
 
 /*
@@ -522,6 +523,27 @@ unsigned long bdi_dirty_limit(struct backing_dev_info *bdi, unsigned long dirty)
  *   card's bdi_dirty may rush to many times higher than bdi_setpoint.
  * - the bdi dirty thresh drops quickly due to change of JBOD workload
  */
+static long long pos_ratio_polynom(unsigned long setpoint,
+				   unsigned long dirty,
+				   unsigned long limit)
+{
+	long long pos_ratio;
+	long x;
+
+	x = div_s64(((s64)setpoint - (s64)dirty) << RATELIMIT_CALC_SHIFT,
+		    limit - setpoint + 1);
+	pos_ratio = x;
+	pos_ratio = pos_ratio * x >> RATELIMIT_CALC_SHIFT;
+	pos_ratio = pos_ratio * x >> RATELIMIT_CALC_SHIFT;
+	pos_ratio += 1 << RATELIMIT_CALC_SHIFT;
+
+	/*
+	 * Far below the freerun ceiling, which only happens when the task
+	 * is throttled for its memcg, don't let it run away.
+	 */
+	return clamp(pos_ratio, 0LL, 2LL << RATELIMIT_CALC_SHIFT);
+}
+
 static unsigned long bdi_position_ratio(struct backing_dev_info *bdi,
 					unsigned long thresh,
 					unsigned long bg_thresh,
@@ -559,12 +581,7 @@ static unsigned long bdi_position_ratio(struct backing_dev_info *bdi,
 	 *     => fast response on large errors; small oscillation near setpoint
 	 */
 	setpoint = (freerun + limit) / 2;
-	x = div_s64((setpoint - dirty) << RATELIMIT_CALC_SHIFT,
-		    limit - setpoint + 1);
-	pos_ratio = x;
-	pos_ratio = pos_ratio * x >> RATELIMIT_CALC_SHIFT;
-	pos_ratio = pos_ratio * x >> RATELIMIT_CALC_SHIFT;
-	pos_ratio += 1 << RATELIMIT_CALC_SHIFT;
+	pos_ratio = pos_ratio_polynom(setpoint, dirty, limit);
 
 	/*
 	 * We have computed basic pos_ratio above based on global situation. If
@@ -998,6 +1015,25 @@ static unsigned long bdi_max_pause(struct backing_dev_info *bdi,
 	return clamp_val(t, 4, MAX_PAUSE);
 }
 
+/*
+ * memcg_position_ratio - dirty throttling factor of a memory cgroup
+ *
+ * The global control line of bdi_position_ratio(), applied to the dirty
+ * pages and dirty thresholds of the memcg the dirtier task belongs to.
+ * The memcg's dirty_thresh is its hard limit.
+ */
+static unsigned long memcg_position_ratio(struct mem_cgroup_dirty_info *info)
+{
+	unsigned long freerun = dirty_freerun_ceiling(info->dirty_thresh,
+						      info->background_thresh);
+	unsigned long limit = info->dirty_thresh;
+
+	if (unlikely(info->nr_dirty >= limit))
+		return 0;
+
+	return pos_ratio_polynom((freerun + limit) / 2, info->nr_dirty, limit);
+}
+
 /*
  * balance_dirty_pages() must be called by processes which are generating dirty
  * data.  It looks at the number of dirty pages in the machine and will force
@@ -1024,6 +1060,8 @@ static void balance_dirty_pages(struct address_space *mapping,
 	unsigned long pos_ratio;
 	struct backing_dev_info *bdi = mapping->backing_dev_info;
 	unsigned long start_time = jiffies;
+	struct mem_cgroup_dirty_info memcg_info;
+	bool memcg_limited;
 
 	for (;;) {
 		/*
@@ -1038,6 +1076,17 @@ static void balance_dirty_pages(struct address_space *mapping,
 
 		global_dirty_limits(&background_thresh, &dirty_thresh);
 
+		/*
+		 * A task in a memory cgroup is also held to the dirty limits
+		 * of its memcg, so that one container cannot use up the dirty
+		 * budget of the whole system.  Its own inodes are written
+		 * back when the memcg goes over its background threshold.
+		 */
+		memcg_limited = mem_cgroup_dirty_info(&memcg_info);
+		if (memcg_limited && memcg_info.nr_reclaimable >
+					memcg_info.background_thresh)
+			mem_cgroup_start_writeback(bdi);
+
 		/*
 		 * Throttle it only when the background writeback cannot
 		 * catch-up. This avoids (excessively) small writeouts
@@ -1045,10 +1094,13 @@ static void balance_dirty_pages(struct address_space *mapping,
 		 */
 		freerun = dirty_freerun_ceiling(dirty_thresh,
 						background_thresh);
-		if (nr_dirty <= freerun)
-			break;
-
-		if (unlikely(!writeback_in_progress(bdi)))
+		if (nr_dirty <= freerun) {
+			if (!memcg_limited ||
+			    memcg_info.nr_dirty <= dirty_freerun_ceiling(
+					memcg_info.dirty_thresh,
+					memcg_info.background_thresh))
+				break;
+		} else if (unlikely(!writeback_in_progress(bdi)))
 			bdi_start_background_writeback(bdi);
 
 		/*
@@ -1101,6 +1153,9 @@ static void balance_dirty_pages(struct address_space *mapping,
 		pos_ratio = bdi_position_ratio(bdi, dirty_thresh,
 					       background_thresh, nr_dirty,
 					       bdi_thresh, bdi_dirty);
+		if (memcg_limited)
+			pos_ratio = min(pos_ratio,
+					memcg_position_ratio(&memcg_info));
 		task_ratelimit = ((u64)dirty_ratelimit * pos_ratio) >>
 							RATELIMIT_CALC_SHIFT;
 		if (unlikely(task_ratelimit == 0)) {
@@ -1169,8 +1224,14 @@ pause:
 
 	current->nr_dirtied = 0;
 	if (pause == 0) { /* in freerun area */
-		current->nr_dirtied_pause =
-				dirty_poll_interval(nr_dirty, dirty_thresh);
+		unsigned long interval;
+
+		interval = dirty_poll_interval(nr_dirty, dirty_thresh);
+		if (memcg_limited)
+			interval = min(interval,
+				       dirty_poll_interval(memcg_info.nr_dirty,
+						memcg_info.dirty_thresh));
+		current->nr_dirtied_pause = interval;
 	} else if (pause <= max_pause / 4 &&
 		   pages_dirtied >= current->nr_dirtied_pause) {
 		current->nr_dirtied_pause = clamp_val(
@@ -1736,6 +1797,7 @@ int __set_page_dirty_no_writeback(struct page *page)
 void account_page_dirtied(struct page *page, struct address_space *mapping)
 {
 	if (mapping_cap_account_dirty(mapping)) {
+		mem_cgroup_inc_page_stat(page, MEMCG_NR_FILE_DIRTY);
 		__inc_zone_page_state(page, NR_FILE_DIRTY);
 		__inc_zone_page_state(page, NR_DIRTIED);
 		__inc_bdi_stat(mapping->backing_dev_info, BDI_RECLAIMABLE);
@@ -1934,6 +1996,7 @@ int clear_page_dirty_for_io(struct page *page)
 		 * for more comments.
 		 */
 		if (TestClearPageDirty(page)) {
+			mem_cgroup_dec_page_stat(page, MEMCG_NR_FILE_DIRTY);
 			dec_zone_page_state(page, NR_FILE_DIRTY);
 			dec_bdi_stat(mapping->backing_dev_info,
 					BDI_RECLAIMABLE);
@@ -1961,6 +2024,8 @@ int test_clear_page_writeback(struct page *page)
 						page_index(page),
 						PAGECACHE_TAG_WRITEBACK);
 			if (bdi_cap_account_writeback(bdi)) {
+				mem_cgroup_dec_page_stat(page,
+						MEMCG_NR_FILE_WRITEBACK);
 				__dec_bdi_stat(bdi, BDI_WRITEBACK);
 				__bdi_writeout_inc(bdi);
 			}
@@ -1991,8 +2056,11 @@ int test_set_page_writeback(struct page *page)
 			radix_tree_tag_set(&mapping->page_tree,
 						page_index(page),
 						PAGECACHE_TAG_WRITEBACK);
-			if (bdi_cap_account_writeback(bdi))
+			if (bdi_cap_account_writeback(bdi)) {
+				mem_cgroup_inc_page_stat(page,
+						MEMCG_NR_FILE_WRITEBACK);
 				__inc_bdi_stat(bdi, BDI_WRITEBACK);
+			}
 		}
 		if (!PageDirty(page))
 			radix_tree_tag_clear(&mapping->page_tree,
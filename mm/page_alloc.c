@@ -57,6 +57,7 @@
 #include <linux/ftrace_event.h>
 #include <linux/memcontrol.h>
 #include <linux/prefetch.h>
+#include <linux/kthread.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -134,6 +135,8 @@ int pageblock_order __read_mostly;
 #endif
 
 static void __free_pages_ok(struct page *page, unsigned int order);
+static void __free_hot_cold_page(struct page *page, unsigned int order,
+				 int cold);
 
 /*
  * results with 256, 32 in the lowmem_reserve sysctl:
@@ -344,7 +347,12 @@ out:
 
 static void free_compound_page(struct page *page)
 {
-	__free_pages_ok(page, compound_order(page));
+	unsigned int order = compound_order(page);
+
+	if (order <= PAGE_ALLOC_COSTLY_ORDER)
+		__free_hot_cold_page(page, order, 0);
+	else
+		__free_pages_ok(page, order);
 }
 
 void prep_compound_page(struct page *page, unsigned long order)
@@ -581,10 +589,31 @@ static inline int free_pages_check(struct page *page)
 	return 0;
 }
 
+/*
+ * The pcp lists of order-0 pages come first, so that pcp_list() of an
+ * order-0 allocation or free is as cheap as it ever was.
+ */
+static inline unsigned int order_to_pindex(int migratetype, unsigned int order)
+{
+	return order * MIGRATE_PCPTYPES + migratetype;
+}
+
+static inline unsigned int pindex_to_order(unsigned int pindex)
+{
+	return pindex / MIGRATE_PCPTYPES;
+}
+
+static inline struct list_head *pcp_list(struct per_cpu_pages *pcp,
+					 int migratetype, unsigned int order)
+{
+	return &pcp->lists[order_to_pindex(migratetype, order)];
+}
+
 /*
  * Frees a number of pages from the PCP lists
- * Assumes all pages on list are in same zone, and of same order.
- * count is the number of pages to free.
+ * Assumes all pages on list are in same zone.
+ * count is the number of base pages to free, a high-order page on the
+ * lists counts for all of its pages: a little more may be freed.
  *
  * If the zone was previously in an "all pages pinned" state then look to
  * see if this freeing clears that state.
@@ -595,17 +624,20 @@ static inline int free_pages_check(struct page *page)
 static void free_pcppages_bulk(struct zone *zone, int count,
 					struct per_cpu_pages *pcp)
 {
-	int migratetype = 0;
+	int pindex = 0;
 	int batch_free = 0;
-	int to_free = count;
+	int freed = 0;
+
+	count = min(count, pcp->count);
 
 	spin_lock(&zone->lock);
 	zone->all_unreclaimable = 0;
 	zone->pages_scanned = 0;
 
-	while (to_free) {
+	while (count > 0) {
 		struct page *page;
 		struct list_head *list;
+		unsigned int order;
 
 		/*
 		 * Remove pages from lists in a round-robin fashion. A
@@ -616,25 +648,29 @@ static void free_pcppages_bulk(struct zone *zone, int count,
 		 */
 		do {
 			batch_free++;
-			if (++migratetype == MIGRATE_PCPTYPES)
-				migratetype = 0;
-			list = &pcp->lists[migratetype];
+			if (++pindex == NR_PCP_LISTS)
+				pindex = 0;
+			list = &pcp->lists[pindex];
 		} while (list_empty(list));
 
 		/* This is the only non-empty list. Free them all. */
-		if (batch_free == MIGRATE_PCPTYPES)
-			batch_free = to_free;
+		if (batch_free == NR_PCP_LISTS)
+			batch_free = count;
 
+		order = pindex_to_order(pindex);
 		do {
 			page = list_entry(list->prev, struct page, lru);
 			/* must delete as __free_one_page list manipulates */
 			list_del(&page->lru);
 			/* MIGRATE_MOVABLE list may include MIGRATE_RESERVEs */
-			__free_one_page(page, zone, 0, page_private(page));
-			trace_mm_page_pcpu_drain(page, 0, page_private(page));
-		} while (--to_free && --batch_free && !list_empty(list));
+			__free_one_page(page, zone, order, page_private(page));
+			trace_mm_page_pcpu_drain(page, order, page_private(page));
+			count -= 1 << order;
+			freed += 1 << order;
+		} while (count > 0 && --batch_free && !list_empty(list));
 	}
-	__mod_zone_page_state(zone, NR_FREE_PAGES, count);
+	pcp->count -= freed;
+	__mod_zone_page_state(zone, NR_FREE_PAGES, freed);
 	spin_unlock(&zone->lock);
 }
 
@@ -707,10 +743,10 @@ void __meminit __free_pages_bootmem(struct page *page, unsigned int order)
 		int loop;
 
 		prefetchw(page);
-		for (loop = 0; loop < BITS_PER_LONG; loop++) {
+		for (loop = 0; loop < (1 << order); loop++) {
 			struct page *p = &page[loop];
 
-			if (loop + 1 < BITS_PER_LONG)
+			if (loop + 1 < (1 << order))
 				prefetchw(p + 1);
 			__ClearPageReserved(p);
 			set_page_count(p, 0);
@@ -1074,7 +1110,6 @@ void drain_zone_pages(struct zone *zone, struct per_cpu_pages *pcp)
 	else
 		to_drain = pcp->count;
 	free_pcppages_bulk(zone, to_drain, pcp);
-	pcp->count -= to_drain;
 	local_irq_restore(flags);
 }
 #endif
@@ -1099,10 +1134,8 @@ static void drain_pages(unsigned int cpu)
 		pset = per_cpu_ptr(zone->pageset, cpu);
 
 		pcp = &pset->pcp;
-		if (pcp->count) {
+		if (pcp->count)
 			free_pcppages_bulk(zone, pcp->count, pcp);
-			pcp->count = 0;
-		}
 		local_irq_restore(flags);
 	}
 }
@@ -1160,10 +1193,11 @@ void mark_free_pages(struct zone *zone)
 #endif /* CONFIG_PM */
 
 /*
- * Free a 0-order page
+ * Free a page of order up to PAGE_ALLOC_COSTLY_ORDER to the pcp lists
  * cold == 1 ? free a cold page : free a hot page
  */
-void free_hot_cold_page(struct page *page, int cold)
+static void __free_hot_cold_page(struct page *page, unsigned int order,
+				 int cold)
 {
 	struct zone *zone = page_zone(page);
 	struct per_cpu_pages *pcp;
@@ -1171,7 +1205,12 @@ void free_hot_cold_page(struct page *page, int cold)
 	int migratetype;
 	int wasMlocked = __TestClearPageMlocked(page);
 
-	if (!free_pages_prepare(page, 0))
+	if (!free_pages_prepare(page, order))
+		return;
+
+	/* The pcp lists hold plain pages, the allocation may want another */
+	if (order && unlikely(PageCompound(page)) &&
+	    unlikely(destroy_compound_page(page, order)))
 		return;
 
 	migratetype = get_pageblock_migratetype(page);
@@ -1179,7 +1218,7 @@ void free_hot_cold_page(struct page *page, int cold)
 	local_irq_save(flags);
 	if (unlikely(wasMlocked))
 		free_page_mlock(page);
-	__count_vm_event(PGFREE);
+	__count_vm_events(PGFREE, 1 << order);
 
 	/*
 	 * We only track unmovable, reclaimable and movable on pcp lists.
@@ -1190,7 +1229,7 @@ void free_hot_cold_page(struct page *page, int cold)
 	 */
 	if (migratetype >= MIGRATE_PCPTYPES) {
 		if (unlikely(migratetype == MIGRATE_ISOLATE)) {
-			free_one_page(zone, page, 0, migratetype);
+			free_one_page(zone, page, order, migratetype);
 			goto out;
 		}
 		migratetype = MIGRATE_MOVABLE;
@@ -1198,19 +1237,26 @@ void free_hot_cold_page(struct page *page, int cold)
 
 	pcp = &this_cpu_ptr(zone->pageset)->pcp;
 	if (cold)
-		list_add_tail(&page->lru, &pcp->lists[migratetype]);
+		list_add_tail(&page->lru, pcp_list(pcp, migratetype, order));
 	else
-		list_add(&page->lru, &pcp->lists[migratetype]);
-	pcp->count++;
-	if (pcp->count >= pcp->high) {
+		list_add(&page->lru, pcp_list(pcp, migratetype, order));
+	pcp->count += 1 << order;
+	if (pcp->count >= pcp->high)
 		free_pcppages_bulk(zone, pcp->batch, pcp);
-		pcp->count -= pcp->batch;
-	}
 
 out:
 	local_irq_restore(flags);
 }
 
+/*
+ * Free a 0-order page
+ * cold == 1 ? free a cold page : free a hot page
+ */
+void free_hot_cold_page(struct page *page, int cold)
+{
+	__free_hot_cold_page(page, 0, cold);
+}
+
 /*
  * split_page takes a non-compound higher-order page, and splits it into
  * n (1<<order) sub-pages: page[0..n]
@@ -1298,18 +1344,35 @@ struct page *buffered_rmqueue(struct zone *preferred_zone,
 	struct page *page;
 	int cold = !!(gfp_flags & __GFP_COLD);
 
+	if (order && unlikely(gfp_flags & __GFP_NOFAIL)) {
+		/*
+		 * __GFP_NOFAIL is not to be used in new code.
+		 *
+		 * All __GFP_NOFAIL callers should be fixed so that they
+		 * properly detect and handle allocation failures.
+		 *
+		 * We most definitely don't want callers attempting to
+		 * allocate greater than order-1 page units with
+		 * __GFP_NOFAIL.
+		 */
+		WARN_ON_ONCE(order > 1);
+	}
+
 again:
-	if (likely(order == 0)) {
+	if (likely(order <= PAGE_ALLOC_COSTLY_ORDER)) {
 		struct per_cpu_pages *pcp;
 		struct list_head *list;
 
 		local_irq_save(flags);
 		pcp = &this_cpu_ptr(zone->pageset)->pcp;
-		list = &pcp->lists[migratetype];
+		list = pcp_list(pcp, migratetype, order);
 		if (list_empty(list)) {
-			pcp->count += rmqueue_bulk(zone, 0,
-					pcp->batch, list,
-					migratetype, cold);
+			/* Refill with about a batch worth of base pages */
+			int batch = max(pcp->batch >> order, 1);
+
+			pcp->count += rmqueue_bulk(zone, order,
+					batch, list,
+					migratetype, cold) << order;
 			if (unlikely(list_empty(list)))
 				goto failed;
 		}
@@ -1320,21 +1383,8 @@ again:
 			page = list_entry(list->next, struct page, lru);
 
 		list_del(&page->lru);
-		pcp->count--;
+		pcp->count -= 1 << order;
 	} else {
-		if (unlikely(gfp_flags & __GFP_NOFAIL)) {
-			/*
-			 * __GFP_NOFAIL is not to be used in new code.
-			 *
-			 * All __GFP_NOFAIL callers should be fixed so that they
-			 * properly detect and handle allocation failures.
-			 *
-			 * We most definitely don't want callers attempting to
-			 * allocate greater than order-1 page units with
-			 * __GFP_NOFAIL.
-			 */
-			WARN_ON_ONCE(order > 1);
-		}
 		spin_lock_irqsave(&zone->lock, flags);
 		page = __rmqueue(zone, order, migratetype);
 		spin_unlock(&zone->lock);
@@ -1637,6 +1687,33 @@ static void zlc_clear_zones_full(struct zonelist *zonelist)
 }
 #endif	/* CONFIG_NUMA */
 
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+static bool _deferred_grow_zone(struct zone *zone);
+static bool deferred_init_wait(void);
+
+/*
+ * Initialise another chunk of @zone's deferred struct pages, if it has
+ * any left.  Returns false once there's nothing left, i.e. after boot.
+ */
+static inline bool deferred_grow_zone(struct zone *zone)
+{
+	if (likely(zone->zone_pgdat->first_deferred_pfn >=
+		   zone->zone_start_pfn + zone->spanned_pages))
+		return false;
+	return _deferred_grow_zone(zone);
+}
+#else
+static inline bool deferred_grow_zone(struct zone *zone)
+{
+	return false;
+}
+
+static inline bool deferred_init_wait(void)
+{
+	return false;
+}
+#endif
+
 /*
  * get_page_from_freelist goes through the zonelist trying to allocate
  * a page.
@@ -1679,6 +1756,12 @@ zonelist_scan:
 				    classzone_idx, alloc_flags))
 				goto try_this_zone;
 
+			/* use up deferred struct pages before reclaiming */
+			while (deferred_grow_zone(zone))
+				if (zone_watermark_ok(zone, order, mark,
+					    classzone_idx, alloc_flags))
+					goto try_this_zone;
+
 			if (NUMA_BUILD && !did_zlc_setup && nr_online_nodes > 1) {
 				/*
 				 * we do zlc_setup if there are multiple nodes
@@ -2157,6 +2240,14 @@ rebalance:
 	if (test_thread_flag(TIF_MEMDIE) && !(gfp_mask & __GFP_NOFAIL))
 		goto nopage;
 
+	/*
+	 * The rest of memory may still be on its way, wait for it.  The
+	 * preferred zone may have been empty until now: start over so that
+	 * it is looked up again and kswapd is woken for the new pages.
+	 */
+	if (deferred_init_wait())
+		goto restart;
+
 	/*
 	 * Try direct compaction. The first pass is asynchronous. Subsequent
 	 * attempts after direct reclaim are synchronous
@@ -2240,6 +2331,13 @@ rebalance:
 	}
 
 nopage:
+	/*
+	 * Have kcompactd work on the fragmentation so that the next
+	 * allocation of this order has a better chance.
+	 */
+	if (order)
+		wakeup_kcompactd(preferred_zone->zone_pgdat, order,
+				 zone_idx(preferred_zone));
 	warn_alloc_failed(gfp_mask, order, NULL);
 	return page;
 got_pg:
@@ -2303,6 +2401,159 @@ __alloc_pages_nodemask(gfp_t gfp_mask, unsigned int order,
 }
 EXPORT_SYMBOL(__alloc_pages_nodemask);
 
+/**
+ * __alloc_pages_bulk - Allocate a number of order-0 pages to a list or array
+ * @gfp_mask: GFP flags for the allocation
+ * @zonelist: zonelist to allocate from
+ * @nodemask: set of nodes to allocate from, may be NULL
+ * @nr_pages: the number of pages requested, including populated @page_array slots
+ * @page_list: list to store the allocated pages, may be NULL
+ * @page_array: array to store the pages, used if @page_list is NULL
+ *
+ * This is a batched version of the page allocator that attempts to
+ * allocate nr_pages quickly.  Pages are taken from the per-cpu lists of
+ * the first suitable zone with interrupts disabled only once, and the
+ * per-cpu list is refilled from the buddy lists in pcp->batch sized
+ * chunks, as buffered_rmqueue() does, when it runs dry.  If no zone
+ * has enough free pages above the low watermark, or the allocation
+ * would have to enter reclaim, at most a single page is allocated
+ * through the regular allocator.
+ *
+ * For @page_array, only NULL slots are filled and the return value counts
+ * both the prepopulated and the newly allocated entries.  For @page_list,
+ * the return value is the number of pages added to the list.
+ */
+unsigned long __alloc_pages_bulk(gfp_t gfp_mask, struct zonelist *zonelist,
+				 nodemask_t *nodemask, unsigned long nr_pages,
+				 struct list_head *page_list,
+				 struct page **page_array)
+{
+	enum zone_type high_zoneidx = gfp_zone(gfp_mask);
+	int migratetype = allocflags_to_migratetype(gfp_mask);
+	int cold = !!(gfp_mask & __GFP_COLD);
+	struct zone *preferred_zone, *zone;
+	struct zoneref *z;
+	struct per_cpu_pages *pcp;
+	struct list_head *pcp_pages;
+	struct page *page;
+	unsigned long flags;
+	unsigned long nr_populated = 0;
+
+	if (unlikely(nr_pages == 0))
+		return 0;
+
+	/* Skip populated array elements */
+	while (page_array && nr_populated < nr_pages &&
+	       page_array[nr_populated])
+		nr_populated++;
+
+	if (nr_populated == nr_pages)
+		return nr_populated;
+
+	/* Use the single page allocator for one page */
+	if (nr_pages - nr_populated == 1)
+		goto failed;
+
+	gfp_mask &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(gfp_mask);
+
+	might_sleep_if(gfp_mask & __GFP_WAIT);
+
+	if (should_fail_alloc_page(gfp_mask, 0))
+		goto failed;
+
+	if (unlikely(!zonelist->_zonerefs->zone))
+		goto failed;
+
+	get_mems_allowed();
+	first_zones_zonelist(zonelist, high_zoneidx,
+				nodemask ? : &cpuset_current_mems_allowed,
+				&preferred_zone);
+	if (!preferred_zone)
+		goto failed_put;
+
+	/* Find the first zone that can take the whole batch without reclaim */
+	for_each_zone_zonelist_nodemask(zone, z, zonelist,
+						high_zoneidx, nodemask) {
+		if (!cpuset_zone_allowed_softwall(zone,
+						  gfp_mask | __GFP_HARDWALL))
+			continue;
+		if (zone_watermark_ok(zone, 0,
+				      low_wmark_pages(zone) + nr_pages,
+				      zone_idx(preferred_zone), 0))
+			break;
+	}
+	if (!zone)
+		goto failed_put;
+
+	local_irq_save(flags);
+	pcp = &this_cpu_ptr(zone->pageset)->pcp;
+	pcp_pages = pcp_list(pcp, migratetype, 0);
+
+	while (nr_populated < nr_pages) {
+		/* Skip existing pages */
+		if (page_array && page_array[nr_populated]) {
+			nr_populated++;
+			continue;
+		}
+
+		if (list_empty(pcp_pages)) {
+			pcp->count += rmqueue_bulk(zone, 0, pcp->batch,
+						   pcp_pages, migratetype, cold);
+			if (unlikely(list_empty(pcp_pages)))
+				break;
+		}
+
+		if (cold)
+			page = list_entry(pcp_pages->prev, struct page, lru);
+		else
+			page = list_entry(pcp_pages->next, struct page, lru);
+		list_del(&page->lru);
+		pcp->count--;
+
+		__count_zone_vm_events(PGALLOC, zone, 1);
+		zone_statistics(preferred_zone, zone, gfp_mask);
+
+		VM_BUG_ON(bad_range(zone, page));
+		/* A bad page is leaked, just as buffered_rmqueue() does */
+		if (prep_new_page(page, 0, gfp_mask))
+			continue;
+
+		if (kmemcheck_enabled)
+			kmemcheck_pagealloc_alloc(page, 0, gfp_mask);
+		trace_mm_page_alloc(page, 0, gfp_mask, migratetype);
+
+		if (page_list)
+			list_add(&page->lru, page_list);
+		else
+			page_array[nr_populated] = page;
+		nr_populated++;
+	}
+	/* Trim what the refills left over, like free_hot_cold_page() */
+	if (pcp->count >= pcp->high)
+		free_pcppages_bulk(zone, pcp->batch, pcp);
+	local_irq_restore(flags);
+	put_mems_allowed();
+
+	return nr_populated;
+
+failed_put:
+	put_mems_allowed();
+failed:
+	page = __alloc_pages_nodemask(gfp_mask, 0, zonelist, nodemask);
+	if (page) {
+		if (page_list)
+			list_add(&page->lru, page_list);
+		else
+			page_array[nr_populated] = page;
+		nr_populated++;
+	}
+
+	return nr_populated;
+}
+EXPORT_SYMBOL_GPL(__alloc_pages_bulk);
+
 /*
  * Common helper functions.
  */
@@ -2343,8 +2594,8 @@ void __pagevec_free(struct pagevec *pvec)
 void __free_pages(struct page *page, unsigned int order)
 {
 	if (put_page_testzero(page)) {
-		if (order == 0)
-			free_hot_cold_page(page, 0);
+		if (order <= PAGE_ALLOC_COSTLY_ORDER)
+			__free_hot_cold_page(page, order, 0);
 		else
 			__free_pages_ok(page, order);
 	}
@@ -3441,6 +3692,54 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 	}
 }
 
+static void __meminit __init_single_page(struct page *page, unsigned long pfn,
+				unsigned long zone, int nid)
+{
+	set_page_links(page, zone, nid, pfn);
+	mminit_verify_page_links(page, zone, nid, pfn);
+	init_page_count(page);
+	reset_page_mapcount(page);
+	INIT_LIST_HEAD(&page->lru);
+#ifdef WANT_PAGE_VIRTUAL
+	/* The shift won't overflow because ZONE_NORMAL is below 4G. */
+	if (!is_highmem_idx(zone))
+		set_page_address(page, __va(pfn << PAGE_SHIFT));
+#endif
+}
+
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/* struct pages initialised per node at boot, the rest is deferred */
+#define DEFERRED_INIT_EARLY_PAGES	(2UL << (30 - PAGE_SHIFT))
+
+/*
+ * Returns false once @pfn is far enough into the node's last zone for
+ * the rest of the zone to be left to the deferred init threads.  Lower
+ * zones are always initialised for address-constrained allocations.
+ */
+static inline bool __meminit update_defer_init(pg_data_t *pgdat,
+				unsigned long pfn, unsigned long zone_end,
+				unsigned long *nr_initialised)
+{
+	if (zone_end < pgdat_end_pfn(pgdat))
+		return true;
+
+	(*nr_initialised)++;
+	if (*nr_initialised > DEFERRED_INIT_EARLY_PAGES &&
+	    !(pfn & (MAX_ORDER_NR_PAGES - 1))) {
+		pgdat->first_deferred_pfn = pfn;
+		return false;
+	}
+	return true;
+}
+#else
+static inline bool update_defer_init(pg_data_t *pgdat,
+				unsigned long pfn, unsigned long zone_end,
+				unsigned long *nr_initialised)
+{
+	return true;
+}
+#endif
+
 /*
  * Initially all pages are reserved - free ones are freed
  * up by free_all_bootmem() once the early boot process is
@@ -3449,8 +3748,10 @@ static void setup_zone_migrate_reserve(struct zone *zone)
 void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		unsigned long start_pfn, enum memmap_context context)
 {
+	pg_data_t *pgdat = NODE_DATA(nid);
 	struct page *page;
 	unsigned long end_pfn = start_pfn + size;
+	unsigned long nr_initialised = 0;
 	unsigned long pfn;
 	struct zone *z;
 
@@ -3469,12 +3770,12 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 				continue;
 			if (!early_pfn_in_nid(pfn, nid))
 				continue;
+			if (!update_defer_init(pgdat, pfn, end_pfn,
+					       &nr_initialised))
+				break;
 		}
 		page = pfn_to_page(pfn);
-		set_page_links(page, zone, nid, pfn);
-		mminit_verify_page_links(page, zone, nid, pfn);
-		init_page_count(page);
-		reset_page_mapcount(page);
+		__init_single_page(page, pfn, zone, nid);
 		SetPageReserved(page);
 		/*
 		 * Mark the block movable so that blocks are reserved for
@@ -3494,13 +3795,6 @@ void __meminit memmap_init_zone(unsigned long size, int nid, unsigned long zone,
 		    && (pfn < z->zone_start_pfn + z->spanned_pages)
 		    && !(pfn & (pageblock_nr_pages - 1)))
 			set_pageblock_migratetype(page, MIGRATE_MOVABLE);
-
-		INIT_LIST_HEAD(&page->lru);
-#ifdef WANT_PAGE_VIRTUAL
-		/* The shift won't overflow because ZONE_NORMAL is below 4G. */
-		if (!is_highmem_idx(zone))
-			set_page_address(page, __va(pfn << PAGE_SHIFT));
-#endif
 	}
 }
 
@@ -3571,7 +3865,7 @@ static int zone_batchsize(struct zone *zone)
 static void setup_pageset(struct per_cpu_pageset *p, unsigned long batch)
 {
 	struct per_cpu_pages *pcp;
-	int migratetype;
+	int pindex;
 
 	memset(p, 0, sizeof(*p));
 
@@ -3579,8 +3873,8 @@ static void setup_pageset(struct per_cpu_pageset *p, unsigned long batch)
 	pcp->count = 0;
 	pcp->high = 6 * batch;
 	pcp->batch = max(1UL, 1 * batch);
-	for (migratetype = 0; migratetype < MIGRATE_PCPTYPES; migratetype++)
-		INIT_LIST_HEAD(&pcp->lists[migratetype]);
+	for (pindex = 0; pindex < NR_PCP_LISTS; pindex++)
+		INIT_LIST_HEAD(&pcp->lists[pindex]);
 }
 
 /*
@@ -3819,6 +4113,247 @@ bool __meminit early_pfn_in_nid(unsigned long pfn, int node)
 	for (i = first_active_region_index_in_nid(nid); i != -1; \
 				i = next_active_region_index_in_nid(i, nid))
 
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+/* protects first_deferred_pfn of all nodes */
+static DEFINE_SPINLOCK(deferred_init_lock);
+
+/* deferred init threads still running, waited for on deferred_init_wq */
+static atomic_t pgdat_init_n_undone;
+static DECLARE_WAIT_QUEUE_HEAD(deferred_init_wq);
+
+/* the deferred range of a node always lies in its highest zone */
+static struct zone * __init deferred_pfn_zone(pg_data_t *pgdat,
+					      unsigned long pfn)
+{
+	struct zone *zone = pgdat->node_zones + MAX_NR_ZONES - 1;
+
+	while (pfn < zone->zone_start_pfn ||
+	       pfn >= zone->zone_start_pfn + zone->spanned_pages)
+		zone--;
+	return zone;
+}
+
+static void __init deferred_init_page(struct zone *zone, unsigned long pfn,
+				      int nid)
+{
+	struct page *page = pfn_to_page(pfn);
+
+	__init_single_page(page, pfn, zone_idx(zone), nid);
+	if (!(pfn & (pageblock_nr_pages - 1)))
+		set_pageblock_migratetype(page, MIGRATE_MOVABLE);
+}
+
+/**
+ * deferred_init_reserved - initialise reserved struct pages in a deferred range
+ * @nid: node the reserved range is looked at for
+ * @start_pfn: start of the reserved range
+ * @end_pfn: end of the reserved range
+ *
+ * Called from free_all_bootmem() for each reserved range before the free
+ * ranges are released, so that reserved pages are valid from then on and
+ * are told apart from free ones by the deferred init threads.
+ */
+void __init deferred_init_reserved(int nid, unsigned long start_pfn,
+				   unsigned long end_pfn)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	struct zone *zone;
+	unsigned long pfn;
+
+	start_pfn = max(start_pfn, pgdat->first_deferred_pfn);
+	end_pfn = min(end_pfn, pgdat_end_pfn(pgdat));
+	if (start_pfn >= end_pfn)
+		return;
+
+	zone = deferred_pfn_zone(pgdat, start_pfn);
+	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+		if (!early_pfn_valid(pfn) || !early_pfn_in_nid(pfn, nid))
+			continue;
+		deferred_init_page(zone, pfn, nid);
+		SetPageReserved(pfn_to_page(pfn));
+	}
+}
+
+static void __init deferred_free_range(unsigned long pfn,
+				       unsigned long nr_pages)
+{
+	if (!nr_pages)
+		return;
+
+	if (nr_pages == MAX_ORDER_NR_PAGES &&
+	    !(pfn & (MAX_ORDER_NR_PAGES - 1))) {
+		__free_pages_bootmem(pfn_to_page(pfn), MAX_ORDER - 1);
+		return;
+	}
+
+	for (; nr_pages--; pfn++)
+		__free_pages_bootmem(pfn_to_page(pfn), 0);
+}
+
+/*
+ * Initialise the struct pages of [start_pfn, end_pfn), which lies in an
+ * active range of @nid, and free them.  Pages which were initialised
+ * already are reserved ones, see deferred_init_reserved().  Returns the
+ * number of pages freed.
+ */
+static unsigned long __init deferred_init_range(struct zone *zone, int nid,
+						unsigned long start_pfn,
+						unsigned long end_pfn)
+{
+	unsigned long pfn, free_base = start_pfn, nr_free = 0;
+	unsigned long nr_pages = 0;
+
+	for (pfn = start_pfn; pfn < end_pfn; pfn++) {
+		/* free in MAX_ORDER sized runs so that buddies can merge */
+		if (!(pfn & (MAX_ORDER_NR_PAGES - 1))) {
+			deferred_free_range(free_base, nr_free);
+			nr_pages += nr_free;
+			nr_free = 0;
+		}
+
+		if (!early_pfn_valid(pfn) || pfn_to_page(pfn)->flags) {
+			deferred_free_range(free_base, nr_free);
+			nr_pages += nr_free;
+			nr_free = 0;
+			continue;
+		}
+
+		deferred_init_page(zone, pfn, nid);
+		if (!nr_free)
+			free_base = pfn;
+		nr_free++;
+	}
+	deferred_free_range(free_base, nr_free);
+
+	return nr_pages + nr_free;
+}
+
+/*
+ * Struct pages are initialised in chunks of this many pfns, both by the
+ * deferred init threads and by allocations growing a zone on demand.
+ */
+#define DEFERRED_INIT_CHUNK	(MAX_ORDER_NR_PAGES << 5)
+
+/*
+ * Claim the next chunk of @pgdat's deferred range, initialise its struct
+ * pages and free the free ones.  Returns false if nothing was left.
+ */
+static bool __init deferred_init_chunk(pg_data_t *pgdat,
+				       unsigned long *nr_freed)
+{
+	unsigned long node_end = pgdat_end_pfn(pgdat);
+	unsigned long start_pfn, end_pfn, nr_pages = 0;
+	unsigned long flags;
+	int nid = pgdat->node_id;
+	struct zone *zone;
+	int i;
+
+	spin_lock_irqsave(&deferred_init_lock, flags);
+	start_pfn = pgdat->first_deferred_pfn;
+	if (start_pfn >= node_end) {
+		spin_unlock_irqrestore(&deferred_init_lock, flags);
+		return false;
+	}
+	end_pfn = min(start_pfn + DEFERRED_INIT_CHUNK, node_end);
+	pgdat->first_deferred_pfn = end_pfn < node_end ? end_pfn : ULONG_MAX;
+	spin_unlock_irqrestore(&deferred_init_lock, flags);
+
+	zone = deferred_pfn_zone(pgdat, start_pfn);
+	for_each_active_range_index_in_nid(i, nid) {
+		unsigned long spfn = max(start_pfn, early_node_map[i].start_pfn);
+		unsigned long epfn = min(end_pfn, early_node_map[i].end_pfn);
+
+		if (spfn < epfn)
+			nr_pages += deferred_init_range(zone, nid, spfn, epfn);
+	}
+
+	spin_lock_irqsave(&deferred_init_lock, flags);
+	totalram_pages += nr_pages;
+	spin_unlock_irqrestore(&deferred_init_lock, flags);
+
+	if (nr_freed)
+		*nr_freed += nr_pages;
+	return true;
+}
+
+/*
+ * Called from get_page_from_freelist() when a zone holding a deferred
+ * range fails its watermark.  All deferred ranges are claimed before
+ * the init sections go away, so this is never reached afterwards.
+ */
+static bool __ref _deferred_grow_zone(struct zone *zone)
+{
+	return deferred_init_chunk(zone->zone_pgdat, NULL);
+}
+
+static bool deferred_init_wait(void)
+{
+	if (!atomic_read(&pgdat_init_n_undone))
+		return false;
+
+	wait_event(deferred_init_wq, !atomic_read(&pgdat_init_n_undone));
+	return true;
+}
+
+static void __init deferred_init_memmap(pg_data_t *pgdat)
+{
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+	unsigned long start = jiffies;
+	unsigned long nr_pages = 0;
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+
+	while (deferred_init_chunk(pgdat, &nr_pages))
+		cond_resched();
+
+	printk(KERN_INFO "node %d initialised, %lu pages in %ums\n",
+	       pgdat->node_id, nr_pages, jiffies_to_msecs(jiffies - start));
+}
+
+static int __init deferred_init_thread(void *data)
+{
+	deferred_init_memmap(data);
+
+	if (atomic_dec_and_test(&pgdat_init_n_undone))
+		wake_up_all(&deferred_init_wq);
+	return 0;
+}
+
+/**
+ * page_alloc_init_late - initialise the deferred struct pages
+ *
+ * Start a thread per node to initialise the struct pages left over by
+ * memmap_init_zone() and wait for all of them to finish.  Called after
+ * SMP bring-up so that the nodes are initialised in parallel.
+ */
+void __init page_alloc_init_late(void)
+{
+	struct task_struct *tsk;
+	int nid;
+
+	for_each_online_node(nid) {
+		pg_data_t *pgdat = NODE_DATA(nid);
+
+		if (pgdat->first_deferred_pfn == ULONG_MAX)
+			continue;
+
+		tsk = kthread_create_on_node(deferred_init_thread, pgdat, nid,
+					     "pgdatinit%d", nid);
+		if (IS_ERR(tsk)) {
+			deferred_init_memmap(pgdat);
+			continue;
+		}
+
+		/* allocators may wait for it from now on */
+		atomic_inc(&pgdat_init_n_undone);
+		wake_up_process(tsk);
+	}
+
+	wait_event(deferred_init_wq, !atomic_read(&pgdat_init_n_undone));
+}
+#endif /* CONFIG_DEFERRED_STRUCT_PAGE_INIT */
+
 /**
  * free_bootmem_with_active_regions - Call free_bootmem_node for each active range
  * @nid: The node to free memory on. If MAX_NUMNODES, all nodes are freed.
@@ -4307,6 +4842,9 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat->nr_zones = 0;
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	pgdat->kswapd_max_order = 0;
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+#endif
 	pgdat_page_cgroup_init(pgdat);
 	
 	for (j = 0; j < MAX_NR_ZONES; j++) {
@@ -4431,6 +4969,9 @@ void __paginginit free_area_init_node(int nid, unsigned long *zones_size,
 
 	pgdat->node_id = nid;
 	pgdat->node_start_pfn = node_start_pfn;
+#ifdef CONFIG_DEFERRED_STRUCT_PAGE_INIT
+	pgdat->first_deferred_pfn = ULONG_MAX;
+#endif
 	calculate_node_totalpages(pgdat, zones_size, zholes_size);
 
 	alloc_node_mem_map(pgdat);
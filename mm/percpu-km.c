@@ -70,6 +70,9 @@ static struct pcpu_chunk *pcpu_create_chunk(void)
 
 	chunk->data = pages;
 	chunk->base_addr = page_address(pages) - pcpu_group_offsets[0];
+
+	/* the whole chunk is backed by pages from the start */
+	bitmap_fill(chunk->populated, pcpu_unit_pages);
 	return chunk;
 }
 
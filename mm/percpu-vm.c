@@ -306,6 +306,7 @@ static int pcpu_populate_chunk(struct pcpu_chunk *chunk, int off, int size)
 	int free_end = page_start, unmap_end = page_start;
 	struct page **pages;
 	unsigned long *populated;
+	unsigned long flags;
 	unsigned int cpu;
 	int rs, re, rc;
 
@@ -338,8 +339,13 @@ static int pcpu_populate_chunk(struct pcpu_chunk *chunk, int off, int size)
 	}
 	pcpu_post_map_flush(chunk, page_start, page_end);
 
-	/* commit new bitmap */
+	/*
+	 * Commit new bitmap.  Atomic allocations look at it under
+	 * pcpu_lock without holding pcpu_alloc_mutex.
+	 */
+	spin_lock_irqsave(&pcpu_lock, flags);
 	bitmap_copy(chunk->populated, populated, pcpu_unit_pages);
+	spin_unlock_irqrestore(&pcpu_lock, flags);
 clear:
 	for_each_possible_cpu(cpu)
 		memset((void *)pcpu_chunk_addr(chunk, cpu, 0) + off, 0, size);
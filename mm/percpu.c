@@ -29,17 +29,18 @@
  *
  * There are usually many small percpu allocations many of them being
  * as small as 4 bytes.  The allocator organizes chunks into lists
- * according to free size and tries to allocate from the fullest one.
- * Each chunk keeps the maximum contiguous area size hint which is
- * guaranteed to be equal to or larger than the maximum contiguous
- * area in the chunk.  This helps the allocator not to iterate the
- * chunk maps unnecessarily.
- *
- * Allocation state in each chunk is kept using an array of integers
- * on chunk->map.  A positive value in the map represents a free
- * region and negative allocated.  Allocation inside a chunk is done
- * by scanning this map sequentially and serving the first matching
- * entry.  This is mostly copied from the percpu_modalloc() allocator.
+ * according to the size of their largest free region and tries to
+ * allocate from the fullest one.  Each chunk keeps the exact size and
+ * position of its largest free region, which lets the allocator skip
+ * chunks that can't possibly serve a request.
+ *
+ * Allocation state in each chunk is kept in a bitmap on
+ * chunk->alloc_map with one bit per PCPU_MIN_ALLOC_SIZE bytes, and
+ * the start and end of each allocation are marked in
+ * chunk->bound_map.  The bitmap is split into PAGE_SIZE blocks which
+ * each cache their largest free region and the free runs at both
+ * ends.  Allocation skips blocks which can't serve the request using
+ * these hints and serves the first matching area in the bitmap.
  * Chunks can be determined from the address using the index field
  * in the page struct. The index field contains a pointer to the chunk.
  *
@@ -74,7 +75,17 @@
 #include <asm/io.h>
 
 #define PCPU_SLOT_BASE_SHIFT		5	/* 1-31 shares the same slot */
-#define PCPU_DFL_MAP_ALLOC		16	/* start a map with 16 ents */
+
+/*
+ * Chunks are managed in PCPU_MIN_ALLOC_SIZE units, one bit per unit in
+ * the allocation bitmap.  The bitmap is split into PAGE_SIZE blocks,
+ * each of which caches hints about its free space.
+ */
+#define PCPU_MIN_ALLOC_SHIFT		2
+#define PCPU_MIN_ALLOC_SIZE		(1 << PCPU_MIN_ALLOC_SHIFT)
+#define PCPU_BITMAP_BLOCK_SIZE		PAGE_SIZE
+#define PCPU_BITMAP_BLOCK_BITS		(PCPU_BITMAP_BLOCK_SIZE >>	\
+					 PCPU_MIN_ALLOC_SHIFT)
 
 #ifdef CONFIG_SMP
 /* default addr <-> pcpu_ptr mapping, override in asm/percpu.h if necessary */
@@ -96,14 +107,28 @@
 #define __pcpu_ptr_to_addr(ptr)		(void __force *)(ptr)
 #endif	/* CONFIG_SMP */
 
+/*
+ * Free space hints of one PCPU_BITMAP_BLOCK_SIZE block of a chunk's
+ * allocation bitmap.  All values are in bits, relative to the block.
+ */
+struct pcpu_block_md {
+	int			contig_hint;	/* largest free region */
+	int			contig_hint_start; /* start of that region */
+	int			left_free;	/* free bits at the start */
+	int			right_free;	/* free bits at the end */
+	int			first_free;	/* first free bit */
+};
+
 struct pcpu_chunk {
 	struct list_head	list;		/* linked to pcpu_slot lists */
-	int			free_size;	/* free bytes in the chunk */
-	int			contig_hint;	/* max contiguous size hint */
+	int			free_bytes;	/* free bytes in the chunk */
+	int			contig_bits;	/* largest free region in bits */
+	int			contig_bits_start; /* start of that region */
+	int			first_bit;	/* no free bit below this one */
 	void			*base_addr;	/* base address of this chunk */
-	int			map_used;	/* # of map entries used */
-	int			map_alloc;	/* # of map entries allocated */
-	int			*map;		/* allocation map */
+	unsigned long		*alloc_map;	/* allocation bitmap */
+	unsigned long		*bound_map;	/* allocation boundaries */
+	struct pcpu_block_md	*md_blocks;	/* per block free hints */
 	void			*data;		/* chunk data */
 	bool			immutable;	/* no [de]population allowed */
 	unsigned long		populated[];	/* populated bitmap */
@@ -153,16 +178,18 @@ static int pcpu_reserved_chunk_limit;
  * Synchronization rules.
  *
  * There are two locks - pcpu_alloc_mutex and pcpu_lock.  The former
- * protects allocation/reclaim paths, chunks, populated bitmap and
- * vmalloc mapping.  The latter is a spinlock and protects the index
- * data structures - chunk slots, chunks and area maps in chunks.
- *
- * During allocation, pcpu_alloc_mutex is kept locked all the time and
- * pcpu_lock is grabbed and released as necessary.  All actual memory
- * allocations are done using GFP_KERNEL with pcpu_lock released.  In
- * general, percpu memory can't be allocated with irq off but
- * irqsave/restore are still used in alloc path so that it can be used
- * from early init path - sched_init() specifically.
+ * protects chunk creation, population and reclaim, the populated
+ * bitmap and vmalloc mapping.  The latter is a spinlock and protects
+ * the index data structures - chunk slots, chunks and the allocation
+ * bitmaps and block hints in chunks.
+ *
+ * Finding and reserving an area only needs pcpu_lock.  Sleeping
+ * allocations additionally hold pcpu_alloc_mutex all the time so that
+ * they can create and populate chunks with pcpu_lock released, using
+ * GFP_KERNEL.  Atomic allocations only take pcpu_lock and are served
+ * from pages that are already populated.  irqsave/restore are used in
+ * the alloc path so that it can be used from early init path -
+ * sched_init() specifically - and from atomic context.
  *
  * Free path accesses and alters only the index data structures, so it
  * can be safely called from atomic context.  When memory needs to be
@@ -210,12 +237,29 @@ static int pcpu_size_to_slot(int size)
 	return __pcpu_size_to_slot(size);
 }
 
+/* chunks are sorted into slots by the size of their largest free region */
 static int pcpu_chunk_slot(const struct pcpu_chunk *chunk)
 {
-	if (chunk->free_size < sizeof(int) || chunk->contig_hint < sizeof(int))
+	if (chunk->free_bytes < PCPU_MIN_ALLOC_SIZE || !chunk->contig_bits)
 		return 0;
 
-	return pcpu_size_to_slot(chunk->free_size);
+	return pcpu_size_to_slot(chunk->contig_bits * PCPU_MIN_ALLOC_SIZE);
+}
+
+static int pcpu_chunk_map_bits(void)
+{
+	return pcpu_unit_size >> PCPU_MIN_ALLOC_SHIFT;
+}
+
+static int pcpu_chunk_nr_blocks(void)
+{
+	return pcpu_unit_size / PCPU_BITMAP_BLOCK_SIZE;
+}
+
+static unsigned long *pcpu_index_alloc_map(struct pcpu_chunk *chunk, int index)
+{
+	return chunk->alloc_map +
+		index * PCPU_BITMAP_BLOCK_BITS / BITS_PER_LONG;
 }
 
 /* set the pointer to a chunk in a page struct */
@@ -337,138 +381,234 @@ static void pcpu_chunk_relocate(struct pcpu_chunk *chunk, int oslot)
 	}
 }
 
+/*
+ * Free region iterator over an allocation bitmap.  Iterate over the
+ * runs of clear bits between @start and @end in @map.  @rs and @re
+ * are set to the start and end bit of the current free region.
+ */
+#define pcpu_for_each_free_region(map, rs, re, start, end)		\
+	for ((rs) = find_next_zero_bit((map), (end), (start)),		\
+	     (re) = find_next_bit((map), (end), (rs));			\
+	     (rs) < (end);						\
+	     (rs) = find_next_zero_bit((map), (end), (re)),		\
+	     (re) = find_next_bit((map), (end), (rs)))
+
 /**
- * pcpu_need_to_extend - determine whether chunk area map needs to be extended
+ * pcpu_block_update - update a block's hints with a free region
+ * @block: block of interest
+ * @start: start bit of the free region, relative to @block
+ * @end: end bit of the free region, relative to @block
+ *
+ * Feed the free region [@start, @end) into the hints of @block.
+ * Regions should be fed in ascending order after the hints were
+ * reset so that the lowest of equally sized regions is remembered.
+ */
+static void pcpu_block_update(struct pcpu_block_md *block, int start, int end)
+{
+	int contig = end - start;
+
+	block->first_free = min(block->first_free, start);
+	if (start == 0)
+		block->left_free = contig;
+	if (end == PCPU_BITMAP_BLOCK_BITS)
+		block->right_free = contig;
+
+	if (contig > block->contig_hint) {
+		block->contig_hint_start = start;
+		block->contig_hint = contig;
+	}
+}
+
+/**
+ * pcpu_block_refresh_hint - rebuild the hints of a block
  * @chunk: chunk of interest
+ * @index: index of the block
  *
- * Determine whether area map of @chunk needs to be extended to
- * accommodate a new allocation.
+ * Rescan the allocation bitmap of the @index'th block of @chunk and
+ * rebuild its hints from scratch.
  *
  * CONTEXT:
  * pcpu_lock.
- *
- * RETURNS:
- * New target map allocation length if extension is necessary, 0
- * otherwise.
  */
-static int pcpu_need_to_extend(struct pcpu_chunk *chunk)
+static void pcpu_block_refresh_hint(struct pcpu_chunk *chunk, int index)
 {
-	int new_alloc;
+	struct pcpu_block_md *block = chunk->md_blocks + index;
+	unsigned long *alloc_map = pcpu_index_alloc_map(chunk, index);
+	int rs, re;
 
-	if (chunk->map_alloc >= chunk->map_used + 2)
-		return 0;
+	block->contig_hint = 0;
+	block->left_free = block->right_free = 0;
+	block->first_free = PCPU_BITMAP_BLOCK_BITS;
 
-	new_alloc = PCPU_DFL_MAP_ALLOC;
-	while (new_alloc < chunk->map_used + 2)
-		new_alloc *= 2;
+	pcpu_for_each_free_region(alloc_map, rs, re, 0, PCPU_BITMAP_BLOCK_BITS)
+		pcpu_block_update(block, rs, re);
+}
 
-	return new_alloc;
+/* remember [@start, @start + @bits) if it beats the chunk's contig hint */
+static void pcpu_chunk_update(struct pcpu_chunk *chunk, int start, int bits)
+{
+	if (bits > chunk->contig_bits) {
+		chunk->contig_bits_start = start;
+		chunk->contig_bits = bits;
+	}
 }
 
 /**
- * pcpu_extend_area_map - extend area map of a chunk
+ * pcpu_chunk_refresh_hint - rebuild the hints of a chunk
  * @chunk: chunk of interest
- * @new_alloc: new target allocation length of the area map
  *
- * Extend area map of @chunk to have @new_alloc entries.
+ * Rebuild the contig hint and first free bit of @chunk from the
+ * block hints.  Free regions crossing block boundaries are put
+ * together from the right and left free runs of adjacent blocks, so
+ * the allocation bitmap itself isn't scanned.
  *
  * CONTEXT:
- * Does GFP_KERNEL allocation.  Grabs and releases pcpu_lock.
- *
- * RETURNS:
- * 0 on success, -errno on failure.
+ * pcpu_lock.
  */
-static int pcpu_extend_area_map(struct pcpu_chunk *chunk, int new_alloc)
+static void pcpu_chunk_refresh_hint(struct pcpu_chunk *chunk)
 {
-	int *old = NULL, *new = NULL;
-	size_t old_size = 0, new_size = new_alloc * sizeof(new[0]);
-	unsigned long flags;
-
-	new = pcpu_mem_zalloc(new_size);
-	if (!new)
-		return -ENOMEM;
+	struct pcpu_block_md *block = chunk->md_blocks;
+	int nr_blocks = pcpu_chunk_nr_blocks();
+	int i, base, run = 0, run_start = 0;
 
-	/* acquire pcpu_lock and switch to new area map */
-	spin_lock_irqsave(&pcpu_lock, flags);
-
-	if (new_alloc <= chunk->map_alloc)
-		goto out_unlock;
+	chunk->contig_bits = 0;
+	chunk->first_bit = pcpu_chunk_map_bits();
 
-	old_size = chunk->map_alloc * sizeof(chunk->map[0]);
-	old = chunk->map;
+	for (i = 0; i < nr_blocks; i++, block++) {
+		base = i * PCPU_BITMAP_BLOCK_BITS;
 
-	memcpy(new, old, old_size);
+		if (block->first_free < PCPU_BITMAP_BLOCK_BITS)
+			chunk->first_bit = min(chunk->first_bit,
+					       base + block->first_free);
 
-	chunk->map_alloc = new_alloc;
-	chunk->map = new;
-	new = NULL;
+		/* fully free block, extend the running region */
+		if (block->contig_hint == PCPU_BITMAP_BLOCK_BITS) {
+			if (!run)
+				run_start = base;
+			run += PCPU_BITMAP_BLOCK_BITS;
+			continue;
+		}
 
-out_unlock:
-	spin_unlock_irqrestore(&pcpu_lock, flags);
+		/* the running region ends with the left free run */
+		if (!run)
+			run_start = base;
+		pcpu_chunk_update(chunk, run_start, run + block->left_free);
+		pcpu_chunk_update(chunk, base + block->contig_hint_start,
+				  block->contig_hint);
 
-	/*
-	 * pcpu_mem_free() might end up calling vfree() which uses
-	 * IRQ-unsafe lock and thus can't be called under pcpu_lock.
-	 */
-	pcpu_mem_free(old, old_size);
-	pcpu_mem_free(new, new_size);
+		run = block->right_free;
+		run_start = base + PCPU_BITMAP_BLOCK_BITS - run;
+	}
 
-	return 0;
+	if (run)
+		pcpu_chunk_update(chunk, run_start, run);
 }
 
 /**
- * pcpu_split_block - split a map block
+ * pcpu_mark_area - mark an area allocated in a chunk's bitmaps
  * @chunk: chunk of interest
- * @i: index of map block to split
- * @head: head size in bytes (can be 0)
- * @tail: tail size in bytes (can be 0)
+ * @bit_off: start bit of the area
+ * @bits: size of the area in bits
  *
- * Split the @i'th map block into two or three blocks.  If @head is
- * non-zero, @head bytes block is inserted before block @i moving it
- * to @i+1 and reducing its size by @head bytes.
- *
- * If @tail is non-zero, the target block, which can be @i or @i+1
- * depending on @head, is reduced by @tail bytes and @tail byte block
- * is inserted after the target block.
- *
- * @chunk->map must have enough free slots to accommodate the split.
+ * Mark [@bit_off, @bit_off + @bits) allocated and record its
+ * boundaries, then refresh the hints of the blocks it touches.  The
+ * chunk hints are left alone.
  *
  * CONTEXT:
  * pcpu_lock.
  */
-static void pcpu_split_block(struct pcpu_chunk *chunk, int i,
-			     int head, int tail)
+static void pcpu_mark_area(struct pcpu_chunk *chunk, int bit_off, int bits)
 {
-	int nr_extra = !!head + !!tail;
+	int end = bit_off + bits;
+	int i;
 
-	BUG_ON(chunk->map_alloc < chunk->map_used + nr_extra);
+	bitmap_set(chunk->alloc_map, bit_off, bits);
+	__set_bit(bit_off, chunk->bound_map);
+	bitmap_clear(chunk->bound_map, bit_off + 1, bits - 1);
+	__set_bit(end, chunk->bound_map);
 
-	/* insert new subblocks */
-	memmove(&chunk->map[i + nr_extra], &chunk->map[i],
-		sizeof(chunk->map[0]) * (chunk->map_used - i));
-	chunk->map_used += nr_extra;
+	for (i = bit_off / PCPU_BITMAP_BLOCK_BITS;
+	     i <= (end - 1) / PCPU_BITMAP_BLOCK_BITS; i++)
+		pcpu_block_refresh_hint(chunk, i);
+}
 
-	if (head) {
-		chunk->map[i + 1] = chunk->map[i] - head;
-		chunk->map[i++] = head;
+/**
+ * pcpu_find_block_fit - find a free area for an allocation
+ * @chunk: chunk of interest
+ * @bits: size of the allocation in bits
+ * @align: wanted alignment in bytes
+ * @pop_only: only consider areas backed by populated pages
+ *
+ * Find the lowest free area of @bits aligned at @align in @chunk.
+ * Blocks which can neither hold the area nor start one crossing into
+ * the next block are skipped using the block hints.
+ *
+ * CONTEXT:
+ * pcpu_lock.
+ *
+ * RETURNS:
+ * Start bit of the found area, -1 if there's none.
+ */
+static int pcpu_find_block_fit(struct pcpu_chunk *chunk, int bits,
+			       size_t align, bool pop_only)
+{
+	int map_bits = pcpu_chunk_map_bits();
+	int nr_blocks = pcpu_chunk_nr_blocks();
+	unsigned long align_mask;
+	struct pcpu_block_md *block;
+	int i, start, bit_off, rs, re, page_end;
+
+	if (chunk->contig_bits < bits)
+		return -1;
+
+	align_mask = max_t(size_t, align >> PCPU_MIN_ALLOC_SHIFT, 1) - 1;
+
+	/* skip to the first block a fitting area can start in */
+	i = chunk->first_bit / PCPU_BITMAP_BLOCK_BITS;
+	for (block = chunk->md_blocks + i; i < nr_blocks; i++, block++) {
+		if (block->contig_hint >= bits ||
+		    block->right_free)
+			break;
 	}
-	if (tail) {
-		chunk->map[i++] -= tail;
-		chunk->map[i] = tail;
+	if (i == nr_blocks)
+		return -1;
+
+	start = i * PCPU_BITMAP_BLOCK_BITS;
+	if (block->contig_hint >= bits)
+		start += block->first_free;
+	else
+		start += PCPU_BITMAP_BLOCK_BITS - block->right_free;
+	start = max(start, chunk->first_bit);
+
+	while (true) {
+		bit_off = bitmap_find_next_zero_area(chunk->alloc_map, map_bits,
+						     start, bits, align_mask);
+		if (bit_off + bits > map_bits)
+			return -1;
+		if (!pop_only)
+			return bit_off;
+
+		/* all pages under the area must be populated */
+		rs = (bit_off << PCPU_MIN_ALLOC_SHIFT) >> PAGE_SHIFT;
+		page_end = PFN_UP((bit_off + bits) << PCPU_MIN_ALLOC_SHIFT);
+		pcpu_next_unpop(chunk, &rs, &re, page_end);
+		if (rs >= page_end)
+			return bit_off;
+
+		start = (re << PAGE_SHIFT) >> PCPU_MIN_ALLOC_SHIFT;
 	}
 }
 
 /**
  * pcpu_alloc_area - allocate area from a pcpu_chunk
  * @chunk: chunk of interest
- * @size: wanted size in bytes
+ * @bits: size of the area in PCPU_MIN_ALLOC_SIZE units
  * @align: wanted align
+ * @pop_only: only allocate from populated pages
  *
- * Try to allocate @size bytes area aligned at @align from @chunk.
- * Note that this function only allocates the offset.  It doesn't
- * populate or map the area.
- *
- * @chunk->map must have at least two free slots.
+ * Try to allocate @bits units aligned at @align from @chunk.  Note
+ * that this function only allocates the offset.  It doesn't populate
+ * or map the area.
  *
  * CONTEXT:
  * pcpu_lock.
@@ -477,81 +617,32 @@ static void pcpu_split_block(struct pcpu_chunk *chunk, int i,
  * Allocated offset in @chunk on success, -1 if no matching area is
  * found.
  */
-static int pcpu_alloc_area(struct pcpu_chunk *chunk, int size, int align)
+static int pcpu_alloc_area(struct pcpu_chunk *chunk, int bits, size_t align,
+			   bool pop_only)
 {
 	int oslot = pcpu_chunk_slot(chunk);
-	int max_contig = 0;
-	int i, off;
+	int bit_off, end;
 
-	for (i = 0, off = 0; i < chunk->map_used; off += abs(chunk->map[i++])) {
-		bool is_last = i + 1 == chunk->map_used;
-		int head, tail;
+	bit_off = pcpu_find_block_fit(chunk, bits, align, pop_only);
+	if (bit_off < 0)
+		return -1;
+	end = bit_off + bits;
 
-		/* extra for alignment requirement */
-		head = ALIGN(off, align) - off;
-		BUG_ON(i == 0 && head != 0);
+	pcpu_mark_area(chunk, bit_off, bits);
+	chunk->free_bytes -= bits * PCPU_MIN_ALLOC_SIZE;
 
-		if (chunk->map[i] < 0)
-			continue;
-		if (chunk->map[i] < head + size) {
-			max_contig = max(chunk->map[i], max_contig);
-			continue;
-		}
+	if (bit_off == chunk->first_bit)
+		chunk->first_bit = find_next_zero_bit(chunk->alloc_map,
+						      pcpu_chunk_map_bits(),
+						      end);
 
-		/*
-		 * If head is small or the previous block is free,
-		 * merge'em.  Note that 'small' is defined as smaller
-		 * than sizeof(int), which is very small but isn't too
-		 * uncommon for percpu allocations.
-		 */
-		if (head && (head < sizeof(int) || chunk->map[i - 1] > 0)) {
-			if (chunk->map[i - 1] > 0)
-				chunk->map[i - 1] += head;
-			else {
-				chunk->map[i - 1] -= head;
-				chunk->free_size -= head;
-			}
-			chunk->map[i] -= head;
-			off += head;
-			head = 0;
-		}
+	/* the contig hint only needs rebuilding if we carved into it */
+	if (bit_off < chunk->contig_bits_start + chunk->contig_bits &&
+	    end > chunk->contig_bits_start)
+		pcpu_chunk_refresh_hint(chunk);
 
-		/* if tail is small, just keep it around */
-		tail = chunk->map[i] - head - size;
-		if (tail < sizeof(int))
-			tail = 0;
-
-		/* split if warranted */
-		if (head || tail) {
-			pcpu_split_block(chunk, i, head, tail);
-			if (head) {
-				i++;
-				off += head;
-				max_contig = max(chunk->map[i - 1], max_contig);
-			}
-			if (tail)
-				max_contig = max(chunk->map[i + 1], max_contig);
-		}
-
-		/* update hint and mark allocated */
-		if (is_last)
-			chunk->contig_hint = max_contig; /* fully scanned */
-		else
-			chunk->contig_hint = max(chunk->contig_hint,
-						 max_contig);
-
-		chunk->free_size -= chunk->map[i];
-		chunk->map[i] = -chunk->map[i];
-
-		pcpu_chunk_relocate(chunk, oslot);
-		return off;
-	}
-
-	chunk->contig_hint = max_contig;	/* fully scanned */
 	pcpu_chunk_relocate(chunk, oslot);
-
-	/* tell the upper layer that this chunk has no matching area */
-	return -1;
+	return bit_off * PCPU_MIN_ALLOC_SIZE;
 }
 
 /**
@@ -560,8 +651,8 @@ static int pcpu_alloc_area(struct pcpu_chunk *chunk, int size, int align)
  * @freeme: offset of area to free
  *
  * Free area starting from @freeme to @chunk.  Note that this function
- * only modifies the allocation map.  It doesn't depopulate or unmap
- * the area.
+ * only modifies the allocation bitmap.  It doesn't depopulate or
+ * unmap the area.
  *
  * CONTEXT:
  * pcpu_lock.
@@ -569,37 +660,106 @@ static int pcpu_alloc_area(struct pcpu_chunk *chunk, int size, int align)
 static void pcpu_free_area(struct pcpu_chunk *chunk, int freeme)
 {
 	int oslot = pcpu_chunk_slot(chunk);
-	int i, off;
-
-	for (i = 0, off = 0; i < chunk->map_used; off += abs(chunk->map[i++]))
-		if (off == freeme)
-			break;
-	BUG_ON(off != freeme);
-	BUG_ON(chunk->map[i] > 0);
-
-	chunk->map[i] = -chunk->map[i];
-	chunk->free_size += chunk->map[i];
-
-	/* merge with previous? */
-	if (i > 0 && chunk->map[i - 1] >= 0) {
-		chunk->map[i - 1] += chunk->map[i];
-		chunk->map_used--;
-		memmove(&chunk->map[i], &chunk->map[i + 1],
-			(chunk->map_used - i) * sizeof(chunk->map[0]));
-		i--;
+	int nr_blocks = pcpu_chunk_nr_blocks();
+	struct pcpu_block_md *block;
+	int bit_off, end, bits, start, stop, index, off, i;
+
+	bit_off = freeme / PCPU_MIN_ALLOC_SIZE;
+	BUG_ON(!test_bit(bit_off, chunk->alloc_map));
+
+	end = find_next_bit(chunk->bound_map, pcpu_chunk_map_bits() + 1,
+			    bit_off + 1);
+	bits = end - bit_off;
+	bitmap_clear(chunk->alloc_map, bit_off, bits);
+
+	for (i = bit_off / PCPU_BITMAP_BLOCK_BITS;
+	     i <= (end - 1) / PCPU_BITMAP_BLOCK_BITS; i++)
+		pcpu_block_refresh_hint(chunk, i);
+
+	chunk->free_bytes += bits * PCPU_MIN_ALLOC_SIZE;
+	chunk->first_bit = min(chunk->first_bit, bit_off);
+
+	/* find the start of the free region the area merged into */
+	index = bit_off / PCPU_BITMAP_BLOCK_BITS;
+	off = bit_off % PCPU_BITMAP_BLOCK_BITS;
+	block = chunk->md_blocks + index;
+	if (block->left_free > off) {
+		start = index * PCPU_BITMAP_BLOCK_BITS;
+		for (i = index - 1, block--; i >= 0; i--, block--) {
+			if (block->contig_hint < PCPU_BITMAP_BLOCK_BITS) {
+				start -= block->right_free;
+				break;
+			}
+			start -= PCPU_BITMAP_BLOCK_BITS;
+		}
+	} else {
+		start = index * PCPU_BITMAP_BLOCK_BITS +
+			find_last_bit(pcpu_index_alloc_map(chunk, index),
+				      off) + 1;
 	}
-	/* merge with next? */
-	if (i + 1 < chunk->map_used && chunk->map[i + 1] >= 0) {
-		chunk->map[i] += chunk->map[i + 1];
-		chunk->map_used--;
-		memmove(&chunk->map[i + 1], &chunk->map[i + 2],
-			(chunk->map_used - (i + 1)) * sizeof(chunk->map[0]));
+
+	/* and its end */
+	index = (end - 1) / PCPU_BITMAP_BLOCK_BITS;
+	off = end - index * PCPU_BITMAP_BLOCK_BITS;
+	block = chunk->md_blocks + index;
+	if (block->right_free > PCPU_BITMAP_BLOCK_BITS - off) {
+		stop = (index + 1) * PCPU_BITMAP_BLOCK_BITS;
+		for (i = index + 1, block++; i < nr_blocks; i++, block++) {
+			if (block->contig_hint < PCPU_BITMAP_BLOCK_BITS) {
+				stop += block->left_free;
+				break;
+			}
+			stop += PCPU_BITMAP_BLOCK_BITS;
+		}
+	} else {
+		stop = index * PCPU_BITMAP_BLOCK_BITS +
+			find_next_bit(pcpu_index_alloc_map(chunk, index),
+				      PCPU_BITMAP_BLOCK_BITS, off);
 	}
 
-	chunk->contig_hint = max(chunk->map[i], chunk->contig_hint);
+	pcpu_chunk_update(chunk, start, stop - start);
 	pcpu_chunk_relocate(chunk, oslot);
 }
 
+static void pcpu_init_md_blocks(struct pcpu_chunk *chunk)
+{
+	struct pcpu_block_md *block = chunk->md_blocks;
+	int i;
+
+	for (i = 0; i < pcpu_chunk_nr_blocks(); i++, block++) {
+		block->contig_hint = PCPU_BITMAP_BLOCK_BITS;
+		block->contig_hint_start = 0;
+		block->left_free = PCPU_BITMAP_BLOCK_BITS;
+		block->right_free = PCPU_BITMAP_BLOCK_BITS;
+		block->first_free = 0;
+	}
+}
+
+static size_t pcpu_alloc_map_size(void)
+{
+	return BITS_TO_LONGS(pcpu_chunk_map_bits()) * sizeof(unsigned long);
+}
+
+static size_t pcpu_bound_map_size(void)
+{
+	return BITS_TO_LONGS(pcpu_chunk_map_bits() + 1) * sizeof(unsigned long);
+}
+
+static size_t pcpu_md_blocks_size(void)
+{
+	return pcpu_chunk_nr_blocks() * sizeof(struct pcpu_block_md);
+}
+
+static void pcpu_free_chunk(struct pcpu_chunk *chunk)
+{
+	if (!chunk)
+		return;
+	pcpu_mem_free(chunk->md_blocks, pcpu_md_blocks_size());
+	pcpu_mem_free(chunk->bound_map, pcpu_bound_map_size());
+	pcpu_mem_free(chunk->alloc_map, pcpu_alloc_map_size());
+	kfree(chunk);
+}
+
 static struct pcpu_chunk *pcpu_alloc_chunk(void)
 {
 	struct pcpu_chunk *chunk;
@@ -608,31 +768,25 @@ static struct pcpu_chunk *pcpu_alloc_chunk(void)
 	if (!chunk)
 		return NULL;
 
-	chunk->map = pcpu_mem_zalloc(PCPU_DFL_MAP_ALLOC *
-						sizeof(chunk->map[0]));
-	if (!chunk->map) {
-		kfree(chunk);
+	chunk->alloc_map = pcpu_mem_zalloc(pcpu_alloc_map_size());
+	chunk->bound_map = pcpu_mem_zalloc(pcpu_bound_map_size());
+	chunk->md_blocks = pcpu_mem_zalloc(pcpu_md_blocks_size());
+	if (!chunk->alloc_map || !chunk->bound_map || !chunk->md_blocks) {
+		pcpu_free_chunk(chunk);
 		return NULL;
 	}
 
-	chunk->map_alloc = PCPU_DFL_MAP_ALLOC;
-	chunk->map[chunk->map_used++] = pcpu_unit_size;
+	pcpu_init_md_blocks(chunk);
 
 	INIT_LIST_HEAD(&chunk->list);
-	chunk->free_size = pcpu_unit_size;
-	chunk->contig_hint = pcpu_unit_size;
+	chunk->free_bytes = pcpu_unit_size;
+	chunk->contig_bits = pcpu_chunk_map_bits();
+	chunk->contig_bits_start = 0;
+	chunk->first_bit = 0;
 
 	return chunk;
 }
 
-static void pcpu_free_chunk(struct pcpu_chunk *chunk)
-{
-	if (!chunk)
-		return;
-	pcpu_mem_free(chunk->map, chunk->map_alloc * sizeof(chunk->map[0]));
-	kfree(chunk);
-}
-
 /*
  * Chunk management implementation.
  *
@@ -694,22 +848,30 @@ static struct pcpu_chunk *pcpu_chunk_addr_search(void *addr)
  * @size: size of area to allocate in bytes
  * @align: alignment of area (max PAGE_SIZE)
  * @reserved: allocate from the reserved chunk if available
+ * @gfp: allocation flags
  *
- * Allocate percpu area of @size bytes aligned at @align.
+ * Allocate percpu area of @size bytes aligned at @align.  If @gfp
+ * doesn't contain %__GFP_WAIT, the allocation is atomic: it is only
+ * served from already populated pages of existing chunks and never
+ * sleeps.
  *
  * CONTEXT:
- * Does GFP_KERNEL allocation.
+ * Does GFP_KERNEL allocation if @gfp contains %__GFP_WAIT; otherwise,
+ * can be called from any context.
  *
  * RETURNS:
  * Percpu pointer to the allocated area on success, NULL on failure.
  */
-static void __percpu *pcpu_alloc(size_t size, size_t align, bool reserved)
+static void __percpu *pcpu_alloc(size_t size, size_t align, bool reserved,
+				 gfp_t gfp)
 {
 	static int warn_limit = 10;
 	struct pcpu_chunk *chunk;
 	const char *err;
-	int slot, off, new_alloc;
+	bool is_atomic = !(gfp & __GFP_WAIT);
+	int slot, off, bits;
 	unsigned long flags;
+	unsigned int cpu;
 
 	if (unlikely(!size || size > PCPU_MIN_UNIT_SIZE || align > PAGE_SIZE)) {
 		WARN(true, "illegal size (%zu) or align (%zu) for "
@@ -717,28 +879,21 @@ static void __percpu *pcpu_alloc(size_t size, size_t align, bool reserved)
 		return NULL;
 	}
 
-	mutex_lock(&pcpu_alloc_mutex);
+	/* areas are handed out in PCPU_MIN_ALLOC_SIZE units */
+	if (align < PCPU_MIN_ALLOC_SIZE)
+		align = PCPU_MIN_ALLOC_SIZE;
+	size = ALIGN(size, PCPU_MIN_ALLOC_SIZE);
+	bits = size >> PCPU_MIN_ALLOC_SHIFT;
+
+	if (!is_atomic)
+		mutex_lock(&pcpu_alloc_mutex);
 	spin_lock_irqsave(&pcpu_lock, flags);
 
 	/* serve reserved allocations from the reserved chunk if available */
 	if (reserved && pcpu_reserved_chunk) {
 		chunk = pcpu_reserved_chunk;
 
-		if (size > chunk->contig_hint) {
-			err = "alloc from reserved chunk failed";
-			goto fail_unlock;
-		}
-
-		while ((new_alloc = pcpu_need_to_extend(chunk))) {
-			spin_unlock_irqrestore(&pcpu_lock, flags);
-			if (pcpu_extend_area_map(chunk, new_alloc) < 0) {
-				err = "failed to extend area map of reserved chunk";
-				goto fail_unlock_mutex;
-			}
-			spin_lock_irqsave(&pcpu_lock, flags);
-		}
-
-		off = pcpu_alloc_area(chunk, size, align);
+		off = pcpu_alloc_area(chunk, bits, align, is_atomic);
 		if (off >= 0)
 			goto area_found;
 
@@ -750,34 +905,21 @@ restart:
 	/* search through normal chunks */
 	for (slot = pcpu_size_to_slot(size); slot < pcpu_nr_slots; slot++) {
 		list_for_each_entry(chunk, &pcpu_slot[slot], list) {
-			if (size > chunk->contig_hint)
-				continue;
-
-			new_alloc = pcpu_need_to_extend(chunk);
-			if (new_alloc) {
-				spin_unlock_irqrestore(&pcpu_lock, flags);
-				if (pcpu_extend_area_map(chunk,
-							 new_alloc) < 0) {
-					err = "failed to extend area map";
-					goto fail_unlock_mutex;
-				}
-				spin_lock_irqsave(&pcpu_lock, flags);
-				/*
-				 * pcpu_lock has been dropped, need to
-				 * restart cpu_slot list walking.
-				 */
-				goto restart;
-			}
-
-			off = pcpu_alloc_area(chunk, size, align);
+			off = pcpu_alloc_area(chunk, bits, align, is_atomic);
 			if (off >= 0)
 				goto area_found;
 		}
 	}
 
-	/* hmmm... no space left, create a new chunk */
 	spin_unlock_irqrestore(&pcpu_lock, flags);
 
+	/* atomic allocations can't create and populate chunks */
+	if (is_atomic) {
+		err = "atomic alloc failed, no space left";
+		goto fail;
+	}
+
+	/* hmmm... no space left, create a new chunk */
 	chunk = pcpu_create_chunk();
 	if (!chunk) {
 		err = "failed to allocate new chunk";
@@ -791,15 +933,22 @@ restart:
 area_found:
 	spin_unlock_irqrestore(&pcpu_lock, flags);
 
-	/* populate, map and clear the area */
-	if (pcpu_populate_chunk(chunk, off, size)) {
-		spin_lock_irqsave(&pcpu_lock, flags);
-		pcpu_free_area(chunk, off);
-		err = "failed to populate";
-		goto fail_unlock;
-	}
+	if (is_atomic) {
+		/* the area is already populated, just clear it */
+		for_each_possible_cpu(cpu)
+			memset((void *)pcpu_chunk_addr(chunk, cpu, 0) + off,
+			       0, size);
+	} else {
+		/* populate, map and clear the area */
+		if (pcpu_populate_chunk(chunk, off, size)) {
+			spin_lock_irqsave(&pcpu_lock, flags);
+			pcpu_free_area(chunk, off);
+			err = "failed to populate";
+			goto fail_unlock;
+		}
 
-	mutex_unlock(&pcpu_alloc_mutex);
+		mutex_unlock(&pcpu_alloc_mutex);
+	}
 
 	/* return address relative to base address */
 	return __addr_to_pcpu_ptr(chunk->base_addr + off);
@@ -807,8 +956,10 @@ area_found:
 fail_unlock:
 	spin_unlock_irqrestore(&pcpu_lock, flags);
 fail_unlock_mutex:
-	mutex_unlock(&pcpu_alloc_mutex);
-	if (warn_limit) {
+	if (!is_atomic)
+		mutex_unlock(&pcpu_alloc_mutex);
+fail:
+	if (!is_atomic && warn_limit) {
 		pr_warning("PERCPU: allocation failed, size=%zu align=%zu, "
 			   "%s\n", size, align, err);
 		dump_stack();
@@ -818,6 +969,30 @@ fail_unlock_mutex:
 	return NULL;
 }
 
+/**
+ * __alloc_percpu_gfp - allocate dynamic percpu area
+ * @size: size of area to allocate in bytes
+ * @align: alignment of area (max PAGE_SIZE)
+ * @gfp: allocation flags
+ *
+ * Allocate zero-filled percpu area of @size bytes aligned at @align.
+ * If @gfp doesn't contain %__GFP_WAIT, the allocation doesn't sleep
+ * and is only served from already populated areas, which makes it
+ * more likely to fail than a sleeping one.
+ *
+ * CONTEXT:
+ * Can be called from atomic context if @gfp doesn't contain
+ * %__GFP_WAIT.
+ *
+ * RETURNS:
+ * Percpu pointer to the allocated area on success, NULL on failure.
+ */
+void __percpu *__alloc_percpu_gfp(size_t size, size_t align, gfp_t gfp)
+{
+	return pcpu_alloc(size, align, false, gfp);
+}
+EXPORT_SYMBOL_GPL(__alloc_percpu_gfp);
+
 /**
  * __alloc_percpu - allocate dynamic percpu area
  * @size: size of area to allocate in bytes
@@ -834,7 +1009,7 @@ fail_unlock_mutex:
  */
 void __percpu *__alloc_percpu(size_t size, size_t align)
 {
-	return pcpu_alloc(size, align, false);
+	return pcpu_alloc(size, align, false, GFP_KERNEL);
 }
 EXPORT_SYMBOL_GPL(__alloc_percpu);
 
@@ -856,7 +1031,7 @@ EXPORT_SYMBOL_GPL(__alloc_percpu);
  */
 void __percpu *__alloc_reserved_percpu(size_t size, size_t align)
 {
-	return pcpu_alloc(size, align, true);
+	return pcpu_alloc(size, align, true, GFP_KERNEL);
 }
 
 /**
@@ -926,7 +1101,7 @@ void free_percpu(void __percpu *ptr)
 	pcpu_free_area(chunk, off);
 
 	/* if there are more than one fully free chunks, wake up grim reaper */
-	if (chunk->free_size == pcpu_unit_size) {
+	if (chunk->free_bytes == pcpu_unit_size) {
 		struct pcpu_chunk *pos;
 
 		list_for_each_entry(pos, &pcpu_slot[pcpu_nr_slots - 1], list)
@@ -1142,6 +1317,53 @@ static void pcpu_dump_alloc_info(const char *lvl,
 	printk("\n");
 }
 
+/**
+ * pcpu_alloc_first_chunk - create a chunk serving part of the first chunk
+ * @base_addr: mapped address of the first chunk
+ * @start_offset: offset of the region served by the new chunk
+ * @map_size: size of the region served by the new chunk
+ *
+ * Create an immutable chunk over @base_addr which only serves
+ * [@start_offset, @start_offset + @map_size).  The rest of the unit is
+ * hidden by marking it allocated.  The bitmaps are allocated from
+ * bootmem so that they can be used before slab is online.
+ *
+ * RETURNS:
+ * The new chunk.
+ */
+static struct pcpu_chunk * __init pcpu_alloc_first_chunk(void *base_addr,
+							 int start_offset,
+							 int map_size)
+{
+	struct pcpu_chunk *chunk;
+	int map_bits = pcpu_chunk_map_bits();
+	int start, end;
+
+	chunk = alloc_bootmem(pcpu_chunk_struct_size);
+	INIT_LIST_HEAD(&chunk->list);
+	chunk->base_addr = base_addr;
+	chunk->immutable = true;
+	bitmap_fill(chunk->populated, pcpu_unit_pages);
+
+	chunk->alloc_map = alloc_bootmem(pcpu_alloc_map_size());
+	chunk->bound_map = alloc_bootmem(pcpu_bound_map_size());
+	chunk->md_blocks = alloc_bootmem(pcpu_md_blocks_size());
+	pcpu_init_md_blocks(chunk);
+
+	/* only whole PCPU_MIN_ALLOC_SIZE units inside the region are served */
+	start = DIV_ROUND_UP(start_offset, PCPU_MIN_ALLOC_SIZE);
+	end = (start_offset + map_size) / PCPU_MIN_ALLOC_SIZE;
+	chunk->free_bytes = (end - start) * PCPU_MIN_ALLOC_SIZE;
+
+	if (start)
+		pcpu_mark_area(chunk, 0, start);
+	if (end < map_bits)
+		pcpu_mark_area(chunk, end, map_bits - end);
+	pcpu_chunk_refresh_hint(chunk);
+
+	return chunk;
+}
+
 /**
  * pcpu_setup_first_chunk - initialize the first percpu chunk
  * @ai: pcpu_alloc_info describing how to percpu area is shaped
@@ -1202,8 +1424,6 @@ int __init pcpu_setup_first_chunk(const struct pcpu_alloc_info *ai,
 				  void *base_addr)
 {
 	static char cpus_buf[4096] __initdata;
-	static int smap[PERCPU_DYNAMIC_EARLY_SLOTS] __initdata;
-	static int dmap[PERCPU_DYNAMIC_EARLY_SLOTS] __initdata;
 	size_t dyn_size = ai->dyn_size;
 	size_t size_sum = ai->static_size + ai->reserved_size + dyn_size;
 	struct pcpu_chunk *schunk, *dchunk = NULL;
@@ -1316,42 +1536,22 @@ int __init pcpu_setup_first_chunk(const struct pcpu_alloc_info *ai,
 	 * covers static area + reserved area (mostly used for module
 	 * static percpu allocation).
 	 */
-	schunk = alloc_bootmem(pcpu_chunk_struct_size);
-	INIT_LIST_HEAD(&schunk->list);
-	schunk->base_addr = base_addr;
-	schunk->map = smap;
-	schunk->map_alloc = ARRAY_SIZE(smap);
-	schunk->immutable = true;
-	bitmap_fill(schunk->populated, pcpu_unit_pages);
-
 	if (ai->reserved_size) {
-		schunk->free_size = ai->reserved_size;
+		schunk = pcpu_alloc_first_chunk(base_addr, ai->static_size,
+						ai->reserved_size);
 		pcpu_reserved_chunk = schunk;
 		pcpu_reserved_chunk_limit = ai->static_size + ai->reserved_size;
 	} else {
-		schunk->free_size = dyn_size;
+		schunk = pcpu_alloc_first_chunk(base_addr, ai->static_size,
+						dyn_size);
 		dyn_size = 0;			/* dynamic area covered */
 	}
-	schunk->contig_hint = schunk->free_size;
-
-	schunk->map[schunk->map_used++] = -ai->static_size;
-	if (schunk->free_size)
-		schunk->map[schunk->map_used++] = schunk->free_size;
 
 	/* init dynamic chunk if necessary */
-	if (dyn_size) {
-		dchunk = alloc_bootmem(pcpu_chunk_struct_size);
-		INIT_LIST_HEAD(&dchunk->list);
-		dchunk->base_addr = base_addr;
-		dchunk->map = dmap;
-		dchunk->map_alloc = ARRAY_SIZE(dmap);
-		dchunk->immutable = true;
-		bitmap_fill(dchunk->populated, pcpu_unit_pages);
-
-		dchunk->contig_hint = dchunk->free_size = dyn_size;
-		dchunk->map[dchunk->map_used++] = -pcpu_reserved_chunk_limit;
-		dchunk->map[dchunk->map_used++] = dchunk->free_size;
-	}
+	if (dyn_size)
+		dchunk = pcpu_alloc_first_chunk(base_addr,
+						pcpu_reserved_chunk_limit,
+						dyn_size);
 
 	/* link the first chunk in */
 	pcpu_first_chunk = dchunk ?: schunk;
@@ -1888,33 +2088,3 @@ void __init setup_per_cpu_areas(void)
 }
 
 #endif	/* CONFIG_SMP */
-
-/*
- * First and reserved chunks are initialized with temporary allocation
- * map in initdata so that they can be used before slab is online.
- * This function is called after slab is brought up and replaces those
- * with properly allocated maps.
- */
-void __init percpu_init_late(void)
-{
-	struct pcpu_chunk *target_chunks[] =
-		{ pcpu_first_chunk, pcpu_reserved_chunk, NULL };
-	struct pcpu_chunk *chunk;
-	unsigned long flags;
-	int i;
-
-	for (i = 0; (chunk = target_chunks[i]); i++) {
-		int *map;
-		const size_t size = PERCPU_DYNAMIC_EARLY_SLOTS * sizeof(map[0]);
-
-		BUILD_BUG_ON(size > PAGE_SIZE);
-
-		map = pcpu_mem_zalloc(size);
-		BUG_ON(!map);
-
-		spin_lock_irqsave(&pcpu_lock, flags);
-		memcpy(map, chunk->map, size);
-		chunk->map = map;
-		spin_unlock_irqrestore(&pcpu_lock, flags);
-	}
-}
@@ -30,6 +30,7 @@
 #include <linux/mm.h>
 #include <linux/export.h>
 #include <linux/swap.h>
+#include <linux/khugepaged.h>
 
 static struct vfsmount *shm_mnt;
 
@@ -67,6 +68,8 @@ static struct vfsmount *shm_mnt;
 #include <asm/uaccess.h>
 #include <asm/pgtable.h>
 
+#include "internal.h"
+
 #define BLOCKS_PER_PAGE  (PAGE_CACHE_SIZE/512)
 #define VM_ACCT(size)    (PAGE_CACHE_ALIGN(size) >> PAGE_SHIFT)
 
@@ -89,8 +92,44 @@ enum sgp_type {
 	SGP_CACHE,	/* don't exceed i_size, may allocate page */
 	SGP_DIRTY,	/* like SGP_CACHE, but set new page dirty */
 	SGP_WRITE,	/* may exceed i_size, may allocate page */
+	SGP_HUGE,	/* like SGP_CACHE, but vma asked for hugepages */
 };
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Definitions for "huge tmpfs": tmpfs mounted with the huge= option
+ *
+ * SHMEM_HUGE_NEVER:
+ *	disables huge pages for the mount;
+ * SHMEM_HUGE_ALWAYS:
+ *	enables huge pages for the mount;
+ * SHMEM_HUGE_WITHIN_SIZE:
+ *	only allocate huge pages if the page will be fully within i_size,
+ *	also respect madvise() hints;
+ * SHMEM_HUGE_ADVISE:
+ *	only allocate huge pages if requested with madvise();
+ */
+#define SHMEM_HUGE_NEVER	0
+#define SHMEM_HUGE_ALWAYS	1
+#define SHMEM_HUGE_WITHIN_SIZE	2
+#define SHMEM_HUGE_ADVISE	3
+
+/*
+ * Special values.
+ * Only can be set via /sys/kernel/mm/transparent_hugepage/shmem_enabled:
+ *
+ * SHMEM_HUGE_DENY:
+ *	disables huge on shm_mnt and all mounts, for emergency use;
+ * SHMEM_HUGE_FORCE:
+ *	enables huge on shm_mnt and all mounts, w/o needing option, for testing;
+ */
+#define SHMEM_HUGE_DENY		(-1)
+#define SHMEM_HUGE_FORCE	(-2)
+
+/* ifdef here to avoid bloating shmem.o when not necessary */
+static int shmem_huge __read_mostly;
+#endif
+
 #ifdef CONFIG_TMPFS
 static unsigned long shmem_default_max_blocks(void)
 {
@@ -142,10 +181,10 @@ static inline void shmem_unacct_size(unsigned long flags, loff_t size)
  * shmem_getpage reports shmem_acct_block failure as -ENOSPC not -ENOMEM,
  * so that a failure on a sparse tmpfs mapping will give SIGBUS not OOM.
  */
-static inline int shmem_acct_block(unsigned long flags)
+static inline int shmem_acct_block(unsigned long flags, long pages)
 {
 	return (flags & VM_NORESERVE) ?
-		security_vm_enough_memory_kern(VM_ACCT(PAGE_CACHE_SIZE)) : 0;
+		security_vm_enough_memory_kern(pages * VM_ACCT(PAGE_CACHE_SIZE)) : 0;
 }
 
 static inline void shmem_unacct_blocks(unsigned long flags, long pages)
@@ -796,6 +835,27 @@ static struct page *shmem_alloc_page(gfp_t gfp,
 	 */
 	return alloc_page_vma(gfp, &pvma, 0);
 }
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static struct page *shmem_alloc_hugepage(gfp_t gfp,
+			struct shmem_inode_info *info, pgoff_t index)
+{
+	struct vm_area_struct pvma;
+
+	/* Create a pseudo vma that just contains the policy */
+	pvma.vm_start = 0;
+	pvma.vm_pgoff = round_down(index, HPAGE_PMD_NR);
+	pvma.vm_ops = NULL;
+	pvma.vm_policy = mpol_shared_policy_lookup(&info->policy,
+						   pvma.vm_pgoff);
+
+	/*
+	 * alloc_pages_vma() will drop the shared policy reference
+	 */
+	return alloc_pages_vma(gfp, HPAGE_PMD_ORDER, &pvma, 0,
+			       numa_node_id());
+}
+#endif
 #else /* !CONFIG_NUMA */
 #ifdef CONFIG_TMPFS
 static inline void shmem_show_mpol(struct seq_file *seq, struct mempolicy *mpol)
@@ -814,6 +874,14 @@ static inline struct page *shmem_alloc_page(gfp_t gfp,
 {
 	return alloc_page(gfp);
 }
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+static inline struct page *shmem_alloc_hugepage(gfp_t gfp,
+			struct shmem_inode_info *info, pgoff_t index)
+{
+	return alloc_pages(gfp, HPAGE_PMD_ORDER);
+}
+#endif
 #endif /* CONFIG_NUMA */
 
 #if !defined(CONFIG_NUMA) || !defined(CONFIG_TMPFS)
@@ -823,6 +891,252 @@ static inline struct mempolicy *shmem_get_sbmpol(struct shmem_sb_info *sbinfo)
 }
 #endif
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Decide whether a page allocation at index should try for a whole
+ * hugepage first, according to the mount's huge= option and the
+ * administrator's override in shmem_enabled.
+ */
+static bool shmem_huge_allowed(struct inode *inode, pgoff_t index,
+			       enum sgp_type sgp)
+{
+	loff_t i_size;
+
+	if (shmem_huge == SHMEM_HUGE_FORCE)
+		return true;
+	if (shmem_huge == SHMEM_HUGE_DENY)
+		return false;
+	switch (SHMEM_SB(inode->i_sb)->huge) {
+	case SHMEM_HUGE_ALWAYS:
+		return true;
+	case SHMEM_HUGE_WITHIN_SIZE:
+		i_size = round_up(i_size_read(inode), PAGE_CACHE_SIZE);
+		if (i_size >> PAGE_CACHE_SHIFT >=
+		    round_up(index + 1, HPAGE_PMD_NR))
+			return true;
+		/* fallthrough */
+	case SHMEM_HUGE_ADVISE:
+		return sgp == SGP_HUGE;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Try to fill the whole naturally aligned hugepage extent around index
+ * with the subpages of a single high-order allocation, so that it can
+ * later be mapped by a pmd.  The subpages are ordinary order-0 page
+ * cache pages, each with its own reference count, so that the rest of
+ * shmem (swap, truncation, page cache lookups) need not know about them.
+ *
+ * Returns 0 if the extent was populated, in which case the caller should
+ * look up index again; otherwise the caller falls back to a small page.
+ */
+static int shmem_alloc_huge(struct inode *inode, pgoff_t index, gfp_t gfp,
+			    enum sgp_type sgp)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct shmem_inode_info *info = SHMEM_I(inode);
+	struct shmem_sb_info *sbinfo = SHMEM_SB(inode->i_sb);
+	pgoff_t hindex = round_down(index, HPAGE_PMD_NR);
+	struct page *entry, *page;
+	pgoff_t found;
+	int error = 0;
+	int i;
+
+	/* Nothing may already occupy the extent, not even swap */
+	if (shmem_find_get_pages_and_swap(mapping, hindex, 1, &entry, &found)) {
+		if (!radix_tree_exceptional_entry(entry))
+			page_cache_release(entry);
+		if (found < hindex + HPAGE_PMD_NR)
+			return -EEXIST;
+	}
+
+	if (shmem_acct_block(info->flags, HPAGE_PMD_NR))
+		return -ENOSPC;
+	if (sbinfo->max_blocks) {
+		if (sbinfo->max_blocks < HPAGE_PMD_NR ||
+		    percpu_counter_compare(&sbinfo->used_blocks,
+				sbinfo->max_blocks - HPAGE_PMD_NR) > 0) {
+			error = -ENOSPC;
+			goto unacct;
+		}
+		percpu_counter_add(&sbinfo->used_blocks, HPAGE_PMD_NR);
+	}
+
+	page = shmem_alloc_hugepage(gfp | __GFP_NORETRY | __GFP_NOWARN |
+			__GFP_NOMEMALLOC | __GFP_NO_KSWAPD, info, index);
+	if (!page) {
+		count_vm_event(THP_FILE_FALLBACK);
+		error = -ENOMEM;
+		goto decused;
+	}
+	count_vm_event(THP_FILE_ALLOC);
+	split_page(page, HPAGE_PMD_ORDER);
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		clear_highpage(page + i);
+		flush_dcache_page(page + i);
+		SetPageSwapBacked(page + i);
+		__set_page_locked(page + i);
+	}
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		error = mem_cgroup_cache_charge(page + i, current->mm,
+						gfp & GFP_RECLAIM_MASK);
+		if (error)
+			break;
+		error = shmem_add_to_page_cache(page + i, mapping,
+						hindex + i, gfp, NULL);
+		if (error) {
+			mem_cgroup_uncharge_cache_page(page + i);
+			break;
+		}
+	}
+	if (error) {
+		/* Lost a race, or out of memory: back out what went in */
+		while (i--)
+			delete_from_page_cache(page + i);
+		for (i = 0; i < HPAGE_PMD_NR; i++) {
+			__clear_page_locked(page + i);
+			page_cache_release(page + i);
+		}
+		goto decused;
+	}
+
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		lru_cache_add_anon(page + i);
+		SetPageUptodate(page + i);
+	}
+
+	spin_lock(&info->lock);
+	info->alloced += HPAGE_PMD_NR;
+	inode->i_blocks += BLOCKS_PER_PAGE * HPAGE_PMD_NR;
+	shmem_recalc_inode(inode);
+	spin_unlock(&info->lock);
+
+	if (sgp == SGP_DIRTY)
+		set_page_dirty(page + (index - hindex));
+	for (i = 0; i < HPAGE_PMD_NR; i++) {
+		unlock_page(page + i);
+		page_cache_release(page + i);
+	}
+	return 0;
+
+decused:
+	if (sbinfo->max_blocks)
+		percpu_counter_add(&sbinfo->used_blocks, -HPAGE_PMD_NR);
+unacct:
+	shmem_unacct_blocks(info->flags, HPAGE_PMD_NR);
+	return error;
+}
+
+#if defined(CONFIG_SYSFS) || defined(CONFIG_TMPFS)
+static int shmem_parse_huge(const char *str)
+{
+	if (!strcmp(str, "never"))
+		return SHMEM_HUGE_NEVER;
+	if (!strcmp(str, "always"))
+		return SHMEM_HUGE_ALWAYS;
+	if (!strcmp(str, "within_size"))
+		return SHMEM_HUGE_WITHIN_SIZE;
+	if (!strcmp(str, "advise"))
+		return SHMEM_HUGE_ADVISE;
+	if (!strcmp(str, "deny"))
+		return SHMEM_HUGE_DENY;
+	if (!strcmp(str, "force"))
+		return SHMEM_HUGE_FORCE;
+	return -EINVAL;
+}
+
+static const char *shmem_format_huge(int huge)
+{
+	switch (huge) {
+	case SHMEM_HUGE_NEVER:
+		return "never";
+	case SHMEM_HUGE_ALWAYS:
+		return "always";
+	case SHMEM_HUGE_WITHIN_SIZE:
+		return "within_size";
+	case SHMEM_HUGE_ADVISE:
+		return "advise";
+	case SHMEM_HUGE_DENY:
+		return "deny";
+	case SHMEM_HUGE_FORCE:
+		return "force";
+	default:
+		VM_BUG_ON(1);
+		return "bad_val";
+	}
+}
+#endif
+
+#ifdef CONFIG_SYSFS
+static ssize_t shmem_enabled_show(struct kobject *kobj,
+				  struct kobj_attribute *attr, char *buf)
+{
+	int values[] = {
+		SHMEM_HUGE_ALWAYS,
+		SHMEM_HUGE_WITHIN_SIZE,
+		SHMEM_HUGE_ADVISE,
+		SHMEM_HUGE_NEVER,
+		SHMEM_HUGE_DENY,
+		SHMEM_HUGE_FORCE,
+	};
+	int i, count;
+
+	for (i = 0, count = 0; i < ARRAY_SIZE(values); i++) {
+		const char *fmt = shmem_huge == values[i] ? "[%s] " : "%s ";
+
+		count += sprintf(buf + count, fmt,
+				shmem_format_huge(values[i]));
+	}
+	buf[count - 1] = '\n';
+	return count;
+}
+
+static ssize_t shmem_enabled_store(struct kobject *kobj,
+		struct kobj_attribute *attr, const char *buf, size_t count)
+{
+	char tmp[16];
+	int huge;
+
+	if (count + 1 > sizeof(tmp))
+		return -EINVAL;
+	memcpy(tmp, buf, count);
+	tmp[count] = '\0';
+	if (count && tmp[count - 1] == '\n')
+		tmp[count - 1] = '\0';
+
+	huge = shmem_parse_huge(tmp);
+	if (huge == -EINVAL)
+		return -EINVAL;
+	if (!has_transparent_hugepage() &&
+			huge != SHMEM_HUGE_NEVER && huge != SHMEM_HUGE_DENY)
+		return -EINVAL;
+
+	shmem_huge = huge;
+	if (shmem_huge > SHMEM_HUGE_DENY)
+		SHMEM_SB(shm_mnt->mnt_sb)->huge = shmem_huge;
+	return count;
+}
+
+struct kobj_attribute shmem_enabled_attr =
+	__ATTR(shmem_enabled, 0644, shmem_enabled_show, shmem_enabled_store);
+#endif /* CONFIG_SYSFS */
+#else /* !CONFIG_TRANSPARENT_HUGEPAGE */
+static inline bool shmem_huge_allowed(struct inode *inode, pgoff_t index,
+				      enum sgp_type sgp)
+{
+	return false;
+}
+
+static inline int shmem_alloc_huge(struct inode *inode, pgoff_t index,
+				   gfp_t gfp, enum sgp_type sgp)
+{
+	return -EINVAL;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 /*
  * shmem_getpage_gfp - find page in cache, or get from swap, or allocate
  *
@@ -845,7 +1159,7 @@ static int shmem_getpage_gfp(struct inode *inode, pgoff_t index,
 		return -EFBIG;
 repeat:
 	swap.val = 0;
-	page = find_lock_page(mapping, index);
+	page = find_lock_entry(mapping, index);
 	if (radix_tree_exceptional_entry(page)) {
 		swap = radix_to_swp_entry(page);
 		page = NULL;
@@ -877,7 +1191,7 @@ repeat:
 
 	if (swap.val) {
 		/* Look it up and read it in.. */
-		page = lookup_swap_cache(swap);
+		page = lookup_swap_cache(swap, NULL, 0);
 		if (!page) {
 			/* here we actually do the io */
 			if (fault_type)
@@ -924,7 +1238,11 @@ repeat:
 		swap_free(swap);
 
 	} else {
-		if (shmem_acct_block(info->flags)) {
+		if (shmem_huge_allowed(inode, index, sgp) &&
+		    !shmem_alloc_huge(inode, index, gfp, sgp))
+			goto repeat;
+
+		if (shmem_acct_block(info->flags, 1)) {
 			error = -ENOSPC;
 			goto failed;
 		}
@@ -993,7 +1311,7 @@ unacct:
 	shmem_unacct_blocks(info->flags, 1);
 failed:
 	if (swap.val && error != -EINVAL) {
-		struct page *test = find_get_page(mapping, index);
+		struct page *test = find_get_entry(mapping, index);
 		if (test && !radix_tree_exceptional_entry(test))
 			page_cache_release(test);
 		/* Have another try if the entry has changed */
@@ -1019,10 +1337,15 @@ failed:
 static int shmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
 	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	enum sgp_type sgp = SGP_CACHE;
 	int error;
 	int ret = VM_FAULT_LOCKED;
 
-	error = shmem_getpage(inode, vmf->pgoff, &vmf->page, SGP_CACHE, &ret);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (vma->vm_flags & VM_HUGEPAGE)
+		sgp = SGP_HUGE;
+#endif
+	error = shmem_getpage(inode, vmf->pgoff, &vmf->page, sgp, &ret);
 	if (error)
 		return ((error == -ENOMEM) ? VM_FAULT_OOM : VM_FAULT_SIGBUS);
 
@@ -1033,6 +1356,254 @@ static int shmem_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	return ret;
 }
 
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+/*
+ * Map a whole hugepage extent of the file with one pmd, if its pages are
+ * physically contiguous and naturally aligned (as shmem_alloc_huge or
+ * shmem_collapse_huge leave them).  Anything else falls back to ptes.
+ */
+static int shmem_pmd_fault(struct vm_area_struct *vma, unsigned long address,
+			   pmd_t *pmd, unsigned int flags)
+{
+	struct inode *inode = vma->vm_file->f_path.dentry->d_inode;
+	struct address_space *mapping = inode->i_mapping;
+	unsigned long haddr = address & HPAGE_PMD_MASK;
+	struct page *head, *page;
+	pgoff_t hindex;
+	int fault_type = 0;
+	int ret = VM_FAULT_FALLBACK;
+	int i;
+
+	if (!(vma->vm_flags & VM_SHARED) ||
+	    (vma->vm_flags & (VM_NOHUGEPAGE | VM_NONLINEAR)))
+		return VM_FAULT_FALLBACK;
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	hindex = ((haddr - vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
+	if (hindex & (HPAGE_PMD_NR - 1))
+		return VM_FAULT_FALLBACK;
+	if (shmem_huge == SHMEM_HUGE_DENY)
+		return VM_FAULT_FALLBACK;
+	if (((loff_t)(hindex + HPAGE_PMD_NR) << PAGE_CACHE_SHIFT) >
+	    i_size_read(inode))
+		return VM_FAULT_FALLBACK;
+
+	/* Errors are left for the pte fault to report */
+	if (shmem_getpage(inode, hindex, &head, (vma->vm_flags & VM_HUGEPAGE) ?
+			  SGP_HUGE : SGP_CACHE, &fault_type))
+		return VM_FAULT_FALLBACK;
+	if (fault_type & VM_FAULT_MAJOR) {
+		count_vm_event(PGMAJFAULT);
+		mem_cgroup_count_vm_event(vma->vm_mm, PGMAJFAULT);
+	}
+
+	i = 1;
+	if (page_to_pfn(head) & (HPAGE_PMD_NR - 1))
+		goto out;
+	for (; i < HPAGE_PMD_NR; i++) {
+		page = find_lock_page(mapping, hindex + i);
+		if (page != head + i) {
+			if (page && !radix_tree_exceptional_entry(page)) {
+				unlock_page(page);
+				page_cache_release(page);
+			}
+			break;
+		}
+	}
+	/* Recheck i_size now that the pages are locked against truncation */
+	if (i == HPAGE_PMD_NR &&
+	    ((loff_t)(hindex + HPAGE_PMD_NR) << PAGE_CACHE_SHIFT) <=
+	    i_size_read(inode))
+		ret = do_huge_pmd_file_page(vma->vm_mm, vma, address, pmd,
+					    head, flags);
+out:
+	/* On success the references are handed over to the pmd mapping */
+	while (i--) {
+		unlock_page(head + i);
+		if (ret != VM_FAULT_NOPAGE)
+			page_cache_release(head + i);
+	}
+	if (ret & VM_FAULT_OOM)
+		return ret;
+	return ret == VM_FAULT_NOPAGE ? ret | fault_type : VM_FAULT_FALLBACK;
+}
+
+bool shmem_huge_enabled(struct vm_area_struct *vma)
+{
+	struct inode *inode;
+
+	if (vma->vm_ops != &shmem_vm_ops)
+		return false;
+	if (!(vma->vm_flags & VM_SHARED) ||
+	    (vma->vm_flags & (VM_NOHUGEPAGE | VM_NONLINEAR)))
+		return false;
+	if (shmem_huge == SHMEM_HUGE_FORCE)
+		return true;
+	if (shmem_huge == SHMEM_HUGE_DENY)
+		return false;
+	inode = vma->vm_file->f_path.dentry->d_inode;
+	switch (SHMEM_SB(inode->i_sb)->huge) {
+	case SHMEM_HUGE_ALWAYS:
+	case SHMEM_HUGE_WITHIN_SIZE:
+		return true;
+	case SHMEM_HUGE_ADVISE:
+		return vma->vm_flags & VM_HUGEPAGE;
+	default:
+		return false;
+	}
+}
+
+/**
+ * shmem_collapse_huge - gather a hugepage extent into contiguous memory
+ * @mapping: shmem mapping
+ * @index: first page offset of the extent, aligned to HPAGE_PMD_NR
+ *
+ * Called by khugepaged: copies each page of a fully populated extent into
+ * the matching subpage of a newly allocated hugepage, replacing it in the
+ * page cache, so that the extent can then be mapped by a pmd.  All the
+ * old pages are locked and unmapped first; a page still in use by anyone
+ * else stops the collapse, leaving those pages already replaced in place.
+ *
+ * Returns 1 if the extent was collapsed, 0 if it was already contiguous,
+ * or a negative error.
+ */
+int shmem_collapse_huge(struct address_space *mapping, pgoff_t index)
+{
+	struct inode *inode = mapping->host;
+	struct mem_cgroup *memcg;
+	struct page **pages;
+	struct page *new;
+	int nr, locked, i, j;
+	int ret;
+
+	VM_BUG_ON(index & (HPAGE_PMD_NR - 1));
+	if (((loff_t)(index + HPAGE_PMD_NR) << PAGE_CACHE_SHIFT) >
+	    i_size_read(inode))
+		return -EINVAL;
+
+	pages = kmalloc(HPAGE_PMD_NR * sizeof(struct page *), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+
+	/* Swapped out or missing pages are not brought in for collapse */
+	nr = find_get_pages_contig(mapping, index, HPAGE_PMD_NR, pages);
+	locked = 0;
+	i = 0;
+	if (nr < HPAGE_PMD_NR) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	for (i = 1; i < nr; i++)
+		if (pages[i] != pages[0] + i)
+			break;
+	if (i == nr && !(page_to_pfn(pages[0]) & (HPAGE_PMD_NR - 1))) {
+		ret = 0;
+		i = 0;
+		goto out;
+	}
+	i = 0;
+
+	new = shmem_alloc_hugepage(mapping_gfp_mask(mapping) |
+			__GFP_NORETRY | __GFP_NOWARN | __GFP_NO_KSWAPD,
+			SHMEM_I(inode), index);
+	if (!new) {
+		count_vm_event(THP_COLLAPSE_ALLOC_FAILED);
+		ret = -ENOMEM;
+		goto out;
+	}
+	count_vm_event(THP_COLLAPSE_ALLOC);
+	split_page(new, HPAGE_PMD_ORDER);
+
+	/* Pages may still sit in this cpu's pagevecs, off the lru */
+	lru_add_drain();
+	ret = -EAGAIN;
+	for (locked = 0; locked < nr; locked++) {
+		struct page *page = pages[locked];
+
+		lock_page(page);
+		if (page->mapping != mapping ||
+		    page->index != index + locked || PageMlocked(page)) {
+			unlock_page(page);
+			goto out_free;
+		}
+	}
+
+	unmap_mapping_range(mapping, (loff_t)index << PAGE_CACHE_SHIFT,
+			    HPAGE_PMD_SIZE, 0);
+
+	for (; i < nr; i++) {
+		struct page *page = pages[i];
+		void **pslot;
+		bool ok = false;
+
+		if (page_mapped(page) || isolate_lru_page(page))
+			goto out_free;
+		if (mem_cgroup_prepare_migration(page, new + i, &memcg,
+						 GFP_KERNEL)) {
+			putback_lru_page(page);
+			goto out_free;
+		}
+
+		copy_highpage(new + i, page);
+		__set_page_locked(new + i);
+		SetPageSwapBacked(new + i);
+		SetPageUptodate(new + i);
+		if (PageDirty(page))
+			SetPageDirty(new + i);
+
+		/* page cache, our lookup and lru isolation hold references */
+		spin_lock_irq(&mapping->tree_lock);
+		pslot = radix_tree_lookup_slot(&mapping->page_tree, index + i);
+		if (pslot && radix_tree_deref_slot_protected(pslot,
+					&mapping->tree_lock) == page &&
+		    page_freeze_refs(page, 3)) {
+			page_cache_get(new + i);
+			new[i].mapping = mapping;
+			new[i].index = index + i;
+			radix_tree_replace_slot(pslot, new + i);
+			page->mapping = NULL;
+			page_unfreeze_refs(page, 2);
+			__dec_zone_page_state(page, NR_FILE_PAGES);
+			__dec_zone_page_state(page, NR_SHMEM);
+			__inc_zone_page_state(new + i, NR_FILE_PAGES);
+			__inc_zone_page_state(new + i, NR_SHMEM);
+			ok = true;
+		}
+		spin_unlock_irq(&mapping->tree_lock);
+		mem_cgroup_end_migration(memcg, page, new + i, ok);
+
+		if (!ok) {
+			__clear_page_locked(new + i);
+			putback_lru_page(page);
+			goto out_free;
+		}
+
+		if (TestClearPageActive(page))
+			SetPageActive(new + i);
+		ClearPageUnevictable(page);
+		unlock_page(new + i);
+		putback_lru_page(new + i);	/* drops allocation reference */
+		unlock_page(page);
+		page_cache_release(page);	/* isolation reference */
+		page_cache_release(page);	/* lookup reference */
+	}
+	kfree(pages);
+	return 1;
+
+out_free:
+	for (j = i; j < HPAGE_PMD_NR; j++)
+		__free_page(new + j);
+out:
+	for (; i < nr; i++) {
+		if (i < locked)
+			unlock_page(pages[i]);
+		page_cache_release(pages[i]);
+	}
+	kfree(pages);
+	return ret;
+}
+#endif /* CONFIG_TRANSPARENT_HUGEPAGE */
+
 #ifdef CONFIG_NUMA
 static int shmem_set_policy(struct vm_area_struct *vma, struct mempolicy *mpol)
 {
@@ -1088,7 +1659,95 @@ static int shmem_mmap(struct file *file, struct vm_area_struct *vma)
 	file_accessed(file);
 	vma->vm_ops = &shmem_vm_ops;
 	vma->vm_flags |= VM_CAN_NONLINEAR;
-	return 0;
+	return khugepaged_enter_vma_merge(vma);
+}
+
+unsigned long shmem_get_unmapped_area(struct file *file,
+				      unsigned long uaddr, unsigned long len,
+				      unsigned long pgoff, unsigned long flags)
+{
+	unsigned long (*get_area)(struct file *, unsigned long,
+				  unsigned long, unsigned long, unsigned long);
+	unsigned long addr;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	unsigned long offset;
+	unsigned long inflated_len;
+	unsigned long inflated_addr;
+	unsigned long inflated_offset;
+#endif
+
+	if (len > TASK_SIZE)
+		return -ENOMEM;
+
+	get_area = current->mm->get_unmapped_area;
+	addr = get_area(file, uaddr, len, pgoff, flags);
+
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	if (IS_ERR_VALUE(addr))
+		return addr;
+	if (addr & ~PAGE_MASK)
+		return addr;
+	if (addr > TASK_SIZE - len)
+		return addr;
+
+	if (shmem_huge == SHMEM_HUGE_DENY)
+		return addr;
+	if (len < HPAGE_PMD_SIZE)
+		return addr;
+	if (flags & MAP_FIXED)
+		return addr;
+	/* If caller specified an address hint, respect that as before */
+	if (uaddr)
+		return addr;
+
+	if (shmem_huge != SHMEM_HUGE_FORCE) {
+		struct super_block *sb;
+
+		if (file) {
+			VM_BUG_ON(file->f_op != &shmem_file_operations);
+			sb = file->f_path.mnt->mnt_sb;
+		} else {
+			/*
+			 * Called directly from mm/mmap.c, or drivers/char/mem.c
+			 * for "/dev/zero", to create a shared anonymous object.
+			 */
+			if (IS_ERR(shm_mnt))
+				return addr;
+			sb = shm_mnt->mnt_sb;
+		}
+		if (SHMEM_SB(sb)->huge == SHMEM_HUGE_NEVER)
+			return addr;
+	}
+
+	offset = (pgoff << PAGE_SHIFT) & (HPAGE_PMD_SIZE-1);
+	if (offset && offset + len < 2 * HPAGE_PMD_SIZE)
+		return addr;
+	if ((addr & (HPAGE_PMD_SIZE-1)) == offset)
+		return addr;
+
+	inflated_len = len + HPAGE_PMD_SIZE - PAGE_SIZE;
+	if (inflated_len > TASK_SIZE)
+		return addr;
+	if (inflated_len < len)
+		return addr;
+
+	inflated_addr = get_area(NULL, 0, inflated_len, 0, flags);
+	if (IS_ERR_VALUE(inflated_addr))
+		return addr;
+	if (inflated_addr & ~PAGE_MASK)
+		return addr;
+
+	inflated_offset = inflated_addr & (HPAGE_PMD_SIZE-1);
+	inflated_addr += offset - inflated_offset;
+	if (inflated_offset > offset)
+		inflated_addr += HPAGE_PMD_SIZE;
+
+	if (inflated_addr > TASK_SIZE - len)
+		return addr;
+	return inflated_addr;
+#else
+	return addr;
+#endif
 }
 
 static struct inode *shmem_get_inode(struct super_block *sb, const struct inode *dir,
@@ -2065,6 +2724,17 @@ static int shmem_parse_options(char *options, struct shmem_sb_info *sbinfo,
 		} else if (!strcmp(this_char,"mpol")) {
 			if (mpol_parse_str(value, &sbinfo->mpol, 1))
 				goto bad_val;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+		} else if (!strcmp(this_char,"huge")) {
+			int huge;
+			huge = shmem_parse_huge(value);
+			if (huge < 0)
+				goto bad_val;
+			if (!has_transparent_hugepage() &&
+					huge != SHMEM_HUGE_NEVER)
+				goto bad_val;
+			sbinfo->huge = huge;
+#endif
 		} else {
 			printk(KERN_ERR "tmpfs: Bad mount option %s\n",
 			       this_char);
@@ -2110,6 +2780,7 @@ static int shmem_remount_fs(struct super_block *sb, int *flags, char *data)
 	sbinfo->max_blocks  = config.max_blocks;
 	sbinfo->max_inodes  = config.max_inodes;
 	sbinfo->free_inodes = config.max_inodes - inodes;
+	sbinfo->huge        = config.huge;
 
 	mpol_put(sbinfo->mpol);
 	sbinfo->mpol        = config.mpol;	/* transfers initial ref */
@@ -2133,6 +2804,11 @@ static int shmem_show_options(struct seq_file *seq, struct vfsmount *vfs)
 		seq_printf(seq, ",uid=%u", sbinfo->uid);
 	if (sbinfo->gid != 0)
 		seq_printf(seq, ",gid=%u", sbinfo->gid);
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	/* Rightly or wrongly, show huge mount option unmasked by shmem_huge */
+	if (sbinfo->huge)
+		seq_printf(seq, ",huge=%s", shmem_format_huge(sbinfo->huge));
+#endif
 	shmem_show_mpol(seq, sbinfo->mpol);
 	return 0;
 }
@@ -2255,7 +2931,7 @@ static int shmem_init_inodecache(void)
 {
 	shmem_inode_cachep = kmem_cache_create("shmem_inode_cache",
 				sizeof(struct shmem_inode_info),
-				0, SLAB_PANIC, shmem_init_inode);
+				0, SLAB_PANIC|SLAB_ACCOUNT, shmem_init_inode);
 	return 0;
 }
 
@@ -2277,6 +2953,7 @@ static const struct address_space_operations shmem_aops = {
 
 static const struct file_operations shmem_file_operations = {
 	.mmap		= shmem_mmap,
+	.get_unmapped_area = shmem_get_unmapped_area,
 #ifdef CONFIG_TMPFS
 	.llseek		= generic_file_llseek,
 	.read		= do_sync_read,
@@ -2350,6 +3027,9 @@ static const struct super_operations shmem_ops = {
 
 static const struct vm_operations_struct shmem_vm_ops = {
 	.fault		= shmem_fault,
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+	.pmd_fault	= shmem_pmd_fault,
+#endif
 #ifdef CONFIG_NUMA
 	.set_policy     = shmem_set_policy,
 	.get_policy     = shmem_get_policy,
@@ -2452,6 +3132,15 @@ void shmem_truncate_range(struct inode *inode, loff_t lstart, loff_t lend)
 }
 EXPORT_SYMBOL_GPL(shmem_truncate_range);
 
+#ifdef CONFIG_MMU
+unsigned long shmem_get_unmapped_area(struct file *file,
+				      unsigned long addr, unsigned long len,
+				      unsigned long pgoff, unsigned long flags)
+{
+	return current->mm->get_unmapped_area(file, addr, len, pgoff, flags);
+}
+#endif
+
 #define shmem_vm_ops				generic_file_vm_ops
 #define shmem_file_operations			ramfs_file_operations
 #define shmem_get_inode(sb, dir, mode, dev, flags)	ramfs_get_inode(sb, dir, mode, dev)
@@ -2544,7 +3233,7 @@ int shmem_zero_setup(struct vm_area_struct *vma)
 	vma->vm_file = file;
 	vma->vm_ops = &shmem_vm_ops;
 	vma->vm_flags |= VM_CAN_NONLINEAR;
-	return 0;
+	return khugepaged_enter_vma_merge(vma);
 }
 
 /**
@@ -29,6 +29,7 @@
 #include <linux/math64.h>
 #include <linux/fault-inject.h>
 #include <linux/stacktrace.h>
+#include <linux/memcontrol.h>
 
 #include <trace/events/kmem.h>
 
@@ -162,7 +163,7 @@ static inline int kmem_cache_debug(struct kmem_cache *s)
  */
 #define SLUB_NEVER_MERGE (SLAB_RED_ZONE | SLAB_POISON | SLAB_STORE_USER | \
 		SLAB_TRACE | SLAB_DESTROY_BY_RCU | SLAB_NOLEAKTRACE | \
-		SLAB_FAILSLAB)
+		SLAB_FAILSLAB | SLAB_ACCOUNT)
 
 #define SLUB_MERGE_SAME (SLAB_DEBUG_FREE | SLAB_RECLAIM_ACCOUNT | \
 		SLAB_CACHE_DMA | SLAB_NOTRACK)
@@ -1258,6 +1259,116 @@ static inline void slab_free_hook(struct kmem_cache *s, void *x) {}
 
 #endif /* CONFIG_SLUB_DEBUG */
 
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+static inline bool is_memcg_copy(struct kmem_cache *s)
+{
+	return s->memcg_params && !s->memcg_params->is_root_cache;
+}
+
+/*
+ * Allocations from caches with SLAB_ACCOUNT are redirected to the copy
+ * of the cache of the memcg of the current task.  Allocations that are
+ * not made on behalf of a user task are not accounted.
+ */
+static __always_inline struct kmem_cache *
+memcg_kmem_get_cache(struct kmem_cache *s, gfp_t flags)
+{
+	if (!memcg_kmem_enabled() || !(s->flags & SLAB_ACCOUNT))
+		return s;
+	if (flags & __GFP_NOFAIL)
+		return s;
+	if (in_interrupt() || !current->mm || (current->flags & PF_KTHREAD))
+		return s;
+	if (unlikely(fatal_signal_pending(current)))
+		return s;
+	return __memcg_kmem_get_cache(s, flags);
+}
+
+/* The object may come from the copy of the cache of a memcg */
+static inline struct kmem_cache *cache_from_obj(struct kmem_cache *s,
+						struct page *page)
+{
+	if (!memcg_kmem_enabled())
+		return s;
+	return page->slab;
+}
+
+static inline int memcg_charge_slab(struct kmem_cache *s, gfp_t flags,
+				    int order)
+{
+	if (!memcg_kmem_enabled() || !is_memcg_copy(s))
+		return 0;
+	return __memcg_charge_slab(s, flags, order);
+}
+
+static inline void memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+	if (memcg_kmem_enabled() && is_memcg_copy(s))
+		__memcg_uncharge_slab(s, order);
+}
+
+/*
+ * Freeing the last slab of a copy whose memcg is gone destroys the copy:
+ * paths that keep using the cache after discard_slab() pin it meanwhile.
+ */
+static inline bool memcg_cache_tryget(struct kmem_cache *s)
+{
+	if (memcg_kmem_enabled() && is_memcg_copy(s))
+		return __memcg_cache_tryget(s);
+	return true;
+}
+
+static inline void memcg_cache_put(struct kmem_cache *s)
+{
+	if (memcg_kmem_enabled() && is_memcg_copy(s))
+		__memcg_cache_put(s);
+}
+#else
+static inline bool is_memcg_copy(struct kmem_cache *s)
+{
+	return false;
+}
+
+static inline struct kmem_cache *
+memcg_kmem_get_cache(struct kmem_cache *s, gfp_t flags)
+{
+	return s;
+}
+
+static inline struct kmem_cache *cache_from_obj(struct kmem_cache *s,
+						struct page *page)
+{
+	return s;
+}
+
+static inline int memcg_charge_slab(struct kmem_cache *s, gfp_t flags,
+				    int order)
+{
+	return 0;
+}
+
+static inline void memcg_uncharge_slab(struct kmem_cache *s, int order)
+{
+}
+
+static inline bool memcg_cache_tryget(struct kmem_cache *s)
+{
+	return true;
+}
+
+static inline void memcg_cache_put(struct kmem_cache *s)
+{
+}
+
+static inline void memcg_destroy_cache_copies(struct kmem_cache *s)
+{
+}
+
+static inline void memcg_release_cache(struct kmem_cache *s)
+{
+}
+#endif
+
 /*
  * Slab allocation and freeing
  */
@@ -1306,6 +1417,11 @@ static struct page *allocate_slab(struct kmem_cache *s, gfp_t flags, int node)
 			stat(s, ORDER_FALLBACK);
 	}
 
+	if (page && memcg_charge_slab(s, flags, oo_order(oo))) {
+		__free_pages(page, oo_order(oo));
+		page = NULL;
+	}
+
 	if (flags & __GFP_WAIT)
 		local_irq_disable();
 
@@ -1410,6 +1526,7 @@ static void __free_slab(struct kmem_cache *s, struct page *page)
 	if (current->reclaim_state)
 		current->reclaim_state->reclaimed_slab += pages;
 	__free_pages(page, order);
+	memcg_uncharge_slab(s, order);
 }
 
 #define need_reserve_slab_rcu						\
@@ -1791,7 +1908,7 @@ redo:
 
 	new.frozen = 0;
 
-	if (!new.inuse && n->nr_partial > s->min_partial)
+	if (!new.inuse && n->nr_partial >= s->min_partial)
 		m = M_FREE;
 	else if (new.freelist) {
 		m = M_PARTIAL;
@@ -1851,9 +1968,12 @@ redo:
 		spin_unlock(&n->list_lock);
 
 	if (m == M_FREE) {
+		/* The slab holds a page of the cache, this cannot fail */
+		memcg_cache_tryget(s);
 		stat(s, DEACTIVATE_EMPTY);
 		discard_slab(s, page);
 		stat(s, FREE_SLAB);
+		memcg_cache_put(s);
 	}
 }
 
@@ -1884,7 +2004,7 @@ static void unfreeze_partials(struct kmem_cache *s)
 
 			new.frozen = 0;
 
-			if (!new.inuse && (!n || n->nr_partial > s->min_partial))
+			if (!new.inuse && (!n || n->nr_partial >= s->min_partial))
 				m = M_FREE;
 			else {
 				struct kmem_cache_node *n2 = get_node(s,
@@ -1924,6 +2044,10 @@ static void unfreeze_partials(struct kmem_cache *s)
 	if (n)
 		spin_unlock(&n->list_lock);
 
+	if (!discard_page)
+		return;
+
+	memcg_cache_tryget(s);
 	while (discard_page) {
 		page = discard_page;
 		discard_page = discard_page->next;
@@ -1932,6 +2056,7 @@ static void unfreeze_partials(struct kmem_cache *s)
 		discard_slab(s, page);
 		stat(s, FREE_SLAB);
 	}
+	memcg_cache_put(s);
 }
 
 /*
@@ -2267,6 +2392,7 @@ static __always_inline void *slab_alloc(struct kmem_cache *s,
 	if (slab_pre_alloc_hook(s, gfpflags))
 		return NULL;
 
+	s = memcg_kmem_get_cache(s, gfpflags);
 redo:
 
 	/*
@@ -2387,10 +2513,9 @@ EXPORT_SYMBOL(kmem_cache_alloc_node_trace);
  * handling required then we can return immediately.
  */
 static void __slab_free(struct kmem_cache *s, struct page *page,
-			void *x, unsigned long addr)
+			void *head, void *tail, int cnt, unsigned long addr)
 {
 	void *prior;
-	void **object = (void *)x;
 	int was_frozen;
 	int inuse;
 	struct page new;
@@ -2400,16 +2525,16 @@ static void __slab_free(struct kmem_cache *s, struct page *page,
 
 	stat(s, FREE_SLOWPATH);
 
-	if (kmem_cache_debug(s) && !free_debug_processing(s, page, x, addr))
+	if (kmem_cache_debug(s) && !free_debug_processing(s, page, head, addr))
 		return;
 
 	do {
 		prior = page->freelist;
 		counters = page->counters;
-		set_freepointer(s, object, prior);
+		set_freepointer(s, tail, prior);
 		new.counters = counters;
 		was_frozen = new.frozen;
-		new.inuse--;
+		new.inuse -= cnt;
 		if ((!new.inuse || !prior) && !was_frozen && !n) {
 
 			if (!kmem_cache_debug(s) && !prior)
@@ -2439,7 +2564,7 @@ static void __slab_free(struct kmem_cache *s, struct page *page,
 
 	} while (!cmpxchg_double_slab(s, page,
 		prior, counters,
-		object, new.counters,
+		head, new.counters,
 		"__slab_free"));
 
 	if (likely(!n)) {
@@ -2467,7 +2592,7 @@ static void __slab_free(struct kmem_cache *s, struct page *page,
 	if (was_frozen)
 		stat(s, FREE_FROZEN);
 	else {
-		if (unlikely(!inuse && n->nr_partial > s->min_partial))
+		if (unlikely(!inuse && n->nr_partial >= s->min_partial))
                         goto slab_empty;
 
 		/*
@@ -2509,16 +2634,19 @@ slab_empty:
  *
  * If fastpath is not possible then fall back to __slab_free where we deal
  * with all sorts of special processing.
+ *
+ * Bulk free of a freelist with several objects (all residing in the same
+ * slab) is possible by specifying head and tail ptr, plus objects count
+ * (cnt).  For a single object tail is NULL.  The free hooks must have
+ * been run on all the objects by the caller.
  */
-static __always_inline void slab_free(struct kmem_cache *s,
-			struct page *page, void *x, unsigned long addr)
+static __always_inline void slab_free(struct kmem_cache *s, struct page *page,
+			void *head, void *tail, int cnt, unsigned long addr)
 {
-	void **object = (void *)x;
+	void *tail_obj = tail ? : head;
 	struct kmem_cache_cpu *c;
 	unsigned long tid;
 
-	slab_free_hook(s, x);
-
 redo:
 	/*
 	 * Determine the currently cpus per cpu slab.
@@ -2532,19 +2660,19 @@ redo:
 	barrier();
 
 	if (likely(page == c->page)) {
-		set_freepointer(s, object, c->freelist);
+		set_freepointer(s, tail_obj, c->freelist);
 
 		if (unlikely(!irqsafe_cpu_cmpxchg_double(
 				s->cpu_slab->freelist, s->cpu_slab->tid,
 				c->freelist, tid,
-				object, next_tid(tid)))) {
+				head, next_tid(tid)))) {
 
 			note_cmpxchg_failure("slab_free", s, tid);
 			goto redo;
 		}
 		stat(s, FREE_FASTPATH);
 	} else
-		__slab_free(s, page, x, addr);
+		__slab_free(s, page, head, tail_obj, cnt, addr);
 
 }
 
@@ -2553,13 +2681,197 @@ void kmem_cache_free(struct kmem_cache *s, void *x)
 	struct page *page;
 
 	page = virt_to_head_page(x);
+	s = cache_from_obj(s, page);
 
-	slab_free(s, page, x, _RET_IP_);
+	slab_free_hook(s, x);
+	slab_free(s, page, x, NULL, 1, _RET_IP_);
 
 	trace_kmem_cache_free(_RET_IP_, x);
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+struct detached_freelist {
+	struct kmem_cache *s;
+	struct page *page;
+	void *tail;
+	void *freelist;
+	int cnt;
+};
+
+/*
+ * This function progressively scans the array with free objects (with
+ * a limited look ahead) and extracts objects belonging to the same
+ * page.  It builds a detached freelist directly within the given
+ * page/objects.  This can happen without any need for
+ * synchronization, because the objects are owned by the running
+ * process.  The freelist is built up as a single linked list in the
+ * objects.  The idea is that this detached freelist can then be
+ * spliced into the page's freelist with a single cmpxchg_double.
+ *
+ * Objects that were put on the freelist are cleared from the array.
+ * Returns the array index to continue the scan from.
+ */
+static size_t build_detached_freelist(struct kmem_cache *s, size_t size,
+				      void **p, struct detached_freelist *df)
+{
+	size_t first_skipped_index = 0;
+	int lookahead = 3;
+	void *object;
+
+	df->page = NULL;
+
+	/* Always re-init detached_freelist */
+	do {
+		object = p[--size];
+	} while (!object && size);
+
+	if (!object)
+		return 0;
+
+	df->page = virt_to_head_page(object);
+	df->s = cache_from_obj(s, df->page);
+
+	/* Start new detached freelist */
+	slab_free_hook(df->s, object);
+	set_freepointer(df->s, object, NULL);
+	df->tail = object;
+	df->freelist = object;
+	df->cnt = 1;
+	p[size] = NULL; /* mark object processed */
+
+	while (size) {
+		object = p[--size];
+		if (!object)
+			continue; /* Skip processed objects */
+
+		/* df->page is always set at this point */
+		if (df->page == virt_to_head_page(object)) {
+			/* Opportunity build freelist */
+			slab_free_hook(df->s, object);
+			set_freepointer(df->s, object, df->freelist);
+			df->freelist = object;
+			df->cnt++;
+			p[size] = NULL; /* mark object processed */
+
+			continue;
+		}
+
+		/* Limit look ahead search */
+		if (!--lookahead)
+			break;
+
+		if (!first_skipped_index)
+			first_skipped_index = size + 1;
+	}
+
+	return first_skipped_index;
+}
+
+/*
+ * kmem_cache_free_bulk - free an array of objects to a cache
+ *
+ * Objects from the same slab page are chained into one freelist and
+ * returned with a single cmpxchg, either to the cpu slab or through
+ * __slab_free().  The contents of @p are clobbered.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *s, size_t size, void **p)
+{
+	if (WARN_ON(!size))
+		return;
+
+	/* The debug checks in __slab_free() handle one object at a time */
+	if (kmem_cache_debug(s)) {
+		size_t i;
+
+		for (i = 0; i < size; i++)
+			kmem_cache_free(s, p[i]);
+		return;
+	}
+
+	do {
+		struct detached_freelist df;
+
+		size = build_detached_freelist(s, size, p, &df);
+		if (unlikely(!df.page))
+			continue;
+
+		slab_free(df.s, df.page, df.freelist, df.tail, df.cnt,
+			  _RET_IP_);
+	} while (likely(size));
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+/*
+ * kmem_cache_alloc_bulk - allocate an array of objects from a cache
+ *
+ * The objects are taken straight off the cpu slab freelist with
+ * interrupts disabled once for the whole batch, refilling the cpu slab
+ * through __slab_alloc() when it runs dry.  Either all @size objects
+ * are allocated and @size is returned, or nothing is allocated and 0
+ * is returned.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *s, gfp_t flags, size_t size,
+			  void **p)
+{
+	struct kmem_cache_cpu *c;
+	size_t i;
+
+	if (slab_pre_alloc_hook(s, flags))
+		return 0;
+
+	s = memcg_kmem_get_cache(s, flags);
+
+	/*
+	 * Drain objects in the per cpu slab, while disabling local
+	 * IRQs, which protects against PREEMPT and interrupts
+	 * handlers invoking normal fastpath.
+	 */
+	local_irq_disable();
+	c = this_cpu_ptr(s->cpu_slab);
+
+	for (i = 0; i < size; i++) {
+		void *object = c->freelist;
+
+		if (unlikely(!object)) {
+			/*
+			 * Invoking slow path likely have side-effect
+			 * of re-populating per CPU c->freelist.  The
+			 * tid bump makes any interrupted fastpath
+			 * retry instead of using a stale freelist.
+			 */
+			c->tid = next_tid(c->tid);
+			p[i] = __slab_alloc(s, flags, NUMA_NO_NODE,
+					    _RET_IP_, c);
+			if (unlikely(!p[i]))
+				goto error;
+
+			c = this_cpu_ptr(s->cpu_slab);
+			continue;
+		}
+		c->freelist = get_freepointer(s, object);
+		p[i] = object;
+		stat(s, ALLOC_FASTPATH);
+	}
+	c->tid = next_tid(c->tid);
+	local_irq_enable();
+
+	for (i = 0; i < size; i++) {
+		if (unlikely(flags & __GFP_ZERO))
+			memset(p[i], 0, s->objsize);
+		slab_post_alloc_hook(s, flags, p[i]);
+	}
+	return size;
+
+error:
+	local_irq_enable();
+	while (i--) {
+		slab_post_alloc_hook(s, flags, p[i]);
+		kmem_cache_free(s, p[i]);
+	}
+	return 0;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 /*
  * Object placement in a slab is made very easy because we always start at
  * offset 0. If we tune the size of the object to the alignment then we can
@@ -3145,6 +3457,7 @@ void kmem_cache_destroy(struct kmem_cache *s)
 	if (!s->refcount) {
 		list_del(&s->list);
 		up_write(&slub_lock);
+		memcg_destroy_cache_copies(s);
 		if (kmem_cache_close(s)) {
 			printk(KERN_ERR "SLUB %s: %s called for cache that "
 				"still has objects.\n", s->name, __func__);
@@ -3152,6 +3465,7 @@ void kmem_cache_destroy(struct kmem_cache *s)
 		}
 		if (s->flags & SLAB_DESTROY_BY_RCU)
 			rcu_barrier();
+		memcg_release_cache(s);
 		sysfs_slab_remove(s);
 	} else
 		up_write(&slub_lock);
@@ -3424,7 +3738,8 @@ void kfree(const void *x)
 		put_page(page);
 		return;
 	}
-	slab_free(page->slab, page, object, _RET_IP_);
+	slab_free_hook(page->slab, object);
+	slab_free(page->slab, page, object, NULL, 1, _RET_IP_);
 }
 EXPORT_SYMBOL(kfree);
 
@@ -3453,6 +3768,12 @@ int kmem_cache_shrink(struct kmem_cache *s)
 	if (!slabs_by_inuse)
 		return -ENOMEM;
 
+	/* A dead memcg copy without pages is about to be destroyed */
+	if (!memcg_cache_tryget(s)) {
+		kfree(slabs_by_inuse);
+		return 0;
+	}
+
 	flush_all(s);
 	for_each_node_state(node, N_NORMAL_MEMORY) {
 		n = get_node(s, node);
@@ -3491,6 +3812,7 @@ int kmem_cache_shrink(struct kmem_cache *s)
 			discard_slab(s, page);
 	}
 
+	memcg_cache_put(s);
 	kfree(slabs_by_inuse);
 	return 0;
 }
@@ -3929,6 +4251,58 @@ err:
 }
 EXPORT_SYMBOL(kmem_cache_create);
 
+#ifdef CONFIG_CGROUP_MEM_RES_CTLR_KMEM
+/*
+ * Create the copy of @root that the allocations of a memcg are served
+ * from.  Caches with SLAB_ACCOUNT are never merged, so the copy has the
+ * same layout as @root.
+ */
+struct kmem_cache *kmem_cache_create_memcg(struct kmem_cache *root,
+		const char *name, struct memcg_cache_params *params)
+{
+	struct kmem_cache *s;
+	char *n;
+
+	n = kstrdup(name, GFP_KERNEL);
+	if (!n)
+		return NULL;
+
+	down_write(&slub_lock);
+	s = kmalloc(kmem_size, GFP_KERNEL);
+	if (s) {
+		if (kmem_cache_open(s, n, root->objsize, root->align,
+				root->flags & ~(__OBJECT_POISON | __CMPXCHG_DOUBLE),
+				root->ctor)) {
+			s->memcg_params = params;
+			list_add(&s->list, &slab_caches);
+			if (sysfs_slab_add(s)) {
+				list_del(&s->list);
+				goto err;
+			}
+			up_write(&slub_lock);
+			return s;
+		}
+err:
+		kfree(s);
+	}
+	up_write(&slub_lock);
+	kfree(n);
+	return NULL;
+}
+
+/*
+ * Called when the memcg of a copy is gone: nothing is allocated from the
+ * copy anymore, so its empty slabs are released right away from now on,
+ * and those it caches at this point are released too.
+ */
+void kmem_cache_shrink_dead(struct kmem_cache *s)
+{
+	s->cpu_partial = 0;
+	s->min_partial = 0;
+	kmem_cache_shrink(s);
+}
+#endif
+
 #ifdef CONFIG_SMP
 /*
  * Use the cpu notifier to insure that the cpu slabs are flushed when
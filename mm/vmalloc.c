@@ -22,6 +22,7 @@
 #include <linux/kallsyms.h>
 #include <linux/list.h>
 #include <linux/rbtree.h>
+#include <linux/llist.h>
 #include <linux/radix-tree.h>
 #include <linux/rcupdate.h>
 #include <linux/pfn.h>
@@ -255,20 +256,26 @@ struct vmap_area {
 	unsigned long flags;
 	struct rb_node rb_node;		/* address sorted rbtree */
 	struct list_head list;		/* address sorted list */
-	struct list_head purge_list;	/* "lazy purge" list */
+	struct llist_node purge_list;	/* "lazy purge" list */
+	unsigned long subtree_max_size;	/* largest free area in subtree */
 	void *private;
-	struct rcu_head rcu_head;
 };
 
 static DEFINE_SPINLOCK(vmap_area_lock);
 static LIST_HEAD(vmap_area_list);
 static struct rb_root vmap_area_root = RB_ROOT;
+static LLIST_HEAD(vmap_purge_list);
 
-/* The vmap cache globals are protected by vmap_area_lock */
-static struct rb_node *free_vmap_cache;
-static unsigned long cached_hole_size;
-static unsigned long cached_vstart;
-static unsigned long cached_align;
+/*
+ * All of the address space that is not covered by a busy vmap_area is
+ * described by free vmap_areas, kept in their own address sorted list
+ * and rbtree.  Each node of the free tree is augmented with the size
+ * of the largest free area in its subtree, so the lowest free area
+ * that fits an allocation is found in O(log n), independent of the
+ * number of busy areas.  Both trees are protected by vmap_area_lock.
+ */
+static LIST_HEAD(free_vmap_area_list);
+static struct rb_root free_vmap_area_root = RB_ROOT;
 
 static unsigned long vmap_area_pcpu_hole;
 
@@ -318,9 +325,246 @@ static void __insert_vmap_area(struct vmap_area *va)
 	if (tmp) {
 		struct vmap_area *prev;
 		prev = rb_entry(tmp, struct vmap_area, rb_node);
-		list_add_rcu(&va->list, &prev->list);
+		list_add(&va->list, &prev->list);
+	} else
+		list_add(&va->list, &vmap_area_list);
+}
+
+static inline unsigned long va_size(struct vmap_area *va)
+{
+	return va->va_end - va->va_start;
+}
+
+static inline unsigned long get_subtree_max_size(struct rb_node *node)
+{
+	if (!node)
+		return 0;
+
+	return rb_entry(node, struct vmap_area, rb_node)->subtree_max_size;
+}
+
+static inline unsigned long compute_subtree_max_size(struct vmap_area *va)
+{
+	return max3(va_size(va),
+		    get_subtree_max_size(va->rb_node.rb_left),
+		    get_subtree_max_size(va->rb_node.rb_right));
+}
+
+static void free_vmap_area_augment_cb(struct rb_node *node, void *unused)
+{
+	struct vmap_area *va = rb_entry(node, struct vmap_area, rb_node);
+
+	va->subtree_max_size = compute_subtree_max_size(va);
+}
+
+/*
+ * Update subtree_max_size from @va up to the root after @va was resized
+ * in place.  Stops as soon as a node's value does not change.
+ */
+static void augment_tree_propagate_from(struct vmap_area *va)
+{
+	struct rb_node *node = &va->rb_node;
+
+	while (node) {
+		unsigned long new_size;
+
+		va = rb_entry(node, struct vmap_area, rb_node);
+		new_size = compute_subtree_max_size(va);
+		if (va->subtree_max_size == new_size)
+			break;
+
+		va->subtree_max_size = new_size;
+		node = rb_parent(node);
+	}
+}
+
+static void insert_free_vmap_area(struct vmap_area *va)
+{
+	struct rb_node **p = &free_vmap_area_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct rb_node *tmp;
+
+	while (*p) {
+		struct vmap_area *tmp_va;
+
+		parent = *p;
+		tmp_va = rb_entry(parent, struct vmap_area, rb_node);
+		if (va->va_end <= tmp_va->va_start)
+			p = &(*p)->rb_left;
+		else if (va->va_start >= tmp_va->va_end)
+			p = &(*p)->rb_right;
+		else
+			BUG();
+	}
+
+	va->subtree_max_size = va_size(va);
+	rb_link_node(&va->rb_node, parent, p);
+	rb_insert_color(&va->rb_node, &free_vmap_area_root);
+	rb_augment_insert(&va->rb_node, free_vmap_area_augment_cb, NULL);
+
+	tmp = rb_prev(&va->rb_node);
+	if (tmp) {
+		struct vmap_area *prev;
+		prev = rb_entry(tmp, struct vmap_area, rb_node);
+		list_add(&va->list, &prev->list);
 	} else
-		list_add_rcu(&va->list, &vmap_area_list);
+		list_add(&va->list, &free_vmap_area_list);
+}
+
+static void unlink_free_vmap_area(struct vmap_area *va)
+{
+	struct rb_node *deepest;
+
+	deepest = rb_augment_erase_begin(&va->rb_node);
+	rb_erase(&va->rb_node, &free_vmap_area_root);
+	RB_CLEAR_NODE(&va->rb_node);
+	rb_augment_erase_end(deepest, free_vmap_area_augment_cb, NULL);
+	list_del(&va->list);
+}
+
+/*
+ * Hand the range of a no longer busy @va to the free tree, coalescing
+ * it with the free areas directly below and above.  @va is either
+ * linked into the free tree or freed.
+ */
+static void merge_or_add_free_vmap_area(struct vmap_area *va)
+{
+	struct rb_node *n = free_vmap_area_root.rb_node;
+	struct vmap_area *next = NULL, *prev = NULL;
+	struct list_head *prev_list;
+
+	/* find the lowest free area above va */
+	while (n) {
+		struct vmap_area *tmp;
+
+		tmp = rb_entry(n, struct vmap_area, rb_node);
+		if (tmp->va_start >= va->va_end) {
+			next = tmp;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	prev_list = next ? next->list.prev : free_vmap_area_list.prev;
+	if (prev_list != &free_vmap_area_list)
+		prev = list_entry(prev_list, struct vmap_area, list);
+
+	if (next && next->va_start == va->va_end) {
+		if (prev && prev->va_end == va->va_start) {
+			/* va closes the gap between prev and next */
+			prev->va_end = next->va_end;
+			unlink_free_vmap_area(next);
+			kfree(next);
+			augment_tree_propagate_from(prev);
+		} else {
+			next->va_start = va->va_start;
+			augment_tree_propagate_from(next);
+		}
+		kfree(va);
+	} else if (prev && prev->va_end == va->va_start) {
+		prev->va_end = va->va_end;
+		augment_tree_propagate_from(prev);
+		kfree(va);
+	} else
+		insert_free_vmap_area(va);
+}
+
+static bool is_within_this_va(struct vmap_area *va, unsigned long size,
+			      unsigned long align, unsigned long vstart)
+{
+	unsigned long addr = ALIGN(max(va->va_start, vstart), align);
+
+	/* ALIGN() or the size may have overflowed */
+	if (addr < vstart || addr + size < addr)
+		return false;
+
+	return addr + size <= va->va_end;
+}
+
+/*
+ * Find the lowest free area that can hold @size bytes aligned to @align
+ * at or above @vstart.
+ */
+static struct vmap_area *find_vmap_lowest_match(unsigned long size,
+				unsigned long align, unsigned long vstart)
+{
+	struct rb_node *node = free_vmap_area_root.rb_node;
+	struct rb_node *parent;
+	struct vmap_area *va;
+	unsigned long length;
+	bool from_left = false;
+
+	/*
+	 * Free areas are page aligned, so with bigger alignments only an
+	 * area that has room for the worst case padding is sure to fit.
+	 */
+	length = align <= PAGE_SIZE ? size : size + align - 1;
+
+	while (node) {
+		va = rb_entry(node, struct vmap_area, rb_node);
+
+		/* everything in the left subtree is below va->va_start */
+		if (!from_left && vstart < va->va_start &&
+		    get_subtree_max_size(node->rb_left) >= length) {
+			node = node->rb_left;
+			continue;
+		}
+		from_left = false;
+
+		if (is_within_this_va(va, size, align, vstart))
+			return va;
+
+		if (get_subtree_max_size(node->rb_right) >= length) {
+			node = node->rb_right;
+			continue;
+		}
+
+		/*
+		 * Nothing fits at or below this node.  The next candidates
+		 * in address order are the first ancestor that we entered
+		 * from its left child, and that ancestor's right subtree.
+		 */
+		while ((parent = rb_parent(node)) && parent->rb_left != node)
+			node = parent;
+		node = parent;
+		from_left = true;
+	}
+
+	return NULL;
+}
+
+/*
+ * Cut [addr, addr + size) out of the free area @free, which must contain
+ * it.  Splitting @free in two consumes the preallocated *@spare.
+ */
+static void carve_free_vmap_area(struct vmap_area *free, unsigned long addr,
+				 unsigned long size, struct vmap_area **spare)
+{
+	unsigned long end = addr + size;
+
+	BUG_ON(addr < free->va_start || end > free->va_end);
+
+	if (free->va_start == addr && free->va_end == end) {
+		unlink_free_vmap_area(free);
+		kfree(free);
+	} else if (free->va_start == addr) {
+		free->va_start = end;
+		augment_tree_propagate_from(free);
+	} else if (free->va_end == end) {
+		free->va_end = addr;
+		augment_tree_propagate_from(free);
+	} else {
+		struct vmap_area *lva = *spare;
+
+		BUG_ON(!lva);
+		*spare = NULL;
+
+		lva->va_start = free->va_start;
+		lva->va_end = addr;
+		free->va_start = end;
+		augment_tree_propagate_from(free);
+		insert_free_vmap_area(lva);
+	}
 }
 
 static void purge_vmap_area_lazy(void);
@@ -334,11 +578,9 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 				unsigned long vstart, unsigned long vend,
 				int node, gfp_t gfp_mask)
 {
-	struct vmap_area *va;
-	struct rb_node *n;
+	struct vmap_area *va, *free, *spare = NULL;
 	unsigned long addr;
 	int purged = 0;
-	struct vmap_area *first;
 
 	BUG_ON(!size);
 	BUG_ON(size & ~PAGE_MASK);
@@ -351,86 +593,41 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 
 retry:
 	spin_lock(&vmap_area_lock);
-	/*
-	 * Invalidate cache if we have more permissive parameters.
-	 * cached_hole_size notes the largest hole noticed _below_
-	 * the vmap_area cached in free_vmap_cache: if size fits
-	 * into that hole, we want to scan from vstart to reuse
-	 * the hole instead of allocating above free_vmap_cache.
-	 * Note that __free_vmap_area may update free_vmap_cache
-	 * without updating cached_hole_size or cached_align.
-	 */
-	if (!free_vmap_cache ||
-			size < cached_hole_size ||
-			vstart < cached_vstart ||
-			align < cached_align) {
-nocache:
-		cached_hole_size = 0;
-		free_vmap_cache = NULL;
-	}
-	/* record if we encounter less permissive parameters */
-	cached_vstart = vstart;
-	cached_align = align;
-
-	/* find starting point for our search */
-	if (free_vmap_cache) {
-		first = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-		addr = ALIGN(first->va_end, align);
-		if (addr < vstart)
-			goto nocache;
-		if (addr + size - 1 < addr)
-			goto overflow;
 
-	} else {
-		addr = ALIGN(vstart, align);
-		if (addr + size - 1 < addr)
-			goto overflow;
-
-		n = vmap_area_root.rb_node;
-		first = NULL;
-
-		while (n) {
-			struct vmap_area *tmp;
-			tmp = rb_entry(n, struct vmap_area, rb_node);
-			if (tmp->va_end >= addr) {
-				first = tmp;
-				if (tmp->va_start <= addr)
-					break;
-				n = n->rb_left;
-			} else
-				n = n->rb_right;
-		}
-
-		if (!first)
-			goto found;
-	}
-
-	/* from the starting point, walk areas until a suitable hole is found */
-	while (addr + size > first->va_start && addr + size <= vend) {
-		if (addr + cached_hole_size < first->va_start)
-			cached_hole_size = first->va_start - addr;
-		addr = ALIGN(first->va_end, align);
-		if (addr + size - 1 < addr)
-			goto overflow;
-
-		n = rb_next(&first->rb_node);
-		if (n)
-			first = rb_entry(n, struct vmap_area, rb_node);
-		else
-			goto found;
-	}
+	free = find_vmap_lowest_match(size, align, vstart);
+	if (!free)
+		goto overflow;
 
-found:
+	addr = ALIGN(max(free->va_start, vstart), align);
 	if (addr + size > vend)
 		goto overflow;
 
+	/* allocating from the middle of a free area splits it in two */
+	if (!spare && addr != free->va_start &&
+	    addr + size != free->va_end) {
+		spare = kmalloc_node(sizeof(struct vmap_area), GFP_NOWAIT,
+				     node);
+		if (unlikely(!spare)) {
+			spin_unlock(&vmap_area_lock);
+			spare = kmalloc_node(sizeof(struct vmap_area),
+					gfp_mask & GFP_RECLAIM_MASK, node);
+			if (unlikely(!spare)) {
+				kfree(va);
+				return ERR_PTR(-ENOMEM);
+			}
+			goto retry;
+		}
+	}
+	carve_free_vmap_area(free, addr, size, &spare);
+
 	va->va_start = addr;
 	va->va_end = addr + size;
 	va->flags = 0;
 	__insert_vmap_area(va);
-	free_vmap_cache = &va->rb_node;
 	spin_unlock(&vmap_area_lock);
 
+	kfree(spare);
+
 	BUG_ON(va->va_start & (align-1));
 	BUG_ON(va->va_start < vstart);
 	BUG_ON(va->va_end > vend);
@@ -448,6 +645,7 @@ overflow:
 		printk(KERN_WARNING
 			"vmap allocation for size %lu failed: "
 			"use vmalloc=<size> to increase size.\n", size);
+	kfree(spare);
 	kfree(va);
 	return ERR_PTR(-EBUSY);
 }
@@ -456,24 +654,9 @@ static void __free_vmap_area(struct vmap_area *va)
 {
 	BUG_ON(RB_EMPTY_NODE(&va->rb_node));
 
-	if (free_vmap_cache) {
-		if (va->va_end < cached_vstart) {
-			free_vmap_cache = NULL;
-		} else {
-			struct vmap_area *cache;
-			cache = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-			if (va->va_start <= cache->va_start) {
-				free_vmap_cache = rb_prev(&va->rb_node);
-				/*
-				 * We don't try to update cached_hole_size or
-				 * cached_align, but it won't go very wrong.
-				 */
-			}
-		}
-	}
 	rb_erase(&va->rb_node, &vmap_area_root);
 	RB_CLEAR_NODE(&va->rb_node);
-	list_del_rcu(&va->list);
+	list_del(&va->list);
 
 	/*
 	 * Track the highest possible candidate for pcpu area
@@ -484,7 +667,8 @@ static void __free_vmap_area(struct vmap_area *va)
 	if (va->va_end > VMALLOC_START && va->va_end <= VMALLOC_END)
 		vmap_area_pcpu_hole = max(vmap_area_pcpu_hole, va->va_end);
 
-	kfree_rcu(va, rcu_head);
+	/* give the range back to the free tree */
+	merge_or_add_free_vmap_area(va);
 }
 
 /*
@@ -553,6 +737,12 @@ static unsigned long lazy_max_pages(void)
 
 static atomic_t vmap_lazy_nr = ATOMIC_INIT(0);
 
+/*
+ * Number of lazily freed areas returned to the free tree per hold of
+ * vmap_area_lock, so that a big purge does not stall allocations.
+ */
+#define VMAP_PURGE_BATCH	32
+
 /* for per-CPU blocks */
 static void purge_fragmented_blocks_allcpus(void);
 
@@ -568,6 +758,10 @@ void set_iounmap_nonlazy(void)
 /*
  * Purges all lazily-freed vmap areas.
  *
+ * The areas are queued on vmap_purge_list by free_vmap_area_noflush(), so
+ * only they are looked at.  The TLB flush is done without vmap_area_lock
+ * and the areas are then returned to the free tree in batches.
+ *
  * If sync is 0 then don't purge if there is already a purge in progress.
  * If force_flush is 1, then flush kernel TLBs between *start and *end even
  * if we found no lazy vmap areas to unmap (callers can use this to optimise
@@ -579,9 +773,8 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 					int sync, int force_flush)
 {
 	static DEFINE_SPINLOCK(purge_lock);
-	LIST_HEAD(valist);
+	struct llist_node *valist;
 	struct vmap_area *va;
-	struct vmap_area *n_va;
 	int nr = 0;
 
 	/*
@@ -598,20 +791,16 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 	if (sync)
 		purge_fragmented_blocks_allcpus();
 
-	rcu_read_lock();
-	list_for_each_entry_rcu(va, &vmap_area_list, list) {
-		if (va->flags & VM_LAZY_FREE) {
-			if (va->va_start < *start)
-				*start = va->va_start;
-			if (va->va_end > *end)
-				*end = va->va_end;
-			nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
-			list_add_tail(&va->purge_list, &valist);
-			va->flags |= VM_LAZY_FREEING;
-			va->flags &= ~VM_LAZY_FREE;
-		}
+	valist = llist_del_all(&vmap_purge_list);
+	llist_for_each_entry(va, valist, purge_list) {
+		if (va->va_start < *start)
+			*start = va->va_start;
+		if (va->va_end > *end)
+			*end = va->va_end;
+		nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
+		va->flags |= VM_LAZY_FREEING;
+		va->flags &= ~VM_LAZY_FREE;
 	}
-	rcu_read_unlock();
 
 	if (nr)
 		atomic_sub(nr, &vmap_lazy_nr);
@@ -620,9 +809,20 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 		flush_tlb_kernel_range(*start, *end);
 
 	if (nr) {
+		int batch = 0;
+
 		spin_lock(&vmap_area_lock);
-		list_for_each_entry_safe(va, n_va, &valist, purge_list)
+		while (valist) {
+			va = llist_entry(valist, struct vmap_area, purge_list);
+			valist = llist_next(valist);
 			__free_vmap_area(va);
+
+			if (++batch == VMAP_PURGE_BATCH && valist) {
+				spin_unlock(&vmap_area_lock);
+				batch = 0;
+				spin_lock(&vmap_area_lock);
+			}
+		}
 		spin_unlock(&vmap_area_lock);
 	}
 	spin_unlock(&purge_lock);
@@ -656,9 +856,16 @@ static void purge_vmap_area_lazy(void)
  */
 static void free_vmap_area_noflush(struct vmap_area *va)
 {
+	int nr_lazy;
+
 	va->flags |= VM_LAZY_FREE;
-	atomic_add((va->va_end - va->va_start) >> PAGE_SHIFT, &vmap_lazy_nr);
-	if (unlikely(atomic_read(&vmap_lazy_nr) > lazy_max_pages()))
+	nr_lazy = atomic_add_return((va->va_end - va->va_start) >> PAGE_SHIFT,
+				    &vmap_lazy_nr);
+
+	/* After this point, a concurrent purge may free va at any time */
+	llist_add(&va->purge_list, &vmap_purge_list);
+
+	if (unlikely(nr_lazy > lazy_max_pages()))
 		try_purge_vmap_area_lazy();
 }
 
@@ -1143,6 +1350,34 @@ void __init vm_area_register_early(struct vm_struct *vm, size_t align)
 	vmlist = vm;
 }
 
+/*
+ * Populate the free tree with everything not covered by the vmap_areas
+ * imported from the early vmlist.
+ */
+static void __init vmap_init_free_space(void)
+{
+	unsigned long vmap_start = 1;
+	const unsigned long vmap_end = ULONG_MAX;
+	struct vmap_area *busy, *free;
+
+	list_for_each_entry(busy, &vmap_area_list, list) {
+		if (busy->va_start > vmap_start) {
+			free = kzalloc(sizeof(struct vmap_area), GFP_NOWAIT);
+			free->va_start = vmap_start;
+			free->va_end = busy->va_start;
+			insert_free_vmap_area(free);
+		}
+		vmap_start = busy->va_end;
+	}
+
+	if (vmap_end > vmap_start) {
+		free = kzalloc(sizeof(struct vmap_area), GFP_NOWAIT);
+		free->va_start = vmap_start;
+		free->va_end = vmap_end;
+		insert_free_vmap_area(free);
+	}
+}
+
 void __init vmalloc_init(void)
 {
 	struct vmap_area *va;
@@ -1166,6 +1401,8 @@ void __init vmalloc_init(void)
 		__insert_vmap_area(va);
 	}
 
+	vmap_init_free_space();
+
 	vmap_area_pcpu_hole = VMALLOC_END;
 
 	vmap_initialized = true;
@@ -2282,6 +2519,29 @@ static unsigned long pvm_determine_end(struct vmap_area **pnext,
 	return addr;
 }
 
+/*
+ * Find the free vmap_area containing @addr.
+ */
+static struct vmap_area *find_free_vmap_area(unsigned long addr)
+{
+	struct rb_node *n = free_vmap_area_root.rb_node;
+
+	while (n) {
+		struct vmap_area *va;
+
+		va = rb_entry(n, struct vmap_area, rb_node);
+		if (addr < va->va_start)
+			n = n->rb_left;
+		else if (addr >= va->va_end)
+			n = n->rb_right;
+		else
+			return va;
+	}
+
+	BUG();
+	return NULL;
+}
+
 /**
  * pcpu_get_vm_areas - allocate vmalloc areas for percpu allocator
  * @offsets: array containing offset of each area
@@ -2312,7 +2572,7 @@ struct vm_struct **pcpu_get_vm_areas(const unsigned long *offsets,
 {
 	const unsigned long vmalloc_start = ALIGN(VMALLOC_START, align);
 	const unsigned long vmalloc_end = VMALLOC_END & ~(align - 1);
-	struct vmap_area **vas, *prev, *next;
+	struct vmap_area **vas, **spares, *prev, *next;
 	struct vm_struct **vms;
 	int area, area2, last_area, term_area;
 	unsigned long base, start, end, last_end;
@@ -2352,13 +2612,16 @@ struct vm_struct **pcpu_get_vm_areas(const unsigned long *offsets,
 
 	vms = kzalloc(sizeof(vms[0]) * nr_vms, GFP_KERNEL);
 	vas = kzalloc(sizeof(vas[0]) * nr_vms, GFP_KERNEL);
-	if (!vas || !vms)
+	spares = kzalloc(sizeof(spares[0]) * nr_vms, GFP_KERNEL);
+	if (!vas || !vms || !spares)
 		goto err_free;
 
+	/* each area may split a free area, which takes an extra vmap_area */
 	for (area = 0; area < nr_vms; area++) {
 		vas[area] = kzalloc(sizeof(struct vmap_area), GFP_KERNEL);
 		vms[area] = kzalloc(sizeof(struct vm_struct), GFP_KERNEL);
-		if (!vas[area] || !vms[area])
+		spares[area] = kzalloc(sizeof(struct vmap_area), GFP_KERNEL);
+		if (!vas[area] || !vms[area] || !spares[area])
 			goto err_free;
 	}
 retry:
@@ -2434,6 +2697,9 @@ found:
 
 		va->va_start = base + offsets[area];
 		va->va_end = va->va_start + sizes[area];
+		carve_free_vmap_area(find_free_vmap_area(va->va_start),
+				     va->va_start, sizes[area],
+				     &spares[area]);
 		__insert_vmap_area(va);
 	}
 
@@ -2446,6 +2712,9 @@ found:
 		insert_vmalloc_vm(vms[area], vas[area], VM_ALLOC,
 				  pcpu_get_vm_areas);
 
+	for (area = 0; area < nr_vms; area++)
+		kfree(spares[area]);
+	kfree(spares);
 	kfree(vas);
 	return vms;
 
@@ -2455,7 +2724,10 @@ err_free:
 			kfree(vas[area]);
 		if (vms)
 			kfree(vms[area]);
+		if (spares)
+			kfree(spares[area]);
 	}
+	kfree(spares);
 	kfree(vas);
 	kfree(vms);
 	return NULL;
@@ -43,6 +43,7 @@
 #include <linux/sysctl.h>
 #include <linux/oom.h>
 #include <linux/prefetch.h>
+#include <linux/ksm.h>
 
 #include <asm/tlbflush.h>
 #include <asm/div64.h>
@@ -255,6 +256,10 @@ unsigned long shrink_slab(struct shrink_control *shrink,
 		long batch_size = shrinker->batch ? shrinker->batch
 						  : SHRINK_BATCH;
 
+		if (shrink->memcg &&
+		    !(shrinker->flags & SHRINKER_MEMCG_AWARE))
+			continue;
+
 		max_pass = do_shrinker_shrink(shrinker, shrink, 0);
 		if (max_pass <= 0)
 			continue;
@@ -263,8 +268,14 @@ unsigned long shrink_slab(struct shrink_control *shrink,
 		 * copy the current shrinker scan count into a local variable
 		 * and zero it so that other concurrent shrinker invocations
 		 * don't also do this scanning work.
+		 *
+		 * The deferred count is global: memcg reclaim neither uses
+		 * nor feeds it.
 		 */
-		nr = atomic_long_xchg(&shrinker->nr_in_batch, 0);
+		if (shrink->memcg)
+			nr = 0;
+		else
+			nr = atomic_long_xchg(&shrinker->nr_in_batch, 0);
 
 		total_scan = nr;
 		delta = (4 * nr_pages_scanned) / shrinker->seeks;
@@ -301,6 +312,13 @@ unsigned long shrink_slab(struct shrink_control *shrink,
 		if (total_scan > max_pass * 2)
 			total_scan = max_pass * 2;
 
+		/*
+		 * A memcg may own fewer objects than a batch: scan them
+		 * anyway, nothing is deferred for later.
+		 */
+		if (shrink->memcg && total_scan > 0)
+			batch_size = min(batch_size, total_scan);
+
 		trace_mm_shrink_slab_start(shrinker, shrink, nr,
 					nr_pages_scanned, lru_pages,
 					max_pass, delta, total_scan);
@@ -326,7 +344,7 @@ unsigned long shrink_slab(struct shrink_control *shrink,
 		 * manner that handles concurrent updates. If we exhausted the
 		 * scan, there is no need to do an update.
 		 */
-		if (total_scan > 0)
+		if (total_scan > 0 && !shrink->memcg)
 			new_nr = atomic_long_add_return(total_scan,
 					&shrinker->nr_in_batch);
 		else
@@ -558,10 +576,24 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 		swapcache_free(swap, page);
 	} else {
 		void (*freepage)(struct page *);
+		void *shadow = NULL;
 
 		freepage = mapping->a_ops->freepage;
-
-		__delete_from_page_cache(page);
+		/*
+		 * Remember a shadow entry for reclaimed file cache in
+		 * order to detect refaults, thus thrashing, later on.
+		 *
+		 * But don't store shadows in an address space that is
+		 * already exiting, as nobody is going to refault into
+		 * it, nor in one that holds more shadows than there are
+		 * file pages in the system: refault distances larger
+		 * than that never lead to activation anyway, and the
+		 * shadows would pin radix tree nodes for nothing.
+		 */
+		if (page_is_file_cache(page) && !mapping_exiting(mapping) &&
+		    mapping->nrshadows < global_page_state(NR_FILE_PAGES))
+			shadow = workingset_eviction(mapping, page);
+		__delete_from_page_cache(page, shadow);
 		spin_unlock_irq(&mapping->tree_lock);
 		mem_cgroup_uncharge_cache_page(page);
 
@@ -771,6 +803,7 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		struct address_space *mapping;
 		struct page *page;
 		int may_enter_fs;
+		int lazyfree = 0;
 
 		cond_resched();
 
@@ -833,8 +866,16 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		if (PageAnon(page) && !PageSwapCache(page)) {
 			if (!(sc->gfp_mask & __GFP_IO))
 				goto keep_locked;
+			/*
+			 * Anon pages outside the swap cache are dirty or
+			 * mapped by dirty ptes, unless they have been freed
+			 * with MADV_FREE and not written to since.
+			 */
+			lazyfree = !PageDirty(page) && !PageKsm(page);
 			if (!add_to_swap(page))
 				goto activate_locked;
+			if (lazyfree)
+				ClearPageDirty(page);
 			may_enter_fs = 1;
 		}
 
@@ -845,7 +886,18 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		 * processes. Try to unmap it here.
 		 */
 		if (page_mapped(page) && mapping) {
-			switch (try_to_unmap(page, TTU_UNMAP)) {
+			int ret;
+
+			ret = try_to_unmap(page, (lazyfree ?
+					   TTU_UNMAP | TTU_FREE : TTU_UNMAP) |
+					   TTU_BATCH_FLUSH);
+			/*
+			 * A lazyfree page that stays mapped is swapped out
+			 * like any other the next time around.
+			 */
+			if (lazyfree && ret != SWAP_SUCCESS)
+				SetPageDirty(page);
+			switch (ret) {
 			case SWAP_FAIL:
 				goto activate_locked;
 			case SWAP_AGAIN:
@@ -858,6 +910,8 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		}
 
 		if (PageDirty(page)) {
+			/* written to since MADV_FREE, swap it out */
+			lazyfree = 0;
 			nr_dirty++;
 
 			/*
@@ -886,6 +940,12 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			if (!sc->may_writepage)
 				goto keep_locked;
 
+			/*
+			 * A stale writable TLB entry could dirty the page
+			 * while it is under IO, flush it out first.
+			 */
+			try_to_unmap_flush_dirty();
+
 			/* Page is dirty, try to write it out here */
 			switch (pageout(page, mapping, sc)) {
 			case PAGE_KEEP:
@@ -958,6 +1018,9 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		if (!mapping || !__remove_mapping(mapping, page))
 			goto keep_locked;
 
+		if (lazyfree)
+			count_vm_event(PGLAZYFREED);
+
 		/*
 		 * At this point, we have no other references and there is
 		 * no way to pick any more up (removed from LRU, removed
@@ -1009,6 +1072,8 @@ keep_lumpy:
 	if (nr_dirty && nr_dirty == nr_congested && scanning_global_lru(sc))
 		zone_set_flag(zone, ZONE_CONGESTED);
 
+	/* No stale TLB entry may reach the pages once they are freed */
+	try_to_unmap_flush();
 	free_page_list(&free_pages);
 
 	list_splice(&ret_pages, page_list);
@@ -2252,6 +2317,15 @@ static unsigned long do_try_to_free_pages(struct zonelist *zonelist,
 				sc->nr_reclaimed += reclaim_state->reclaimed_slab;
 				reclaim_state->reclaimed_slab = 0;
 			}
+		} else if (memcg_kmem_is_active(sc->mem_cgroup)) {
+			/*
+			 * The memcg is charged for its slab objects too:
+			 * shrink those of them that can be reclaimed.
+			 */
+			shrink->memcg = sc->mem_cgroup;
+			shrink_slab(shrink, sc->nr_scanned,
+				    mem_cgroup_reclaimable_pages(sc->mem_cgroup));
+			shrink->memcg = NULL;
 		}
 		total_scanned += sc->nr_scanned;
 		if (sc->nr_reclaimed >= sc->nr_to_reclaim)
@@ -2934,6 +3008,14 @@ static int kswapd(void *p)
 			balanced_classzone_idx = classzone_idx;
 			balanced_order = balance_pgdat(pgdat, order,
 						&balanced_classzone_idx);
+
+			/*
+			 * Reclaim only frees pages: leave it to kcompactd to
+			 * assemble them into blocks of the requested order.
+			 */
+			if (order)
+				wakeup_kcompactd(pgdat, order,
+						 balanced_classzone_idx);
 		}
 	}
 	return 0;
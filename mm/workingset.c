@@ -0,0 +1,149 @@
+/*
+ * mm/workingset.c - refault detection for the page cache
+ */
+
+#include <linux/mm.h>
+#include <linux/mmzone.h>
+#include <linux/swap.h>
+#include <linux/pagemap.h>
+#include <linux/module.h>
+#include <linux/vmstat.h>
+
+/*
+ *		Double CLOCK lists
+ *
+ * Per zone, two clock lists are maintained for file pages: the
+ * inactive and the active list.  Freshly faulted pages start out at
+ * the head of the inactive list and page reclaim scans pages from the
+ * tail.  Pages that are accessed multiple times on the inactive list
+ * are promoted to the active list, to protect them from reclaim,
+ * whereas active pages are demoted to the inactive list when the
+ * active list grows too big.
+ *
+ * The size of the inactive list is fixed by inactive_file_is_low(),
+ * which gives the active list up to half of the file cache.  A set of
+ * pages that is accessed repeatedly but is bigger than the inactive
+ * list is therefore evicted before its second access: it thrashes on
+ * the inactive list forever and never makes it to the active list,
+ * even if it would fit there.
+ *
+ *		Approximating inactive page access frequency
+ *
+ * Every page that is evicted from the inactive list, and every page
+ * that is activated from it, advances the zone's inactive_age counter
+ * by one.  The difference between the counter value at the eviction
+ * of a page and at its refault - the refault distance - is the number
+ * of pages that were pushed out of or promoted from the inactive list
+ * in between: the minimum number of additional inactive slots the
+ * page would have needed to still be in memory at its second access.
+ *
+ * The active list competes for the same memory, so if the refault
+ * distance is not bigger than the active list, the page would have
+ * been accessed while resident had the inactive list been given the
+ * space of the active pages.  Such a page is activated right away on
+ * refault, letting it compete with the existing active pages for
+ * residency, instead of thrashing on the inactive list.
+ *
+ *		Implementation
+ *
+ * On eviction of a page cache page, the zone and the current value of
+ * its inactive_age are packed into an exceptional radix tree entry
+ * (a "shadow entry") that takes the place of the page in its mapping.
+ * When the page refaults, add_to_page_cache_lru() finds the shadow
+ * entry, and workingset_refault() compares the stored eviction age
+ * against the current one to decide about activation.
+ *
+ * Refaults and the activations they cause are counted in the zone's
+ * WORKINGSET_REFAULT and WORKINGSET_ACTIVATE vmstat items.
+ */
+
+#define EVICTION_SHIFT	(RADIX_TREE_EXCEPTIONAL_SHIFT + \
+			 ZONES_SHIFT + NODES_SHIFT)
+#define EVICTION_MASK	(~0UL >> EVICTION_SHIFT)
+
+static void *pack_shadow(unsigned long eviction, struct zone *zone)
+{
+	eviction = (eviction << NODES_SHIFT) | zone_to_nid(zone);
+	eviction = (eviction << ZONES_SHIFT) | zone_idx(zone);
+	eviction = (eviction << RADIX_TREE_EXCEPTIONAL_SHIFT);
+
+	return (void *)(eviction | RADIX_TREE_EXCEPTIONAL_ENTRY);
+}
+
+static void unpack_shadow(void *shadow, struct zone **zone,
+			  unsigned long *distance)
+{
+	unsigned long entry = (unsigned long)shadow;
+	unsigned long eviction;
+	unsigned long refault;
+	int zid, nid;
+
+	entry >>= RADIX_TREE_EXCEPTIONAL_SHIFT;
+	zid = entry & ((1UL << ZONES_SHIFT) - 1);
+	entry >>= ZONES_SHIFT;
+	nid = entry & ((1UL << NODES_SHIFT) - 1);
+	entry >>= NODES_SHIFT;
+	eviction = entry;
+
+	*zone = NODE_DATA(nid)->node_zones + zid;
+
+	refault = atomic_long_read(&(*zone)->inactive_age);
+	/*
+	 * The unsigned subtraction gives an accurate distance across
+	 * inactive_age overflows.  A shadow entry that lives long enough
+	 * for the counter to lap it yields a falsely small distance and
+	 * an unwarranted activation, which merely puts a bit of extra
+	 * pressure on the active list.
+	 */
+	*distance = (refault - eviction) & EVICTION_MASK;
+}
+
+/**
+ * workingset_eviction - note the eviction of a page from memory
+ * @mapping: address space the page was backing
+ * @page: the page being evicted
+ *
+ * Returns a shadow entry to be stored in @mapping->page_tree in place
+ * of the evicted @page so that a later refault can be detected.
+ */
+void *workingset_eviction(struct address_space *mapping, struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	unsigned long eviction;
+
+	eviction = atomic_long_inc_return(&zone->inactive_age);
+	return pack_shadow(eviction, zone);
+}
+
+/**
+ * workingset_refault - evaluate the refault of a previously evicted page
+ * @shadow: shadow entry of the evicted page
+ *
+ * Calculates and evaluates the refault distance of the previously
+ * evicted page in the context of the zone it was allocated in.
+ *
+ * Returns %true if the page should be activated, %false otherwise.
+ */
+bool workingset_refault(void *shadow)
+{
+	unsigned long refault_distance;
+	struct zone *zone;
+
+	unpack_shadow(shadow, &zone, &refault_distance);
+	inc_zone_state(zone, WORKINGSET_REFAULT);
+
+	if (refault_distance <= zone_page_state(zone, NR_ACTIVE_FILE)) {
+		inc_zone_state(zone, WORKINGSET_ACTIVATE);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * workingset_activation - note a page activation
+ * @page: page that is being activated
+ */
+void workingset_activation(struct page *page)
+{
+	atomic_long_inc(&page_zone(page)->inactive_age);
+}
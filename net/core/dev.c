@@ -3960,6 +3960,7 @@ static void net_rx_action(struct softirq_action *h)
 	}
 out:
 	net_rps_action_and_irq_enable(sd);
+	__kfree_skb_flush();
 
 #ifdef CONFIG_NET_DMA
 	/*
@@ -74,6 +74,19 @@
 static struct kmem_cache *skbuff_head_cache __read_mostly;
 static struct kmem_cache *skbuff_fclone_cache __read_mostly;
 
+/*
+ * skbuff heads freed from NAPI context are collected per cpu and handed
+ * back to the slab allocator in batches.
+ */
+#define NAPI_SKB_CACHE_SIZE	64
+
+struct napi_skb_cache {
+	unsigned int skb_count;
+	void *skb_cache[NAPI_SKB_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct napi_skb_cache, napi_skb_cache);
+
 static void sock_pipe_buf_release(struct pipe_inode_info *pipe,
 				  struct pipe_buffer *buf)
 {
@@ -86,10 +99,21 @@ static void sock_pipe_buf_get(struct pipe_inode_info *pipe,
 	get_page(buf->page);
 }
 
+/*
+ * Payload pages handed to the pipe by skb_splice_bits() can be given away
+ * once the skb has released them, e.g. to be inserted into the page cache
+ * by splice to a file. The linear part of an skb lives in slab memory and
+ * compound pages can't be split up, so those always get copied.
+ */
 static int sock_pipe_buf_steal(struct pipe_inode_info *pipe,
 			       struct pipe_buffer *buf)
 {
-	return 1;
+	struct page *page = buf->page;
+
+	if (PageSlab(page) || PageCompound(page) || page->mapping)
+		return 1;
+
+	return generic_pipe_buf_steal(pipe, buf);
 }
 
 
@@ -485,6 +509,88 @@ void consume_skb(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(consume_skb);
 
+/**
+ *	__kfree_skb_flush - free the skbuff heads deferred by napi_consume_skb
+ *
+ *	Called from softirq context at the end of a NAPI polling round.
+ */
+void __kfree_skb_flush(void)
+{
+	struct napi_skb_cache *nc = &__get_cpu_var(napi_skb_cache);
+
+	/* flush skb_cache if containing objects */
+	if (nc->skb_count) {
+		kmem_cache_free_bulk(skbuff_head_cache, nc->skb_count,
+				     nc->skb_cache);
+		nc->skb_count = 0;
+	}
+}
+
+static inline void _kfree_skb_defer(struct sk_buff *skb)
+{
+	struct napi_skb_cache *nc = &__get_cpu_var(napi_skb_cache);
+
+	/* drop skb->head and call any destructors for packet */
+	skb_release_all(skb);
+
+	/* record skb to CPU local list */
+	nc->skb_cache[nc->skb_count++] = skb;
+
+#ifdef CONFIG_SLUB
+	/* SLUB writes into objects when freeing */
+	prefetchw(skb);
+#endif
+
+	/* flush skb_cache if it is filled */
+	if (unlikely(nc->skb_count == NAPI_SKB_CACHE_SIZE)) {
+		kmem_cache_free_bulk(skbuff_head_cache, NAPI_SKB_CACHE_SIZE,
+				     nc->skb_cache);
+		nc->skb_count = 0;
+	}
+}
+
+/**
+ *	napi_consume_skb - consume an skb from a NAPI poll routine
+ *	@skb: buffer to free
+ *	@budget: the NAPI budget of the caller, 0 outside of NAPI
+ *
+ *	Like consume_skb(), but for use in the tx completion path of a
+ *	driver's NAPI poll routine.  The skbuff head is not freed right
+ *	away but batched per cpu and released with kmem_cache_free_bulk()
+ *	once enough have been collected or the NET_RX softirq finishes.
+ */
+void napi_consume_skb(struct sk_buff *skb, int budget)
+{
+	if (unlikely(!skb))
+		return;
+
+	/*
+	 * Zero budget indicates a non-NAPI context called us.  netpoll
+	 * still polls with a real budget, but from hardirq or with irqs
+	 * off, where it may have interrupted a NET_RX softirq that is in
+	 * the middle of updating this cpu's skb cache.
+	 */
+	if (unlikely(!budget || in_irq() || irqs_disabled())) {
+		dev_kfree_skb_any(skb);
+		return;
+	}
+
+	if (likely(atomic_read(&skb->users) == 1))
+		smp_rmb();
+	else if (likely(!atomic_dec_and_test(&skb->users)))
+		return;
+	trace_consume_skb(skb);
+
+	/* if SKB is a clone, don't handle this case */
+	if (skb->fclone != SKB_FCLONE_UNAVAILABLE) {
+		__kfree_skb(skb);
+		return;
+	}
+
+	_kfree_skb_defer(skb);
+}
+EXPORT_SYMBOL(napi_consume_skb);
+
 /**
  * 	skb_recycle - clean up an skb for reuse
  * 	@skb: buffer